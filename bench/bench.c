@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "includes/harness.h"
+#include "../server/includes/utils.h"
+#include "../server/includes/data_loader.h"
+#include "../server/includes/memacct.h"
+
+#define Clear   "\033[3;0;0m"
+#define Red     "\033[0;31m"
+#define Yellow  "\033[0;33m"
+
+#define LOOKUP_BATCH 1000
+#define BROADCAST_BATCH 32
+#define COMMAND_BATCH 32
+
+// Defined in server.c, which is built without its main()
+extern user_data_t** users;
+extern int user_count;
+extern game_session_t game_session;
+void game_session_init(game_session_t* session, int id);
+void broadcast_all(game_session_t* session, const char* message, client_t* exclude);
+bool handle_command(client_t* client, char* buff);
+
+//
+//  Users
+//
+
+static void clear_users() {
+    for (int i = 0; i < user_count; i++)
+        mem_free(MEM_USERS, users[i]);
+    mem_free(MEM_USERS, users);
+    users = NULL;
+    user_count = 0;
+}
+
+static void fill_users(int count) {
+    clear_users();
+    users = mem_malloc(MEM_USERS, count * sizeof(user_data_t*));
+    for (int i = 0; i < count; i++) {
+        user_data_t* user = mem_calloc(MEM_USERS, 1, sizeof(user_data_t));
+        snprintf(user->username, sizeof(user->username), "player_%d", i);
+        user->total_points = i * 7 % 5000;
+        user->games_played = i % 300;
+        user->games_won = i % 120;
+        user->max_streak = i % 17;
+        user->curr_streak = i % 5;
+        strcpy(user->last_login, "2025-01-01 12:00:00");
+        users[i] = user;
+    }
+    user_count = count;
+}
+
+static void run_save_users(void* ctx) {
+    (void) ctx;
+    save_users();
+}
+
+static void run_xml_load(void* ctx) {
+    (void) ctx;
+    XMLDocument doc;
+    if (XMLDocument_load(&doc, "data/users.xml") == XML_SUCCESS)
+        XMLDocument_free(&doc);
+}
+
+static void run_xml_load_parallel(void* ctx) {
+    (void) ctx;
+    XMLDocument doc;
+    if (XMLDocument_load_parallel(&doc, "data/users.xml", 0) == XML_SUCCESS)
+        XMLDocument_free(&doc);
+}
+
+static void run_load_users(void* ctx) {
+    (void) ctx;
+    load_users();
+}
+
+static void reset_load_users(void* ctx) {
+    (void) ctx;
+    clear_users();
+}
+
+typedef struct {
+    int count;
+    unsigned int seed;
+    bool hit;
+} lookup_ctx_t;
+
+static void run_find_user(void* ctx) {
+    lookup_ctx_t* lookup = (lookup_ctx_t*) ctx;
+    char name[MAX_NAME_LEN];
+    for (int i = 0; i < LOOKUP_BATCH; i++) {
+        int id = rand_r(&lookup->seed) % lookup->count;
+        snprintf(name, sizeof(name), lookup->hit ? "player_%d" : "missing_%d", id);
+        if ((find_user(name) != NULL) != lookup->hit)
+            abort();
+    }
+}
+
+//
+//  Sockets
+//
+
+typedef struct {
+    client_t* clients;
+    int* peers;
+    int count;
+} sockets_ctx_t;
+
+static bool open_clients(sockets_ctx_t* ctx, int count) {
+    ctx->clients = calloc(count, sizeof(client_t));
+    ctx->peers = malloc(count * sizeof(int));
+    ctx->count = 0;
+
+    for (int i = 0; i < count; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+            return false;
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+        client_t* client = &ctx->clients[i];
+        client->socket_fd = fds[0];
+        client->state = CLIENT_IN_GAME;
+        client->session = &game_session;
+        snprintf(client->username, sizeof(client->username), "player_%d", i);
+        pthread_mutex_init(&client->lock, NULL);
+        ctx->peers[i] = fds[1];
+        ctx->count++;
+    }
+    return true;
+}
+
+static void close_clients(sockets_ctx_t* ctx) {
+    for (int i = 0; i < ctx->count; i++) {
+        close(ctx->clients[i].socket_fd);
+        close(ctx->peers[i]);
+        pthread_mutex_destroy(&ctx->clients[i].lock);
+    }
+    free(ctx->clients);
+    free(ctx->peers);
+    ctx->count = 0;
+}
+
+static void drain_clients(void* arg) {
+    sockets_ctx_t* ctx = (sockets_ctx_t*) arg;
+    char buff[BUFF_SIZE * 4];
+    for (int i = 0; i < ctx->count; i++)
+        while (recv(ctx->peers[i], buff, sizeof(buff), 0) > 0);
+}
+
+static void run_broadcast(void* ctx) {
+    (void) ctx;
+    for (int i = 0; i < BROADCAST_BATCH; i++)
+        broadcast_all(&game_session, "INFO:Player responded, moving on to the next contestant!\n", NULL);
+}
+
+typedef struct {
+    sockets_ctx_t sockets;
+    const char* command;
+} command_ctx_t;
+
+static void run_command(void* arg) {
+    command_ctx_t* ctx = (command_ctx_t*) arg;
+    char buff[BUFF_SIZE];
+    for (int i = 0; i < COMMAND_BATCH; i++) {
+        memset(buff, 0, sizeof(buff));
+        strcpy(buff, ctx->command);
+        handle_command(&ctx->sockets.clients[0], buff);
+    }
+}
+
+static void reset_command(void* arg) {
+    command_ctx_t* ctx = (command_ctx_t*) arg;
+    drain_clients(&ctx->sockets);
+}
+
+//
+//  Suites
+//
+
+static void bench_persistence(bench_t* bench, const int* sizes, int size_count) {
+    char name[BENCH_NAME_LEN];
+    for (int i = 0; i < size_count; i++) {
+        fill_users(sizes[i]);
+        save_users();
+
+        snprintf(name, sizeof(name), "save_users/%d", sizes[i]);
+        bench_run(bench, name, 1, run_save_users, NULL, NULL);
+        snprintf(name, sizeof(name), "xml_load/%d", sizes[i]);
+        bench_run(bench, name, 1, run_xml_load, NULL, NULL);
+        snprintf(name, sizeof(name), "xml_load_parallel/%d", sizes[i]);
+        bench_run(bench, name, 1, run_xml_load_parallel, NULL, NULL);
+        snprintf(name, sizeof(name), "load_users/%d", sizes[i]);
+        bench_run(bench, name, 1, run_load_users, reset_load_users, NULL);
+
+        lookup_ctx_t lookup = { sizes[i], 42, true };
+        snprintf(name, sizeof(name), "find_user_hit/%d", sizes[i]);
+        bench_run(bench, name, LOOKUP_BATCH, run_find_user, NULL, &lookup);
+        lookup.hit = false;
+        snprintf(name, sizeof(name), "find_user_miss/%d", sizes[i]);
+        bench_run(bench, name, LOOKUP_BATCH, run_find_user, NULL, &lookup);
+    }
+    clear_users();
+}
+
+static void bench_broadcast(bench_t* bench) {
+    static const int fanouts[] = { 16, 256, 1024 };
+    char name[BENCH_NAME_LEN];
+
+    for (size_t i = 0; i < sizeof(fanouts) / sizeof(fanouts[0]); i++) {
+        snprintf(name, sizeof(name), "broadcast_all/%d", fanouts[i]);
+        if (!bench_enabled(bench, name)) continue;
+
+        sockets_ctx_t ctx;
+        if (!open_clients(&ctx, fanouts[i])) {
+            fprintf(stderr, Red"[BENCH] Could not open %d socket pairs: %s\n"Clear, fanouts[i], strerror(errno));
+            close_clients(&ctx);
+            continue;
+        }
+
+        client_t** players = malloc(ctx.count * sizeof(client_t*));
+        for (int j = 0; j < ctx.count; j++)
+            players[j] = &ctx.clients[j];
+        game_session.players = players;
+        game_session.player_count = ctx.count;
+
+        bench_run(bench, name, BROADCAST_BATCH, run_broadcast, drain_clients, &ctx);
+
+        game_session.players = NULL;
+        game_session.player_count = 0;
+        free(players);
+        close_clients(&ctx);
+    }
+}
+
+static void bench_dispatch(bench_t* bench) {
+    static const char* commands[] = { "meow", "stats", "help", "answer : A", "join", "bogus" };
+    char name[BENCH_NAME_LEN];
+
+    fill_users(1000);
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        snprintf(name, sizeof(name), "handle_command/%.*s", (int) strcspn(commands[i], " "), commands[i]);
+        if (!bench_enabled(bench, name)) continue;
+
+        command_ctx_t ctx = { .command = commands[i] };
+        if (!open_clients(&ctx.sockets, 1)) {
+            close_clients(&ctx.sockets);
+            continue;
+        }
+        // Logged in but outside the game, so join/answer take their error paths
+        client_t* client = &ctx.sockets.clients[0];
+        client->state = CLIENT_CONNECTED;
+        client->user_data = users[0];
+        game_session.state = GAME_ACTIVE;
+
+        bench_run(bench, name, COMMAND_BATCH, run_command, reset_command, &ctx);
+
+        game_session.state = GAME_WAITING;
+        close_clients(&ctx.sockets);
+    }
+    clear_users();
+}
+
+//
+//  Main
+//
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [options]\n\
+  -f, --filter TEXT       only run benchmarks whose name contains TEXT\n\
+  -q, --quick             skip the 1M user sizes\n\
+  -r, --reps N            maximum samples per benchmark (default 50)\n\
+  -w, --warmup N          untimed runs before sampling (default 3)\n\
+  -B, --budget SEC        time budget per benchmark (default 2)\n\
+  -o, --output PATH       write results there instead of stdout\n\
+  -b, --baseline PATH     compare medians with an earlier output file\n\
+  -T, --threshold PCT     allowed median slowdown against the baseline (default 10)\n", name);
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option options[] = {
+        { "filter", required_argument, NULL, 'f' },
+        { "quick", no_argument, NULL, 'q' },
+        { "reps", required_argument, NULL, 'r' },
+        { "warmup", required_argument, NULL, 'w' },
+        { "budget", required_argument, NULL, 'B' },
+        { "output", required_argument, NULL, 'o' },
+        { "baseline", required_argument, NULL, 'b' },
+        { "threshold", required_argument, NULL, 'T' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    const char* filter = NULL;
+    const char* output = NULL;
+    const char* baseline = NULL;
+    bool quick = false;
+    int reps = 50, warmup = 3;
+    double budget = 2.0, threshold = 10.0;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:qr:w:B:o:b:T:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'f': filter = optarg; break;
+        case 'q': quick = true; break;
+        case 'r': reps = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        case 'B': budget = atof(optarg); break;
+        case 'o': output = optarg; break;
+        case 'b': baseline = optarg; break;
+        case 'T': threshold = atof(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) return 1;
+
+    // Results go to stdout or the output file; the server's own logging is
+    // sent to /dev/null so it doesn't end up in the timings.
+    FILE* out = NULL;
+    if (output) {
+        out = fopen(output, "w");
+    } else {
+        int fd = dup(STDOUT_FILENO);
+        out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    }
+    if (!out) {
+        fprintf(stderr, Red"[BENCH] Cannot open output: %s\n"Clear, strerror(errno));
+        return 1;
+    }
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+        fflush(stdout);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // save_users()/load_users() work on data/users.xml, so run in a scratch directory
+    char scratch[] = "/tmp/quizbench.XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) < 0 || mkdir("data", 0755) < 0) {
+        fprintf(stderr, Red"[BENCH] Cannot create scratch directory: %s\n"Clear, strerror(errno));
+        return 1;
+    }
+
+    game_session_init(&game_session, 0);
+
+    bench_t bench;
+    bench_init(&bench, out);
+    bench.filter = filter;
+    bench.max_reps = reps > 0 ? reps : 1;
+    bench.min_reps = bench.max_reps < bench.min_reps ? bench.max_reps : bench.min_reps;
+    bench.warmup = warmup;
+    bench.budget_sec = budget;
+
+    static const int sizes[] = { 10000, 100000, 1000000 };
+    bench_persistence(&bench, sizes, quick ? 2 : 3);
+    bench_broadcast(&bench);
+    bench_dispatch(&bench);
+
+    unlink("data/users.xml");
+    rmdir("data");
+    if (chdir(cwd) == 0)
+        rmdir(scratch);
+
+    int status = 0;
+    if (baseline) {
+        int regressions = bench_compare(&bench, baseline, threshold);
+        if (regressions < 0) {
+            fprintf(stderr, Yellow"[BENCH] Cannot read baseline %s\n"Clear, baseline);
+            status = 1;
+        } else if (regressions > 0) {
+            fprintf(stderr, Red"[BENCH] %d benchmark(s) regressed more than %.0f%%\n"Clear, regressions, threshold);
+            status = 1;
+        }
+    }
+
+    bench_free(&bench);
+    fclose(out);
+    pthread_mutex_destroy(&game_session.lock);
+    pthread_cond_destroy(&game_session.game_start);
+    return status;
+}
@@ -0,0 +1,116 @@
+#include "harness.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define Clear   "\033[3;0;0m"
+#define Red     "\033[0;31m"
+#define Green   "\033[0;32m"
+#define Cyan    "\033[0;36m"
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+void bench_init(bench_t* bench, FILE* out) {
+    memset(bench, 0, sizeof(bench_t));
+    bench->warmup = 3;
+    bench->min_reps = 5;
+    bench->max_reps = 50;
+    bench->budget_sec = 2.0;
+    bench->out = out;
+    fprintf(out, "# benchmark\tsamples\tmin_ns\tmedian_ns\tp99_ns\n");
+    fflush(out);
+}
+
+bool bench_enabled(bench_t* bench, const char* name) {
+    return bench->filter == NULL || strstr(name, bench->filter) != NULL;
+}
+
+void bench_run(bench_t* bench, const char* name, int ops, bench_fn run, bench_fn reset, void* ctx) {
+    if (!bench_enabled(bench, name)) return;
+
+    for (int i = 0; i < bench->warmup; i++) {
+        if (reset) reset(ctx);
+        run(ctx);
+    }
+
+    double* samples = malloc(bench->max_reps * sizeof(double));
+    int count = 0;
+    uint64_t deadline = now_ns() + (uint64_t) (bench->budget_sec * 1e9);
+    while (count < bench->max_reps && (count < bench->min_reps || now_ns() < deadline)) {
+        if (reset) reset(ctx);
+        uint64_t start = now_ns();
+        run(ctx);
+        samples[count++] = (double) (now_ns() - start) / ops;
+    }
+
+    qsort(samples, count, sizeof(double), compare_double);
+    bench_result_t result;
+    snprintf(result.name, sizeof(result.name), "%s", name);
+    result.samples = count;
+    result.min_ns = samples[0];
+    result.median_ns = samples[count / 2];
+    result.p99_ns = samples[(int) (0.99 * (count - 1) + 0.5)];
+    free(samples);
+
+    if (bench->count == bench->cap) {
+        bench->cap = bench->cap ? bench->cap * 2 : 16;
+        bench->results = realloc(bench->results, bench->cap * sizeof(bench_result_t));
+    }
+    bench->results[bench->count++] = result;
+
+    fprintf(bench->out, "%s\t%d\t%.1f\t%.1f\t%.1f\n", result.name, result.samples, result.min_ns, result.median_ns, result.p99_ns);
+    fflush(bench->out);
+    fprintf(stderr, Cyan"[BENCH] %-32s"Clear" min %12.1f ns  median %12.1f ns  p99 %12.1f ns  (%d samples)\n",
+            result.name, result.min_ns, result.median_ns, result.p99_ns, result.samples);
+}
+
+int bench_compare(bench_t* bench, const char* path, double threshold) {
+    FILE* file = fopen(path, "r");
+    if (!file) return -1;
+
+    int regressions = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#') continue;
+
+        char name[BENCH_NAME_LEN];
+        int samples;
+        double min_ns, median_ns, p99_ns;
+        if (sscanf(line, "%63s\t%d\t%lf\t%lf\t%lf", name, &samples, &min_ns, &median_ns, &p99_ns) != 5)
+            continue;
+
+        for (int i = 0; i < bench->count; i++) {
+            if (strcmp(bench->results[i].name, name) != 0) continue;
+
+            double change = (bench->results[i].median_ns / median_ns - 1.0) * 100.0;
+            if (change > threshold) {
+                fprintf(stderr, Red"[BENCH] REGRESSION %-32s median %.1f ns -> %.1f ns (%+.1f%%)\n"Clear,
+                        name, median_ns, bench->results[i].median_ns, change);
+                regressions++;
+            } else {
+                fprintf(stderr, Green"[BENCH] ok         %-32s median %.1f ns -> %.1f ns (%+.1f%%)\n"Clear,
+                        name, median_ns, bench->results[i].median_ns, change);
+            }
+            break;
+        }
+    }
+
+    fclose(file);
+    return regressions;
+}
+
+void bench_free(bench_t* bench) {
+    free(bench->results);
+    bench->results = NULL;
+    bench->count = bench->cap = 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <stdio.h>
+#include <stdbool.h>
+
+#define BENCH_NAME_LEN 64
+
+typedef void (*bench_fn)(void* ctx);
+
+typedef struct {
+    char name[BENCH_NAME_LEN];
+    int samples;
+    double min_ns;
+    double median_ns;
+    double p99_ns;
+} bench_result_t;
+
+typedef struct {
+    const char* filter;
+    int warmup;
+    int min_reps;
+    int max_reps;
+    double budget_sec;
+    FILE* out;
+    bench_result_t* results;
+    int count;
+    int cap;
+} bench_t;
+
+void bench_init(bench_t* bench, FILE* out);
+bool bench_enabled(bench_t* bench, const char* name);
+// Times run(ctx) after 'warmup' untimed calls, between min_reps and max_reps
+// times or until budget_sec is spent. Each sample is one call divided by 'ops',
+// the number of operations the call performs. reset(ctx), if given, runs
+// untimed before every call.
+void bench_run(bench_t* bench, const char* name, int ops, bench_fn run, bench_fn reset, void* ctx);
+// Compares medians with a baseline written by an earlier run and returns the
+// number of benchmarks slower by more than 'threshold' percent, or -1 if the
+// baseline can't be read.
+int bench_compare(bench_t* bench, const char* path, double threshold);
+void bench_free(bench_t* bench);
@@ -73,10 +73,17 @@ void* recv_thread(void* arg) {
             client_state.client_name[i] = '\0';
         } else if (strstr(buff, "RESP:Logged Out")) {
             client_state.loggedIn = false;
+            client_state.resume_token[0] = '\0';
+        } else if (strstr(buff, "ERR_:Unknown or expired resume token")) {
+            client_state.resume_token[0] = '\0';
         } else if (strstr(buff, "RESP:bye-bye!")) {
             break;
         }
 
+        char* token = strstr(buff, "INFO:Resume token: ");
+        if (token)
+            sscanf(token, "INFO:Resume token: %63s", client_state.resume_token);
+
         if (global_tui) {
             print_resp(global_tui, buff);
         }
@@ -126,6 +133,13 @@ bool attempt_reconnection(tui_t* tui) {
         pthread_t recv_thread_id;
         pthread_create(&recv_thread_id, NULL, recv_thread, &client_state.socket_fd);
         pthread_detach(recv_thread_id);
+
+        // Picks up the seat the dropped connection left behind
+        if (client_state.resume_token[0]) {
+            char cmd[BUFF_SIZE];
+            snprintf(cmd, sizeof(cmd), "resume : %s", client_state.resume_token);
+            send_command(tui, cmd);
+        }
         return true;
     }
     
@@ -3,7 +3,7 @@
 #include <string.h>
 
 output_state_t output_state = {0};
-client_state_t client_state = {0, true, false, false, false, {0}};
+client_state_t client_state = {0, true, false, false, false, {0}, {0}};
 pthread_mutex_t ncurses_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t server_status_mutex = PTHREAD_MUTEX_INITIALIZER;
 
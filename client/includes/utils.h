@@ -28,6 +28,7 @@ typedef struct {
     bool server_online;
     volatile bool resize_req;
     char client_name[256];
+    char resume_token[64]; // sent by the server at login, used by 'reconnect'
 } client_state_t;
 
 typedef struct {
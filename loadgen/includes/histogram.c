@@ -0,0 +1,63 @@
+#include "histogram.h"
+#include <string.h>
+
+static int bucket_index(uint64_t value) {
+    if (value < HIST_SUB_COUNT)
+        return (int) value;
+
+    int shift = (63 - __builtin_clzll(value)) - HIST_SUB_BITS + 1;
+    return shift * HIST_HALF_COUNT + (int) (value >> shift);
+}
+
+static uint64_t bucket_value(int index) {
+    if (index < HIST_SUB_COUNT)
+        return index;
+
+    int shift = index / HIST_HALF_COUNT - 1;
+    uint64_t low = (uint64_t) (index - shift * HIST_HALF_COUNT) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+
+void hist_init(histogram_t* hist) {
+    memset(hist, 0, sizeof(histogram_t));
+    hist->min = UINT64_MAX;
+}
+
+void hist_record(histogram_t* hist, uint64_t value) {
+    if (value > HIST_MAX_VALUE) value = HIST_MAX_VALUE;
+
+    hist->counts[bucket_index(value)]++;
+    hist->count++;
+    hist->sum += value;
+    if (value < hist->min) hist->min = value;
+    if (value > hist->max) hist->max = value;
+}
+
+void hist_merge(histogram_t* dst, const histogram_t* src) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t hist_percentile(const histogram_t* hist, double percentile) {
+    if (hist->count == 0) return 0;
+
+    uint64_t rank = (uint64_t) (percentile / 100.0 * hist->count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > hist->count) rank = hist->count;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            if (value < hist->min) value = hist->min;
+            if (value > hist->max) value = hist->max;
+            return value;
+        }
+    }
+    return hist->max;
+}
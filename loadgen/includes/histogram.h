@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+
+// Log-linear latency histogram in microseconds: exact below 128us, then 64
+// buckets per power of two (under 1.6% error) up to HIST_MAX_VALUE.
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+#define HIST_MAX_BITS 40
+#define HIST_MAX_VALUE ((1ULL << HIST_MAX_BITS) - 1)
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_HALF_COUNT + HIST_HALF_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} histogram_t;
+
+void hist_init(histogram_t* hist);
+void hist_record(histogram_t* hist, uint64_t value);
+void hist_merge(histogram_t* dst, const histogram_t* src);
+// Smallest recorded value v such that at least 'percentile'% of samples are <= v,
+// reported at the middle of its bucket.
+uint64_t hist_percentile(const histogram_t* hist, double percentile);
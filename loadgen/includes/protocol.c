@@ -0,0 +1,24 @@
+#include "protocol.h"
+#include <string.h>
+
+static const char* prefixes[] = {
+    "RESP:", "ERR_:", "WARN:", "INFO:", "QUES:", "GAME:", "WRES:", "LRES:", "END_:", "SCOR:"
+};
+
+bool proto_is_prefix(const char* ptr, size_t len) {
+    if (len < PROTO_PREFIX_LEN || ptr[4] != ':')
+        return false;
+
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++)
+        if (memcmp(ptr, prefixes[i], 4) == 0)
+            return true;
+    return false;
+}
+
+size_t proto_next_message(const char* buff, size_t len) {
+    for (size_t i = 1; i + PROTO_PREFIX_LEN <= len; i++) {
+        if (buff[i + 4] == ':' && proto_is_prefix(buff + i, len - i))
+            return i;
+    }
+    return len;
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+
+// Server replies are not delimited: each one starts with a four letter tag and
+// a colon ("RESP:", "QUES:", ...) and several may arrive in one read.
+#define PROTO_PREFIX_LEN 5
+
+bool proto_is_prefix(const char* ptr, size_t len);
+// Returns the length of the message at the start of 'buff', which runs up to
+// the next known prefix or the end of the buffer.
+size_t proto_next_message(const char* buff, size_t len);
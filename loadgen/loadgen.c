@@ -0,0 +1,682 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "includes/histogram.h"
+#include "includes/protocol.h"
+#include "../server/includes/libxml.h"
+
+#define Clear   "\033[3;0;0m"
+#define Red     "\033[0;31m"
+#define Green   "\033[0;32m"
+#define Yellow  "\033[0;33m"
+#define Cyan    "\033[0;36m"
+
+#define BUFF_SIZE 4096
+#define MAX_EVENTS 256
+#define MAX_QUESTIONS 1024
+
+typedef enum {
+    CMD_NONE = -1,
+    CMD_CONNECT,
+    CMD_REGISTER,
+    CMD_LOGIN,
+    CMD_JOIN,
+    CMD_START,
+    CMD_ANSWER,
+    CMD_TURN,
+    CMD_COUNT
+} command_t;
+
+static const char* command_names[CMD_COUNT] = {
+    "connect", "register", "login", "join", "start", "answer", "question->result"
+};
+
+typedef enum {
+    BOT_IDLE,
+    BOT_CONNECTING,
+    BOT_CONNECTED,
+    BOT_LOBBY,
+    BOT_IN_GAME,
+    BOT_CLOSED
+} bot_state_t;
+
+typedef struct {
+    int fd;
+    int id;
+    bot_state_t state;
+    command_t pending;
+    uint64_t sent_at;
+    command_t next;
+    uint64_t timer_seq;
+    uint64_t question_at;
+    char answer;
+    char buff[BUFF_SIZE];
+} bot_t;
+
+typedef struct {
+    uint64_t wake_at;
+    uint64_t seq;
+    int bot;
+} bot_timer_t;
+
+typedef struct {
+    int id;
+    int epoll_fd;
+    bot_t* bots;
+    int bot_count;
+    int first_id;
+    bot_timer_t* heap;
+    int heap_len;
+    int heap_cap;
+    unsigned int seed;
+    histogram_t hist[CMD_COUNT];
+    uint64_t errors[CMD_COUNT];
+    uint64_t correct;
+    uint64_t incorrect;
+    uint64_t timeouts;
+    uint64_t games;
+    uint64_t disconnects;
+} worker_t;
+
+typedef struct {
+    char text[BUFF_SIZE / 4];
+    char correct_answer;
+} known_question_t;
+
+static struct {
+    const char* host;
+    int port;
+    int clients;
+    int threads;
+    double duration;
+    double ramp;
+    int think_min;
+    int think_max;
+    int retry;
+    double accuracy;
+    const char* prefix;
+    const char* questions;
+    const char* mode;
+} config = {
+    .host = "127.0.0.1",
+    .port = 8080,
+    .clients = 1000,
+    .threads = 4,
+    .duration = 60,
+    .ramp = 500,
+    .think_min = 200,
+    .think_max = 2000,
+    .retry = 1000,
+    .accuracy = 0.7,
+    .prefix = "loadgen",
+    .questions = "data/questions.xml",
+    .mode = NULL
+};
+
+static struct sockaddr_in server_addr;
+static uint64_t start_time;
+static uint64_t end_time;
+static known_question_t* known_questions = NULL;
+static int known_count = 0;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//
+//  Questions
+//
+
+static const XMLBinding question_fields[] = {
+    XML_BIND_STR("text", known_question_t, text),
+    XML_BIND_CHAR("correct_answer", known_question_t, correct_answer),
+};
+static const XMLSchema question_schema = XML_SCHEMA("questions", "question", known_question_t, question_fields);
+
+static void add_question(void* ctx, const void* record) {
+    (void) ctx;
+    if (known_count == MAX_QUESTIONS) return;
+    memcpy(&known_questions[known_count++], record, sizeof(known_question_t));
+}
+
+static void load_known_questions() {
+    known_questions = calloc(MAX_QUESTIONS, sizeof(known_question_t));
+    XMLDecoder decoder;
+    XMLError err = XMLDecoder_compile(&decoder, &question_schema);
+    if (err == XML_SUCCESS)
+        err = XMLDecoder_load(&decoder, config.questions, 1, add_question, NULL);
+
+    if (err != XML_SUCCESS)
+        printf(Yellow"[LOADGEN] Could not read %s (%s), answers will be random\n"Clear, config.questions, XMLDocument_etos(err));
+}
+
+// A turn looks like "QUES:It's your turn! ...\n<text>\nA:..." (or "everyone's
+// turn" in round mode): look the text up
+// to know which answer is right.
+static char correct_answer_for(const char* msg, size_t len) {
+    const char* text = memchr(msg, '\n', len);
+    if (!text) return 0;
+    text++;
+    const char* text_end = memchr(text, '\n', msg + len - text);
+    if (!text_end) return 0;
+
+    size_t text_len = text_end - text;
+    for (int i = 0; i < known_count; i++) {
+        if (strlen(known_questions[i].text) == text_len &&
+            memcmp(known_questions[i].text, text, text_len) == 0)
+            return known_questions[i].correct_answer;
+    }
+    return 0;
+}
+
+//
+//  Timers
+//
+
+static void heap_swap(bot_timer_t* a, bot_timer_t* b) {
+    bot_timer_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void heap_push(worker_t* worker, bot_timer_t timer) {
+    if (worker->heap_len == worker->heap_cap) {
+        worker->heap_cap = worker->heap_cap ? worker->heap_cap * 2 : 64;
+        worker->heap = realloc(worker->heap, worker->heap_cap * sizeof(bot_timer_t));
+    }
+
+    int i = worker->heap_len++;
+    worker->heap[i] = timer;
+    while (i > 0 && worker->heap[(i - 1) / 2].wake_at > worker->heap[i].wake_at) {
+        heap_swap(&worker->heap[(i - 1) / 2], &worker->heap[i]);
+        i = (i - 1) / 2;
+    }
+}
+
+static bot_timer_t heap_pop(worker_t* worker) {
+    bot_timer_t top = worker->heap[0];
+    worker->heap[0] = worker->heap[--worker->heap_len];
+
+    int i = 0;
+    while (true) {
+        int smallest = i;
+        int left = 2 * i + 1, right = 2 * i + 2;
+        if (left < worker->heap_len && worker->heap[left].wake_at < worker->heap[smallest].wake_at)
+            smallest = left;
+        if (right < worker->heap_len && worker->heap[right].wake_at < worker->heap[smallest].wake_at)
+            smallest = right;
+        if (smallest == i) break;
+        heap_swap(&worker->heap[i], &worker->heap[smallest]);
+        i = smallest;
+    }
+    return top;
+}
+
+// Each bot has at most one scheduled command: scheduling again or cancelling
+// bumps timer_seq, and stale heap entries are dropped when they pop.
+static void schedule(worker_t* worker, bot_t* bot, command_t cmd, uint64_t delay_us) {
+    bot->next = cmd;
+    bot->timer_seq++;
+    bot_timer_t timer = { now_us() + delay_us, bot->timer_seq, (int) (bot - worker->bots) };
+    heap_push(worker, timer);
+}
+
+static void cancel(bot_t* bot) {
+    bot->next = CMD_NONE;
+    bot->timer_seq++;
+}
+
+static uint64_t think_time(worker_t* worker) {
+    int span = config.think_max - config.think_min;
+    int ms = config.think_min + (span > 0 ? rand_r(&worker->seed) % (span + 1) : 0);
+    return (uint64_t) ms * 1000;
+}
+
+//
+//  Bots
+//
+
+static void close_bot(worker_t* worker, bot_t* bot, bool dropped) {
+    if (bot->fd >= 0) {
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, bot->fd, NULL);
+        close(bot->fd);
+    }
+    if (dropped) {
+        worker->disconnects++;
+        if (bot->pending != CMD_NONE)
+            worker->errors[bot->pending]++;
+    }
+    bot->fd = -1;
+    bot->state = BOT_CLOSED;
+    bot->pending = CMD_NONE;
+    cancel(bot);
+}
+
+static void send_command(worker_t* worker, bot_t* bot, command_t cmd, const char* text) {
+    bot->pending = cmd;
+    bot->sent_at = now_us();
+    if (send(bot->fd, text, strlen(text), MSG_NOSIGNAL) < 0)
+        close_bot(worker, bot, true);
+}
+
+static void start_connect(worker_t* worker, bot_t* bot) {
+    bot->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (bot->fd < 0) {
+        worker->errors[CMD_CONNECT]++;
+        bot->state = BOT_CLOSED;
+        return;
+    }
+
+    int opt = 1;
+    setsockopt(bot->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    bot->state = BOT_CONNECTING;
+    bot->pending = CMD_CONNECT;
+    bot->sent_at = now_us();
+    if (connect(bot->fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        close(bot->fd);
+        bot->fd = -1;
+        worker->errors[CMD_CONNECT]++;
+        bot->state = BOT_CLOSED;
+        bot->pending = CMD_NONE;
+        return;
+    }
+
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = bot };
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, bot->fd, &event);
+}
+
+static void fire(worker_t* worker, bot_t* bot) {
+    command_t cmd = bot->next;
+    bot->next = CMD_NONE;
+    if (bot->state == BOT_CLOSED && cmd != CMD_CONNECT) return;
+
+    char buff[BUFF_SIZE];
+    switch (cmd) {
+    case CMD_CONNECT:
+        start_connect(worker, bot);
+        break;
+    case CMD_REGISTER:
+        snprintf(buff, sizeof(buff), "register : %s_%d", config.prefix, bot->id);
+        send_command(worker, bot, cmd, buff);
+        break;
+    case CMD_LOGIN:
+        snprintf(buff, sizeof(buff), "login : %s_%d", config.prefix, bot->id);
+        send_command(worker, bot, cmd, buff);
+        break;
+    case CMD_JOIN:
+        send_command(worker, bot, cmd, "join");
+        break;
+    case CMD_START:
+        if (config.mode) {
+            snprintf(buff, sizeof(buff), "start : %s", config.mode);
+            send_command(worker, bot, cmd, buff);
+        } else {
+            send_command(worker, bot, cmd, "start");
+        }
+        break;
+    case CMD_ANSWER:
+        snprintf(buff, sizeof(buff), "answer : %c", bot->answer);
+        send_command(worker, bot, cmd, buff);
+        break;
+    default:
+        break;
+    }
+}
+
+static bool starts_with(const char* msg, size_t len, const char* prefix) {
+    size_t prefix_len = strlen(prefix);
+    return len >= prefix_len && memcmp(msg, prefix, prefix_len) == 0;
+}
+
+static char pick_answer(worker_t* worker, char correct) {
+    if (correct < 'A' || correct > 'D')
+        return 'A' + rand_r(&worker->seed) % 4;
+    if (rand_r(&worker->seed) < config.accuracy * ((double) RAND_MAX + 1))
+        return correct;
+    return 'A' + (correct - 'A' + 1 + rand_r(&worker->seed) % 3) % 4;
+}
+
+static void handle_message(worker_t* worker, bot_t* bot, const char* msg, size_t len) {
+    uint64_t now = now_us();
+
+    // Commands answer with RESP/ERR_/WARN, except a successful start which
+    // shows up as the GAME broadcast.
+    if (bot->pending != CMD_NONE &&
+        (starts_with(msg, len, "RESP:") || starts_with(msg, len, "ERR_:") || starts_with(msg, len, "WARN:") ||
+         (bot->pending == CMD_START && starts_with(msg, len, "GAME:")))) {
+        hist_record(&worker->hist[bot->pending], now - bot->sent_at);
+        if (!starts_with(msg, len, "RESP:") && !starts_with(msg, len, "GAME:"))
+            worker->errors[bot->pending]++;
+        bot->pending = CMD_NONE;
+    }
+
+    if (starts_with(msg, len, "RESP:Registered") || starts_with(msg, len, "RESP:Welcome") ||
+        starts_with(msg, len, "WARN:You are already logged in")) {
+        schedule(worker, bot, CMD_JOIN, think_time(worker));
+    } else if (starts_with(msg, len, "ERR_:Username already exists")) {
+        schedule(worker, bot, CMD_LOGIN, 0);
+    } else if (starts_with(msg, len, "ERR_:User not found")) {
+        schedule(worker, bot, CMD_REGISTER, (uint64_t) config.retry * 1000);
+    } else if (starts_with(msg, len, "RESP:Joined") || starts_with(msg, len, "WARN:Already in game lobby")) {
+        bot->state = BOT_LOBBY;
+        schedule(worker, bot, CMD_START, think_time(worker));
+    } else if (starts_with(msg, len, "ERR_:Game already in progress")) {
+        schedule(worker, bot, CMD_JOIN, (uint64_t) config.retry * 1000);
+    } else if (starts_with(msg, len, "ERR_:Need at least 2")) {
+        schedule(worker, bot, CMD_START, (uint64_t) config.retry * 1000);
+    } else if (starts_with(msg, len, "GAME:")) {
+        bot->state = BOT_IN_GAME;
+        cancel(bot);
+    } else if (starts_with(msg, len, "QUES:It's your turn") || starts_with(msg, len, "QUES:It's everyone's turn")) {
+        bot->question_at = now;
+        bot->answer = pick_answer(worker, correct_answer_for(msg, len));
+        schedule(worker, bot, CMD_ANSWER, think_time(worker));
+    } else if (starts_with(msg, len, "WRES:")) {
+        hist_record(&worker->hist[CMD_TURN], now - bot->question_at);
+        worker->correct++;
+    } else if (starts_with(msg, len, "LRES:")) {
+        hist_record(&worker->hist[CMD_TURN], now - bot->question_at);
+        if (starts_with(msg, len, "LRES:Oops, you ran out of time"))
+            worker->timeouts++;
+        else
+            worker->incorrect++;
+    } else if (starts_with(msg, len, "END_:")) {
+        worker->games++;
+    } else if (starts_with(msg, len, "INFO:Game ended")) {
+        bot->state = BOT_CONNECTED;
+        schedule(worker, bot, CMD_JOIN, think_time(worker));
+    }
+}
+
+static void handle_readable(worker_t* worker, bot_t* bot) {
+    while (bot->state != BOT_CLOSED) {
+        ssize_t len = recv(bot->fd, bot->buff, sizeof(bot->buff), 0);
+        if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            close_bot(worker, bot, true);
+            return;
+        }
+        if (len < 0) return;
+
+        // The server sends every reply with a single send(), so on a local
+        // connection a read holds whole replies and needs no reassembly.
+        size_t pos = 0;
+        while (pos < (size_t) len && bot->state != BOT_CLOSED) {
+            size_t msg_len = proto_next_message(bot->buff + pos, len - pos);
+            handle_message(worker, bot, bot->buff + pos, msg_len);
+            pos += msg_len;
+        }
+    }
+}
+
+static void handle_connected(worker_t* worker, bot_t* bot) {
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    getsockopt(bot->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+    if (err != 0) {
+        close_bot(worker, bot, true);
+        return;
+    }
+
+    hist_record(&worker->hist[CMD_CONNECT], now_us() - bot->sent_at);
+    bot->pending = CMD_NONE;
+    bot->state = BOT_CONNECTED;
+
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = bot };
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, bot->fd, &event);
+    schedule(worker, bot, CMD_REGISTER, 0);
+}
+
+//
+//  Workers
+//
+
+static void* worker_main(void* arg) {
+    worker_t* worker = (worker_t*) arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (int i = 0; i < worker->bot_count; i++) {
+        bot_t* bot = &worker->bots[i];
+        bot->fd = -1;
+        bot->id = worker->first_id + i;
+        bot->state = BOT_IDLE;
+        bot->pending = CMD_NONE;
+        bot->next = CMD_NONE;
+
+        uint64_t delay = config.ramp > 0 ? (uint64_t) (bot->id * 1000000.0 / config.ramp) : 0;
+        schedule(worker, bot, CMD_CONNECT, delay);
+    }
+
+    while (true) {
+        uint64_t now = now_us();
+        if (now >= end_time) break;
+
+        while (worker->heap_len > 0 && worker->heap[0].wake_at <= now) {
+            bot_timer_t timer = heap_pop(worker);
+            bot_t* bot = &worker->bots[timer.bot];
+            if (timer.seq == bot->timer_seq)
+                fire(worker, bot);
+        }
+
+        uint64_t wake_at = end_time;
+        if (worker->heap_len > 0 && worker->heap[0].wake_at < wake_at)
+            wake_at = worker->heap[0].wake_at;
+        now = now_us();
+        int timeout = wake_at > now ? (int) ((wake_at - now + 999) / 1000) : 0;
+
+        int count = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < count; i++) {
+            bot_t* bot = (bot_t*) events[i].data.ptr;
+            if (bot->state == BOT_CLOSED) continue;
+
+            if (bot->state == BOT_CONNECTING) {
+                handle_connected(worker, bot);
+            } else {
+                if (events[i].events & EPOLLIN)
+                    handle_readable(worker, bot);
+                if (bot->state != BOT_CLOSED && (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)))
+                    close_bot(worker, bot, true);
+            }
+        }
+    }
+
+    for (int i = 0; i < worker->bot_count; i++) {
+        bot_t* bot = &worker->bots[i];
+        if (bot->state != BOT_CLOSED && bot->state != BOT_IDLE && bot->state != BOT_CONNECTING)
+            send(bot->fd, "quit", 4, MSG_NOSIGNAL);
+        if (bot->fd >= 0)
+            close_bot(worker, bot, false);
+    }
+    return NULL;
+}
+
+//
+//  Report
+//
+
+static void print_report(worker_t* workers, int count, double elapsed) {
+    histogram_t total[CMD_COUNT];
+    uint64_t errors[CMD_COUNT] = { 0 };
+    uint64_t correct = 0, incorrect = 0, timeouts = 0, games = 0, disconnects = 0;
+
+    for (int c = 0; c < CMD_COUNT; c++)
+        hist_init(&total[c]);
+    for (int w = 0; w < count; w++) {
+        for (int c = 0; c < CMD_COUNT; c++) {
+            hist_merge(&total[c], &workers[w].hist[c]);
+            errors[c] += workers[w].errors[c];
+        }
+        correct += workers[w].correct;
+        incorrect += workers[w].incorrect;
+        timeouts += workers[w].timeouts;
+        games += workers[w].games;
+        disconnects += workers[w].disconnects;
+    }
+
+    printf(Cyan"[LOADGEN] %d clients over %.1fs on %d threads against %s:%d\n"Clear,
+           config.clients, elapsed, config.threads, config.host, config.port);
+    printf("%-18s %10s %8s %10s %10s %10s %10s %10s\n",
+           "command", "count", "errors", "per_sec", "p50_ms", "p99_ms", "p999_ms", "max_ms");
+    for (int c = 0; c < CMD_COUNT; c++) {
+        histogram_t* hist = &total[c];
+        printf("%-18s %10llu %8llu %10.1f %10.3f %10.3f %10.3f %10.3f\n",
+               command_names[c], (unsigned long long) hist->count, (unsigned long long) errors[c],
+               hist->count / elapsed,
+               hist_percentile(hist, 50) / 1000.0, hist_percentile(hist, 99) / 1000.0,
+               hist_percentile(hist, 99.9) / 1000.0, hist->max / 1000.0);
+    }
+    printf("answers: %llu correct, %llu incorrect, %llu timed out | games finished: %llu | dropped connections: %llu\n",
+           (unsigned long long) correct, (unsigned long long) incorrect, (unsigned long long) timeouts,
+           (unsigned long long) games, (unsigned long long) disconnects);
+}
+
+static void usage(const char* name) {
+    printf("Usage: %s [options]\n\
+  -H, --host ADDR        server address (default 127.0.0.1)\n\
+  -p, --port PORT        server port (default 8080)\n\
+  -n, --clients N        simulated players (default 1000)\n\
+  -t, --threads N        event loop threads (default 4)\n\
+  -d, --duration SEC     run time in seconds (default 60)\n\
+  -r, --ramp N           new connections per second, 0 = all at once (default 500)\n\
+  -k, --think MIN-MAX    think time before each command in ms (default 200-2000)\n\
+  -R, --retry MS         delay before retrying a refused join/start (default 1000)\n\
+  -a, --accuracy P       probability of answering correctly (default 0.7)\n\
+  -u, --prefix NAME      players are NAME_<i> (default loadgen)\n\
+  -q, --questions PATH   questions file used to pick answers (default data/questions.xml)\n\
+  -m, --mode MODE        start games in turns or rounds mode (default: the server's)\n", name);
+}
+
+static bool parse_args(int argc, char* argv[]) {
+    static const struct option options[] = {
+        { "host", required_argument, NULL, 'H' },
+        { "port", required_argument, NULL, 'p' },
+        { "clients", required_argument, NULL, 'n' },
+        { "threads", required_argument, NULL, 't' },
+        { "duration", required_argument, NULL, 'd' },
+        { "ramp", required_argument, NULL, 'r' },
+        { "think", required_argument, NULL, 'k' },
+        { "retry", required_argument, NULL, 'R' },
+        { "accuracy", required_argument, NULL, 'a' },
+        { "prefix", required_argument, NULL, 'u' },
+        { "questions", required_argument, NULL, 'q' },
+        { "mode", required_argument, NULL, 'm' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:n:t:d:r:k:R:a:u:q:m:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'H': config.host = optarg; break;
+        case 'p': config.port = atoi(optarg); break;
+        case 'n': config.clients = atoi(optarg); break;
+        case 't': config.threads = atoi(optarg); break;
+        case 'd': config.duration = atof(optarg); break;
+        case 'r': config.ramp = atof(optarg); break;
+        case 'k':
+            if (sscanf(optarg, "%d-%d", &config.think_min, &config.think_max) == 1)
+                config.think_max = config.think_min;
+            break;
+        case 'R': config.retry = atoi(optarg); break;
+        case 'a': config.accuracy = atof(optarg); break;
+        case 'u': config.prefix = optarg; break;
+        case 'q': config.questions = optarg; break;
+        case 'm': config.mode = optarg; break;
+        default: return false;
+        }
+    }
+
+    if (config.clients < 1 || config.threads < 1 || config.duration <= 0 ||
+        config.think_min < 0 || config.think_max < config.think_min) {
+        printf(Red"[LOADGEN] Invalid options\n"Clear);
+        return false;
+    }
+    if (config.threads > config.clients)
+        config.threads = config.clients;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host, &server_addr.sin_addr) != 1) {
+        printf(Red"[LOADGEN] Invalid address '%s'\n"Clear, config.host);
+        return 1;
+    }
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur < (rlim_t) config.clients + 64)
+            printf(Yellow"[LOADGEN] Open file limit is %llu, some connections will fail\n"Clear,
+                   (unsigned long long) limit.rlim_cur);
+    }
+
+    load_known_questions();
+
+    worker_t* workers = calloc(config.threads, sizeof(worker_t));
+    bot_t* bots = calloc(config.clients, sizeof(bot_t));
+    pthread_t* threads = calloc(config.threads, sizeof(pthread_t));
+    if (!workers || !bots || !threads) {
+        printf(Red"[LOADGEN] Out of memory\n"Clear);
+        return 1;
+    }
+
+    printf(Green"[LOADGEN] Starting %d clients on %d threads for %.1fs\n"Clear, config.clients, config.threads, config.duration);
+    start_time = now_us();
+    end_time = start_time + (uint64_t) (config.duration * 1000000);
+
+    int first = 0;
+    for (int i = 0; i < config.threads; i++) {
+        worker_t* worker = &workers[i];
+        int count = config.clients / config.threads + (i < config.clients % config.threads);
+        worker->id = i;
+        worker->bots = bots + first;
+        worker->bot_count = count;
+        worker->first_id = first;
+        worker->seed = (unsigned int) (start_time ^ (i * 2654435761u));
+        worker->epoll_fd = epoll_create1(0);
+        for (int c = 0; c < CMD_COUNT; c++)
+            hist_init(&worker->hist[c]);
+        first += count;
+        pthread_create(&threads[i], NULL, worker_main, worker);
+    }
+
+    for (int i = 0; i < config.threads; i++)
+        pthread_join(threads[i], NULL);
+
+    print_report(workers, config.threads, (now_us() - start_time) / 1000000.0);
+
+    for (int i = 0; i < config.threads; i++) {
+        close(workers[i].epoll_fd);
+        free(workers[i].heap);
+    }
+    free(threads);
+    free(bots);
+    free(workers);
+    free(known_questions);
+    return 0;
+}
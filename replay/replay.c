@@ -0,0 +1,554 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "../loadgen/includes/protocol.h"
+#include "../server/includes/record.h"
+#include "../server/includes/libxml.h"
+
+#define Clear   "\033[3;0;0m"
+#define Red     "\033[0;31m"
+#define Green   "\033[0;32m"
+#define Yellow  "\033[0;33m"
+#define Cyan    "\033[0;36m"
+
+#define BUFF_SIZE 4096
+#define MAX_EVENTS 256
+#define MAX_QUESTIONS 1024
+#define SHOW_LEN 60
+// Scoreboard frames ("SCOR:...\n") go out on the server's tick rather than
+// in reply to anything, so they are left out of both sides of the comparison
+#define TICK_PREFIX "SCOR:"
+
+typedef struct {
+    record_header_t header;
+    const char* payload;
+    // Bytes the server had sent to the connection up to and including this record
+    size_t expected_before;
+} replay_event_t;
+
+typedef struct {
+    int fd;
+    bool seen;
+    bool open;
+    bool eof;
+    char* expected;
+    size_t expected_len;
+    size_t expected_cap;
+    char* received;
+    size_t received_len;
+    size_t received_cap;
+    size_t target;
+    bool diverged;
+    bool stalled;
+    bool in_tick;                   // inside a scoreboard frame
+    char held[PROTO_PREFIX_LEN];    // received tail that may start one
+    size_t held_len;
+} replay_conn_t;
+
+typedef struct {
+    int id;
+} question_id_t;
+
+static struct {
+    const char* host;
+    int port;
+    double speed;
+    int wait;
+    const char* questions;
+    bool verbose;
+    const char* capture;
+} config = {
+    .host = "127.0.0.1",
+    .port = 8080,
+    .speed = 1.0,
+    .wait = 60000,
+    .questions = "data/questions.xml",
+    .verbose = false,
+    .capture = NULL
+};
+
+static struct sockaddr_in server_addr;
+static int epoll_fd;
+static replay_conn_t* conns = NULL;
+static uint32_t conn_count = 0;
+static uint32_t* recorded_order = NULL;
+static int recorded_questions = 0;
+static uint32_t local_order[MAX_QUESTIONS];
+static int local_questions = 0;
+static int stalls = 0;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool append(char** buff, size_t* len, size_t* cap, const char* data, size_t size) {
+    if (*len + size > *cap) {
+        size_t new_cap = *cap ? *cap * 2 : BUFF_SIZE;
+        while (new_cap < *len + size) new_cap *= 2;
+        char* grown = realloc(*buff, new_cap);
+        if (!grown) return false;
+        *buff = grown;
+        *cap = new_cap;
+    }
+    memcpy(*buff + *len, data, size);
+    *len += size;
+    return true;
+}
+
+//
+//  Capture
+//
+
+static char* read_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = len > 0 ? malloc(len) : NULL;
+    if (data && fread(data, 1, len, file) != (size_t) len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = data ? (size_t) len : 0;
+    return data;
+}
+
+static replay_conn_t* get_conn(uint32_t id) {
+    if (id >= conn_count) {
+        uint32_t count = id + 1 > conn_count * 2 ? id + 1 : conn_count * 2;
+        replay_conn_t* grown = realloc(conns, count * sizeof(replay_conn_t));
+        if (!grown) return NULL;
+        memset(grown + conn_count, 0, (count - conn_count) * sizeof(replay_conn_t));
+        conns = grown;
+        conn_count = count;
+    }
+    return &conns[id];
+}
+
+// Splits the capture into events and builds each connection's expected
+// output. Replies recorded after a connection went away were never delivered.
+static replay_event_t* parse_capture(const char* data, size_t size, size_t* count) {
+    size_t magic_len = strlen(RECORD_MAGIC);
+    if (size < magic_len || memcmp(data, RECORD_MAGIC, magic_len) != 0) {
+        printf(Red"[REPLAY] %s is not a capture file\n"Clear, config.capture);
+        return NULL;
+    }
+
+    size_t cap = 1024;
+    replay_event_t* events = malloc(cap * sizeof(replay_event_t));
+    *count = 0;
+    for (size_t offset = magic_len; offset + sizeof(record_header_t) <= size; ) {
+        record_header_t header;
+        memcpy(&header, data + offset, sizeof(header));
+        offset += sizeof(header);
+        if (header.type >= RECORD_TYPE_COUNT || offset + header.len > size) {
+            printf(Yellow"[REPLAY] Capture is truncated, replaying the first %zu events\n"Clear, *count);
+            break;
+        }
+
+        replay_event_t event = { header, data + offset, 0 };
+        offset += header.len;
+
+        if (header.type == RECORD_QUESTIONS) {
+            recorded_order = (uint32_t*) event.payload;
+            recorded_questions = header.len / sizeof(uint32_t);
+            continue;
+        }
+        if (header.type != RECORD_QUESTION) {
+            replay_conn_t* conn = get_conn(header.conn);
+            if (!conn) return NULL;
+            if (header.type == RECORD_CONNECT)
+                conn->seen = conn->open = true;
+            if (!conn->open) continue;
+
+            if (header.type == RECORD_SEND && !(header.len >= PROTO_PREFIX_LEN &&
+                                                memcmp(event.payload, TICK_PREFIX, PROTO_PREFIX_LEN) == 0))
+                append(&conn->expected, &conn->expected_len, &conn->expected_cap, event.payload, header.len);
+            if (header.type == RECORD_DISCONNECT)
+                conn->open = false;
+            event.expected_before = conn->expected_len;
+        }
+
+        if (*count == cap) {
+            cap *= 2;
+            events = realloc(events, cap * sizeof(replay_event_t));
+        }
+        events[(*count)++] = event;
+    }
+
+    for (uint32_t i = 0; i < conn_count; i++)
+        conns[i].open = false;
+    return events;
+}
+
+static const XMLBinding question_fields[] = {
+    XML_BIND_INT("@id", question_id_t, id),
+};
+static const XMLSchema question_schema = XML_SCHEMA("questions", "question", question_id_t, question_fields);
+
+static void add_question(void* ctx, const void* record) {
+    (void) ctx;
+    if (local_questions < MAX_QUESTIONS)
+        local_order[local_questions++] = ((const question_id_t*) record)->id;
+}
+
+// Replies embed the questions, so a server loaded with another set can't match
+static void check_question_order() {
+    XMLDecoder decoder;
+    XMLError err = XMLDecoder_compile(&decoder, &question_schema);
+    if (err == XML_SUCCESS)
+        err = XMLDecoder_load(&decoder, config.questions, 1, add_question, NULL);
+    if (err != XML_SUCCESS) {
+        printf(Yellow"[REPLAY] Could not read %s (%s), question order not checked\n"Clear, config.questions, XMLDocument_etos(err));
+        return;
+    }
+
+    if (local_questions != recorded_questions ||
+        memcmp(local_order, recorded_order, recorded_questions * sizeof(uint32_t)) != 0)
+        printf(Yellow"[REPLAY] %s differs from the recorded question order (%d questions recorded, %d local), replies won't match\n"Clear,
+               config.questions, recorded_questions, local_questions);
+}
+
+//
+//  Replay
+//
+
+// Drops scoreboard frames from 'len' bytes at 'buff' (which starts with the
+// held bytes) and returns how many are left
+static size_t strip_ticks(replay_conn_t* conn, char* buff, size_t len) {
+    size_t kept = 0;
+    for (size_t i = 0; i < len; ) {
+        if (conn->in_tick) {
+            if (buff[i++] == '\n')
+                conn->in_tick = false;
+            continue;
+        }
+
+        size_t left = len - i;
+        if (left < PROTO_PREFIX_LEN && memcmp(buff + i, TICK_PREFIX, left) == 0) {
+            memcpy(conn->held, buff + i, left);
+            conn->held_len = left;
+            break;
+        }
+        if (left >= PROTO_PREFIX_LEN && memcmp(buff + i, TICK_PREFIX, PROTO_PREFIX_LEN) == 0) {
+            conn->in_tick = true;
+            i += PROTO_PREFIX_LEN;
+            continue;
+        }
+        buff[kept++] = buff[i++];
+    }
+    return kept;
+}
+
+// Stops waiting on a connection as soon as its replies differ from the capture
+static void read_conn(replay_conn_t* conn) {
+    char buff[PROTO_PREFIX_LEN + BUFF_SIZE];
+    while (true) {
+        size_t held = conn->held_len;
+        memcpy(buff, conn->held, held);
+        conn->held_len = 0;
+        ssize_t len = recv(conn->fd, buff + held, BUFF_SIZE, MSG_DONTWAIT);
+        if (len > 0) {
+            size_t kept = strip_ticks(conn, buff, held + len);
+            size_t offset = conn->received_len;
+            append(&conn->received, &conn->received_len, &conn->received_cap, buff, kept);
+            if (conn->received_len > conn->expected_len ||
+                memcmp(conn->received + offset, conn->expected + offset, kept) != 0)
+                conn->diverged = true;
+            if (conn->received_len >= conn->target)
+                conn->stalled = false;
+            continue;
+        }
+        memcpy(conn->held, buff, held);
+        conn->held_len = held;
+        if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            conn->eof = true;
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        }
+        return;
+    }
+}
+
+static void pump(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < ready; i++)
+        read_conn(&conns[events[i].data.u32]);
+}
+
+static bool behind(replay_conn_t* conn) {
+    return conn->open && !conn->eof && !conn->diverged && !conn->stalled &&
+           conn->received_len + conn->held_len < conn->target;
+}
+
+// Waits until every connection has seen everything the server had sent it at
+// this point of the capture, so a command never overtakes the replies that
+// preceded it. A connection that stays behind for --wait is no longer waited on.
+static void gate() {
+    uint64_t deadline = now_us() + (uint64_t) config.wait * 1000;
+    for (uint32_t i = 0; i < conn_count; ) {
+        if (!behind(&conns[i])) {
+            i++;
+            continue;
+        }
+
+        uint64_t now = now_us();
+        if (now >= deadline) {
+            for (; i < conn_count; i++) {
+                if (behind(&conns[i])) {
+                    conns[i].stalled = true;
+                    stalls++;
+                }
+            }
+            return;
+        }
+        pump((int) ((deadline - now + 999) / 1000));
+    }
+}
+
+static void open_conn(uint32_t id) {
+    replay_conn_t* conn = &conns[id];
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->fd < 0 || connect(conn->fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) < 0) {
+        printf(Red"[REPLAY] Connection %u failed: %s\n"Clear, id, strerror(errno));
+        if (conn->fd >= 0) close(conn->fd);
+        conn->eof = true;
+        return;
+    }
+    int opt = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = id };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+    conn->open = true;
+}
+
+static void close_conn(replay_conn_t* conn) {
+    if (!conn->open) return;
+    if (!conn->eof)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->open = false;
+}
+
+static void send_all(replay_conn_t* conn, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(conn->fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return;
+        data += sent;
+        len -= sent;
+    }
+}
+
+static void replay(replay_event_t* events, size_t count, uint64_t* commands) {
+    uint64_t start = now_us();
+    for (size_t i = 0; i < count; i++) {
+        replay_event_t* event = &events[i];
+        if (config.speed > 0) {
+            uint64_t due = start + (uint64_t) (event->header.time_us / config.speed);
+            for (uint64_t now = now_us(); now < due; now = now_us())
+                pump((int) ((due - now + 999) / 1000));
+        }
+
+        replay_conn_t* conn = event->header.type == RECORD_QUESTION ? NULL : &conns[event->header.conn];
+        switch (event->header.type) {
+        case RECORD_CONNECT:
+            open_conn(event->header.conn);
+            break;
+        case RECORD_SEND:
+            conn->target = event->expected_before;
+            break;
+        case RECORD_COMMAND:
+            if (!conn->open) break;
+            gate();
+            send_all(conn, event->payload, event->header.len);
+            (*commands)++;
+            break;
+        case RECORD_DISCONNECT:
+            if (!conn->open) break;
+            gate();
+            close_conn(conn);
+            break;
+        case RECORD_QUESTION:
+            if (config.verbose)
+                printf(Cyan"[REPLAY] Question %u asked\n"Clear, event->header.conn + 1);
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < conn_count; i++) {
+        conns[i].target = conns[i].expected_len;
+        conns[i].stalled = false;
+    }
+    gate();
+    for (uint32_t i = 0; i < conn_count; i++)
+        close_conn(&conns[i]);
+}
+
+//
+//  Report
+//
+
+static void show(const char* label, const char* data, size_t len) {
+    printf("    %-8s \"", label);
+    for (size_t i = 0; i < len && i < SHOW_LEN; i++) {
+        if (data[i] == '\n') printf("\\n");
+        else if ((unsigned char) data[i] < 0x20) printf("\\x%02x", (unsigned char) data[i]);
+        else putchar(data[i]);
+    }
+    printf(len > SHOW_LEN ? "...\"\n" : "\"\n");
+}
+
+// Reports the first message that differs, aligned on reply prefixes
+static bool compare_conn(uint32_t id, replay_conn_t* conn) {
+    append(&conn->received, &conn->received_len, &conn->received_cap, conn->held, conn->held_len);
+    conn->held_len = 0;
+    if (conn->received_len == conn->expected_len &&
+        memcmp(conn->received, conn->expected, conn->expected_len) == 0)
+        return true;
+
+    size_t offset = 0;
+    size_t shortest = conn->received_len < conn->expected_len ? conn->received_len : conn->expected_len;
+    while (offset < shortest) {
+        size_t len = proto_next_message(conn->expected + offset, conn->expected_len - offset);
+        if (len == 0 || offset + len > shortest ||
+            memcmp(conn->expected + offset, conn->received + offset, len) != 0)
+            break;
+        offset += len;
+    }
+
+    printf(Red"[REPLAY] Connection %u diverged at byte %zu (expected %zu bytes, got %zu)\n"Clear,
+           id, offset, conn->expected_len, conn->received_len);
+    show("expected", conn->expected + offset, conn->expected_len - offset);
+    show("got", conn->received + offset, conn->received_len - offset);
+    return false;
+}
+
+static void usage(const char* name) {
+    printf("Usage: %s [options] CAPTURE\n\
+  -H, --host ADDR        server address (default 127.0.0.1)\n\
+  -p, --port PORT        server port (default 8080)\n\
+  -s, --speed X          replay at X times the recorded pace, 0 = as fast as possible (default 1)\n\
+  -f, --fast             same as --speed 0\n\
+  -w, --wait MS          longest wait for an expected reply before sending anyway (default 60000)\n\
+  -q, --questions PATH   questions file the server was started with (default data/questions.xml)\n\
+  -v, --verbose          print questions as they're asked\n\
+Record a capture by starting the server with QUIZ_RECORD=path, and replay it\n\
+against a server started from the same data/ files.\n", name);
+}
+
+static bool parse_args(int argc, char* argv[]) {
+    static const struct option options[] = {
+        { "host", required_argument, NULL, 'H' },
+        { "port", required_argument, NULL, 'p' },
+        { "speed", required_argument, NULL, 's' },
+        { "fast", no_argument, NULL, 'f' },
+        { "wait", required_argument, NULL, 'w' },
+        { "questions", required_argument, NULL, 'q' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:s:fw:q:vh", options, NULL)) != -1) {
+        switch (opt) {
+        case 'H': config.host = optarg; break;
+        case 'p': config.port = atoi(optarg); break;
+        case 's': config.speed = atof(optarg); break;
+        case 'f': config.speed = 0; break;
+        case 'w': config.wait = atoi(optarg); break;
+        case 'q': config.questions = optarg; break;
+        case 'v': config.verbose = true; break;
+        default: return false;
+        }
+    }
+
+    if (optind != argc - 1 || config.speed < 0 || config.wait < 0) {
+        printf(Red"[REPLAY] Invalid options\n"Clear);
+        return false;
+    }
+    config.capture = argv[optind];
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host, &server_addr.sin_addr) != 1) {
+        printf(Red"[REPLAY] Invalid address '%s'\n"Clear, config.host);
+        return 1;
+    }
+
+    size_t size;
+    char* data = read_file(config.capture, &size);
+    if (!data) {
+        printf(Red"[REPLAY] Cannot read %s\n"Clear, config.capture);
+        return 1;
+    }
+
+    size_t count;
+    replay_event_t* events = parse_capture(data, size, &count);
+    if (!events) {
+        free(data);
+        return 1;
+    }
+    check_question_order();
+
+    double recorded = count ? events[count - 1].header.time_us / 1000000.0 : 0;
+    printf(Green"[REPLAY] Replaying %zu events over %.1fs of recorded traffic %s\n"Clear, count, recorded,
+           config.speed > 0 ? "at recorded pace" : "as fast as possible");
+
+    epoll_fd = epoll_create1(0);
+    uint64_t commands = 0;
+    uint64_t start = now_us();
+    replay(events, count, &commands);
+    double elapsed = (now_us() - start) / 1000000.0;
+
+    uint32_t used = 0, matched = 0;
+    for (uint32_t i = 0; i < conn_count; i++) {
+        if (!conns[i].seen) continue;
+        used++;
+        if (compare_conn(i, &conns[i]))
+            matched++;
+    }
+
+    printf(Cyan"[REPLAY] %llu commands on %u connections in %.2fs (recorded %.2fs)\n"Clear,
+           (unsigned long long) commands, used, elapsed, recorded);
+    if (stalls)
+        printf(Yellow"[REPLAY] %d waits for an expected reply timed out\n"Clear, stalls);
+    printf("%s[REPLAY] Outbound messages match on %u/%u connections\n"Clear, matched == used ? Green : Red, matched, used);
+
+    close(epoll_fd);
+    for (uint32_t i = 0; i < conn_count; i++) {
+        free(conns[i].expected);
+        free(conns[i].received);
+    }
+    free(conns);
+    free(events);
+    free(data);
+    return matched == used ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+#include "answers.h"
+#include <sched.h>
+
+static atomic_uint next_shard = 0;
+// Round ids are unique across rooms: players move between them and keep the
+// id of the last round they answered in
+static atomic_uint_fast32_t last_round = 0;
+static __thread int thread_shard = -1;
+
+static answer_shard_t* shard_for_thread(answer_board_t* board) {
+    if (thread_shard < 0)
+        thread_shard = atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % ANSWER_SHARDS;
+    return &board->shards[thread_shard];
+}
+
+// Only called while the board is closed and no submission is in flight
+void answers_open(answer_board_t* board, char correct_answer, uint64_t now_us) {
+    for (int s = 0; s < ANSWER_SHARDS; s++) {
+        answer_shard_t* shard = &board->shards[s];
+        atomic_store_explicit(&shard->answered, 0, memory_order_relaxed);
+        atomic_store_explicit(&shard->correct, 0, memory_order_relaxed);
+        for (int i = 0; i < ANSWER_OPTIONS; i++)
+            atomic_store_explicit(&shard->options[i], 0, memory_order_relaxed);
+        for (int i = 0; i < ANSWER_TIME_BUCKETS; i++)
+            atomic_store_explicit(&shard->time_buckets[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&board->departed, 0, memory_order_relaxed);
+    board->correct_answer = correct_answer;
+    board->opened_us = now_us;
+    atomic_store(&board->round, atomic_fetch_add(&last_round, 1) + 1);
+    atomic_store(&board->open, true);
+}
+
+answer_result_t answers_submit(answer_board_t* board, atomic_uint_fast32_t* player_round,
+                               char* answer_slot, char answer, uint64_t now_us) {
+    answer_shard_t* shard = shard_for_thread(board);
+
+    // answers_close() clears 'open' and then waits for 'inflight' to drain,
+    // so either it sees this submission or this submission sees it closed
+    atomic_fetch_add(&shard->inflight, 1);
+    if (!atomic_load(&board->open)) {
+        atomic_fetch_sub(&shard->inflight, 1);
+        return ANSWER_CLOSED;
+    }
+
+    uint_fast32_t round = atomic_load_explicit(&board->round, memory_order_relaxed);
+    uint_fast32_t prev = atomic_load_explicit(player_round, memory_order_relaxed);
+    if (prev == round || !atomic_compare_exchange_strong(player_round, &prev, round)) {
+        atomic_fetch_sub(&shard->inflight, 1);
+        return ANSWER_DUPLICATE;
+    }
+
+    *answer_slot = answer;
+    uint64_t elapsed = (now_us > board->opened_us ? now_us - board->opened_us : 0) / 1000000;
+    if (elapsed >= ANSWER_TIME_BUCKETS)
+        elapsed = ANSWER_TIME_BUCKETS - 1;
+
+    atomic_fetch_add_explicit(&shard->answered, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->options[answer - 'A'], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->time_buckets[elapsed], 1, memory_order_relaxed);
+    if (answer == board->correct_answer)
+        atomic_fetch_add_explicit(&shard->correct, 1, memory_order_relaxed);
+
+    atomic_fetch_sub_explicit(&shard->inflight, 1, memory_order_release);
+    return ANSWER_ACCEPTED;
+}
+
+uint64_t answers_count(answer_board_t* board) {
+    uint64_t answered = 0;
+    for (int s = 0; s < ANSWER_SHARDS; s++)
+        answered += atomic_load_explicit(&board->shards[s].answered, memory_order_relaxed);
+    uint64_t departed = atomic_load_explicit(&board->departed, memory_order_relaxed);
+    return answered > departed ? answered - departed : 0;
+}
+
+void answers_player_left(answer_board_t* board, atomic_uint_fast32_t* player_round) {
+    if (atomic_load(&board->open) && atomic_load(player_round) == atomic_load(&board->round))
+        atomic_fetch_add(&board->departed, 1);
+}
+
+void answers_player_back(answer_board_t* board, atomic_uint_fast32_t* player_round) {
+    if (atomic_load(&board->open) && atomic_load(player_round) == atomic_load(&board->round))
+        atomic_fetch_sub(&board->departed, 1);
+}
+
+void answers_close(answer_board_t* board, answer_totals_t* totals) {
+    atomic_store(&board->open, false);
+    for (int s = 0; s < ANSWER_SHARDS; s++)
+        while (atomic_load_explicit(&board->shards[s].inflight, memory_order_acquire) != 0)
+            sched_yield();
+
+    *totals = (answer_totals_t) { 0 };
+    for (int s = 0; s < ANSWER_SHARDS; s++) {
+        answer_shard_t* shard = &board->shards[s];
+        totals->answered += atomic_load_explicit(&shard->answered, memory_order_relaxed);
+        totals->correct += atomic_load_explicit(&shard->correct, memory_order_relaxed);
+        for (int i = 0; i < ANSWER_OPTIONS; i++)
+            totals->options[i] += atomic_load_explicit(&shard->options[i], memory_order_relaxed);
+        for (int i = 0; i < ANSWER_TIME_BUCKETS; i++)
+            totals->time_buckets[i] += atomic_load_explicit(&shard->time_buckets[i], memory_order_relaxed);
+    }
+}
+
+bool answers_player_answered(answer_board_t* board, atomic_uint_fast32_t* player_round) {
+    return atomic_load(player_round) == atomic_load(&board->round);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define ANSWER_SHARDS 16
+#define ANSWER_OPTIONS 4
+// Time to answer in whole seconds; the last bucket takes everything slower
+#define ANSWER_TIME_BUCKETS 32
+#define ANSWER_CACHE_LINE 64
+
+// Written by the threads that happen to map to it, so answers from
+// different client threads rarely touch the same cache line
+typedef struct {
+    _Alignas(ANSWER_CACHE_LINE) atomic_int inflight;
+    atomic_uint_fast64_t answered;
+    atomic_uint_fast64_t correct;
+    atomic_uint_fast64_t options[ANSWER_OPTIONS];
+    atomic_uint_fast64_t time_buckets[ANSWER_TIME_BUCKETS];
+} answer_shard_t;
+
+// Collects one round-mode question's answers without the session lock.
+// Players carry the id of the last round they answered in, unique across
+// boards, which makes their first answer win with a single compare-and-swap.
+typedef struct {
+    atomic_bool open;
+    atomic_uint_fast32_t round;
+    atomic_uint_fast64_t departed;   // answered this round, then left the room
+    char correct_answer;
+    uint64_t opened_us;
+    answer_shard_t shards[ANSWER_SHARDS];
+} answer_board_t;
+
+typedef struct {
+    uint64_t answered;
+    uint64_t correct;
+    uint64_t options[ANSWER_OPTIONS];
+    uint64_t time_buckets[ANSWER_TIME_BUCKETS];
+} answer_totals_t;
+
+typedef enum {
+    ANSWER_ACCEPTED,
+    ANSWER_DUPLICATE,
+    ANSWER_CLOSED
+} answer_result_t;
+
+// Game thread: clears the shards and starts a new round
+void answers_open(answer_board_t* board, char correct_answer, uint64_t now_us);
+// Client threads: records 'answer' ('A'-'D') once per player and round. On
+// success it is also stored in '*answer_slot', readable after answers_close().
+answer_result_t answers_submit(answer_board_t* board, atomic_uint_fast32_t* player_round,
+                               char* answer_slot, char answer, uint64_t now_us);
+// Answers so far from players still in the room; O(shards)
+uint64_t answers_count(answer_board_t* board);
+// Call when a player leaves the room, or its connection drops into a held
+// seat, with the session lock held
+void answers_player_left(answer_board_t* board, atomic_uint_fast32_t* player_round);
+// A held seat resumed; undoes answers_player_left() within the same round
+void answers_player_back(answer_board_t* board, atomic_uint_fast32_t* player_round);
+// Game thread: stops accepting, waits out submissions in progress and merges
+// the shards into 'totals'
+void answers_close(answer_board_t* board, answer_totals_t* totals);
+// Whether the player got an answer in before the current round closed
+bool answers_player_answered(answer_board_t* board, atomic_uint_fast32_t* player_round);
@@ -0,0 +1,238 @@
+#include "clock.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// A thread blocked on the virtual clock, either sleeping until 'wake_us' or
+// waiting on 'cond' (wake_us is then UINT64_MAX and it isn't in the heap)
+typedef struct _clock_waiter_t {
+    uint64_t wake_us;
+    pthread_cond_t* cond;
+    pthread_cond_t wake;
+    bool woken;
+    bool counted;
+    int heap_index;
+    struct _clock_waiter_t* next;
+} clock_waiter_t;
+
+static clock_mode_t mode = QUIZ_CLOCK_REAL;
+
+static struct {
+    pthread_mutex_t lock;
+    uint64_t now_us;
+    time_t epoch;
+    int attached;
+    int idle;
+    clock_waiter_t** heap;
+    int heap_len;
+    int heap_cap;
+    clock_waiter_t* cond_waiters;
+} vclock = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread bool thread_attached = false;
+
+static uint64_t real_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void clock_init(clock_mode_t clock_mode) {
+    mode = clock_mode;
+    vclock.now_us = 0;
+    vclock.epoch = time(NULL);
+}
+
+clock_mode_t clock_mode() {
+    return mode;
+}
+
+uint64_t clock_now_us() {
+    if (mode == QUIZ_CLOCK_REAL)
+        return real_now_us();
+
+    pthread_mutex_lock(&vclock.lock);
+    uint64_t now = vclock.now_us;
+    pthread_mutex_unlock(&vclock.lock);
+    return now;
+}
+
+time_t clock_time() {
+    if (mode == QUIZ_CLOCK_REAL)
+        return time(NULL);
+    return vclock.epoch + (time_t) (clock_now_us() / 1000000);
+}
+
+//
+//  Virtual time
+//
+
+static void heap_swap(int a, int b) {
+    clock_waiter_t* tmp = vclock.heap[a];
+    vclock.heap[a] = vclock.heap[b];
+    vclock.heap[b] = tmp;
+    vclock.heap[a]->heap_index = a;
+    vclock.heap[b]->heap_index = b;
+}
+
+static bool heap_push(clock_waiter_t* waiter) {
+    if (vclock.heap_len == vclock.heap_cap) {
+        int cap = vclock.heap_cap ? vclock.heap_cap * 2 : 64;
+        clock_waiter_t** heap = realloc(vclock.heap, cap * sizeof(clock_waiter_t*));
+        if (!heap) return false;
+        vclock.heap = heap;
+        vclock.heap_cap = cap;
+    }
+
+    int i = vclock.heap_len++;
+    vclock.heap[i] = waiter;
+    waiter->heap_index = i;
+    while (i > 0 && vclock.heap[(i - 1) / 2]->wake_us > vclock.heap[i]->wake_us) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    return true;
+}
+
+static clock_waiter_t* heap_pop() {
+    clock_waiter_t* top = vclock.heap[0];
+    vclock.heap_len--;
+    if (vclock.heap_len > 0) {
+        vclock.heap[0] = vclock.heap[vclock.heap_len];
+        vclock.heap[0]->heap_index = 0;
+
+        int i = 0;
+        while (true) {
+            int left = 2 * i + 1, right = left + 1, min = i;
+            if (left < vclock.heap_len && vclock.heap[left]->wake_us < vclock.heap[min]->wake_us) min = left;
+            if (right < vclock.heap_len && vclock.heap[right]->wake_us < vclock.heap[min]->wake_us) min = right;
+            if (min == i) break;
+            heap_swap(i, min);
+            i = min;
+        }
+    }
+    return top;
+}
+
+static void mark_busy(clock_waiter_t* waiter) {
+    waiter->woken = true;
+    if (waiter->counted) {
+        vclock.idle--;
+        waiter->counted = false;
+    }
+}
+
+static void mark_idle(clock_waiter_t* waiter) {
+    waiter->woken = false;
+    waiter->counted = thread_attached;
+    if (waiter->counted)
+        vclock.idle++;
+}
+
+// Called with the lock held whenever a thread goes idle: once all attached
+// threads are, jump to the earliest sleeper and wake everyone due by then
+static void advance() {
+    while (vclock.idle >= vclock.attached && vclock.heap_len > 0) {
+        if (vclock.heap[0]->wake_us > vclock.now_us)
+            vclock.now_us = vclock.heap[0]->wake_us;
+
+        while (vclock.heap_len > 0 && vclock.heap[0]->wake_us <= vclock.now_us) {
+            clock_waiter_t* waiter = heap_pop();
+            mark_busy(waiter);
+            pthread_cond_signal(&waiter->wake);
+        }
+    }
+}
+
+static void virtual_sleep(uint64_t usec) {
+    clock_waiter_t waiter;
+    memset(&waiter, 0, sizeof(waiter));
+    pthread_cond_init(&waiter.wake, NULL);
+
+    pthread_mutex_lock(&vclock.lock);
+    waiter.wake_us = vclock.now_us + usec;
+    if (heap_push(&waiter)) {
+        mark_idle(&waiter);
+        advance();
+        while (!waiter.woken)
+            pthread_cond_wait(&waiter.wake, &vclock.lock);
+    }
+    pthread_mutex_unlock(&vclock.lock);
+    pthread_cond_destroy(&waiter.wake);
+}
+
+void clock_attach() {
+    if (mode == QUIZ_CLOCK_REAL || thread_attached) return;
+    pthread_mutex_lock(&vclock.lock);
+    vclock.attached++;
+    thread_attached = true;
+    pthread_mutex_unlock(&vclock.lock);
+}
+
+void clock_detach() {
+    if (mode == QUIZ_CLOCK_REAL || !thread_attached) return;
+    pthread_mutex_lock(&vclock.lock);
+    vclock.attached--;
+    thread_attached = false;
+    advance();
+    pthread_mutex_unlock(&vclock.lock);
+}
+
+//
+//  Sleeping and waiting
+//
+
+void clock_sleep_us(uint64_t usec) {
+    if (usec == 0) return;
+    if (mode == QUIZ_CLOCK_VIRTUAL) {
+        virtual_sleep(usec);
+        return;
+    }
+
+    struct timespec ts = { (time_t) (usec / 1000000), (long) (usec % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+// The caller holds 'mutex' from registration until pthread_cond_wait()
+// releases it, and broadcasters hold it too, so no wake-up is missed
+void clock_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+    if (mode == QUIZ_CLOCK_REAL) {
+        pthread_cond_wait(cond, mutex);
+        return;
+    }
+
+    clock_waiter_t waiter;
+    memset(&waiter, 0, sizeof(waiter));
+    waiter.wake_us = UINT64_MAX;
+    waiter.cond = cond;
+
+    pthread_mutex_lock(&vclock.lock);
+    waiter.next = vclock.cond_waiters;
+    vclock.cond_waiters = &waiter;
+    mark_idle(&waiter);
+    advance();
+    pthread_mutex_unlock(&vclock.lock);
+
+    pthread_cond_wait(cond, mutex);
+
+    pthread_mutex_lock(&vclock.lock);
+    mark_busy(&waiter);
+    for (clock_waiter_t** link = &vclock.cond_waiters; *link; link = &(*link)->next) {
+        if (*link == &waiter) {
+            *link = waiter.next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&vclock.lock);
+}
+
+void clock_cond_broadcast(pthread_cond_t* cond) {
+    if (mode == QUIZ_CLOCK_VIRTUAL) {
+        pthread_mutex_lock(&vclock.lock);
+        for (clock_waiter_t* waiter = vclock.cond_waiters; waiter; waiter = waiter->next)
+            if (waiter->cond == cond)
+                mark_busy(waiter);
+        pthread_mutex_unlock(&vclock.lock);
+    }
+    pthread_cond_broadcast(cond);
+}
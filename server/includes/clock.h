@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef enum {
+    QUIZ_CLOCK_REAL,
+    QUIZ_CLOCK_VIRTUAL
+} clock_mode_t;
+
+// Game timing (turn limits, pauses, timestamps) goes through this clock.
+// The virtual clock starts at the real time and only moves when every
+// attached thread is idle, sleeping or waiting on a condition: it then jumps
+// straight to the earliest pending wake-up, so fixed pauses cost nothing.
+// Threads that produce work for attached threads (network clients) are not
+// attached, so under a virtual clock their think time is skipped too.
+// Latency measurements (metrics, traces) stay on real time.
+void clock_init(clock_mode_t mode);
+clock_mode_t clock_mode();
+uint64_t clock_now_us();
+time_t clock_time();
+void clock_sleep_us(uint64_t usec);
+#define clock_sleep(sec) clock_sleep_us((uint64_t) (sec) * 1000000)
+
+// Registers the calling thread as one the virtual clock waits for
+void clock_attach();
+void clock_detach();
+
+// Condition waits count as idle. Wake waiters with clock_cond_broadcast() so
+// the clock knows they are busy again before they get to run.
+void clock_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex);
+void clock_cond_broadcast(pthread_cond_t* cond);
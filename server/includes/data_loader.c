@@ -1,270 +1,175 @@
 #include "data_loader.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "logger.h"
+#include "trace.h"
+#include "clock.h"
+#include "memacct.h"
+#include "matchmaking.h"
 
 extern user_data_t** users;
 extern int user_count;
 extern question_t** questions;
 extern int question_count;
 
-#define Clear   "\033[3;0;0m"
-#define Black   "\033[0;30m"
-#define Red     "\033[0;31m"
-#define Green   "\033[0;32m"
-#define Yellow  "\033[0;33m"
-#define Blue    "\033[0;34m"
-#define Purple  "\033[0;35m"
-#define Cyan    "\033[0;36m"
-#define White   "\033[0;37m"
+// Guards the users array: client threads register users concurrently
+static pthread_mutex_t users_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const XMLBinding user_fields[] = {
+    XML_BIND_STR("@username", user_data_t, username),
+    XML_BIND_INT("stats@points", user_data_t, total_points),
+    XML_BIND_INT("stats@games", user_data_t, games_played),
+    XML_BIND_INT("stats@wins", user_data_t, games_won),
+    XML_BIND_INT("stats@rating", user_data_t, rating),
+    XML_BIND_INT("streaks@max", user_data_t, max_streak),
+    XML_BIND_INT("streaks@current", user_data_t, curr_streak),
+    XML_BIND_STR("last_login", user_data_t, last_login),
+};
+static const XMLSchema user_schema = XML_SCHEMA("users", "user", user_data_t, user_fields);
+
+static const XMLBinding question_fields[] = {
+    XML_BIND_INT("@id", question_t, id),
+    XML_BIND_INT("@points", question_t, points),
+    XML_BIND_INT("@time_limit", question_t, time_limit),
+    XML_BIND_STR("@category", question_t, category),
+    XML_BIND_STR("@difficulty", question_t, difficulty),
+    XML_BIND_STR("text", question_t, text),
+    XML_BIND_STR("options/option[letter=A]", question_t, option_a),
+    XML_BIND_STR("options/option[letter=B]", question_t, option_b),
+    XML_BIND_STR("options/option[letter=C]", question_t, option_c),
+    XML_BIND_STR("options/option[letter=D]", question_t, option_d),
+    XML_BIND_CHAR("correct_answer", question_t, correct_answer),
+};
+static const XMLSchema question_schema = XML_SCHEMA("questions", "question", question_t, question_fields);
+
+static void add_user(void* ctx, const void* record) {
+    (void) ctx;
+    user_data_t* user = mem_malloc(MEM_USERS, sizeof(user_data_t));
+    if (!user) return;
+
+    memcpy(user, record, sizeof(user_data_t));
+    // Saved before ratings existed
+    if (user->rating <= 0)
+        user->rating = MATCH_DEFAULT_RATING;
+    users = mem_realloc(MEM_USERS, users, (user_count + 1) * sizeof(user_data_t*));
+    users[user_count] = user;
+    user_count++;
+}
+
+static void add_question(void* ctx, const void* record) {
+    (void) ctx;
+    question_t* question = mem_malloc(MEM_QUESTIONS, sizeof(question_t));
+    if (!question) return;
+
+    memcpy(question, record, sizeof(question_t));
+    questions = mem_realloc(MEM_QUESTIONS, questions, (question_count + 1) * sizeof(question_t*));
+    questions[question_count] = question;
+    question_count++;
+}
 
 void load_users() {
-    XMLDocument doc;
-    XMLError err = XMLDocument_load(&doc, "data/users.xml");
+    XMLDecoder decoder;
+    XMLError err = XMLDecoder_compile(&decoder, &user_schema);
+    if (err == XML_SUCCESS)
+        err = XMLDecoder_load(&decoder, "data/users.xml", 0, add_user, NULL);
     
     if (err != XML_SUCCESS) {
         if (err == XML_ERROR_FILE) {
-            printf(Yellow"[SERVER-XML] No users.xml found, starting with empty user database...\n"Clear);
+            LOG_WARN("[SERVER-XML] No users.xml found, starting with empty user database...");
+        } else if (err == XML_ERROR_INVALID) {
+            LOG_ERROR("[SERVER-XML] Invalid users.xml format");
         } else {
-            printf(Red"[SERVER-XML] Error loading users.xml: %s\n"Clear, XMLDocument_etos(err));
+            LOG_ERROR("[SERVER-XML] Error loading users.xml: %s", XMLDocument_etos(err));
         }
         return;
     }
 
-    XMLNode* root = XMLNode_child(doc.root, 0);
-    XMLNode* user_node;
-    if (!root || strcmp(root->tag, "users") != 0) {
-        printf(Red"[SERVER-XML] Invalid users.xml format\n"Clear);
-        XMLDocument_free(&doc);
-        return;
-    }
-
-    XML_FOREACH_CHILD(root, user_node) {
-        if (!user_node->tag || strcmp(user_node->tag, "user") != 0)
-            continue;
-        
-        user_data_t* user = malloc(sizeof(user_data_t));
-        if (!user) continue;
-        
-        // Initialize to defaults
-        memset(user, 0, sizeof(user_data_t));
-        
-        // Extract username attribute from user node
-        char* username = XMLNode_attr_val(user_node, "username");
-        if (username) {
-            strncpy(user->username, username, MAX_NAME_LEN - 1);
-            user->username[MAX_NAME_LEN - 1] = '\0';
-        }
-        
-        // Now iterate through child nodes to get stats, streaks, and last_login
-        XMLNode* child_node;
-        XML_FOREACH_CHILD(user_node, child_node) {
-            if (!child_node->tag)
-                continue;
-            
-            if (strcmp(child_node->tag, "stats") == 0) {
-                // Read from stats node attributes
-                char* points = XMLNode_attr_val(child_node, "points");
-                user->total_points = points ? atoi(points) : 0;
-                
-                char* games = XMLNode_attr_val(child_node, "games");
-                user->games_played = games ? atoi(games) : 0;
-                
-                char* wins = XMLNode_attr_val(child_node, "wins");
-                user->games_won = wins ? atoi(wins) : 0;
-                
-            } else if (strcmp(child_node->tag, "streaks") == 0) {
-                // Read from streaks node attributes
-                char* max_streak = XMLNode_attr_val(child_node, "max");
-                user->max_streak = max_streak ? atoi(max_streak) : 0;
-                
-                char* current_streak = XMLNode_attr_val(child_node, "current");
-                user->curr_streak = current_streak ? atoi(current_streak) : 0;
-                
-            } else if (strcmp(child_node->tag, "last_login") == 0) {
-                // Read last_login text content
-                if (child_node->inner_text) {
-                    strncpy(user->last_login, child_node->inner_text, sizeof(user->last_login) - 1);
-                    user->last_login[sizeof(user->last_login) - 1] = '\0';
-                }
-            }
-        }
-        
-        // Add to users array
-        users = realloc(users, (user_count + 1) * sizeof(user_data_t*));
-        users[user_count] = user;
-        user_count++;
-    }
-
-    XMLDocument_free(&doc);
-    printf(Cyan"[SERVER-XML] Loaded %d users from database\n"Clear, user_count);
+    LOG_INFO("[SERVER-XML] Loaded %d users from database", user_count);
 }
 
 void load_questions() {
-    XMLDocument doc;
-    XMLError err = XMLDocument_load(&doc, "data/questions.xml");
+    XMLDecoder decoder;
+    XMLError err = XMLDecoder_compile(&decoder, &question_schema);
+    if (err == XML_SUCCESS)
+        err = XMLDecoder_load(&decoder, "data/questions.xml", 0, add_question, NULL);
     
-    if (err != XML_SUCCESS) {
-        printf(Red"[SERVER-XML] Error - questions.xml not found or invalid: %s\n"Clear, XMLDocument_etos(err));
+    if (err == XML_ERROR_INVALID) {
+        LOG_ERROR("[SERVER-XML] Invalid questions.xml format - expected <questions> as root");
         exit(1);
-    }
-
-    XMLNode* root = XMLNode_child(doc.root, 0);
-    if (!root || !root->tag || strcmp(root->tag, "questions") != 0) {
-        printf(Red"[SERVER-XML] Invalid questions.xml format - expected <questions> as root\n"Clear);
+    } else if (err != XML_SUCCESS) {
+        LOG_ERROR("[SERVER-XML] Error - questions.xml not found or invalid: %s", XMLDocument_etos(err));
         exit(1);
     }
 
-    XMLNode* question_node;
-    XML_FOREACH_CHILD(root, question_node) {
-        if (!question_node->tag || strcmp(question_node->tag, "question") != 0)
-            continue;
-        
-        question_t* question = malloc(sizeof(question_t));
-        if (!question) continue;
+    LOG_INFO("[SERVER-XML] Loaded %d questions", question_count);
+}
 
-        memset(question, 0, sizeof(question_t));
+static void write_user(XMLWriter* writer, const user_data_t* user) {
+    XMLWriter_begin(writer, "user");
+    XMLWriter_attr(writer, "username", user->username);
 
-        char* id_attr = XMLNode_attr_val(question_node, "id");
-        if (id_attr)
-            question->id = atoi(id_attr);
+    XMLWriter_begin(writer, "stats");
+    XMLWriter_attr_int(writer, "points", user->total_points);
+    XMLWriter_attr_int(writer, "games", user->games_played);
+    XMLWriter_attr_int(writer, "wins", user->games_won);
+    XMLWriter_attr_int(writer, "rating", user->rating);
+    XMLWriter_end(writer);
 
-        char* points_attr = XMLNode_attr_val(question_node, "points");
-        if (points_attr)
-            question->points = atoi(points_attr);
+    XMLWriter_begin(writer, "streaks");
+    XMLWriter_attr_int(writer, "max", user->max_streak);
+    XMLWriter_attr_int(writer, "current", user->curr_streak);
+    XMLWriter_end(writer);
 
-        char* time_limit_attr = XMLNode_attr_val(question_node, "time_limit");
-        if (time_limit_attr)
-            question->time_limit = atoi(time_limit_attr);
+    XMLWriter_begin(writer, "last_login");
+    XMLWriter_text(writer, user->last_login);
+    XMLWriter_end(writer);
 
-        char* category_attr = XMLNode_attr_val(question_node, "category");
-        if (category_attr) {
-            strncpy(question->category, category_attr, sizeof(question->category) - 1);
-            question->category[sizeof(question->category) - 1] = '\0';
-        }
+    XMLWriter_end(writer);
+}
 
-        char* difficulty_attr = XMLNode_attr_val(question_node, "difficulty");
-        if (difficulty_attr) {    
-            strncpy(question->difficulty, difficulty_attr, sizeof(question->difficulty) - 1);
-            question->difficulty[sizeof(question->difficulty) - 1] = '\0';
+void save_users() {
+    // Concurrent saves would race on the same temporary file
+    static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+    MUTEX_LOCK(&save_lock);
+    uint64_t span = TRACE_BEGIN();
+    uint64_t start = metrics_now_us();
+
+    // Written from copies a batch at a time, so logins and registrations
+    // don't wait on the disk. Users are only ever appended. Under save_lock.
+    static user_data_t batch[SAVE_USERS_BATCH];
+
+    XMLWriter writer;
+    XMLError err = XMLWriter_open(&writer, "data/users.xml", 2);
+    if (err == XML_SUCCESS) {
+        XMLWriter_declaration(&writer, "1.0", "UTF-8");
+        XMLWriter_begin(&writer, "users");
+
+        for (int done = 0, count = 0; ; done += count) {
+            MUTEX_LOCK_WAIT(&users_lock, &metric_users_lock_wait);
+            count = user_count - done < SAVE_USERS_BATCH ? user_count - done : SAVE_USERS_BATCH;
+            for (int i = 0; i < count; i++)
+                batch[i] = *users[done + i];
+            MUTEX_UNLOCK(&users_lock);
+            if (count == 0)
+                break;
+
+            for (int i = 0; i < count; i++)
+                write_user(&writer, &batch[i]);
         }
 
-        XMLNode* child_node;
-        XML_FOREACH_CHILD(question_node, child_node) {
-            if (!child_node->tag)
-                continue;
-            
-            if (strcmp(child_node->tag, "text") == 0 && child_node->inner_text) {
-                strncpy(question->text, child_node->inner_text, BUFF_SIZE / 4 - 1);
-                question->text[BUFF_SIZE / 4 - 1] = '\0';
-            } else if (strcmp(child_node->tag, "correct_answer") == 0 && child_node->inner_text) {
-                question->correct_answer = child_node->inner_text[0];
-            } else if (strcmp(child_node->tag, "options") == 0) {
-                XMLNode* option_node;
-                XML_FOREACH_CHILD(child_node, option_node) {
-                    if (!option_node->tag || strcmp(option_node->tag, "option") != 0)
-                        continue;
-                    
-                    char* letter_attr = XMLNode_attr_val(option_node, "letter");
-                    if (!letter_attr || !option_node->inner_text)
-                        continue;
-
-                    if (letter_attr[0] == 'A' || letter_attr[0] == 'a') {
-                        strncpy(question->option_a, option_node->inner_text, Q_OPTION_SIZE - 1);
-                        question->option_a[Q_OPTION_SIZE - 1] = '\0';
-                    } else if (letter_attr[0] == 'B' || letter_attr[0] == 'b') {
-                        strncpy(question->option_b, option_node->inner_text, Q_OPTION_SIZE - 1);
-                        question->option_b[Q_OPTION_SIZE - 1] = '\0';
-                    } else if (letter_attr[0] == 'C' || letter_attr[0] == 'c') {
-                        strncpy(question->option_c, option_node->inner_text, Q_OPTION_SIZE - 1);
-                        question->option_c[Q_OPTION_SIZE - 1] = '\0';
-                    } else if (letter_attr[0] == 'D' || letter_attr[0] == 'd') {
-                        strncpy(question->option_d, option_node->inner_text, Q_OPTION_SIZE - 1);
-                        question->option_d[Q_OPTION_SIZE - 1] = '\0';
-                    }
-                }
-            }          
-        }
-        
-        questions = realloc(questions, (question_count + 1) * sizeof(question_t*));
-        questions[question_count] = question;
-        question_count++;
+        XMLWriter_end(&writer);
+        err = XMLWriter_close(&writer);
     }
 
-    XMLDocument_free(&doc);
-    printf(Cyan"[SERVER-XML] Loaded %d questions\n"Clear, question_count);
-}
+    histogram_observe(&metric_save_users_latency, metrics_now_us() - start);
+    trace_end(span, "disk", "save_users", NULL, TRACE_NO_ARG);
+    MUTEX_UNLOCK(&save_lock);
 
-void save_users() {
-    XMLDocument doc;
-    doc.version = strdup("1.0");
-    doc.encoding = strdup("UTF-8");
-    doc.root = XMLNode_new(NULL);
-    doc.root->tag = NULL;
-
-    XMLNode* users_node = XMLNode_new(doc.root);
-    users_node->tag = strdup("users");
-    
-    for (int i = 0; i < user_count; i++) {
-        XMLNode* user_node = XMLNode_new(users_node);
-        user_node->tag = strdup("user");
-        
-        // Add username attribute
-        XMLAttribute attr;
-        attr.key = strdup("username");
-        attr.value = strdup(users[i]->username);
-        XMLAttributeList_add(&user_node->attributes, &attr);
-        
-        // Create stats node
-        XMLNode* stats_node = XMLNode_new(user_node);
-        stats_node->tag = strdup("stats");
-        
-        char buffer[32];
-        
-        snprintf(buffer, sizeof(buffer), "%d", users[i]->total_points);
-        attr.key = strdup("points");
-        attr.value = strdup(buffer);
-        XMLAttributeList_add(&stats_node->attributes, &attr);
-        
-        snprintf(buffer, sizeof(buffer), "%d", users[i]->games_played);
-        attr.key = strdup("games");
-        attr.value = strdup(buffer);
-        XMLAttributeList_add(&stats_node->attributes, &attr);
-        
-        snprintf(buffer, sizeof(buffer), "%d", users[i]->games_won);
-        attr.key = strdup("wins");
-        attr.value = strdup(buffer);
-        XMLAttributeList_add(&stats_node->attributes, &attr);
-        
-        // Create streaks node
-        XMLNode* streaks_node = XMLNode_new(user_node);
-        streaks_node->tag = strdup("streaks");
-        
-        snprintf(buffer, sizeof(buffer), "%d", users[i]->max_streak);
-        attr.key = strdup("max");
-        attr.value = strdup(buffer);
-        XMLAttributeList_add(&streaks_node->attributes, &attr);
-        
-        snprintf(buffer, sizeof(buffer), "%d", users[i]->curr_streak);
-        attr.key = strdup("current");
-        attr.value = strdup(buffer);
-        XMLAttributeList_add(&streaks_node->attributes, &attr);
-        
-        // Create last_login node with text content
-        XMLNode* last_login_node = XMLNode_new(user_node);
-        last_login_node->tag = strdup("last_login");
-        
-        char time_buff[20];
-        strncpy(time_buff, users[i]->last_login, sizeof(time_buff) - 1);
-        time_buff[sizeof(time_buff) - 1] = '\0';
-        last_login_node->inner_text = strdup(time_buff);
-    }
-    
-    bool success = XMLDocument_write(&doc, "data/users.xml", 2);
-    if (!success) {
-        printf(Red"[SERVER-XML] Error saving users to database\n"Clear);
+    if (err != XML_SUCCESS) {
+        LOG_ERROR("[SERVER-XML] Error saving users to database: %s", XMLDocument_etos(err));
     } else {
-        printf(Cyan"[SERVER-XML] Saved users to database\n"Clear);
+        LOG_DEBUG("[SERVER-XML] Saved users to database");
     }
-    
-    XMLDocument_free(&doc);
 }
 
 char* int_to_str(int value) {
@@ -274,15 +179,21 @@ char* int_to_str(int value) {
 }
 
 user_data_t* find_user(const char* username) {
-    for (int i = 0; i < user_count; i++)
-        if (strcmp(users[i]->username, username) == 0)
-            return users[i];
+    user_data_t* user = NULL;
+    MUTEX_LOCK_WAIT(&users_lock, &metric_users_lock_wait);
+    for (int i = 0; i < user_count; i++) {
+        if (strcmp(users[i]->username, username) == 0) {
+            user = users[i];
+            break;
+        }
+    }
+    MUTEX_UNLOCK(&users_lock);
     
-    return NULL;
+    return user;
 }
 
 user_data_t* create_user(const char* username) {
-    user_data_t* user = malloc(sizeof(user_data_t));
+    user_data_t* user = mem_malloc(MEM_USERS, sizeof(user_data_t));
     strncpy(user->username, username, MAX_NAME_LEN - 1);
     user->username[MAX_NAME_LEN - 1] = '\0';
     user->total_points = 0;
@@ -290,12 +201,15 @@ user_data_t* create_user(const char* username) {
     user->games_won = 0;
     user->max_streak = 0;
     user->curr_streak = 0;
+    user->rating = MATCH_DEFAULT_RATING;
     
-    time_t now = time(NULL);
+    time_t now = clock_time();
     strftime(user->last_login, sizeof(user->last_login), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    users = realloc(users, (user_count + 1) * sizeof(user_data_t*));
+    MUTEX_LOCK_WAIT(&users_lock, &metric_users_lock_wait);
+    users = mem_realloc(MEM_USERS, users, (user_count + 1) * sizeof(user_data_t*));
     users[user_count] = user;
     user_count++;
+    MUTEX_UNLOCK(&users_lock);
 
     save_users();
     return user;
@@ -2,6 +2,9 @@
 #include "utils.h"
 #include "libxml.h"
 
+// Users copied per hold of the users lock while save_users() writes them out
+#define SAVE_USERS_BATCH 256
+
 void load_users();
 void load_questions();
 void save_users();
@@ -1,201 +1,348 @@
 #include "libxml.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static XMLAllocator allocator = { malloc, calloc, realloc, free };
+
+void XML_set_allocator(XMLAllocator custom)
+{
+    allocator = custom;
+}
+
+static char* xml_strdup(const char* str)
+{
+    size_t len = strlen(str) + 1;
+    char* copy = (char*) allocator.malloc(len);
+    if (copy)
+        memcpy(copy, str, len);
+    return copy;
+}
 
-bool ends_with(const char* haystack, const char* needle)
+XMLView XMLView_from(const char* str)
 {
-    int h_len = strlen(haystack);
-    int n_len = strlen(needle);
+    XMLView view = { str, str ? strlen(str) : 0 };
+    return view;
+}
 
-    if (h_len < n_len)
+bool XMLView_eq(XMLView view, const char* str)
+{
+    if (!view.ptr || !str)
         return false;
+    return strlen(str) == view.len && !memcmp(view.ptr, str, view.len);
+}
 
-    for (int i = 0; i < n_len; i++) {
-        if (haystack[h_len - n_len + i] != needle[i])
-            return false;
+static size_t utf8_encode(long code, char* out)
+{
+    if (code < 0x80) {
+        out[0] = (char) code;
+        return 1;
+    } else if (code < 0x800) {
+        out[0] = (char) (0xC0 | (code >> 6));
+        out[1] = (char) (0x80 | (code & 0x3F));
+        return 2;
+    } else if (code < 0x10000) {
+        out[0] = (char) (0xE0 | (code >> 12));
+        out[1] = (char) (0x80 | ((code >> 6) & 0x3F));
+        out[2] = (char) (0x80 | (code & 0x3F));
+        return 3;
     }
-
-    return true;
+    out[0] = (char) (0xF0 | (code >> 18));
+    out[1] = (char) (0x80 | ((code >> 12) & 0x3F));
+    out[2] = (char) (0x80 | ((code >> 6) & 0x3F));
+    out[3] = (char) (0x80 | (code & 0x3F));
+    return 4;
 }
 
-void XMLAttribute_free(XMLAttribute* attr)
+// Decodes one entity at p (pointing at '&'). Returns the number of source
+// bytes consumed and writes the decoded bytes to out, or 0 if p is not a
+// known entity or character reference.
+static size_t decode_entity(const char* p, const char* end, char* out, size_t* out_len)
 {
-    if (!attr)
-        return;
-
-    if (attr->key) {
-        free(attr->key);
-        attr->key = NULL;
+    const char* semi = memchr(p, ';', (end - p < 12) ? end - p : 12);
+    if (!semi)
+        return 0;
+
+    const char* name = p + 1;
+    size_t len = semi - name;
+    char c = 0;
+    if (len == 3 && !memcmp(name, "amp", 3))
+        c = '&';
+    else if (len == 2 && !memcmp(name, "lt", 2))
+        c = '<';
+    else if (len == 2 && !memcmp(name, "gt", 2))
+        c = '>';
+    else if (len == 4 && !memcmp(name, "quot", 4))
+        c = '"';
+    else if (len == 4 && !memcmp(name, "apos", 4))
+        c = '\'';
+
+    if (c) {
+        out[0] = c;
+        *out_len = 1;
+        return len + 2;
     }
-    if (attr->value) {
-        free(attr->value);
-        attr->value = NULL;
+
+    if (len < 2 || name[0] != '#')
+        return 0;
+
+    long code = 0;
+    bool hex = (name[1] == 'x');
+    for (const char* d = name + (hex ? 2 : 1); d < semi; d++) {
+        int digit;
+        if (*d >= '0' && *d <= '9')
+            digit = *d - '0';
+        else if (hex && (*d | 0x20) >= 'a' && (*d | 0x20) <= 'f')
+            digit = (*d | 0x20) - 'a' + 10;
+        else
+            return 0;
+        code = code * (hex ? 16 : 10) + digit;
     }
-}
+    if (code <= 0 || code > 0x10FFFF)
+        return 0;
 
-void XMLAttributeList_init(XMLAttributeList* list)
-{
-    list->heap_size = 1;
-    list->size = 0;
-    list->data = (XMLAttribute*) malloc(sizeof(XMLAttribute) * list->heap_size);
+    *out_len = utf8_encode(code, out);
+    return len + 2;
 }
 
-void XMLAttributeList_add(XMLAttributeList* list, XMLAttribute* attr)
+size_t XMLView_copy(XMLView view, char* dst, size_t size)
 {
-    while (list->size >= list->heap_size) {
-        list->heap_size *= 2;
-        list->data = (XMLAttribute*) realloc(list->data, sizeof(XMLAttribute) * list->heap_size);
+    if (size == 0)
+        return 0;
+
+    const char* p = view.ptr;
+    const char* end = view.ptr + view.len;
+    size_t n = 0;
+
+    while (p && p < end) {
+        const char* amp = memchr(p, '&', end - p);
+        size_t run = (amp ? amp : end) - p;
+        if (run > size - 1 - n)
+            run = size - 1 - n;
+        memcpy(dst + n, p, run);
+        n += run;
+        p += run;
+        if (!amp || p != amp)
+            break;
+
+        char decoded[4];
+        size_t decoded_len = 0;
+        size_t consumed = decode_entity(p, end, decoded, &decoded_len);
+        if (!consumed) {
+            // Unknown entity, keep it verbatim
+            decoded[0] = '&';
+            decoded_len = 1;
+            consumed = 1;
+        }
+        if (decoded_len > size - 1 - n)
+            break;
+        memcpy(dst + n, decoded, decoded_len);
+        n += decoded_len;
+        p += consumed;
     }
 
-    list->data[list->size].key = (attr->key) ? strdup(attr->key) : NULL;
-    list->data[list->size].value = (attr->value) ? strdup(attr->value) : NULL;
-    list->size++;
+    dst[n] = '\0';
+    return n;
 }
 
-void XMLNodeList_init(XMLNodeList* list)
+char* XMLView_dup(XMLView view)
 {
-    list->heap_size = 1;
-    list->size = 0;
-    list->data = (XMLNode**) malloc(sizeof(XMLNode*) * list->heap_size);
+    // Decoding never grows the text
+    char* str = (char*) allocator.malloc(view.len + 1);
+    if (str)
+        XMLView_copy(view, str, view.len + 1);
+    return str;
 }
 
-void XMLNodeList_add(XMLNodeList* list, XMLNode* node)
+long XMLView_to_int(XMLView view)
 {
-    while (list->size >= list->heap_size) {
-        list->heap_size *= 2;
-        list->data = (XMLNode**) realloc(list->data, sizeof(XMLNode*) * list->heap_size);
-    }
-
-    list->data[list->size++] = node;
+    const char* p = view.ptr;
+    const char* end = view.ptr + view.len;
+    while (p && p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        p++;
+    if (!p || p >= end)
+        return 0;
+
+    bool negative = (*p == '-');
+    if (*p == '-' || *p == '+')
+        p++;
+
+    long value = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        value = value * 10 + (*p - '0');
+    return negative ? -value : value;
 }
 
-XMLNode* XMLNodeList_at(XMLNodeList* list, int index)
+static void XMLNode_init(XMLNode* node, int parent, int index)
 {
-    return list->data[index];
+    node->tag.ptr = NULL;
+    node->tag.len = 0;
+    node->inner_text.ptr = NULL;
+    node->inner_text.len = 0;
+    node->attr_start = 0;
+    node->attr_count = 0;
+    node->parent = parent;
+    node->first_child = XML_NONE;
+    node->last_child = XML_NONE;
+    node->next_sibling = XML_NONE;
+    node->prev_sibling = XML_NONE;
+    node->subtree_end = index + 1;
 }
 
-void XMLNodeList_free(XMLNodeList* list)
+static int XMLNode_append(XMLDocument* doc, int parent)
 {
-    if (list) {
-        free(list->data);
-        free(list);
+    // Appending anywhere but the open tail would break document order
+    if (parent != XML_NONE && doc->nodes[parent].subtree_end != doc->node_count)
+        return XML_NONE;
+
+    if (doc->node_count >= doc->node_cap) {
+        int cap = doc->node_cap ? doc->node_cap * 2 : 16;
+        XMLNode* nodes = (XMLNode*) allocator.realloc(doc->nodes, sizeof(XMLNode) * cap);
+        if (!nodes)
+            return XML_NONE;
+        doc->nodes = nodes;
+        doc->node_cap = cap;
     }
+
+    int index = doc->node_count++;
+    XMLNode* node = &doc->nodes[index];
+    XMLNode_init(node, parent, index);
+
+    if (parent != XML_NONE) {
+        XMLNode* p = &doc->nodes[parent];
+        if (p->last_child == XML_NONE) {
+            p->first_child = index;
+        } else {
+            doc->nodes[p->last_child].next_sibling = index;
+            node->prev_sibling = p->last_child;
+        }
+        p->last_child = index;
+
+        for (int i = parent; i != XML_NONE; i = doc->nodes[i].parent)
+            doc->nodes[i].subtree_end = index + 1;
+    }
+
+    return index;
 }
 
-XMLNode* XMLNode_new(XMLNode* parent)
+XMLNode* XMLNode_new(XMLDocument* doc, XMLNode* parent)
 {
-    XMLNode* node = (XMLNode*) malloc(sizeof(XMLNode));
-    node->parent = parent;
-    node->tag = NULL;
-    node->inner_text = NULL;
-    
-    XMLAttributeList_init(&node->attributes);
-    XMLNodeList_init(&node->children);
-    
-    if (parent)
-        XMLNodeList_add(&parent->children, node);
-    
-    return node;
+    int index = XMLNode_append(doc, parent ? XMLNode_index(doc, parent) : 0);
+    return XMLNode_at(doc, index);
 }
 
-void XMLNode_free(XMLNode* node)
+static XMLAttribute* XMLDocument_append_attr(XMLDocument* doc)
 {
-    if (!node)
-        return;
-        
-    if (node->tag)
-        free(node->tag);
-    if (node->inner_text)
-        free(node->inner_text);
+    if (doc->attr_count >= doc->attr_cap) {
+        int cap = doc->attr_cap ? doc->attr_cap * 2 : 16;
+        XMLAttribute* attrs = (XMLAttribute*) allocator.realloc(doc->attrs, sizeof(XMLAttribute) * cap);
+        if (!attrs)
+            return NULL;
+        doc->attrs = attrs;
+        doc->attr_cap = cap;
+    }
 
-    for (int i = 0; i < node->attributes.size; i++)
-        XMLAttribute_free(&node->attributes.data[i]);
+    return &doc->attrs[doc->attr_count++];
+}
+
+XMLAttribute* XMLNode_add_attr(XMLDocument* doc, XMLNode* node, XMLView key, XMLView value)
+{
+    // A node's attributes must stay contiguous at the tail of the array
+    if (node->attr_count == 0)
+        node->attr_start = doc->attr_count;
+    else if (node->attr_start + node->attr_count != doc->attr_count)
+        return NULL;
 
-    for (int i = 0; i < node->children.size; i++)
-        XMLNode_free(node->children.data[i]);
+    XMLAttribute* attr = XMLDocument_append_attr(doc);
+    if (!attr)
+        return NULL;
 
-    free(node);
+    attr->key = key;
+    attr->value = value;
+    node->attr_count++;
+    return attr;
 }
 
-XMLNode* XMLNode_child(XMLNode* parent, int index)
+int XMLNode_index(XMLDocument* doc, XMLNode* node)
 {
-    return parent->children.data[index];
+    return node ? (int) (node - doc->nodes) : XML_NONE;
 }
 
-XMLNodeList* XMLNode_children(XMLNode* parent, const char* tag)
+XMLNode* XMLNode_at(XMLDocument* doc, int index)
 {
-    XMLNodeList* list = (XMLNodeList*) malloc(sizeof(XMLNodeList));
-    XMLNodeList_init(list);
+    return (index == XML_NONE) ? NULL : &doc->nodes[index];
+}
 
-    for (int i = 0; i < parent->children.size; i++) {
-        XMLNode* child = parent->children.data[i];
-        if (!strcmp(child->tag, tag))
-            XMLNodeList_add(list, child);
-    }
+XMLNode* XMLNode_parent(XMLDocument* doc, XMLNode* node)
+{
+    return XMLNode_at(doc, node->parent);
+}
 
-    return list;
+XMLNode* XMLNode_child(XMLDocument* doc, XMLNode* parent, int index)
+{
+    XMLNode* child = XMLNode_at(doc, parent->first_child);
+    while (child && index-- > 0)
+        child = XMLNode_at(doc, child->next_sibling);
+    return child;
 }
 
-char* XMLNode_attr_val(XMLNode* node, char* key)
+XMLView XMLNode_attr_val(XMLDocument* doc, XMLNode* node, const char* key)
 {
-    for (int i = 0; i < node->attributes.size; i++) {
-        XMLAttribute attr = node->attributes.data[i];
-        if (!strcmp(attr.key, key))
-            return attr.value;
-    }
-    return NULL;
+    XMLAttribute* attr = XMLNode_attr(doc, node, key);
+    if (attr)
+        return attr->value;
+
+    XMLView none = { NULL, 0 };
+    return none;
 }
 
-XMLAttribute* XMLNode_attr(XMLNode* node, char* key)
+XMLAttribute* XMLNode_attr(XMLDocument* doc, XMLNode* node, const char* key)
 {
-    for (int i = 0; i < node->attributes.size; i++) {
-        XMLAttribute* attr = &node->attributes.data[i];
-        if (!strcmp(attr->key, key))
+    XMLAttribute* attr;
+    XML_FOREACH_ATTR(doc, node, attr) {
+        if (XMLView_eq(attr->key, key))
             return attr;
     }
     return NULL;
 }
 
-XMLNode* XMLNode_first_child(XMLNode* parent, const char* tag) {
-    for (int i = 0; i < parent->children.size; i++) {
-        XMLNode* child = parent->children.data[i];
-        if (!tag || !strcmp(child->tag, tag))
-            return child;
-    }
-
-    return NULL;
+XMLNode* XMLNode_first_child(XMLDocument* doc, XMLNode* parent, const char* tag)
+{
+    XMLNode* child = XMLNode_at(doc, parent->first_child);
+    if (child && tag && !XMLView_eq(child->tag, tag))
+        return XMLNode_next_sibling_tag(doc, child, tag);
+    return child;
 }
 
-XMLNode* XMLNode_next_sibling(XMLNode* node) {
-    if (!node || !node->parent)
-        return NULL;
-
-    XMLNodeList* list = &node->parent->children;
-    for (int i = 0; i < list->size - 1; i++) {
-        if (list->data[i] == node)
-            return list->data[i + 1];
-    }
-
-    return NULL;
+XMLNode* XMLNode_next_sibling(XMLDocument* doc, XMLNode* node)
+{
+    return node ? XMLNode_at(doc, node->next_sibling) : NULL;
 }
 
-XMLNode* XMLNode_prev_sibling(XMLNode* node) {
-    if (!node || !node->parent)
+XMLNode* XMLNode_next_sibling_tag(XMLDocument* doc, XMLNode* node, const char* tag)
+{
+    if (!node)
         return NULL;
 
-    XMLNodeList* list = &node->parent->children;
-    for (int i = list->size - 1; i > 0; i--) {
-        if (list->data[i] == node)
-            return list->data[i - 1];
+    for (int i = node->next_sibling; i != XML_NONE; i = doc->nodes[i].next_sibling) {
+        XMLNode* sibling = &doc->nodes[i];
+        if (!tag || XMLView_eq(sibling->tag, tag))
+            return sibling;
     }
 
     return NULL;
 }
 
-enum _TagType
+XMLNode* XMLNode_prev_sibling(XMLDocument* doc, XMLNode* node)
 {
-    TAG_START,
-    TAG_INLINE
-};
-typedef enum _TagType TagType;
+    return node ? XMLNode_at(doc, node->prev_sibling) : NULL;
+}
 
 const char* XMLDocument_etos(XMLError err) {
     switch (err) {
@@ -208,260 +355,1579 @@ const char* XMLDocument_etos(XMLError err) {
     }
 }
 
-static TagType parse_attrs(char* buf, int* i, char* lex, int* lexi, XMLNode* curr_node)
+void XMLDocument_init(XMLDocument* doc)
 {
-    XMLAttribute curr_attr = {0, 0};
-    while (buf[*i] != '>') {
-        lex[(*lexi)++] = buf[(*i)++];
+    doc->nodes = NULL;
+    doc->node_count = 0;
+    doc->node_cap = 0;
+    doc->attrs = NULL;
+    doc->attr_count = 0;
+    doc->attr_cap = 0;
+    doc->source = NULL;
+    doc->source_size = 0;
+    doc->source_mapped = false;
+    doc->version = NULL;
+    doc->encoding = NULL;
+
+    // Index 0 is the tagless document node holding the top-level elements
+    XMLNode_append(doc, XML_NONE);
+}
 
-        // Tag name
-        if (buf[*i] == ' ' && !curr_node->tag) {
-            lex[*lexi] = '\0';
-            curr_node->tag = strdup(lex);
-            *lexi = 0;
-            (*i)++;
-            continue;
+XMLNode* XMLDocument_root(XMLDocument* doc)
+{
+    return doc->node_count > 0 ? &doc->nodes[0] : NULL;
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool is_name_end(char c)
+{
+    return is_space(c) || c == '/' || c == '>' || c == '=';
+}
+
+static const char* skip_spaces(const char* p, const char* end)
+{
+    while (p < end && is_space(*p))
+        p++;
+    return p;
+}
+
+static const char* find_str(const char* p, const char* end, const char* needle)
+{
+    size_t n = strlen(needle);
+    while (p + n <= end) {
+        const char* hit = memchr(p, needle[0], end - p);
+        if (!hit || hit + n > end)
+            return NULL;
+        if (!memcmp(hit, needle, n))
+            return hit;
+        p = hit + 1;
+    }
+    return NULL;
+}
+
+//
+//  Tokenizer
+//
+
+enum _XMLTokenType
+{
+    XML_TOKEN_EOF,
+    XML_TOKEN_TEXT,
+    XML_TOKEN_START,
+    XML_TOKEN_END,
+    XML_TOKEN_DECLARATION
+};
+typedef enum _XMLTokenType XMLTokenType;
+
+enum _XMLTagEnd
+{
+    XML_TAG_ATTR,
+    XML_TAG_OPEN,
+    XML_TAG_INLINE
+};
+typedef enum _XMLTagEnd XMLTagEnd;
+
+struct _XMLToken
+{
+    XMLTokenType type;
+    XMLView value;
+};
+typedef struct _XMLToken XMLToken;
+
+// Reads the next token at p. Comments, DOCTYPEs, processing instructions and
+// whitespace-only text are skipped. After XML_TOKEN_START and
+// XML_TOKEN_DECLARATION the returned position is inside the tag and
+// read_attr() must be called until the tag ends.
+// Returns the position after the token, or NULL on malformed input.
+static const char* read_token(const char* p, const char* end, XMLToken* tok)
+{
+    while (p < end) {
+        if (*p != '<') {
+            const char* lt = memchr(p, '<', end - p);
+            if (!lt)
+                lt = end;
+
+            // Whitespace between elements is not kept
+            if (skip_spaces(p, lt) == lt) {
+                p = lt;
+                continue;
+            }
+
+            tok->type = XML_TOKEN_TEXT;
+            tok->value.ptr = p;
+            tok->value.len = lt - p;
+            return lt;
         }
 
-        // Usually ignore spaces
-        if (lex[*lexi-1] == ' ') {
-            (*lexi)--;
+        p++;
+        if (p >= end)
+            return NULL;
+
+        // End of node
+        if (*p == '/') {
+            const char* name = p + 1;
+            const char* gt = memchr(name, '>', end - name);
+            if (!gt)
+                return NULL;
+
+            const char* name_end = gt;
+            while (name_end > name && is_space(name_end[-1]))
+                name_end--;
+
+            tok->type = XML_TOKEN_END;
+            tok->value.ptr = name;
+            tok->value.len = name_end - name;
+            return gt + 1;
         }
 
-        // Attribute key
-        if (buf[*i] == '=') {
-            lex[*lexi] = '\0';
-            curr_attr.key = strdup(lex);
-            *lexi = 0;
+        // Special nodes
+        if (*p == '!') {
+            // Comments
+            if (end - p >= 3 && !memcmp(p, "!--", 3)) {
+                const char* close = find_str(p + 3, end, "-->");
+                if (!close)
+                    return NULL;
+                p = close + 3;
+                continue;
+            }
+
+            // DOCTYPE and friends are skipped
+            const char* gt = memchr(p, '>', end - p);
+            if (!gt)
+                return NULL;
+            p = gt + 1;
             continue;
         }
 
-        // Attribute value
-        if (buf[*i] == '"') {
-            if (!curr_attr.key) {
-                fprintf(stderr, "Value has no key\n");
-                return TAG_START;
+        // Declaration tags
+        if (*p == '?') {
+            // This is the XML declaration
+            if (end - p >= 5 && !memcmp(p, "?xml", 4) && is_space(p[4])) {
+                tok->type = XML_TOKEN_DECLARATION;
+                tok->value.ptr = p + 1;
+                tok->value.len = 3;
+                return p + 4;
             }
 
-            *lexi = 0;
-            (*i)++;
-
-            while (buf[*i] != '"')
-                lex[(*lexi)++] = buf[(*i)++];
-            lex[*lexi] = '\0';
-            curr_attr.value = strdup(lex);
-            XMLAttributeList_add(&curr_node->attributes, &curr_attr);
-            curr_attr.key = NULL;
-            curr_attr.value = NULL;
-            *lexi = 0;
-            (*i)++;
+            const char* close = find_str(p, end, "?>");
+            if (!close)
+                return NULL;
+            p = close + 2;
             continue;
         }
 
-        // Inline node
-        if (buf[*i - 1] == '/' && buf[*i] == '>') {
-            lex[*lexi] = '\0';
-            if (!curr_node->tag)
-                curr_node->tag = strdup(lex);
-            (*i)++;
-            return TAG_INLINE;
+        // Start tag
+        const char* name = p;
+        while (p < end && !is_name_end(*p))
+            p++;
+        if (p == name) {
+            fprintf(stderr, "Tag has no name\n");
+            return NULL;
         }
+
+        tok->type = XML_TOKEN_START;
+        tok->value.ptr = name;
+        tok->value.len = p - name;
+        return p;
     }
 
-    return TAG_START;
+    tok->type = XML_TOKEN_EOF;
+    return end;
 }
 
-XMLError XMLDocument_load(XMLDocument* doc, const char* path)
+// Reads one attribute of the current tag into attr (XML_TAG_ATTR), or the
+// end of the tag: '>' (XML_TAG_OPEN) or '/>' and '?>' (XML_TAG_INLINE).
+// Returns the position after what was read, or NULL on malformed input.
+static const char* read_attr(const char* p, const char* end, XMLAttribute* attr, XMLTagEnd* tag_end)
 {
-    FILE* file = fopen(path, "r");
-    if (!file) {
-        fprintf(stderr, "Could not load file from '%s'\n", path);
-        return XML_ERROR_FILE;
+    p = skip_spaces(p, end);
+    if (p >= end)
+        return NULL;
+
+    if (*p == '>') {
+        *tag_end = XML_TAG_OPEN;
+        return p + 1;
+    }
+    if (*p == '/' || *p == '?') {
+        if (p + 1 >= end || p[1] != '>')
+            return NULL;
+        *tag_end = XML_TAG_INLINE;
+        return p + 2;
+    }
+
+    // Attribute key
+    const char* key = p;
+    while (p < end && !is_name_end(*p))
+        p++;
+    size_t key_len = p - key;
+    p = skip_spaces(p, end);
+    if (key_len == 0 || p >= end || *p != '=') {
+        fprintf(stderr, "Value has no key\n");
+        return NULL;
     }
+    p = skip_spaces(p + 1, end);
 
-    fseek(file, 0, SEEK_END);
-    int size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    // Attribute value
+    if (p >= end || (*p != '"' && *p != '\''))
+        return NULL;
+    char quote = *p++;
+    const char* value_end = memchr(p, quote, end - p);
+    if (!value_end)
+        return NULL;
 
-    char* buf = (char*) malloc(sizeof(char) * size + 1);
-    fread(buf, 1, size, file);
-    fclose(file);
-    buf[size] = '\0';
+    attr->key.ptr = key;
+    attr->key.len = key_len;
+    attr->value.ptr = p;
+    attr->value.len = value_end - p;
+    *tag_end = XML_TAG_ATTR;
+    return value_end + 1;
+}
 
-    doc->root = XMLNode_new(NULL);
+// Parses the attributes after a tag name up to and including the end of the
+// tag, appending them to the document's attribute array.
+static const char* parse_attrs(const char* p, const char* end, XMLDocument* doc, int* attr_count, bool* is_inline)
+{
+    XMLAttribute attr;
+    XMLTagEnd tag_end;
+    while ((p = read_attr(p, end, &attr, &tag_end)) && tag_end == XML_TAG_ATTR) {
+        XMLAttribute* slot = XMLDocument_append_attr(doc);
+        if (!slot)
+            return NULL;
+        *slot = attr;
+        (*attr_count)++;
+    }
 
-    char lex[LEXER_BUFF_SIZE];
-    int lexi = 0;
-    int i = 0;
+    *is_inline = (tag_end == XML_TAG_INLINE);
+    return p;
+}
 
-    XMLNode* curr_node = doc->root;
+// Parses buf into doc starting below node *curr_out, leaving the innermost
+// open node in *curr_out so fragments of one document can be parsed in turn.
+static XMLError parse_fragment(XMLDocument* doc, const char* buf, size_t size, int* curr_out)
+{
+    const char* p = buf;
+    const char* end = buf + size;
+    int curr = *curr_out;
+    XMLToken tok;
 
-    while (buf[i] != '\0')
+    while ((p = read_token(p, end, &tok)) && tok.type != XML_TOKEN_EOF)
     {
-        if (buf[i] == '<') {
-            lex[lexi] = '\0';
+        XMLNode* node;
+        bool is_inline;
 
-            // Inner text
-            if (lexi > 0) {
-                if (!curr_node) {
+        switch (tok.type) {
+            case XML_TOKEN_TEXT:
+                if (curr == 0) {
                     fprintf(stderr, "Text outside of document\n");
                     return XML_ERROR_PARSER;
                 }
+                node = &doc->nodes[curr];
+                if (!node->inner_text.ptr)
+                    node->inner_text = tok.value;
+                break;
 
-                curr_node->inner_text = strdup(lex);
-                lexi = 0;
-            }
-
-            // End of node
-            if (buf[i + 1] == '/') {
-                i += 2;
-                while (buf[i] != '>')
-                    lex[lexi++] = buf[i++];
-                lex[lexi] = '\0';
-
-                if (!curr_node) {
+            case XML_TOKEN_END:
+                if (curr == 0) {
                     fprintf(stderr, "Already at the root\n");
                     return XML_ERROR_PARSER;
                 }
 
-                if (strcmp(curr_node->tag, lex)) {
-                    fprintf(stderr, "Mismatched tags (%s != %s)\n", curr_node->tag, lex);
+                node = &doc->nodes[curr];
+                if (node->tag.len != tok.value.len || memcmp(node->tag.ptr, tok.value.ptr, tok.value.len)) {
+                    fprintf(stderr, "Mismatched tags (%.*s != %.*s)\n",
+                            (int) node->tag.len, node->tag.ptr, (int) tok.value.len, tok.value.ptr);
                     return XML_ERROR_PARSER;
                 }
+                curr = node->parent;
+                break;
+
+            case XML_TOKEN_DECLARATION: {
+                XMLNode desc;
+                XMLNode_init(&desc, XML_NONE, 0);
+                desc.attr_start = doc->attr_count;
+                p = parse_attrs(p, end, doc, &desc.attr_count, &is_inline);
+                if (!p)
+                    return XML_ERROR_PARSER;
 
-                curr_node = curr_node->parent;
-                i++;
-                continue;
-            }
+                XMLView version = XMLNode_attr_val(doc, &desc, "version");
+                XMLView encoding = XMLNode_attr_val(doc, &desc, "encoding");
+                allocator.free(doc->version);
+                allocator.free(doc->encoding);
+                doc->version = version.ptr ? XMLView_dup(version) : xml_strdup("1.0");
+                doc->encoding = encoding.ptr ? XMLView_dup(encoding) : xml_strdup("UTF-8");
 
-            // Special nodes
-            if (buf[i + 1] == '!') {
-                while (buf[i] != ' ' && buf[i] != '>')
-                    lex[lexi++] = buf[i++];
-                lex[lexi] = '\0';
-
-                // Comments
-                if (!strcmp(lex, "<!--")) {
-                    lex[lexi] = '\0';
-                    while (!ends_with(lex, "-->")) {
-                        lex[lexi++] = buf[i++];
-                        lex[lexi] = '\0';
-                    }
-                    continue;
-                }
+                // The declaration is not a node, drop its attributes again
+                doc->attr_count = desc.attr_start;
+                break;
             }
 
-            // Declaration tags
-            if (buf[i + 1] == '?') {
-                while (buf[i] != ' ' && buf[i] != '>')
-                    lex[lexi++] = buf[i++];
-                lex[lexi] = '\0';
-
-                // This is the XML declaration
-                if (!strcmp(lex, "<?xml")) {
-                    lexi = 0;
-                    XMLNode* desc = XMLNode_new(NULL);
-                    parse_attrs(buf, &i, lex, &lexi, desc);
-
-                    char* version = XMLNode_attr_val(desc, "version");
-                    char* encoding = XMLNode_attr_val(desc, "encoding");
-                    doc->version = version ? strdup(version) : strdup("1.0");
-                    doc->encoding = encoding ? strdup(encoding) : strdup("UTF-8");
-                    
-                    XMLNode_free(desc);
-                    continue;
-                }
+            case XML_TOKEN_START: {
+                int index = XMLNode_append(doc, curr);
+                if (index == XML_NONE)
+                    return XML_ERROR_MEMORY;
+                node = &doc->nodes[index];
+                node->tag = tok.value;
+                node->attr_start = doc->attr_count;
+
+                p = parse_attrs(p, end, doc, &node->attr_count, &is_inline);
+                if (!p)
+                    return XML_ERROR_PARSER;
+                if (!is_inline)
+                    curr = index;
+                break;
             }
 
-            // Set current node
-            curr_node = XMLNode_new(curr_node);
+            default:
+                break;
+        }
+    }
 
-            // Start tag
-            i++;
-            if (parse_attrs(buf, &i, lex, &lexi, curr_node) == TAG_INLINE) {
-                curr_node = curr_node->parent;
-                i++;
-                continue;
-            }
+    if (!p)
+        return XML_ERROR_PARSER;
+
+    *curr_out = curr;
+    return XML_SUCCESS;
+}
+
+static XMLError parse_buffer(XMLDocument* doc, const char* buf, size_t size)
+{
+    int curr = 0;
+    XMLError err = parse_fragment(doc, buf, size, &curr);
+    if (err != XML_SUCCESS)
+        return err;
+
+    if (curr != 0) {
+        fprintf(stderr, "Unclosed tag (%.*s)\n", (int) doc->nodes[curr].tag.len, doc->nodes[curr].tag.ptr);
+        return XML_ERROR_PARSER;
+    }
+
+    return XML_SUCCESS;
+}
+
+// Attaches the contents of path to doc as its source buffer. Regular files
+// are mapped read-only; anything mmap() refuses is read into the heap.
+static XMLError map_file(XMLDocument* doc, const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Could not load file from '%s'\n", path);
+        return XML_ERROR_FILE;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return XML_ERROR_FILE;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && (uint64_t) st.st_size <= SIZE_MAX) {
+        size_t size = (size_t) st.st_size;
+        void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, size, MADV_SEQUENTIAL);
+            close(fd);
+            doc->source = (const char*) map;
+            doc->source_size = size;
+            doc->source_mapped = true;
+            return XML_SUCCESS;
+        }
+    }
 
-            // Set tag name if none
-            lex[lexi] = '\0';
-            if (!curr_node->tag)
-                curr_node->tag = strdup(lex);
+    size_t size = 0;
+    size_t cap = (S_ISREG(st.st_mode) && st.st_size > 0) ? (size_t) st.st_size : 4096;
+    char* buf = (char*) allocator.malloc(cap);
+    while (buf) {
+        if (size == cap) {
+            char* grown = (char*) allocator.realloc(buf, cap * 2);
+            if (!grown)
+                break;
+            buf = grown;
+            cap *= 2;
+        }
 
-            // Reset lexer
-            lexi = 0;
-            i++;
+        ssize_t n = read(fd, buf + size, cap - size);
+        if (n < 0 && errno == EINTR)
             continue;
+        if (n < 0) {
+            allocator.free(buf);
+            close(fd);
+            return XML_ERROR_FILE;
+        }
+        if (n == 0) {
+            close(fd);
+            doc->source = buf;
+            doc->source_size = size;
+            doc->source_mapped = false;
+            return XML_SUCCESS;
+        }
+        size += n;
+    }
+
+    allocator.free(buf);
+    close(fd);
+    return XML_ERROR_MEMORY;
+}
+
+// Drops every node and attribute but keeps the source buffer.
+static void XMLDocument_reset(XMLDocument* doc)
+{
+    doc->node_count = 0;
+    doc->attr_count = 0;
+    allocator.free(doc->version);
+    allocator.free(doc->encoding);
+    doc->version = NULL;
+    doc->encoding = NULL;
+    XMLNode_append(doc, XML_NONE);
+}
+
+XMLError XMLDocument_load(XMLDocument* doc, const char* path)
+{
+    XMLDocument_init(doc);
+
+    XMLError err = map_file(doc, path);
+    if (err == XML_SUCCESS)
+        err = parse_buffer(doc, doc->source, doc->source_size);
+    if (err != XML_SUCCESS)
+        XMLDocument_free(doc);
+    return err;
+}
+
+//
+//  Parallel loading
+//
+
+struct _XMLChunk
+{
+    const char* start;
+    size_t size;
+    XMLDocument doc;
+    XMLError err;
+};
+typedef struct _XMLChunk XMLChunk;
+
+// Record region of a document, cut into chunks at record start tags.
+// Chunk i spans [bounds[i], bounds[i + 1]).
+struct _XMLSplit
+{
+    const char* records;
+    const char* records_end;
+    XMLView record_tag;
+    const char** bounds;
+    int count;
+};
+typedef struct _XMLSplit XMLSplit;
+
+struct _XMLPool
+{
+    void (*fn)(void* ctx, int index);
+    void* ctx;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+};
+typedef struct _XMLPool XMLPool;
+
+static void* pool_worker(void* arg)
+{
+    XMLPool* pool = (XMLPool*) arg;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        int i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->count)
+            break;
+
+        pool->fn(pool->ctx, i);
+    }
+
+    return NULL;
+}
+
+// Runs fn(ctx, 0..count-1) on up to 'threads' threads, the caller included.
+static void run_pool(int count, int threads, void (*fn)(void* ctx, int index), void* ctx)
+{
+    XMLPool pool = { fn, ctx, count, 0, PTHREAD_MUTEX_INITIALIZER };
+    int workers = (threads < count) ? threads : count;
+    pthread_t* ids = (pthread_t*) allocator.malloc(sizeof(pthread_t) * workers);
+    int started = 0;
+    for (; ids && started < workers - 1; started++) {
+        if (pthread_create(&ids[started], NULL, pool_worker, &pool) != 0)
+            break;
+    }
+    pool_worker(&pool);
+    for (int i = 0; i < started; i++)
+        pthread_join(ids[i], NULL);
+    allocator.free(ids);
+}
+
+// Skips declarations, comments and text up to the next element start tag.
+static const char* next_element(const char* p, const char* end)
+{
+    while ((p = memchr(p, '<', end - p)) && p + 1 < end) {
+        if (p[1] == '?') {
+            p = find_str(p, end, "?>");
+        } else if (end - p >= 4 && !memcmp(p, "<!--", 4)) {
+            p = find_str(p, end, "-->");
+        } else if (p[1] == '!') {
+            p = memchr(p, '>', end - p);
+        } else if (p[1] != '/') {
+            return p;
         } else {
-            lex[lexi++] = buf[i++];
+            return NULL;
+        }
+        if (!p)
+            return NULL;
+        p++;
+    }
+    return NULL;
+}
+
+// Skips a start tag, honouring quoted attribute values.
+static const char* skip_tag(const char* p, const char* end)
+{
+    char quote = 0;
+    for (; p < end; p++) {
+        if (quote) {
+            if (*p == quote)
+                quote = 0;
+        } else if (*p == '"' || *p == '\'') {
+            quote = *p;
+        } else if (*p == '>') {
+            return p + 1;
         }
     }
+    return NULL;
+}
+
+// Finds the next start tag of a record element, i.e. '<' + tag followed by a
+// name terminator. Record tags are assumed not to appear in comments or CDATA;
+// a bad split fails to parse and the caller falls back to a sequential load.
+static const char* find_record(const char* p, const char* end, const char* tag, size_t tag_len)
+{
+    while ((p = memchr(p, '<', end - p)) && p + tag_len + 1 < end) {
+        if (!memcmp(p + 1, tag, tag_len) && is_name_end(p[tag_len + 1]))
+            return p;
+        p++;
+    }
+    return NULL;
+}
+
+static void parse_chunk(void* ctx, int index)
+{
+    XMLChunk* chunk = &((XMLChunk*) ctx)[index];
+    int curr = 0;
+    chunk->err = parse_fragment(&chunk->doc, chunk->start, chunk->size, &curr);
+    if (chunk->err == XML_SUCCESS && curr != 0)
+        chunk->err = XML_ERROR_PARSER;
+}
+
+// Moves the nodes of a chunk under 'parent', which must be the open tail of doc.
+static XMLError merge_chunk(XMLDocument* doc, int parent, XMLDocument* chunk)
+{
+    int moved = chunk->node_count - 1;
+    if (moved <= 0)
+        return XML_SUCCESS;
+
+    if (doc->node_count + moved > doc->node_cap) {
+        int cap = doc->node_cap;
+        while (cap < doc->node_count + moved)
+            cap *= 2;
+        XMLNode* nodes = (XMLNode*) allocator.realloc(doc->nodes, sizeof(XMLNode) * cap);
+        if (!nodes)
+            return XML_ERROR_MEMORY;
+        doc->nodes = nodes;
+        doc->node_cap = cap;
+    }
+
+    for (int i = 0; i < chunk->attr_count; i++) {
+        XMLAttribute* attr = XMLDocument_append_attr(doc);
+        if (!attr)
+            return XML_ERROR_MEMORY;
+        *attr = chunk->attrs[i];
+    }
+    int attr_offset = doc->attr_count - chunk->attr_count;
+
+    // Chunk index i lands at i + offset; index 0 (the chunk's holder) maps to parent
+    int offset = doc->node_count - 1;
+    XMLNode* dst = doc->nodes + doc->node_count;
+    memcpy(dst, chunk->nodes + 1, sizeof(XMLNode) * moved);
+
+    #define XML_REMAP(index) ((index) == XML_NONE ? XML_NONE : ((index) == 0 ? parent : (index) + offset))
+    for (int i = 0; i < moved; i++) {
+        XMLNode* node = &dst[i];
+        node->parent = XML_REMAP(node->parent);
+        node->first_child = XML_REMAP(node->first_child);
+        node->last_child = XML_REMAP(node->last_child);
+        node->next_sibling = XML_REMAP(node->next_sibling);
+        node->prev_sibling = XML_REMAP(node->prev_sibling);
+        node->subtree_end += offset;
+        node->attr_start += attr_offset;
+    }
+
+    // Stitch the chunk's top-level nodes onto the parent's child list
+    XMLNode* p = &doc->nodes[parent];
+    int first = XML_REMAP(chunk->nodes[0].first_child);
+    int last = XML_REMAP(chunk->nodes[0].last_child);
+    #undef XML_REMAP
+    if (p->last_child == XML_NONE) {
+        p->first_child = first;
+    } else {
+        doc->nodes[p->last_child].next_sibling = first;
+        doc->nodes[first].prev_sibling = p->last_child;
+    }
+    p->last_child = last;
+
+    doc->node_count += moved;
+    for (int i = parent; i != XML_NONE; i = doc->nodes[i].parent)
+        doc->nodes[i].subtree_end = doc->node_count;
+
+    return XML_SUCCESS;
+}
 
+static XMLError split_records(const char* buf, size_t size, int threads, XMLSplit* split)
+{
+    const char* end = buf + size;
+
+    // Locate the root element and its first record
+    const char* root = next_element(buf, end);
+    if (!root)
+        return XML_ERROR_PARSER;
+    const char* root_name = root + 1;
+    const char* root_name_end = root_name;
+    while (root_name_end < end && !is_name_end(*root_name_end))
+        root_name_end++;
+
+    const char* body = skip_tag(root, end);
+    if (!body || body[-2] == '/')
+        return XML_ERROR_INVALID;
+
+    const char* first = next_element(body, end);
+    if (!first)
+        return XML_ERROR_INVALID;
+    const char* tag = first + 1;
+    size_t tag_len = 0;
+    while (tag + tag_len < end && !is_name_end(tag[tag_len]))
+        tag_len++;
+
+    // Records end where the root closes; "</root" must not just be the start
+    // of a longer name
+    size_t root_len = root_name_end - root_name;
+    const char* records_end = NULL;
+    for (const char* p = end - root_len - 3; p >= first; p--) {
+        if (p[0] == '<' && p[1] == '/' && !memcmp(p + 2, root_name, root_len) &&
+            (is_space(p[root_len + 2]) || p[root_len + 2] == '>')) {
+            records_end = p;
+            break;
+        }
+    }
+    if (!records_end)
+        return XML_ERROR_PARSER;
+
+    // Several chunks per thread so uneven records still balance out
+    int max_chunks = threads * 4;
+    size_t span = (records_end - first) / max_chunks + 1;
+    split->bounds = (const char**) allocator.malloc(sizeof(const char*) * (max_chunks + 1));
+    if (!split->bounds)
+        return XML_ERROR_MEMORY;
+
+    split->records = first;
+    split->records_end = records_end;
+    split->record_tag.ptr = tag;
+    split->record_tag.len = tag_len;
+    split->count = 0;
+
+    const char* start = first;
+    while (start < records_end) {
+        const char* target = start + span;
+        const char* next = (target < records_end) ? find_record(target, records_end, tag, tag_len) : NULL;
+        if (!next || split->count == max_chunks - 1)
+            next = records_end;
+
+        split->bounds[split->count++] = start;
+        start = next;
+    }
+    split->bounds[split->count] = records_end;
     return XML_SUCCESS;
 }
 
-static void node_out(FILE* file, XMLNode* node, int indent, int times)
+static XMLError parse_parallel(XMLDocument* doc, const char* buf, size_t size, int threads)
 {
-    for (int i = 0; i < node->children.size; i++) {
-        XMLNode* child = node->children.data[i];
+    XMLSplit split;
+    XMLError err = split_records(buf, size, threads, &split);
+    if (err != XML_SUCCESS)
+        return err;
+
+    // Prolog and root start tag
+    int curr = 0;
+    err = parse_fragment(doc, buf, split.records - buf, &curr);
+    if (err == XML_SUCCESS && curr == 0)
+        err = XML_ERROR_PARSER;
+
+    XMLChunk* chunks = (err == XML_SUCCESS) ? (XMLChunk*) allocator.calloc(split.count, sizeof(XMLChunk)) : NULL;
+    if (!chunks) {
+        allocator.free(split.bounds);
+        return (err == XML_SUCCESS) ? XML_ERROR_MEMORY : err;
+    }
 
-        if (times > 0)
-            fprintf(file, "%0*s", indent * times, " ");
-        
-        fprintf(file, "<%s", child->tag);
-        for (int i = 0; i < child->attributes.size; i++) {
-            XMLAttribute attr = child->attributes.data[i];
-            if (!attr.value || !strcmp(attr.value, ""))
-                continue;
-            fprintf(file, " %s=\"%s\"", attr.key, attr.value);
-        }
-
-        if (child->children.size == 0 && !child->inner_text)
-            fprintf(file, " />\n");
-        else {
-            fprintf(file, ">");
-            if (child->children.size == 0)
-                fprintf(file, "%s</%s>\n", child->inner_text, child->tag);
-            else {
-                fprintf(file, "\n");
-                node_out(file, child, indent, times + 1);
-                if (times > 0)
-                    fprintf(file, "%0*s", indent * times, " ");
-                fprintf(file, "</%s>\n", child->tag);
+    for (int i = 0; i < split.count; i++) {
+        chunks[i].start = split.bounds[i];
+        chunks[i].size = split.bounds[i + 1] - split.bounds[i];
+        XMLDocument_init(&chunks[i].doc);
+    }
+    run_pool(split.count, threads, parse_chunk, chunks);
+
+    // Merge in source order so the result matches a sequential parse
+    for (int i = 0; i < split.count; i++) {
+        if (err == XML_SUCCESS)
+            err = chunks[i].err;
+        if (err == XML_SUCCESS)
+            err = merge_chunk(doc, curr, &chunks[i].doc);
+        XMLDocument_free(&chunks[i].doc);
+    }
+    allocator.free(chunks);
+    allocator.free(split.bounds);
+    if (err != XML_SUCCESS)
+        return err;
+
+    // Root end tag and anything after it
+    err = parse_fragment(doc, split.records_end, buf + size - split.records_end, &curr);
+    if (err == XML_SUCCESS && curr != 0)
+        err = XML_ERROR_PARSER;
+    return err;
+}
+
+XMLError XMLDocument_load_parallel(XMLDocument* doc, const char* path, int threads)
+{
+    if (threads <= 0)
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    XMLDocument_init(doc);
+    XMLError err = map_file(doc, path);
+    if (err != XML_SUCCESS) {
+        XMLDocument_free(doc);
+        return err;
+    }
+
+    err = XML_ERROR_INVALID;
+    if (threads > 1 && doc->source_size >= XML_PARALLEL_MIN_SIZE) {
+        err = parse_parallel(doc, doc->source, doc->source_size, threads);
+        if (err != XML_SUCCESS)
+            XMLDocument_reset(doc);
+    }
+
+    // Small files, non record-oriented layouts and bad splits parse sequentially
+    if (err != XML_SUCCESS)
+        err = parse_buffer(doc, doc->source, doc->source_size);
+    if (err != XML_SUCCESS)
+        XMLDocument_free(doc);
+    return err;
+}
+
+//
+//  Schema binding
+//
+
+#define XML_STATE_SKIP -1
+#define XML_STATE_DOCUMENT 0
+#define XML_STATE_ROOT 1
+#define XML_STATE_RECORD 2
+
+static unsigned tag_slot(const char* tag, size_t len)
+{
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char) tag[i]) * 16777619u;
+    return hash & (XML_DECODER_SLOTS - 1);
+}
+
+static bool view_eq(XMLView a, XMLView b)
+{
+    return a.len == b.len && !memcmp(a.ptr, b.ptr, a.len);
+}
+
+static bool view_eq_nocase(XMLView a, XMLView b)
+{
+    return a.len == b.len && !strncasecmp(a.ptr, b.ptr, a.len);
+}
+
+static int add_state(XMLDecoder* decoder, int parent, XMLView tag, XMLView pred_key, XMLView pred_value)
+{
+    // Reuse an existing transition for the same step
+    XMLDecoderState* from = &decoder->states[parent];
+    unsigned slot = tag_slot(tag.ptr, tag.len);
+    for (int i = from->jump[slot]; i != XML_NONE; i = decoder->states[i].next_in_slot) {
+        XMLDecoderState* state = &decoder->states[i];
+        if (view_eq(state->tag, tag) && view_eq(state->pred_key, pred_key) && view_eq(state->pred_value, pred_value))
+            return i;
+    }
+
+    if (decoder->state_count >= XML_DECODER_MAX_STATES)
+        return XML_NONE;
+
+    int index = decoder->state_count++;
+    XMLDecoderState* state = &decoder->states[index];
+    state->tag = tag;
+    state->pred_key = pred_key;
+    state->pred_value = pred_value;
+    state->text_field = XML_NONE;
+    state->first_attr_field = XML_NONE;
+    for (int i = 0; i < XML_DECODER_SLOTS; i++)
+        state->jump[i] = XML_NONE;
+
+    // Predicated steps are chained ahead of the plain one so they win
+    from = &decoder->states[parent];
+    if (pred_key.len || from->jump[slot] == XML_NONE) {
+        state->next_in_slot = from->jump[slot];
+        from->jump[slot] = index;
+    } else {
+        int last = from->jump[slot];
+        while (decoder->states[last].next_in_slot != XML_NONE)
+            last = decoder->states[last].next_in_slot;
+        state->next_in_slot = XML_NONE;
+        decoder->states[last].next_in_slot = index;
+    }
+    return index;
+}
+
+static XMLError compile_binding(XMLDecoder* decoder, int field)
+{
+    const XMLBinding* binding = &decoder->schema->fields[field];
+    if (binding->type == XML_FIELD_INT && binding->size != sizeof(int) && binding->size != sizeof(long))
+        return XML_ERROR_INVALID;
+
+    const char* p = binding->path;
+    const char* end = p + strlen(p);
+    int state = XML_STATE_RECORD;
+    XMLView none = { NULL, 0 };
+
+    while (p < end && *p != '@') {
+        const char* step = p;
+        while (p < end && *p != '/' && *p != '@' && *p != '[')
+            p++;
+        XMLView tag = { step, (size_t) (p - step) };
+        XMLView pred_key = none;
+        XMLView pred_value = none;
+
+        // Attribute selector, "[key=value]"
+        if (p < end && *p == '[') {
+            const char* eq = memchr(p, '=', end - p);
+            const char* close = memchr(p, ']', end - p);
+            if (!eq || !close || eq > close)
+                return XML_ERROR_INVALID;
+            pred_key.ptr = p + 1;
+            pred_key.len = eq - p - 1;
+            pred_value.ptr = eq + 1;
+            pred_value.len = close - eq - 1;
+            p = close + 1;
+        }
+        if (!tag.len)
+            return XML_ERROR_INVALID;
+
+        state = add_state(decoder, state, tag, pred_key, pred_value);
+        if (state == XML_NONE)
+            return XML_ERROR_MEMORY;
+        if (p < end && *p == '/')
+            p++;
+    }
+
+    XMLDecoderState* target = &decoder->states[state];
+    if (p < end) {
+        decoder->attr_names[field].ptr = p + 1;
+        decoder->attr_names[field].len = end - p - 1;
+        decoder->next_attr_field[field] = target->first_attr_field;
+        target->first_attr_field = field;
+    } else {
+        if (target->text_field != XML_NONE)
+            return XML_ERROR_INVALID;
+        target->text_field = field;
+    }
+    return XML_SUCCESS;
+}
+
+XMLError XMLDecoder_compile(XMLDecoder* decoder, const XMLSchema* schema)
+{
+    if (schema->field_count > XML_DECODER_MAX_FIELDS)
+        return XML_ERROR_MEMORY;
+
+    XMLView none = { NULL, 0 };
+    decoder->schema = schema;
+    decoder->state_count = 1;
+    decoder->states[XML_STATE_DOCUMENT].text_field = XML_NONE;
+    decoder->states[XML_STATE_DOCUMENT].first_attr_field = XML_NONE;
+    for (int i = 0; i < XML_DECODER_SLOTS; i++)
+        decoder->states[XML_STATE_DOCUMENT].jump[i] = XML_NONE;
+
+    add_state(decoder, XML_STATE_DOCUMENT, XMLView_from(schema->root), none, none);
+    add_state(decoder, XML_STATE_ROOT, XMLView_from(schema->record), none, none);
+
+    for (int i = 0; i < schema->field_count; i++) {
+        XMLError err = compile_binding(decoder, i);
+        if (err != XML_SUCCESS)
+            return err;
+    }
+    return XML_SUCCESS;
+}
+
+static void store_field(const XMLBinding* binding, char* record, XMLView value)
+{
+    char* dst = record + binding->offset;
+    char c[8];
+
+    switch (binding->type) {
+        case XML_FIELD_INT:
+            // Sizes checked by XMLDecoder_compile()
+            if (binding->size == sizeof(long))
+                *(long*) dst = XMLView_to_int(value);
+            else
+                *(int*) dst = (int) XMLView_to_int(value);
+            break;
+        case XML_FIELD_STR:
+            XMLView_copy(value, dst, binding->size);
+            break;
+        case XML_FIELD_CHAR:
+            XMLView_copy(value, c, sizeof(c));
+            *dst = c[0];
+            break;
+    }
+}
+
+struct _XMLRecordBuffer
+{
+    char* data;
+    size_t count;
+    size_t cap;
+};
+typedef struct _XMLRecordBuffer XMLRecordBuffer;
+
+struct _XMLDecodeRun
+{
+    const XMLDecoder* decoder;
+    char* record;
+    int states[XML_DECODER_MAX_DEPTH];
+    XMLView tags[XML_DECODER_MAX_DEPTH];
+    bool has_text[XML_DECODER_MAX_DEPTH];
+    int depth;
+    bool root_seen;
+    XMLRecordFn on_record;
+    void* ctx;
+    XMLRecordBuffer* out;
+};
+typedef struct _XMLDecodeRun XMLDecodeRun;
+
+static bool emit_record(XMLDecodeRun* run)
+{
+    size_t size = run->decoder->schema->record_size;
+    if (!run->out) {
+        run->on_record(run->ctx, run->record);
+        return true;
+    }
+
+    XMLRecordBuffer* out = run->out;
+    if (out->count >= out->cap) {
+        size_t cap = out->cap ? out->cap * 2 : 64;
+        char* data = (char*) allocator.realloc(out->data, cap * size);
+        if (!data)
+            return false;
+        out->data = data;
+        out->cap = cap;
+    }
+    memcpy(out->data + out->count * size, run->record, size);
+    out->count++;
+    return true;
+}
+
+static int next_state(const XMLDecoder* decoder, int parent, XMLView tag, XMLAttribute* attrs, int attr_count)
+{
+    if (parent == XML_STATE_SKIP)
+        return XML_STATE_SKIP;
+
+    const XMLDecoderState* from = &decoder->states[parent];
+    for (int i = from->jump[tag_slot(tag.ptr, tag.len)]; i != XML_NONE; i = decoder->states[i].next_in_slot) {
+        const XMLDecoderState* state = &decoder->states[i];
+        if (!view_eq(state->tag, tag))
+            continue;
+        if (!state->pred_key.len)
+            return i;
+
+        for (int j = 0; j < attr_count; j++) {
+            if (view_eq(attrs[j].key, state->pred_key) && view_eq_nocase(attrs[j].value, state->pred_value))
+                return i;
+        }
+    }
+    return XML_STATE_SKIP;
+}
+
+static XMLError decode_fragment(XMLDecodeRun* run, const char* buf, size_t size)
+{
+    const XMLDecoder* decoder = run->decoder;
+    const XMLBinding* fields = decoder->schema->fields;
+    const char* p = buf;
+    const char* end = buf + size;
+    XMLToken tok;
+
+    while ((p = read_token(p, end, &tok)) && tok.type != XML_TOKEN_EOF) {
+        int top = run->states[run->depth - 1];
+
+        if (tok.type == XML_TOKEN_TEXT) {
+            if (top == XML_STATE_DOCUMENT)
+                return XML_ERROR_PARSER;
+            // The first run of text wins, as in the DOM's inner_text
+            if (top != XML_STATE_SKIP && decoder->states[top].text_field != XML_NONE && !run->has_text[run->depth - 1])
+                store_field(&fields[decoder->states[top].text_field], run->record, tok.value);
+            run->has_text[run->depth - 1] = true;
+            continue;
+        }
+
+        if (tok.type == XML_TOKEN_END) {
+            if (run->depth <= 1 || !view_eq(run->tags[run->depth - 1], tok.value))
+                return XML_ERROR_PARSER;
+            run->depth--;
+            if (top == XML_STATE_RECORD && !emit_record(run))
+                return XML_ERROR_MEMORY;
+            continue;
+        }
+
+        // Start tags and the declaration: collect attributes first, since
+        // selectors need them before the target state is known
+        XMLAttribute attrs[XML_DECODER_MAX_ATTRS];
+        XMLAttribute attr;
+        XMLTagEnd tag_end;
+        int attr_count = 0;
+        while ((p = read_attr(p, end, &attr, &tag_end)) && tag_end == XML_TAG_ATTR) {
+            if (attr_count < XML_DECODER_MAX_ATTRS)
+                attrs[attr_count++] = attr;
+        }
+        if (!p)
+            return XML_ERROR_PARSER;
+        if (tok.type == XML_TOKEN_DECLARATION)
+            continue;
+
+        int state = next_state(decoder, top, tok.value, attrs, attr_count);
+        if (top == XML_STATE_DOCUMENT) {
+            if (state != XML_STATE_ROOT)
+                return XML_ERROR_INVALID;
+            run->root_seen = true;
+        }
+        if (state == XML_STATE_RECORD)
+            memset(run->record, 0, decoder->schema->record_size);
+
+        if (state != XML_STATE_SKIP) {
+            for (int f = decoder->states[state].first_attr_field; f != XML_NONE; f = decoder->next_attr_field[f]) {
+                for (int j = 0; j < attr_count; j++) {
+                    if (view_eq(attrs[j].key, decoder->attr_names[f])) {
+                        store_field(&fields[f], run->record, attrs[j].value);
+                        break;
+                    }
+                }
             }
         }
+
+        if (tag_end == XML_TAG_INLINE) {
+            if (state == XML_STATE_RECORD && !emit_record(run))
+                return XML_ERROR_MEMORY;
+            continue;
+        }
+
+        if (run->depth >= XML_DECODER_MAX_DEPTH)
+            return XML_ERROR_PARSER;
+        run->states[run->depth] = state;
+        run->tags[run->depth] = tok.value;
+        run->has_text[run->depth] = false;
+        run->depth++;
+    }
+
+    return p ? XML_SUCCESS : XML_ERROR_PARSER;
+}
+
+static void decode_run_init(XMLDecodeRun* run, const XMLDecoder* decoder, int state, char* record)
+{
+    memset(run, 0, sizeof(XMLDecodeRun));
+    run->decoder = decoder;
+    run->record = record;
+    run->states[0] = state;
+    run->depth = 1;
+}
+
+struct _XMLDecodeChunk
+{
+    const XMLDecoder* decoder;
+    const char* start;
+    size_t size;
+    XMLRecordBuffer records;
+    XMLError err;
+};
+typedef struct _XMLDecodeChunk XMLDecodeChunk;
+
+static void decode_chunk(void* ctx, int index)
+{
+    XMLDecodeChunk* chunk = &((XMLDecodeChunk*) ctx)[index];
+    char* record = (char*) allocator.malloc(chunk->decoder->schema->record_size);
+    if (!record) {
+        chunk->err = XML_ERROR_MEMORY;
+        return;
+    }
+
+    XMLDecodeRun run;
+    decode_run_init(&run, chunk->decoder, XML_STATE_ROOT, record);
+    run.out = &chunk->records;
+    chunk->err = decode_fragment(&run, chunk->start, chunk->size);
+    if (chunk->err == XML_SUCCESS && run.depth != 1)
+        chunk->err = XML_ERROR_PARSER;
+    allocator.free(record);
+}
+
+// Returns XML_ERROR_INVALID without having handed out any record when the
+// document cannot be split, so the caller can decode it sequentially.
+static XMLError decode_parallel(XMLDecodeRun* run, const char* buf, size_t size, int threads)
+{
+    XMLSplit split;
+    if (split_records(buf, size, threads, &split) != XML_SUCCESS)
+        return XML_ERROR_INVALID;
+
+    // Prolog and root start tag
+    XMLError err = XML_ERROR_INVALID;
+    XMLDecodeChunk* chunks = NULL;
+    if (XMLView_eq(split.record_tag, run->decoder->schema->record) &&
+        decode_fragment(run, buf, split.records - buf) == XML_SUCCESS &&
+        run->depth == 2 && run->states[1] == XML_STATE_ROOT)
+        chunks = (XMLDecodeChunk*) allocator.calloc(split.count, sizeof(XMLDecodeChunk));
+
+    if (chunks) {
+        for (int i = 0; i < split.count; i++) {
+            chunks[i].decoder = run->decoder;
+            chunks[i].start = split.bounds[i];
+            chunks[i].size = split.bounds[i + 1] - split.bounds[i];
+        }
+        run_pool(split.count, threads, decode_chunk, chunks);
+
+        err = XML_SUCCESS;
+        for (int i = 0; i < split.count && err == XML_SUCCESS; i++)
+            err = chunks[i].err;
+
+        // Hand records over in source order, only once every chunk decoded
+        size_t record_size = run->decoder->schema->record_size;
+        for (int i = 0; i < split.count; i++) {
+            for (size_t j = 0; err == XML_SUCCESS && j < chunks[i].records.count; j++)
+                run->on_record(run->ctx, chunks[i].records.data + j * record_size);
+            allocator.free(chunks[i].records.data);
+        }
+        allocator.free(chunks);
+    }
+
+    if (err != XML_SUCCESS) {
+        allocator.free(split.bounds);
+        run->root_seen = false;
+        return XML_ERROR_INVALID;
+    }
+
+    // Root end tag and anything after it
+    err = decode_fragment(run, split.records_end, buf + size - split.records_end);
+    allocator.free(split.bounds);
+    return (err == XML_ERROR_INVALID) ? XML_ERROR_PARSER : err;
+}
+
+XMLError XMLDecoder_load(const XMLDecoder* decoder, const char* path, int threads, XMLRecordFn on_record, void* ctx)
+{
+    if (threads <= 0)
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    // The document only owns the mapping, no nodes are built
+    XMLDocument source;
+    XMLDocument_init(&source);
+    XMLError err = map_file(&source, path);
+
+    char* record = (char*) allocator.malloc(decoder->schema->record_size);
+    if (err == XML_SUCCESS && !record)
+        err = XML_ERROR_MEMORY;
+
+    XMLDecodeRun run;
+    if (err == XML_SUCCESS) {
+        decode_run_init(&run, decoder, XML_STATE_DOCUMENT, record);
+        run.on_record = on_record;
+        run.ctx = ctx;
+
+        // A failed split is only safe to retry if no record was handed out
+        err = XML_ERROR_INVALID;
+        if (threads > 1 && source.source_size >= XML_PARALLEL_MIN_SIZE)
+            err = decode_parallel(&run, source.source, source.source_size, threads);
+
+        if (err == XML_ERROR_INVALID && !run.root_seen) {
+            decode_run_init(&run, decoder, XML_STATE_DOCUMENT, record);
+            run.on_record = on_record;
+            run.ctx = ctx;
+            err = decode_fragment(&run, source.source, source.source_size);
+        }
+        if (err == XML_SUCCESS && !run.root_seen)
+            err = XML_ERROR_INVALID;
+        if (err == XML_SUCCESS && run.depth != 1)
+            err = XML_ERROR_PARSER;
+    }
+
+    allocator.free(record);
+    XMLDocument_free(&source);
+    return err;
+}
+
+static void writer_begin(XMLWriter* writer, XMLView tag);
+static void writer_attr(XMLWriter* writer, XMLView key, XMLView value, bool escape);
+static void writer_text(XMLWriter* writer, XMLView text, bool escape);
+
+static void node_out(XMLWriter* writer, XMLDocument* doc, XMLNode* node)
+{
+    XMLNode* child;
+    XML_FOREACH_CHILD(doc, node, child) {
+        writer_begin(writer, child->tag);
+
+        XMLAttribute* attr;
+        XML_FOREACH_ATTR(doc, child, attr) {
+            if (!attr->value.len)
+                continue;
+            writer_attr(writer, attr->key, attr->value, false);
+        }
+
+        if (child->first_child == XML_NONE) {
+            if (child->inner_text.ptr)
+                writer_text(writer, child->inner_text, false);
+        } else {
+            node_out(writer, doc, child);
+        }
+        XMLWriter_end(writer);
     }
 }
 
 bool XMLDocument_write(XMLDocument* doc, const char* path, int indent)
 {
-    FILE* file = fopen(path, "w");
-    if (!file) {
-        fprintf(stderr, "Could not open file '%s'\n", path);
+    XMLWriter writer;
+    if (XMLWriter_open(&writer, path, indent) != XML_SUCCESS)
         return false;
-    }
 
-    fprintf(
-        file, "<?xml version=\"%s\" encoding=\"%s\" ?>\n",
-        (doc->version) ? doc->version : "1.0",
-        (doc->encoding) ? doc->encoding : "UTF-8"
-    );
-    node_out(file, doc->root, indent, 0);
-    fclose(file);
-    return true;
+    XMLWriter_declaration(&writer, doc->version, doc->encoding);
+    node_out(&writer, doc, XMLDocument_root(doc));
+    return XMLWriter_close(&writer) == XML_SUCCESS;
 }
 
 void XMLDocument_free(XMLDocument* doc)
 {
     if (!doc)
         return;
-    
-    if (doc->root)
-        XMLNode_free(doc->root);
+
+    allocator.free(doc->nodes);
+    allocator.free(doc->attrs);
+    doc->nodes = NULL;
+    doc->attrs = NULL;
+    doc->node_count = doc->node_cap = 0;
+    doc->attr_count = doc->attr_cap = 0;
+
+    if (doc->source_mapped)
+        munmap((void*) doc->source, doc->source_size);
+    else
+        allocator.free((void*) doc->source);
+    doc->source = NULL;
+    doc->source_size = 0;
+    doc->source_mapped = false;
 
     if (doc->encoding)
-        free(doc->encoding);
+        allocator.free(doc->encoding);
     if (doc->version)
-        free(doc->version);
-}
\ No newline at end of file
+        allocator.free(doc->version);
+    doc->encoding = NULL;
+    doc->version = NULL;
+}
+
+static bool write_all(int fd, struct iovec* iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+static void writer_flush(XMLWriter* writer, const char* extra, size_t extra_len)
+{
+    if (writer->err != XML_SUCCESS) {
+        writer->len = 0;
+        return;
+    }
+
+    struct iovec iov[2] = {
+        { writer->buf, writer->len },
+        { (void*) extra, extra_len }
+    };
+    if (!write_all(writer->fd, iov, extra_len ? 2 : 1))
+        writer->err = XML_ERROR_FILE;
+    writer->len = 0;
+}
+
+static void writer_put(XMLWriter* writer, const char* data, size_t len)
+{
+    if (writer->len + len <= XML_WRITER_BUFF_SIZE) {
+        memcpy(writer->buf + writer->len, data, len);
+        writer->len += len;
+        return;
+    }
+
+    // Large runs skip the copy and go out together with the buffer
+    if (len >= XML_WRITER_BUFF_SIZE / 2) {
+        writer_flush(writer, data, len);
+        return;
+    }
+
+    writer_flush(writer, NULL, 0);
+    memcpy(writer->buf, data, len);
+    writer->len = len;
+}
+
+static void writer_putc(XMLWriter* writer, char c)
+{
+    if (writer->len >= XML_WRITER_BUFF_SIZE)
+        writer_flush(writer, NULL, 0);
+    writer->buf[writer->len++] = c;
+}
+
+static void writer_puts(XMLWriter* writer, const char* s)
+{
+    writer_put(writer, s, strlen(s));
+}
+
+static void writer_indent(XMLWriter* writer)
+{
+    for (int i = writer->indent * writer->depth; i > 0; i--)
+        writer_putc(writer, ' ');
+}
+
+static void writer_escaped(XMLWriter* writer, XMLView view, const char* special)
+{
+    const char* s = view.ptr;
+    const char* end = view.ptr + view.len;
+    while (s < end) {
+        const char* run = s;
+        while (run < end && !strchr(special, *run))
+            run++;
+        writer_put(writer, s, run - s);
+        s = run;
+        if (s >= end)
+            break;
+
+        switch (*s) {
+            case '&': writer_put(writer, "&amp;", 5); break;
+            case '<': writer_put(writer, "&lt;", 4); break;
+            case '>': writer_put(writer, "&gt;", 4); break;
+            case '"': writer_put(writer, "&quot;", 6); break;
+            case '\'': writer_put(writer, "&apos;", 6); break;
+        }
+        s++;
+    }
+}
+
+static void writer_close_start_tag(XMLWriter* writer)
+{
+    if (writer->tag_open) {
+        writer_puts(writer, ">\n");
+        writer->tag_open = false;
+    }
+}
+
+XMLError XMLWriter_open(XMLWriter* writer, const char* path, int indent)
+{
+    memset(writer, 0, sizeof(XMLWriter));
+    writer->fd = -1;
+    writer->indent = indent;
+
+    size_t path_len = strlen(path);
+    writer->path = xml_strdup(path);
+    writer->tmp_path = (char*) allocator.malloc(path_len + 5);
+    writer->buf = (char*) allocator.malloc(XML_WRITER_BUFF_SIZE);
+    if (!writer->path || !writer->tmp_path || !writer->buf) {
+        XMLWriter_close(writer);
+        return XML_ERROR_MEMORY;
+    }
+    memcpy(writer->tmp_path, path, path_len);
+    memcpy(writer->tmp_path + path_len, ".tmp", 5);
+
+    writer->fd = open(writer->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->fd < 0) {
+        fprintf(stderr, "Could not open file '%s'\n", writer->tmp_path);
+        writer->err = XML_ERROR_FILE;
+        return XMLWriter_close(writer);
+    }
+
+    return XML_SUCCESS;
+}
+
+void XMLWriter_declaration(XMLWriter* writer, const char* version, const char* encoding)
+{
+    writer_puts(writer, "<?xml version=\"");
+    writer_escaped(writer, XMLView_from(version ? version : "1.0"), "&<>\"");
+    writer_puts(writer, "\" encoding=\"");
+    writer_escaped(writer, XMLView_from(encoding ? encoding : "UTF-8"), "&<>\"");
+    writer_puts(writer, "\" ?>\n");
+}
+
+static void writer_begin(XMLWriter* writer, XMLView tag)
+{
+    if (writer->depth >= XML_WRITER_MAX_DEPTH) {
+        writer->err = XML_ERROR_INVALID;
+        return;
+    }
+
+    writer_close_start_tag(writer);
+    writer_indent(writer);
+    writer_putc(writer, '<');
+    writer_put(writer, tag.ptr, tag.len);
+
+    writer->stack[writer->depth++] = tag;
+    writer->tag_open = true;
+    writer->has_text = false;
+}
+
+static void writer_attr(XMLWriter* writer, XMLView key, XMLView value, bool escape)
+{
+    if (!writer->tag_open) {
+        writer->err = XML_ERROR_INVALID;
+        return;
+    }
+
+    writer_putc(writer, ' ');
+    writer_put(writer, key.ptr, key.len);
+    writer_put(writer, "=\"", 2);
+    if (escape)
+        writer_escaped(writer, value, "&<>\"'");
+    else
+        writer_put(writer, value.ptr, value.len);
+    writer_putc(writer, '"');
+}
+
+static void writer_text(XMLWriter* writer, XMLView text, bool escape)
+{
+    if (writer->depth == 0) {
+        writer->err = XML_ERROR_INVALID;
+        return;
+    }
+
+    if (writer->tag_open) {
+        writer_putc(writer, '>');
+        writer->tag_open = false;
+    }
+    if (escape)
+        writer_escaped(writer, text, "&<>");
+    else
+        writer_put(writer, text.ptr, text.len);
+    writer->has_text = true;
+}
+
+void XMLWriter_begin(XMLWriter* writer, const char* tag)
+{
+    writer_begin(writer, XMLView_from(tag));
+}
+
+void XMLWriter_attr(XMLWriter* writer, const char* key, const char* value)
+{
+    writer_attr(writer, XMLView_from(key), XMLView_from(value), true);
+}
+
+void XMLWriter_attr_int(XMLWriter* writer, const char* key, long value)
+{
+    static const char digit_pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    *--p = '\0';
+
+    unsigned long v = (value < 0) ? 0UL - (unsigned long) value : (unsigned long) value;
+    while (v >= 100) {
+        unsigned long pair = (v % 100) * 2;
+        v /= 100;
+        *--p = digit_pairs[pair + 1];
+        *--p = digit_pairs[pair];
+    }
+    if (v >= 10) {
+        *--p = digit_pairs[v * 2 + 1];
+        *--p = digit_pairs[v * 2];
+    } else {
+        *--p = (char) ('0' + v);
+    }
+    if (value < 0)
+        *--p = '-';
+
+    XMLWriter_attr(writer, key, p);
+}
+
+void XMLWriter_text(XMLWriter* writer, const char* text)
+{
+    writer_text(writer, XMLView_from(text), true);
+}
+
+void XMLWriter_end(XMLWriter* writer)
+{
+    if (writer->depth == 0) {
+        writer->err = XML_ERROR_INVALID;
+        return;
+    }
+
+    XMLView tag = writer->stack[--writer->depth];
+    if (writer->tag_open) {
+        writer_puts(writer, " />\n");
+        writer->tag_open = false;
+        return;
+    }
+
+    if (!writer->has_text)
+        writer_indent(writer);
+    writer_put(writer, "</", 2);
+    writer_put(writer, tag.ptr, tag.len);
+    writer_put(writer, ">\n", 2);
+    writer->has_text = false;
+}
+
+XMLError XMLWriter_close(XMLWriter* writer)
+{
+    if (writer->depth != 0 && writer->err == XML_SUCCESS)
+        writer->err = XML_ERROR_INVALID;
+
+    if (writer->fd >= 0) {
+        if (writer->len > 0)
+            writer_flush(writer, NULL, 0);
+        // The data must be on disk before the rename makes it the only copy
+        if (writer->err == XML_SUCCESS && fsync(writer->fd) < 0)
+            writer->err = XML_ERROR_FILE;
+        if (close(writer->fd) < 0 && writer->err == XML_SUCCESS)
+            writer->err = XML_ERROR_FILE;
+
+        if (writer->err == XML_SUCCESS && rename(writer->tmp_path, writer->path) < 0)
+            writer->err = XML_ERROR_FILE;
+        if (writer->err != XML_SUCCESS)
+            unlink(writer->tmp_path);
+        writer->fd = -1;
+    }
+
+    allocator.free(writer->path);
+    allocator.free(writer->tmp_path);
+    allocator.free(writer->buf);
+    writer->path = NULL;
+    writer->tmp_path = NULL;
+    writer->buf = NULL;
+    return writer->err;
+}
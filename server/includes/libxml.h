@@ -5,74 +5,117 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
 
-#define LEXER_BUFF_SIZE 4096
+#define XML_NONE -1
+#define XML_WRITER_BUFF_SIZE (64 * 1024)
+#define XML_WRITER_MAX_DEPTH 64
+#define XML_PARALLEL_MIN_SIZE (1024 * 1024)
+#define XML_DECODER_MAX_STATES 64
+#define XML_DECODER_MAX_FIELDS 64
+#define XML_DECODER_SLOTS 16
+#define XML_DECODER_MAX_DEPTH 64
+#define XML_DECODER_MAX_ATTRS 16
 
 //
-//  Definitions
+//  Allocation
 //
 
-struct _XMLAttribute
+// All of the library's heap memory, including strings from XMLView_dup(),
+// comes from these. The defaults are the libc functions; replace them before
+// any other call.
+struct _XMLAllocator
 {
-    char* key;
-    char* value;
+    void* (*malloc)(size_t size);
+    void* (*calloc)(size_t count, size_t size);
+    void* (*realloc)(void* ptr, size_t size);
+    void (*free)(void* ptr);
 };
-typedef struct _XMLAttribute XMLAttribute;
+typedef struct _XMLAllocator XMLAllocator;
 
-void XMLAttribute_free(XMLAttribute* attr);
+void XML_set_allocator(XMLAllocator allocator);
 
-struct _XMLAttributeList
+//
+//  Definitions
+//
+
+// A view is a (pointer, length) slice, not NUL-terminated. Views into a
+// loaded document point straight at the source bytes, so text and attribute
+// values are still entity-encoded: use XMLView_copy()/XMLView_dup() to decode.
+struct _XMLView
 {
-    int heap_size;
-    int size;
-    XMLAttribute* data;
+    const char* ptr;
+    size_t len;
 };
-typedef struct _XMLAttributeList XMLAttributeList;
+typedef struct _XMLView XMLView;
 
-void XMLAttributeList_init(XMLAttributeList* list);
-void XMLAttributeList_add(XMLAttributeList* list, XMLAttribute* attr);
+XMLView XMLView_from(const char* str);
+bool XMLView_eq(XMLView view, const char* str);
+size_t XMLView_copy(XMLView view, char* dst, size_t size);
+char* XMLView_dup(XMLView view);
+long XMLView_to_int(XMLView view);
 
-struct _XMLNodeList
+struct _XMLAttribute
 {
-    int heap_size;
-    int size;
-    struct _XMLNode** data;
+    XMLView key;
+    XMLView value;
 };
-typedef struct _XMLNodeList XMLNodeList;
-
-void XMLNodeList_init(XMLNodeList* list);
-void XMLNodeList_add(XMLNodeList* list, struct _XMLNode* node);
-struct _XMLNode* XMLNodeList_at(XMLNodeList* list, int index);
-void XMLNodeList_free(XMLNodeList* list);
+typedef struct _XMLAttribute XMLAttribute;
 
+// Nodes live in one contiguous array owned by the document, in document order.
+// Links are indices into that array (XML_NONE when absent), and the descendants
+// of a node are exactly the nodes in [index + 1, subtree_end). Attributes of a
+// node are the slice [attr_start, attr_start + attr_count) of the document's
+// attribute array.
 struct _XMLNode
 {
-    char* tag;
-    char* inner_text;
-    struct _XMLNode* parent;
-    XMLAttributeList attributes;
-    XMLNodeList children;
+    XMLView tag;
+    XMLView inner_text;
+    int attr_start;
+    int attr_count;
+    int parent;
+    int first_child;
+    int last_child;
+    int next_sibling;
+    int prev_sibling;
+    int subtree_end;
 };
 typedef struct _XMLNode XMLNode;
 
-XMLNode* XMLNode_new(XMLNode* parent);
-void XMLNode_free(XMLNode* node);
-XMLNode* XMLNode_child(XMLNode* parent, int index);
-XMLNodeList* XMLNode_children(XMLNode* parent, const char* tag);
-char* XMLNode_attr_val(XMLNode* node, char* key);
-XMLAttribute* XMLNode_attr(XMLNode* node, char* key);
-XMLNode* XMLNode_first_child(XMLNode* parent, const char* tag);
-XMLNode* XMLNode_next_sibling(XMLNode* node);
-XMLNode* XMLNode_prev_sibling(XMLNode* node);
-
 struct _XMLDocument
 {
-    XMLNode* root;
+    XMLNode* nodes;
+    int node_count;
+    int node_cap;
+    XMLAttribute* attrs;
+    int attr_count;
+    int attr_cap;
+    const char* source;
+    size_t source_size;
+    bool source_mapped;
     char* version;
     char* encoding;
 };
 typedef struct _XMLDocument XMLDocument;
 
+// XMLNode_new() appends in document order: parent must be the most recently
+// added node or one of its ancestors. Node pointers stay valid until the next
+// XMLNode_new() on the same document; keep indices across insertions.
+// Attributes can only be added to the most recently added node, and views
+// passed to a built document must outlive it.
+XMLNode* XMLNode_new(XMLDocument* doc, XMLNode* parent);
+XMLAttribute* XMLNode_add_attr(XMLDocument* doc, XMLNode* node, XMLView key, XMLView value);
+int XMLNode_index(XMLDocument* doc, XMLNode* node);
+XMLNode* XMLNode_at(XMLDocument* doc, int index);
+XMLNode* XMLNode_parent(XMLDocument* doc, XMLNode* node);
+XMLNode* XMLNode_child(XMLDocument* doc, XMLNode* parent, int index);
+XMLView XMLNode_attr_val(XMLDocument* doc, XMLNode* node, const char* key);
+XMLAttribute* XMLNode_attr(XMLDocument* doc, XMLNode* node, const char* key);
+XMLNode* XMLNode_first_child(XMLDocument* doc, XMLNode* parent, const char* tag);
+XMLNode* XMLNode_next_sibling(XMLDocument* doc, XMLNode* node);
+XMLNode* XMLNode_next_sibling_tag(XMLDocument* doc, XMLNode* node, const char* tag);
+XMLNode* XMLNode_prev_sibling(XMLDocument* doc, XMLNode* node);
+
 enum _XMLError {
     XML_SUCCESS = 0,
     XML_ERROR_FILE,
@@ -82,20 +125,147 @@ enum _XMLError {
 };
 typedef enum _XMLError XMLError;
 
+void XMLDocument_init(XMLDocument* doc);
+XMLNode* XMLDocument_root(XMLDocument* doc);
 const char* XMLDocument_etos(XMLError err);
+// Loading maps the file read-only and parses it in place: the document keeps
+// the mapping alive and all views point into it until XMLDocument_free().
 XMLError XMLDocument_load(XMLDocument* doc, const char* path);
+// Splits record-oriented documents (a root holding many sibling elements) at
+// record boundaries and parses the pieces on 'threads' threads (0 = one per
+// core). The result is identical to XMLDocument_load().
+XMLError XMLDocument_load_parallel(XMLDocument* doc, const char* path, int threads);
 bool XMLDocument_write(XMLDocument* doc, const char* path, int indent);
 void XMLDocument_free(XMLDocument* doc);
 
+// Streaming writer: output goes through one buffer flushed with write()/writev()
+// into '<path>.tmp', which is renamed over 'path' by a successful close, so
+// readers never see a half-written file. Tag names must outlive their element.
+// Strings passed to the writer are escaped; views from a document are raw.
+struct _XMLWriter
+{
+    int fd;
+    char* path;
+    char* tmp_path;
+    char* buf;
+    size_t len;
+    int indent;
+    int depth;
+    bool tag_open;
+    bool has_text;
+    XMLView stack[XML_WRITER_MAX_DEPTH];
+    XMLError err;
+};
+typedef struct _XMLWriter XMLWriter;
+
+XMLError XMLWriter_open(XMLWriter* writer, const char* path, int indent);
+void XMLWriter_declaration(XMLWriter* writer, const char* version, const char* encoding);
+void XMLWriter_begin(XMLWriter* writer, const char* tag);
+void XMLWriter_attr(XMLWriter* writer, const char* key, const char* value);
+void XMLWriter_attr_int(XMLWriter* writer, const char* key, long value);
+void XMLWriter_text(XMLWriter* writer, const char* text);
+void XMLWriter_end(XMLWriter* writer);
+XMLError XMLWriter_close(XMLWriter* writer);
+
+//
+//  Schema binding
+//
+
+enum _XMLFieldType
+{
+    XML_FIELD_INT,
+    XML_FIELD_STR,
+    XML_FIELD_CHAR
+};
+typedef enum _XMLFieldType XMLFieldType;
+
+// Binds a value inside a record element to a struct field. Paths are relative
+// to the record: "@key" is an attribute of the record itself, "a/b" the text
+// of a nested element, "a/b@key" one of its attributes, and a step can select
+// among same-named siblings by attribute with "b[key=value]" (the value
+// is matched ignoring ASCII case).
+struct _XMLBinding
+{
+    const char* path;
+    XMLFieldType type;
+    size_t offset;
+    size_t size;
+};
+typedef struct _XMLBinding XMLBinding;
+
+// Documents are a 'root' element holding 'record' elements, each decoded
+// into a zeroed struct of record_size bytes.
+struct _XMLSchema
+{
+    const char* root;
+    const char* record;
+    size_t record_size;
+    const XMLBinding* fields;
+    int field_count;
+};
+typedef struct _XMLSchema XMLSchema;
+
+struct _XMLDecoderState
+{
+    XMLView tag;
+    XMLView pred_key;
+    XMLView pred_value;
+    int next_in_slot;
+    int text_field;
+    int first_attr_field;
+    int jump[XML_DECODER_SLOTS];
+};
+typedef struct _XMLDecoderState XMLDecoderState;
+
+// A schema compiled into a state machine: each state has a jump table from
+// tag hash to child states, and lists of the fields its attributes and text
+// feed. Compile once, then decode straight from the source bytes, no DOM.
+struct _XMLDecoder
+{
+    const XMLSchema* schema;
+    XMLDecoderState states[XML_DECODER_MAX_STATES];
+    int state_count;
+    XMLView attr_names[XML_DECODER_MAX_FIELDS];
+    int next_attr_field[XML_DECODER_MAX_FIELDS];
+};
+typedef struct _XMLDecoder XMLDecoder;
+
+typedef void (*XMLRecordFn)(void* ctx, const void* record);
+
+// XML_ERROR_INVALID for a malformed path, a second text binding on one
+// element, or an XML_FIELD_INT that is neither an int nor a long
+XMLError XMLDecoder_compile(XMLDecoder* decoder, const XMLSchema* schema);
+// Calls on_record for every record in document order. Large files are split
+// and decoded on 'threads' threads like XMLDocument_load_parallel().
+XMLError XMLDecoder_load(const XMLDecoder* decoder, const char* path, int threads, XMLRecordFn on_record, void* ctx);
+
 
 //
 //  Macros
 //
-#define XML_FOREACH_CHILD(parent, child) \
-    for (int _i = 0; _i < (parent)->children.size && ((child) = (parent)->children.data[_i]); _i++)
+#define XML_FOREACH_NODE(doc, node) \
+    for ((node) = (doc)->nodes; (node) < (doc)->nodes + (doc)->node_count; (node)++)
+
+#define XML_FOREACH_DESCENDANT(doc, parent, node) \
+    for ((node) = (parent) + 1; (node) < (doc)->nodes + (parent)->subtree_end; (node)++)
+
+#define XML_FOREACH_CHILD(doc, parent, child) \
+    for ((child) = XMLNode_at((doc), (parent)->first_child); (child); (child) = XMLNode_at((doc), (child)->next_sibling))
+
+#define XML_FOREACH_CHILD_TAG(doc, parent, tag, child) \
+    for ((child) = XMLNode_first_child((doc), (parent), (tag)); (child); (child) = XMLNode_next_sibling_tag((doc), (child), (tag)))
+
+#define XML_BIND(path, type, record_t, field) \
+    { (path), (type), offsetof(record_t, field), sizeof(((record_t*) 0)->field) }
+#define XML_BIND_INT(path, record_t, field) XML_BIND(path, XML_FIELD_INT, record_t, field)
+#define XML_BIND_STR(path, record_t, field) XML_BIND(path, XML_FIELD_STR, record_t, field)
+#define XML_BIND_CHAR(path, record_t, field) XML_BIND(path, XML_FIELD_CHAR, record_t, field)
+
+#define XML_SCHEMA(root, record, record_t, fields) \
+    { (root), (record), sizeof(record_t), (fields), (int) (sizeof(fields) / sizeof((fields)[0])) }
 
-#define XML_FOREACH_ATTR(node, attr) \
-    for (int _j = 0; _j < (node)->attributes.size && ((attr) = &(node)->attributes.data[_j]); _j++)
+#define XML_FOREACH_ATTR(doc, node, attr) \
+    for ((attr) = (doc)->attrs + (node)->attr_start; (attr) < (doc)->attrs + (node)->attr_start + (node)->attr_count; (attr)++)
 
 
-#endif
\ No newline at end of file
+#endif
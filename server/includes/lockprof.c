@@ -0,0 +1,209 @@
+#include "lockprof.h"
+#include "logger.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef LOCK_PROFILE
+
+typedef struct {
+    pthread_mutex_t* mutex;
+    lock_site_t* site;
+    uint64_t acquired_at;
+} held_lock_t;
+
+static _Atomic(lock_site_t*) sites = NULL;
+static __thread held_lock_t held[LOCKPROF_MAX_HELD];
+static __thread int held_count = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void update_max(atomic_uint_fast64_t* max, uint64_t value) {
+    uint64_t curr = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > curr && !atomic_compare_exchange_weak_explicit(max, &curr, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+static void register_site(lock_site_t* site) {
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&site->registered, &expected, true))
+        return;
+
+    lock_site_t* head = atomic_load(&sites);
+    do {
+        site->next = head;
+    } while (!atomic_compare_exchange_weak(&sites, &head, site));
+}
+
+void lockprof_lock(pthread_mutex_t* mutex, lock_site_t* site, metric_histogram_t* wait) {
+    if (!atomic_load_explicit(&site->registered, memory_order_acquire))
+        register_site(site);
+
+    uint64_t wait_ns = 0;
+    if (pthread_mutex_trylock(mutex) != 0) {
+        uint64_t start = now_ns();
+        pthread_mutex_lock(mutex);
+        wait_ns = now_ns() - start;
+        if (trace_enabled())
+            trace_end(start, "lock", "lock wait", site->mutex, TRACE_NO_ARG);
+
+        atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&site->wait_total_ns, wait_ns, memory_order_relaxed);
+        update_max(&site->wait_max_ns, wait_ns);
+    }
+    atomic_fetch_add_explicit(&site->acquisitions, 1, memory_order_relaxed);
+    if (wait)
+        histogram_observe(wait, wait_ns / 1000);
+
+    if (held_count < LOCKPROF_MAX_HELD) {
+        held[held_count].mutex = mutex;
+        held[held_count].site = site;
+        held[held_count].acquired_at = now_ns();
+        held_count++;
+    }
+}
+
+static held_lock_t* find_held(pthread_mutex_t* mutex) {
+    for (int i = held_count - 1; i >= 0; i--)
+        if (held[i].mutex == mutex)
+            return &held[i];
+    return NULL;
+}
+
+static void charge_hold(held_lock_t* entry, uint64_t now) {
+    uint64_t hold_ns = now - entry->acquired_at;
+    atomic_fetch_add_explicit(&entry->site->hold_total_ns, hold_ns, memory_order_relaxed);
+    update_max(&entry->site->hold_max_ns, hold_ns);
+}
+
+void lockprof_unlock(pthread_mutex_t* mutex) {
+    held_lock_t* entry = find_held(mutex);
+    if (entry) {
+        charge_hold(entry, now_ns());
+        int index = entry - held;
+        memmove(&held[index], &held[index + 1], (held_count - index - 1) * sizeof(held_lock_t));
+        held_count--;
+    }
+    pthread_mutex_unlock(mutex);
+}
+
+// Time spent blocked on the condition isn't hold time
+void lockprof_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+    held_lock_t* entry = find_held(mutex);
+    if (entry)
+        charge_hold(entry, now_ns());
+
+    clock_cond_wait(cond, mutex);
+
+    entry = find_held(mutex);
+    if (entry)
+        entry->acquired_at = now_ns();
+}
+
+void lockprof_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline) {
+    held_lock_t* entry = find_held(mutex);
+    if (entry)
+        charge_hold(entry, now_ns());
+
+    if (deadline)
+        pthread_cond_timedwait(cond, mutex, deadline);
+    else
+        pthread_cond_wait(cond, mutex);
+
+    entry = find_held(mutex);
+    if (entry)
+        entry->acquired_at = now_ns();
+}
+
+static int compare_wait(const void* a, const void* b) {
+    uint64_t x = atomic_load(&(*(lock_site_t* const*) a)->wait_total_ns);
+    uint64_t y = atomic_load(&(*(lock_site_t* const*) b)->wait_total_ns);
+    return (x < y) - (x > y);
+}
+
+void lockprof_dump(const char* path) {
+    FILE* out = path ? fopen(path, "w") : stdout;
+    if (!out) {
+        LOG_ERROR("[LOCKPROF] Error - cannot write %s", path);
+        out = stdout;
+    }
+
+    int count = 0;
+    for (lock_site_t* site = atomic_load(&sites); site; site = site->next)
+        count++;
+
+    lock_site_t** sorted = malloc(count * sizeof(lock_site_t*));
+    int i = 0;
+    for (lock_site_t* site = atomic_load(&sites); site && i < count; site = site->next)
+        sorted[i++] = site;
+    qsort(sorted, i, sizeof(lock_site_t*), compare_wait);
+
+    fprintf(out, "%-28s %-40s %12s %12s %9s %14s %12s %14s %12s\n",
+            "mutex", "site", "acquired", "contended", "cont_%", "wait_total_us", "wait_max_us", "hold_total_us", "hold_max_us");
+    for (int j = 0; j < i; j++) {
+        lock_site_t* site = sorted[j];
+        uint64_t acquisitions = atomic_load(&site->acquisitions);
+        uint64_t contended = atomic_load(&site->contended);
+        char where[256];
+        snprintf(where, sizeof(where), "%s:%d %s()", site->file, site->line, site->func);
+        fprintf(out, "%-28s %-40s %12llu %12llu %8.2f%% %14.1f %12.1f %14.1f %12.1f\n",
+                site->mutex, where, (unsigned long long) acquisitions, (unsigned long long) contended,
+                acquisitions ? 100.0 * contended / acquisitions : 0.0,
+                atomic_load(&site->wait_total_ns) / 1000.0, atomic_load(&site->wait_max_ns) / 1000.0,
+                atomic_load(&site->hold_total_ns) / 1000.0, atomic_load(&site->hold_max_ns) / 1000.0);
+    }
+    free(sorted);
+
+    if (out != stdout) {
+        fclose(out);
+        LOG_INFO("[LOCKPROF] Lock profile written to %s", path);
+    } else {
+        fflush(out);
+    }
+}
+
+static void dump_at_exit() {
+    lockprof_dump(LOCKPROF_DUMP_PATH);
+}
+
+void lockprof_start() {
+    atexit(dump_at_exit);
+    LOG_INFO("[LOCKPROF] Lock profiling on: kill -USR1 %d to dump to %s", (int) getpid(), LOCKPROF_DUMP_PATH);
+}
+
+#else
+
+void lockprof_lock(pthread_mutex_t* mutex, lock_site_t* site, metric_histogram_t* wait) {
+    (void) site;
+    metrics_lock(mutex, wait);
+}
+
+void lockprof_unlock(pthread_mutex_t* mutex) {
+    pthread_mutex_unlock(mutex);
+}
+
+void lockprof_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+    clock_cond_wait(cond, mutex);
+}
+
+void lockprof_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline) {
+    if (deadline)
+        pthread_cond_timedwait(cond, mutex, deadline);
+    else
+        pthread_cond_wait(cond, mutex);
+}
+
+void lockprof_dump(const char* path) {
+    (void) path;
+}
+
+void lockprof_start() {
+}
+
+#endif
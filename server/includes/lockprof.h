@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "metrics.h"
+#include "clock.h"
+
+#define LOCKPROF_MAX_HELD 16
+#define LOCKPROF_DUMP_PATH "build/logs/lockprof.txt"
+
+// Statistics for one MUTEX_LOCK() call site, linked into a global list the
+// first time the site is reached. Hold time is charged to the site that
+// acquired the mutex.
+typedef struct _lock_site_t {
+    const char* mutex;
+    const char* file;
+    const char* func;
+    int line;
+    atomic_bool registered;
+    struct _lock_site_t* next;
+    atomic_uint_fast64_t acquisitions;
+    atomic_uint_fast64_t contended;
+    atomic_uint_fast64_t wait_total_ns;
+    atomic_uint_fast64_t wait_max_ns;
+    atomic_uint_fast64_t hold_total_ns;
+    atomic_uint_fast64_t hold_max_ns;
+} lock_site_t;
+
+// Built with -DLOCK_PROFILE (make LOCK_PROFILE=1) every lock goes through the
+// profiler; otherwise these are plain pthread calls, plus the contended-wait
+// histogram for locks that export one. Condition waits go through the game
+// clock so a virtual clock sees them as idle.
+#ifdef LOCK_PROFILE
+#define MUTEX_LOCK_WAIT(lock, wait) do { \
+        static lock_site_t lock_site_ = { .mutex = #lock, .file = __FILE__, .func = __func__, .line = __LINE__ }; \
+        lockprof_lock((lock), &lock_site_, (wait)); \
+    } while (0)
+#define MUTEX_UNLOCK(mutex) lockprof_unlock(mutex)
+#define MUTEX_COND_WAIT(cond, mutex) lockprof_cond_wait((cond), (mutex))
+#define MUTEX_COND_TIMEDWAIT(cond, mutex, deadline) lockprof_cond_timedwait((cond), (mutex), (deadline))
+#else
+#define MUTEX_LOCK_WAIT(mutex, wait) metrics_lock((mutex), (wait))
+#define MUTEX_UNLOCK(mutex) pthread_mutex_unlock(mutex)
+#define MUTEX_COND_WAIT(cond, mutex) clock_cond_wait((cond), (mutex))
+#define MUTEX_COND_TIMEDWAIT(cond, mutex, deadline) lockprof_cond_timedwait((cond), (mutex), (deadline))
+#endif
+#define MUTEX_LOCK(lock) MUTEX_LOCK_WAIT(lock, NULL)
+#define MUTEX_COND_BROADCAST(cond) clock_cond_broadcast(cond)
+
+void lockprof_lock(pthread_mutex_t* mutex, lock_site_t* site, metric_histogram_t* wait);
+void lockprof_unlock(pthread_mutex_t* mutex);
+void lockprof_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex);
+// Real time, for threads the game clock doesn't wait for; a NULL deadline waits until woken
+void lockprof_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline);
+// Writes per-site statistics, sorted by total wait, to 'path' (stdout if NULL)
+void lockprof_dump(const char* path);
+// Without LOCK_PROFILE these do nothing. With it, the profile is dumped to
+// LOCKPROF_DUMP_PATH at exit (the server also dumps on SIGUSR1).
+void lockprof_start();
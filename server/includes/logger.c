@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+#include "logger.h"
+#include "memacct.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define Clear   "\033[3;0;0m"
+#define Red     "\033[0;31m"
+#define Yellow  "\033[0;33m"
+#define Blue    "\033[0;34m"
+#define Cyan    "\033[0;36m"
+
+#define LOG_MSG_SIZE (LOG_SLOT_SIZE - sizeof(log_record_t))
+#define LOG_WRITE_BUFF_SIZE (64 * 1024)
+
+typedef struct {
+    log_record_t header;
+    char msg[LOG_MSG_SIZE];
+} log_slot_t;
+
+// Single producer (the owning thread), single consumer (the flusher)
+typedef struct _log_ring_t {
+    _Alignas(64) atomic_uint_fast64_t head;
+    _Alignas(64) atomic_uint_fast64_t tail;
+    atomic_uint_fast64_t dropped;
+    atomic_bool dead;
+    uint32_t thread;
+    char name[LOG_THREAD_NAME_LEN];
+    struct _log_ring_t* next;
+    log_slot_t slots[LOG_RING_SLOTS];
+} log_ring_t;
+
+typedef struct {
+    log_slot_t slot;
+    const char* thread_name;
+    uint64_t seq;
+} log_entry_t;
+
+static const char* level_names[LOG_LEVEL_COUNT] = { "DEBUG", "INFO", "WARN", "ERROR" };
+static const char* level_colors[LOG_LEVEL_COUNT] = { Blue, Cyan, Yellow, Red };
+
+static _Atomic(log_ring_t*) rings = NULL;
+static atomic_int min_level = LOG_INFO;
+static atomic_bool running = false;
+static atomic_uint next_thread = 1;
+static pthread_key_t ring_key;
+static __thread log_ring_t* thread_ring = NULL;
+
+static struct {
+    log_format_t format;
+    bool console;
+    int fd;
+    size_t size;
+    char path[256];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool stop;
+    log_entry_t* batch;
+    size_t batch_cap;
+    char* out;
+    size_t out_len;
+    char* console_out;
+    size_t console_len;
+} flusher = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+//
+//  Producers
+//
+
+static void release_ring(void* arg) {
+    log_ring_t* ring = (log_ring_t*) arg;
+    atomic_store_explicit(&ring->dead, true, memory_order_release);
+}
+
+static log_ring_t* get_ring() {
+    if (thread_ring) return thread_ring;
+
+    log_ring_t* ring = mem_calloc(MEM_LOGGING, 1, sizeof(log_ring_t));
+    if (!ring) return NULL;
+    ring->thread = atomic_fetch_add(&next_thread, 1);
+    snprintf(ring->name, sizeof(ring->name), "t%u", ring->thread);
+    pthread_setspecific(ring_key, ring);
+
+    log_ring_t* head = atomic_load(&rings);
+    do {
+        ring->next = head;
+    } while (!atomic_compare_exchange_weak(&rings, &head, ring));
+
+    thread_ring = ring;
+    return ring;
+}
+
+void log_write(log_level_t level, const char* fmt, ...) {
+    if ((int) level < atomic_load_explicit(&min_level, memory_order_relaxed) ||
+        !atomic_load_explicit(&running, memory_order_relaxed))
+        return;
+
+    log_ring_t* ring = get_ring();
+    if (!ring) return;
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    log_slot_t* slot = &ring->slots[head % LOG_RING_SLOTS];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(slot->msg, LOG_MSG_SIZE, fmt, args);
+    va_end(args);
+    if (len < 0) len = 0;
+    if ((size_t) len >= LOG_MSG_SIZE) len = LOG_MSG_SIZE - 1;
+
+    slot->header.timestamp_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    slot->header.thread = ring->thread;
+    slot->header.len = (uint16_t) len;
+    slot->header.level = (uint8_t) level;
+    slot->header.reserved = 0;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Also names the OS thread, which is what traces and debuggers show
+void log_set_thread_name(const char* name) {
+    pthread_setname_np(pthread_self(), name);
+    log_ring_t* ring = get_ring();
+    if (ring)
+        snprintf(ring->name, sizeof(ring->name), "%s", name);
+}
+
+void log_set_level(log_level_t level) {
+    if (level < LOG_LEVEL_COUNT)
+        atomic_store(&min_level, level);
+}
+
+log_level_t log_get_level() {
+    return (log_level_t) atomic_load(&min_level);
+}
+
+const char* log_level_name(log_level_t level) {
+    return level < LOG_LEVEL_COUNT ? level_names[level] : "?";
+}
+
+bool log_parse_level(const char* name, log_level_t* level) {
+    for (int i = 0; i < LOG_LEVEL_COUNT; i++) {
+        if (strncasecmp(name, level_names[i], strlen(level_names[i])) == 0) {
+            *level = (log_level_t) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+//
+//  Flusher
+//
+
+static void open_log() {
+    mkdir("build", 0755);
+    mkdir(LOG_DIR, 0755);
+    snprintf(flusher.path, sizeof(flusher.path), "%s/%s", LOG_DIR,
+             flusher.format == LOG_FORMAT_BINARY ? "server.bin" : "server.log");
+
+    flusher.fd = open(flusher.path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (flusher.fd < 0) {
+        fprintf(stderr, Red"[LOGGER] Error - cannot open %s: %s\n"Clear, flusher.path, strerror(errno));
+        return;
+    }
+
+    struct stat st;
+    flusher.size = fstat(flusher.fd, &st) == 0 ? st.st_size : 0;
+    if (flusher.format == LOG_FORMAT_BINARY && flusher.size == 0) {
+        if (write(flusher.fd, LOG_BINARY_MAGIC, strlen(LOG_BINARY_MAGIC)) > 0)
+            flusher.size = strlen(LOG_BINARY_MAGIC);
+    }
+}
+
+// server.log -> server.log.1 -> ... -> server.log.LOG_ROTATE_KEEP (dropped)
+static void rotate_log() {
+    close(flusher.fd);
+    flusher.fd = -1;
+
+    char from[300], to[300];
+    for (int i = LOG_ROTATE_KEEP - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", flusher.path, i);
+        snprintf(to, sizeof(to), "%s.%d", flusher.path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", flusher.path);
+    rename(flusher.path, to);
+    open_log();
+}
+
+static void write_fd(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return;
+        data += written;
+        len -= written;
+    }
+}
+
+static void flush_output() {
+    if (flusher.out_len > 0 && flusher.fd >= 0) {
+        write_fd(flusher.fd, flusher.out, flusher.out_len);
+        flusher.size += flusher.out_len;
+        if (flusher.size >= LOG_ROTATE_SIZE)
+            rotate_log();
+    }
+    if (flusher.console_len > 0)
+        write_fd(STDOUT_FILENO, flusher.console_out, flusher.console_len);
+    flusher.out_len = 0;
+    flusher.console_len = 0;
+}
+
+static void append(char* buff, size_t* len, const char* data, size_t size) {
+    if (*len + size > LOG_WRITE_BUFF_SIZE) {
+        flush_output();
+    }
+    memcpy(buff + *len, data, size);
+    *len += size;
+}
+
+static void emit(const log_entry_t* entry) {
+    const log_record_t* header = &entry->slot.header;
+
+    if (flusher.format == LOG_FORMAT_BINARY) {
+        append(flusher.out, &flusher.out_len, (const char*) header, sizeof(log_record_t));
+        append(flusher.out, &flusher.out_len, entry->slot.msg, header->len);
+    }
+
+    char stamp[32];
+    time_t secs = header->timestamp_ns / 1000000000;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+    char line[LOG_SLOT_SIZE + 96];
+    int prefix = snprintf(line, sizeof(line), "%s.%06u %-5s [%s] ", stamp,
+                          (unsigned) (header->timestamp_ns % 1000000000 / 1000),
+                          log_level_name(header->level), entry->thread_name);
+    memcpy(line + prefix, entry->slot.msg, header->len);
+    line[prefix + header->len] = '\n';
+    size_t line_len = prefix + header->len + 1;
+
+    if (flusher.format == LOG_FORMAT_TEXT)
+        append(flusher.out, &flusher.out_len, line, line_len);
+
+    if (flusher.console) {
+        const char* color = level_colors[header->level < LOG_LEVEL_COUNT ? header->level : LOG_ERROR];
+        append(flusher.console_out, &flusher.console_len, color, strlen(color));
+        append(flusher.console_out, &flusher.console_len, line, line_len - 1);
+        append(flusher.console_out, &flusher.console_len, Clear"\n", strlen(Clear) + 1);
+    }
+}
+
+static int compare_entries(const void* a, const void* b) {
+    const log_entry_t* x = (const log_entry_t*) a;
+    const log_entry_t* y = (const log_entry_t*) b;
+    if (x->slot.header.timestamp_ns != y->slot.header.timestamp_ns)
+        return x->slot.header.timestamp_ns < y->slot.header.timestamp_ns ? -1 : 1;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static void flush_rings() {
+    size_t count = 0;
+    uint64_t dropped = 0;
+
+    log_ring_t* prev = NULL;
+    log_ring_t* unlinked = NULL;
+    log_ring_t* ring = atomic_load(&rings);
+    while (ring) {
+        bool dead = atomic_load_explicit(&ring->dead, memory_order_acquire);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        if (count + (head - tail) > flusher.batch_cap) {
+            size_t cap = flusher.batch_cap * 2 + (head - tail);
+            log_entry_t* batch = mem_realloc(MEM_LOGGING, flusher.batch, cap * sizeof(log_entry_t));
+            if (!batch) break;
+            flusher.batch = batch;
+            flusher.batch_cap = cap;
+        }
+        for (; tail < head; tail++) {
+            log_entry_t* entry = &flusher.batch[count];
+            entry->slot = ring->slots[tail % LOG_RING_SLOTS];
+            entry->thread_name = ring->name;
+            entry->seq = count++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        dropped += atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+
+        // Rings of exited threads are unlinked once drained, and freed once
+        // the batch no longer points at their names. The list head is left
+        // alone since producers push there concurrently.
+        log_ring_t* next = ring->next;
+        if (dead && prev) {
+            prev->next = next;
+            ring->next = unlinked;
+            unlinked = ring;
+        } else {
+            prev = ring;
+        }
+        ring = next;
+    }
+
+    qsort(flusher.batch, count, sizeof(log_entry_t), compare_entries);
+    for (size_t i = 0; i < count; i++)
+        emit(&flusher.batch[i]);
+    while (unlinked) {
+        log_ring_t* next = unlinked->next;
+        mem_free(MEM_LOGGING, unlinked);
+        unlinked = next;
+    }
+
+    if (dropped > 0) {
+        log_entry_t entry;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        entry.slot.header.timestamp_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        entry.slot.header.thread = 0;
+        entry.slot.header.level = LOG_WARN;
+        entry.slot.header.len = snprintf(entry.slot.msg, LOG_MSG_SIZE, "[LOGGER] Dropped %llu records, ring buffers were full",
+                                         (unsigned long long) dropped);
+        entry.thread_name = "logger";
+        emit(&entry);
+    }
+
+    flush_output();
+}
+
+static void* flusher_thread(void* arg) {
+    (void) arg;
+    pthread_mutex_lock(&flusher.lock);
+    while (!flusher.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&flusher.wake, &flusher.lock, &deadline);
+
+        pthread_mutex_unlock(&flusher.lock);
+        flush_rings();
+        pthread_mutex_lock(&flusher.lock);
+    }
+    pthread_mutex_unlock(&flusher.lock);
+    return NULL;
+}
+
+static void log_stop() {
+    if (!atomic_exchange(&running, false)) return;
+
+    pthread_mutex_lock(&flusher.lock);
+    flusher.stop = true;
+    pthread_cond_signal(&flusher.wake);
+    pthread_mutex_unlock(&flusher.lock);
+    pthread_join(flusher.thread, NULL);
+
+    flush_rings();
+    if (flusher.fd >= 0) close(flusher.fd);
+    flusher.fd = -1;
+}
+
+void log_start() {
+    const char* env = getenv("QUIZ_LOG_LEVEL");
+    log_level_t level;
+    if (env && log_parse_level(env, &level))
+        log_set_level(level);
+    env = getenv("QUIZ_LOG_FORMAT");
+    flusher.format = (env && strcmp(env, "binary") == 0) ? LOG_FORMAT_BINARY : LOG_FORMAT_TEXT;
+    env = getenv("QUIZ_LOG_CONSOLE");
+    flusher.console = !(env && strcmp(env, "0") == 0);
+
+    flusher.out = mem_malloc(MEM_LOGGING, LOG_WRITE_BUFF_SIZE);
+    flusher.console_out = mem_malloc(MEM_LOGGING, LOG_WRITE_BUFF_SIZE);
+    if (!flusher.out || !flusher.console_out) return;
+
+    pthread_key_create(&ring_key, release_ring);
+    open_log();
+
+    atomic_store(&running, true);
+    pthread_create(&flusher.thread, NULL, flusher_thread, NULL);
+    atexit(log_stop);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LOG_DIR "build/logs"
+#define LOG_RING_SLOTS 64
+#define LOG_SLOT_SIZE 256
+#define LOG_FLUSH_INTERVAL_MS 20
+#define LOG_ROTATE_SIZE (16 * 1024 * 1024)
+#define LOG_ROTATE_KEEP 4
+#define LOG_THREAD_NAME_LEN 16
+
+typedef enum {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+    LOG_LEVEL_COUNT
+} log_level_t;
+
+typedef enum {
+    LOG_FORMAT_TEXT,
+    LOG_FORMAT_BINARY
+} log_format_t;
+
+// Binary logs (server.bin) start with LOG_BINARY_MAGIC, then one header per
+// record followed by 'len' bytes of message. Fields are host byte order.
+#define LOG_BINARY_MAGIC "QLOG1\n"
+
+typedef struct {
+    uint64_t timestamp_ns;   // CLOCK_REALTIME
+    uint32_t thread;
+    uint16_t len;
+    uint8_t level;
+    uint8_t reserved;
+} log_record_t;
+
+// Logging formats the message into the calling thread's own ring buffer and
+// returns: a background thread drains the rings, orders records by time and
+// writes them to LOG_DIR (and the console if enabled). When a ring is full
+// the record is dropped and counted, so callers never wait on I/O.
+#define LOG_DEBUG(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) log_write(LOG_INFO, __VA_ARGS__)
+#define LOG_WARN(...) log_write(LOG_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) log_write(LOG_ERROR, __VA_ARGS__)
+
+// Settings come from QUIZ_LOG_LEVEL (debug|info|warn|error), QUIZ_LOG_FORMAT
+// (text|binary) and QUIZ_LOG_CONSOLE (0|1). Remaining records are flushed at exit.
+void log_start();
+void log_write(log_level_t level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_set_level(log_level_t level);
+log_level_t log_get_level();
+const char* log_level_name(log_level_t level);
+bool log_parse_level(const char* name, log_level_t* level);
+void log_set_thread_name(const char* name);
@@ -0,0 +1,333 @@
+#include "matchmaking.h"
+#include "logger.h"
+#include "clock.h"
+#include "memacct.h"
+#include "lockprof.h"
+#include "upgrade.h"
+#include <math.h>
+
+// Defined in server.c
+void game_session_init(game_session_t* session, int id);
+void* game_loop(void* arg);
+void send_to_client(client_t* client, const char* message);
+void start_match(game_session_t* session, client_t** players, int count, game_mode_t mode);
+
+typedef struct _match_entry_t {
+    client_t* client;
+    int rating;
+    int bucket;
+    uint64_t since_us;
+    struct _match_entry_t* prev;       // in its bucket, oldest first
+    struct _match_entry_t* next;
+    struct _match_entry_t* older;      // in the whole queue, oldest first
+    struct _match_entry_t* newer;
+} match_entry_t;
+
+typedef struct {
+    match_entry_t* head;
+    match_entry_t* tail;
+} match_list_t;
+
+metric_gauge_t metric_match_queued = METRIC_GAUGE_INIT("quiz_match_queued", "Players waiting in the matchmaking queue", NULL);
+metric_histogram_t metric_match_wait = METRIC_HISTOGRAM_INIT("quiz_match_wait_seconds", "Time from 'queue' to being seated in a room", NULL);
+metric_counter_t metric_matches = METRIC_COUNTER_INIT("quiz_matches_total", "Rooms formed by the matchmaker", NULL);
+metric_counter_t metric_match_spread = METRIC_COUNTER_INIT("quiz_match_rating_spread_total",
+                                                           "Sum over formed rooms of the gap between the highest and lowest rating", NULL);
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t seated;
+    bool seating;                    // players out of the queue, not yet in their room
+    bool running;
+    game_mode_t mode;
+    int room_size;
+    match_list_t buckets[MATCH_BUCKETS];
+    match_entry_t* oldest;
+    match_entry_t* newest;
+    int queued;
+    game_session_t** rooms;
+    int room_count;
+} matcher = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER, .seated = PTHREAD_COND_INITIALIZER };
+
+static int bucket_of(int rating) {
+    int bucket = rating / MATCH_BUCKET_WIDTH;
+    if (bucket < 0) return 0;
+    return bucket < MATCH_BUCKETS ? bucket : MATCH_BUCKETS - 1;
+}
+
+static int window_of(match_entry_t* entry, uint64_t now) {
+    uint64_t waited = now > entry->since_us ? now - entry->since_us : 0;
+    return MATCH_WINDOW + (int) (waited / 1000000) * MATCH_WINDOW_GROWTH;
+}
+
+//
+//  Queue (matcher lock held)
+//
+
+static void queue_insert(match_entry_t* entry) {
+    match_list_t* bucket = &matcher.buckets[entry->bucket];
+    entry->prev = bucket->tail;
+    entry->next = NULL;
+    if (bucket->tail) bucket->tail->next = entry;
+    else bucket->head = entry;
+    bucket->tail = entry;
+
+    entry->older = matcher.newest;
+    entry->newer = NULL;
+    if (matcher.newest) matcher.newest->newer = entry;
+    else matcher.oldest = entry;
+    matcher.newest = entry;
+    matcher.queued++;
+}
+
+static void queue_remove(match_entry_t* entry) {
+    match_list_t* bucket = &matcher.buckets[entry->bucket];
+    if (entry->prev) entry->prev->next = entry->next;
+    else bucket->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else bucket->tail = entry->prev;
+
+    if (entry->older) entry->older->newer = entry->newer;
+    else matcher.oldest = entry->newer;
+    if (entry->newer) entry->newer->older = entry->older;
+    else matcher.newest = entry->older;
+    matcher.queued--;
+}
+
+bool matchmaking_join(client_t* client) {
+    match_entry_t* entry = mem_calloc(MEM_GAME, 1, sizeof(match_entry_t));
+    if (!entry) return false;
+    entry->client = client;
+    entry->rating = client->user_data->rating;
+    entry->bucket = bucket_of(entry->rating);
+    entry->since_us = clock_now_us();
+
+    MUTEX_LOCK(&matcher.lock);
+    if (!matcher.running) {
+        MUTEX_UNLOCK(&matcher.lock);
+        mem_free(MEM_GAME, entry);
+        return false;
+    }
+    client->match_entry = entry;
+    client->state = CLIENT_QUEUED;
+    queue_insert(entry);
+    MUTEX_COND_BROADCAST(&matcher.wake);
+    MUTEX_UNLOCK(&matcher.lock);
+
+    gauge_add(&metric_match_queued, 1);
+    return true;
+}
+
+bool matchmaking_leave(client_t* client) {
+    MUTEX_LOCK(&matcher.lock);
+    match_entry_t* entry = client->match_entry;
+    if (entry) {
+        queue_remove(entry);
+        client->match_entry = NULL;
+        client->state = CLIENT_CONNECTED;
+    }
+    // Already taken out by the matcher: it is being seated, and must not go
+    // away before it is
+    while (!entry && matcher.seating)
+        MUTEX_COND_WAIT(&matcher.seated, &matcher.lock);
+    MUTEX_UNLOCK(&matcher.lock);
+
+    if (!entry) return false;
+    gauge_add(&metric_match_queued, -1);
+    mem_free(MEM_GAME, entry);
+    return true;
+}
+
+//
+//  Matching (matcher lock held)
+//
+
+// A room nobody is using, or a new one with its own game thread
+static game_session_t* idle_room() {
+    for (int i = 0; i < matcher.room_count; i++) {
+        game_session_t* room = matcher.rooms[i];
+        MUTEX_LOCK(&room->lock);
+        bool idle = room->state == GAME_WAITING && room->player_count == 0;
+        MUTEX_UNLOCK(&room->lock);
+        if (idle) return room;
+    }
+
+    game_session_t** grown = mem_realloc(MEM_GAME, matcher.rooms, (matcher.room_count + 1) * sizeof(game_session_t*));
+    if (!grown) return NULL;
+    matcher.rooms = grown;
+    game_session_t* room = mem_malloc(MEM_GAME, sizeof(game_session_t));
+    if (!room) return NULL;
+    // Room 0 is the one players 'join' by hand
+    game_session_init(room, matcher.room_count + 1);
+    room->default_mode = matcher.mode;
+    matcher.rooms[matcher.room_count++] = room;
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, game_loop, room);
+    pthread_detach(thread);
+    return room;
+}
+
+game_session_t* matchmaking_room() {
+    MUTEX_LOCK(&matcher.lock);
+    game_session_t* room = idle_room();
+    MUTEX_UNLOCK(&matcher.lock);
+    return room;
+}
+
+// Fills 'found' with up to room_size - 1 players whose rating suits 'anchor'
+// (and whose own window takes the anchor's rating), nearest buckets first
+static int find_opponents(match_entry_t* anchor, match_entry_t** found, uint64_t now) {
+    int window = window_of(anchor, now);
+    int count = 0;
+    for (int d = 0; d < MATCH_BUCKETS && count < matcher.room_size - 1; d++) {
+        if ((d - 1) * MATCH_BUCKET_WIDTH > window) break;
+
+        int sides[2] = { anchor->bucket - d, anchor->bucket + d };
+        for (int s = 0; s < (d == 0 ? 1 : 2); s++) {
+            if (sides[s] < 0 || sides[s] >= MATCH_BUCKETS) continue;
+            for (match_entry_t* entry = matcher.buckets[sides[s]].head;
+                 entry && count < matcher.room_size - 1; entry = entry->next) {
+                int gap = abs(entry->rating - anchor->rating);
+                if (entry != anchor && gap <= window && gap <= window_of(entry, now))
+                    found[count++] = entry;
+            }
+        }
+    }
+    return count;
+}
+
+// Oldest players get matched first; a full room is formed as soon as one fits
+// in the anchor's window, a partial one once the anchor has waited too long.
+// Takes the players of the next room out of the queue into 'entries' and
+// returns the room, or NULL if there is none to form.
+static game_session_t* next_match(match_entry_t** entries, int* count, uint64_t now) {
+    for (match_entry_t* anchor = matcher.oldest; anchor; anchor = anchor->newer) {
+        int found = find_opponents(anchor, entries + 1, now);
+        bool patient = now - anchor->since_us < MATCH_MAX_WAIT_US;
+        if (found < matcher.room_size - 1 && (patient || found == 0))
+            continue;
+
+        game_session_t* room = idle_room();
+        if (!room) return NULL;
+        entries[0] = anchor;
+        *count = found + 1;
+        for (int i = 0; i < *count; i++) {
+            queue_remove(entries[i]);
+            entries[i]->client->match_entry = NULL;
+        }
+        return room;
+    }
+    return NULL;
+}
+
+//
+//  Seating (matcher lock not held)
+//
+
+static void seat(game_session_t* room, match_entry_t** entries, int count, uint64_t now) {
+    client_t* players[count];
+    int low = entries[0]->rating, high = entries[0]->rating;
+    for (int i = 0; i < count; i++) {
+        match_entry_t* entry = entries[i];
+        players[i] = entry->client;
+        if (entry->rating < low) low = entry->rating;
+        if (entry->rating > high) high = entry->rating;
+        histogram_observe(&metric_match_wait, now - entry->since_us);
+    }
+
+    char buff[BUFF_SIZE];
+    snprintf(buff, sizeof(buff), "RESP:Match found! Room %d with %d players (ratings %d-%d)\n", room->id, count, low, high);
+    for (int i = 0; i < count; i++)
+        send_to_client(players[i], buff);
+    start_match(room, players, count, matcher.mode);
+
+    gauge_add(&metric_match_queued, -count);
+    counter_add(&metric_matches, 1);
+    counter_add(&metric_match_spread, high - low);
+    LOG_INFO("[MATCH] Room %d: %d players, ratings %d-%d, oldest waited %.1fs",
+             room->id, count, low, high, (now - entries[0]->since_us) / 1e6);
+    for (int i = 0; i < count; i++)
+        mem_free(MEM_GAME, entries[i]);
+}
+
+static void* matcher_thread(void* arg) {
+    (void) arg;
+    log_set_thread_name("matcher");
+    clock_attach();
+
+    MUTEX_LOCK(&matcher.lock);
+    while (true) {
+        while (matcher.queued < 2)
+            MUTEX_COND_WAIT(&matcher.wake, &matcher.lock);
+        // The step comes first: client threads take the matcher lock without one
+        MUTEX_UNLOCK(&matcher.lock);
+        upgrade_step_begin();
+        MUTEX_LOCK(&matcher.lock);
+        // Players are told and the room started outside the lock, so 'queue'
+        // commands don't wait on their sockets
+        uint64_t now = clock_now_us();
+        match_entry_t* entries[matcher.room_size];
+        int count;
+        game_session_t* room;
+        while ((room = next_match(entries, &count, now))) {
+            matcher.seating = true;
+            MUTEX_UNLOCK(&matcher.lock);
+            seat(room, entries, count, now);
+            MUTEX_LOCK(&matcher.lock);
+            matcher.seating = false;
+            MUTEX_COND_BROADCAST(&matcher.seated);
+        }
+        MUTEX_UNLOCK(&matcher.lock);
+        upgrade_step_end();
+
+        clock_sleep_us(MATCH_INTERVAL_US);
+        MUTEX_LOCK(&matcher.lock);
+    }
+    return NULL;
+}
+
+//
+//  Ratings
+//
+
+void matchmaking_rate(client_t** players, int count) {
+    int delta[count];
+    for (int i = 0; i < count; i++) {
+        delta[i] = 0;
+        if (!players[i]->user_data || count < 2) continue;
+
+        double change = 0;
+        for (int j = 0; j < count; j++) {
+            if (j == i || !players[j]->user_data) continue;
+            double expected = 1.0 / (1.0 + pow(10.0, (players[j]->user_data->rating - players[i]->user_data->rating) / 400.0));
+            double actual = players[i]->score > players[j]->score ? 1.0 : players[i]->score == players[j]->score ? 0.5 : 0.0;
+            change += actual - expected;
+        }
+        delta[i] = (int) lround(MATCH_K_FACTOR * change / (count - 1));
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!players[i]->user_data) continue;
+        players[i]->user_data->rating += delta[i];
+        if (players[i]->user_data->rating < 1)
+            players[i]->user_data->rating = 1;
+    }
+}
+
+void matchmaking_start(game_mode_t mode) {
+    metrics_register(&metric_match_queued.base);
+    metrics_register(&metric_match_wait.base);
+    metrics_register(&metric_matches.base);
+    metrics_register(&metric_match_spread.base);
+
+    const char* size = getenv("QUIZ_MATCH_SIZE");
+    matcher.room_size = size && atoi(size) >= 2 ? atoi(size) : MATCH_ROOM_SIZE;
+    matcher.mode = mode;
+    matcher.running = true;
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, matcher_thread, NULL);
+    pthread_detach(thread);
+}
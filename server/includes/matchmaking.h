@@ -0,0 +1,36 @@
+#pragma once
+#include "utils.h"
+#include "metrics.h"
+
+#define MATCH_DEFAULT_RATING 1000
+#define MATCH_K_FACTOR 32
+// Queued players are bucketed by rating; the last bucket takes everything above
+#define MATCH_BUCKET_WIDTH 50
+#define MATCH_BUCKETS 80
+// Players per room (QUIZ_MATCH_SIZE overrides); after MATCH_MAX_WAIT_US in the
+// queue a player takes any room of two or more
+#define MATCH_ROOM_SIZE 4
+#define MATCH_MAX_WAIT_US 30000000
+// Rating difference accepted at first, and how much it widens per second waited
+#define MATCH_WINDOW 100
+#define MATCH_WINDOW_GROWTH 50
+#define MATCH_INTERVAL_US 500000
+
+extern metric_gauge_t metric_match_queued;
+extern metric_histogram_t metric_match_wait;
+extern metric_counter_t metric_matches;
+extern metric_counter_t metric_match_spread;
+
+// Registers the quiz_match* metrics and starts the matcher, which seats the
+// rooms it forms in 'mode'. Call before metrics_start().
+void matchmaking_start(game_mode_t mode);
+// An idle room with its own game thread, for snapshot_restore(); call before
+// any client connects
+game_session_t* matchmaking_room();
+// Puts a logged in, idle client in the queue. False if matchmaking isn't running.
+bool matchmaking_join(client_t* client);
+// Takes 'client' out of the queue; false if the matcher already seated it
+bool matchmaking_leave(client_t* client);
+// Elo over every pair of players in a finished game, ranked by score. Call
+// with the session lock held.
+void matchmaking_rate(client_t** players, int count);
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include "memacct.h"
+#include "metrics.h"
+#include "logger.h"
+#include "libxml.h"
+#include <malloc.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define MEM_LIVE(tag, label) \
+    [MEM_##tag] = METRIC_GAUGE_INIT("quiz_memory_live_bytes", "Heap bytes currently allocated, by subsystem", "subsystem=\"" label "\"")
+#define MEM_PEAK(tag, label) \
+    [MEM_##tag] = METRIC_GAUGE_INIT("quiz_memory_peak_bytes", "Most heap bytes allocated at once, by subsystem", "subsystem=\"" label "\"")
+#define MEM_ALLOCS(tag, label) \
+    [MEM_##tag] = METRIC_COUNTER_INIT("quiz_memory_allocations_total", "Allocations and reallocations, by subsystem", "subsystem=\"" label "\"")
+#define MEM_FREES(tag, label) \
+    [MEM_##tag] = METRIC_COUNTER_INIT("quiz_memory_frees_total", "Frees, by subsystem", "subsystem=\"" label "\"")
+
+#define MEM_FAMILY(kind) { \
+    kind(NETWORK, "network"), kind(GAME, "game"), kind(USERS, "users"), kind(QUESTIONS, "questions"), \
+    kind(XML, "xml"), kind(LOGGING, "logging"), kind(SPECTATORS, "spectators"), kind(STACKS, "stacks") \
+}
+
+static const char* tag_names[MEM_TAG_COUNT] = {
+    [MEM_NETWORK] = "network", [MEM_GAME] = "game", [MEM_USERS] = "users", [MEM_QUESTIONS] = "questions",
+    [MEM_XML] = "xml", [MEM_LOGGING] = "logging", [MEM_SPECTATORS] = "spectators", [MEM_STACKS] = "stacks"
+};
+
+static metric_gauge_t live_bytes[MEM_TAG_COUNT] = MEM_FAMILY(MEM_LIVE);
+static metric_gauge_t peak_bytes[MEM_TAG_COUNT] = MEM_FAMILY(MEM_PEAK);
+static metric_counter_t allocations[MEM_TAG_COUNT] = MEM_FAMILY(MEM_ALLOCS);
+static metric_counter_t frees[MEM_TAG_COUNT] = MEM_FAMILY(MEM_FREES);
+static atomic_uint_fast64_t allocated_bytes = 0;
+
+static void charge(mem_tag_t tag, int64_t bytes) {
+    int_fast64_t live = atomic_fetch_add_explicit(&live_bytes[tag].value, bytes, memory_order_relaxed) + bytes;
+    int_fast64_t peak = atomic_load_explicit(&peak_bytes[tag].value, memory_order_relaxed);
+    while (live > peak &&
+           !atomic_compare_exchange_weak_explicit(&peak_bytes[tag].value, &peak, live,
+                                                  memory_order_relaxed, memory_order_relaxed));
+}
+
+static void count_alloc(mem_tag_t tag, size_t bytes) {
+    counter_add(&allocations[tag], 1);
+    atomic_fetch_add_explicit(&allocated_bytes, bytes, memory_order_relaxed);
+}
+
+//
+//  Allocation
+//
+
+void* mem_malloc(mem_tag_t tag, size_t size) {
+    void* ptr = malloc(size);
+    if (ptr) {
+        size_t usable = malloc_usable_size(ptr);
+        charge(tag, usable);
+        count_alloc(tag, usable);
+    }
+    return ptr;
+}
+
+void* mem_calloc(mem_tag_t tag, size_t count, size_t size) {
+    void* ptr = calloc(count, size);
+    if (ptr) {
+        size_t usable = malloc_usable_size(ptr);
+        charge(tag, usable);
+        count_alloc(tag, usable);
+    }
+    return ptr;
+}
+
+void* mem_realloc(mem_tag_t tag, void* ptr, size_t size) {
+    if (ptr && size == 0) {
+        mem_free(tag, ptr);
+        return NULL;
+    }
+
+    size_t old = ptr ? malloc_usable_size(ptr) : 0;
+    void* grown = realloc(ptr, size);
+    if (grown) {
+        size_t usable = malloc_usable_size(grown);
+        charge(tag, (int64_t) usable - (int64_t) old);
+        count_alloc(tag, usable);
+    }
+    return grown;
+}
+
+char* mem_strdup(mem_tag_t tag, const char* str) {
+    size_t len = strlen(str) + 1;
+    char* copy = mem_malloc(tag, len);
+    if (copy)
+        memcpy(copy, str, len);
+    return copy;
+}
+
+void mem_free(mem_tag_t tag, void* ptr) {
+    if (!ptr) return;
+    charge(tag, -(int64_t) malloc_usable_size(ptr));
+    counter_add(&frees[tag], 1);
+    free(ptr);
+}
+
+void mem_track(mem_tag_t tag, int64_t bytes) {
+    charge(tag, bytes);
+}
+
+void mem_totals(uint64_t* count, uint64_t* bytes) {
+    uint64_t sum = 0;
+    for (int tag = 0; tag < MEM_TAG_COUNT; tag++)
+        sum += counter_value(&allocations[tag]);
+    *count = sum;
+    *bytes = atomic_load_explicit(&allocated_bytes, memory_order_relaxed);
+}
+
+static void* xml_malloc(size_t size) {
+    return mem_malloc(MEM_XML, size);
+}
+
+static void* xml_calloc(size_t count, size_t size) {
+    return mem_calloc(MEM_XML, count, size);
+}
+
+static void* xml_realloc(void* ptr, size_t size) {
+    return mem_realloc(MEM_XML, ptr, size);
+}
+
+static void xml_free(void* ptr) {
+    mem_free(MEM_XML, ptr);
+}
+
+//
+//  Reporting
+//
+
+static long resident_bytes() {
+    long pages = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%*d %ld", &pages) != 1)
+            pages = 0;
+        fclose(statm);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+char* mem_render() {
+    size_t cap = (MEM_TAG_COUNT + 4) * 96;
+    char* body = malloc(cap);
+    if (!body) return NULL;
+
+    size_t len = snprintf(body, cap, "%-12s %14s %14s %14s %14s\n",
+                          "subsystem", "live_bytes", "peak_bytes", "allocations", "frees");
+    int64_t heap = 0;
+    for (int tag = 0; tag < MEM_TAG_COUNT; tag++) {
+        int64_t live = atomic_load_explicit(&live_bytes[tag].value, memory_order_relaxed);
+        if (tag != MEM_STACKS) heap += live;
+        len += snprintf(body + len, cap - len, "%-12s %14lld %14lld %14llu %14llu\n", tag_names[tag],
+                        (long long) live, (long long) atomic_load_explicit(&peak_bytes[tag].value, memory_order_relaxed),
+                        (unsigned long long) counter_value(&allocations[tag]),
+                        (unsigned long long) counter_value(&frees[tag]));
+    }
+    len += snprintf(body + len, cap - len, "%-12s %14lld\n", "heap_total", (long long) heap);
+    snprintf(body + len, cap - len, "%-12s %14ld\n", "process_rss", resident_bytes());
+    return body;
+}
+
+void mem_dump(const char* path) {
+    char* body = mem_render();
+    if (!body) return;
+
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        LOG_ERROR("[MEMORY] Error - cannot write %s: %s", path, strerror(errno));
+    } else {
+        fputs(body, out);
+        fclose(out);
+        LOG_INFO("[MEMORY] Memory accounting written to %s", path);
+    }
+    free(body);
+}
+
+// GET /memory returns the same table as the dump
+static char* memory_route(const char* query) {
+    (void) query;
+    return mem_render();
+}
+
+void mem_start() {
+    metric_gauge_t* gauges[] = { live_bytes, peak_bytes };
+    metric_counter_t* counters[] = { allocations, frees };
+    for (int family = 0; family < 2; family++)
+        for (int tag = 0; tag < MEM_TAG_COUNT; tag++)
+            metrics_register(&gauges[family][tag].base);
+    for (int family = 0; family < 2; family++)
+        for (int tag = 0; tag < MEM_TAG_COUNT; tag++)
+            metrics_register(&counters[family][tag].base);
+
+    metrics_add_route("/memory", memory_route);
+
+    XMLAllocator allocator = { xml_malloc, xml_calloc, xml_realloc, xml_free };
+    XML_set_allocator(allocator);
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define MEM_DUMP_PATH "build/logs/memory.txt"
+
+typedef enum {
+    MEM_NETWORK,     // client_t structs
+    MEM_GAME,        // session player lists, simulation rooms and bots
+    MEM_USERS,       // user_data_t records and the user array
+    MEM_QUESTIONS,   // question_t records and the question array
+    MEM_XML,         // libxml documents, decoders and writers (save_users() temporaries)
+    MEM_LOGGING,     // per-thread log rings and flusher buffers
+    MEM_SPECTATORS,  // spectator subscriptions and the frames published to them
+    MEM_STACKS,      // reserved client thread stacks (address space, not necessarily resident)
+    MEM_TAG_COUNT
+} mem_tag_t;
+
+// malloc() and friends charged to 'tag'. Sizes come from malloc_usable_size(),
+// so memory must be freed with mem_free() under the same tag to be uncharged;
+// a plain free() is safe but leaves the bytes counted as live.
+void* mem_malloc(mem_tag_t tag, size_t size);
+void* mem_calloc(mem_tag_t tag, size_t count, size_t size);
+void* mem_realloc(mem_tag_t tag, void* ptr, size_t size);
+char* mem_strdup(mem_tag_t tag, const char* str);
+void mem_free(mem_tag_t tag, void* ptr);
+// Charges memory that doesn't come from malloc (negative 'bytes' to release)
+void mem_track(mem_tag_t tag, int64_t bytes);
+// Allocations and reallocations made through the calls above since startup,
+// over every tag, and the bytes they returned
+void mem_totals(uint64_t* count, uint64_t* bytes);
+
+// Live bytes, peak bytes, allocations and frees per subsystem, plus the
+// process RSS for comparison. Returns a malloc'd table.
+char* mem_render();
+void mem_dump(const char* path);
+// Registers the quiz_memory_* metrics and GET /memory, and routes libxml's
+// allocations to MEM_XML. Call before metrics_start().
+void mem_start();
@@ -0,0 +1,357 @@
+#include "metrics.h"
+#include "logger.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define METRICS_MAX_ROUTES 8
+
+#define COMMAND_METRICS(cmd, label) \
+    [COMMAND_##cmd] = METRIC_COUNTER_INIT("quiz_commands_total", "Commands received, by type", "command=\"" label "\"")
+#define COMMAND_LATENCY(cmd, label) \
+    [COMMAND_##cmd] = METRIC_HISTOGRAM_INIT("quiz_command_duration_seconds", "Time spent handling a command, by type", "command=\"" label "\"")
+
+const char* command_names[COMMAND_TYPE_COUNT] = {
+    [COMMAND_ANSWER] = "answer", [COMMAND_HELP] = "help", [COMMAND_JOIN] = "join", [COMMAND_LOGIN] = "login",
+    [COMMAND_LOGOUT] = "logout", [COMMAND_MEOW] = "meow", [COMMAND_REGISTER] = "register", [COMMAND_STATS] = "stats",
+    [COMMAND_START] = "start", [COMMAND_SPECTATE] = "spectate", [COMMAND_QUEUE] = "queue", [COMMAND_RESUME] = "resume",
+    [COMMAND_QUIT] = "quit", [COMMAND_UNKNOWN] = "unknown"
+};
+
+metric_counter_t metric_accepts = METRIC_COUNTER_INIT("quiz_accepts_total", "Accepted client connections", NULL);
+metric_gauge_t metric_connections = METRIC_GAUGE_INIT("quiz_connections_active", "Currently connected clients", NULL);
+metric_counter_t metric_commands[COMMAND_TYPE_COUNT] = {
+    COMMAND_METRICS(ANSWER, "answer"), COMMAND_METRICS(HELP, "help"), COMMAND_METRICS(JOIN, "join"), COMMAND_METRICS(LOGIN, "login"),
+    COMMAND_METRICS(LOGOUT, "logout"), COMMAND_METRICS(MEOW, "meow"), COMMAND_METRICS(REGISTER, "register"), COMMAND_METRICS(STATS, "stats"),
+    COMMAND_METRICS(START, "start"), COMMAND_METRICS(SPECTATE, "spectate"), COMMAND_METRICS(QUEUE, "queue"), COMMAND_METRICS(RESUME, "resume"), COMMAND_METRICS(QUIT, "quit"), COMMAND_METRICS(UNKNOWN, "unknown")
+};
+metric_histogram_t metric_command_latency[COMMAND_TYPE_COUNT] = {
+    COMMAND_LATENCY(ANSWER, "answer"), COMMAND_LATENCY(HELP, "help"), COMMAND_LATENCY(JOIN, "join"), COMMAND_LATENCY(LOGIN, "login"),
+    COMMAND_LATENCY(LOGOUT, "logout"), COMMAND_LATENCY(MEOW, "meow"), COMMAND_LATENCY(REGISTER, "register"), COMMAND_LATENCY(STATS, "stats"),
+    COMMAND_LATENCY(START, "start"), COMMAND_LATENCY(SPECTATE, "spectate"), COMMAND_LATENCY(QUEUE, "queue"), COMMAND_LATENCY(RESUME, "resume"), COMMAND_LATENCY(QUIT, "quit"), COMMAND_LATENCY(UNKNOWN, "unknown")
+};
+metric_histogram_t metric_broadcast_latency = METRIC_HISTOGRAM_INIT("quiz_broadcast_duration_seconds", "Time to fan a message out to all players", NULL);
+metric_counter_t metric_bytes_in = METRIC_COUNTER_INIT("quiz_received_bytes_total", "Bytes received from clients", NULL);
+metric_counter_t metric_bytes_out = METRIC_COUNTER_INIT("quiz_sent_bytes_total", "Bytes sent to clients", NULL);
+metric_gauge_t metric_rooms = METRIC_GAUGE_INIT("quiz_rooms_active", "Game sessions currently running", NULL);
+metric_counter_t metric_games = METRIC_COUNTER_INIT("quiz_games_total", "Games played to the end", NULL);
+metric_counter_t metric_turns = METRIC_COUNTER_INIT("quiz_turns_total", "Turns answered or timed out", NULL);
+metric_histogram_t metric_save_users_latency = METRIC_HISTOGRAM_INIT("quiz_save_users_duration_seconds", "Time to write users.xml", NULL);
+metric_histogram_t metric_session_lock_wait = METRIC_HISTOGRAM_INIT("quiz_lock_wait_seconds", "Time spent waiting for contended locks", "lock=\"session\"");
+metric_histogram_t metric_users_lock_wait = METRIC_HISTOGRAM_INIT("quiz_lock_wait_seconds", "Time spent waiting for contended locks", "lock=\"users\"");
+
+static metric_t* registry[METRICS_MAX];
+static int registry_count = 0;
+
+static struct {
+    const char* path;
+    metrics_route_t handler;
+} routes[METRICS_MAX_ROUTES];
+static int route_count = 0;
+
+static atomic_int next_shard = 0;
+static __thread int thread_shard = -1;
+
+static int shard_index() {
+    if (thread_shard < 0)
+        thread_shard = atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % METRICS_SHARDS;
+    return thread_shard;
+}
+
+static int bucket_index(uint64_t usec) {
+    if (usec < 2) return (int) usec;
+
+    int exp = 63 - __builtin_clzll(usec);
+    if (exp > METRICS_HIST_MAX_BITS) return METRICS_HIST_BUCKETS - 1;
+    return 2 * exp + (int) ((usec >> (exp - 1)) & 1);
+}
+
+// Values in bucket 'index' are below this many microseconds
+static uint64_t bucket_bound(int index) {
+    if (index < 2) return index + 1;
+
+    int exp = index / 2;
+    return (uint64_t) (2 + index % 2 + 1) << (exp - 1);
+}
+
+uint64_t metrics_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_register(metric_t* metric) {
+    if (registry_count < METRICS_MAX)
+        registry[registry_count++] = metric;
+}
+
+void counter_add(metric_counter_t* counter, uint64_t value) {
+    atomic_fetch_add_explicit(&counter->shards[shard_index()].value, value, memory_order_relaxed);
+}
+
+uint64_t counter_value(metric_counter_t* counter) {
+    uint64_t total = 0;
+    for (int s = 0; s < METRICS_SHARDS; s++)
+        total += atomic_load_explicit(&counter->shards[s].value, memory_order_relaxed);
+    return total;
+}
+
+void gauge_add(metric_gauge_t* gauge, int64_t delta) {
+    atomic_fetch_add_explicit(&gauge->value, delta, memory_order_relaxed);
+}
+
+void gauge_set(metric_gauge_t* gauge, int64_t value) {
+    atomic_store_explicit(&gauge->value, value, memory_order_relaxed);
+}
+
+void histogram_observe(metric_histogram_t* histogram, uint64_t usec) {
+    metric_hist_shard_t* shard = &histogram->shards[shard_index()];
+    atomic_fetch_add_explicit(&shard->buckets[bucket_index(usec)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->sum, usec, memory_order_relaxed);
+}
+
+void metrics_lock(pthread_mutex_t* lock, metric_histogram_t* wait) {
+    if (!wait) {
+        pthread_mutex_lock(lock);
+        return;
+    }
+    if (pthread_mutex_trylock(lock) == 0) {
+        histogram_observe(wait, 0);
+        return;
+    }
+
+    uint64_t span = TRACE_BEGIN();
+    uint64_t start = metrics_now_us();
+    pthread_mutex_lock(lock);
+    histogram_observe(wait, metrics_now_us() - start);
+    trace_end(span, "lock", "lock wait", wait->base.label, TRACE_NO_ARG);
+}
+
+//
+//  Exposition
+//
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} render_buff_t;
+
+static void render(render_buff_t* out, const char* fmt, ...) {
+    while (true) {
+        va_list args;
+        va_start(args, fmt);
+        int len = vsnprintf(out->data + out->len, out->cap - out->len, fmt, args);
+        va_end(args);
+
+        if (len >= 0 && out->len + len < out->cap) {
+            out->len += len;
+            return;
+        }
+
+        size_t cap = out->cap * 2 + (len > 0 ? len : 0);
+        char* data = realloc(out->data, cap);
+        if (!data) return;
+        out->data = data;
+        out->cap = cap;
+    }
+}
+
+static void render_series(render_buff_t* out, const char* name, const char* suffix, const char* label, const char* extra) {
+    render(out, "%s%s", name, suffix);
+    if (label || extra)
+        render(out, "{%s%s%s}", label ? label : "", label && extra ? "," : "", extra ? extra : "");
+    render(out, " ");
+}
+
+static void render_histogram(render_buff_t* out, metric_histogram_t* histogram) {
+    uint64_t buckets[METRICS_HIST_BUCKETS] = { 0 };
+    uint64_t sum = 0;
+
+    for (int s = 0; s < METRICS_SHARDS; s++) {
+        metric_hist_shard_t* shard = &histogram->shards[s];
+        for (int i = 0; i < METRICS_HIST_BUCKETS; i++)
+            buckets[i] += atomic_load_explicit(&shard->buckets[i], memory_order_relaxed);
+        sum += atomic_load_explicit(&shard->sum, memory_order_relaxed);
+    }
+
+    // Shards are read while writers keep going, so derive the total from the
+    // buckets to keep the series consistent
+    uint64_t cumulative = 0;
+    char le[64];
+    for (int i = 0; i < METRICS_HIST_BUCKETS - 1; i++) {
+        cumulative += buckets[i];
+        snprintf(le, sizeof(le), "le=\"%g\"", bucket_bound(i) / 1e6);
+        render_series(out, histogram->base.name, "_bucket", histogram->base.label, le);
+        render(out, "%llu\n", (unsigned long long) cumulative);
+    }
+    cumulative += buckets[METRICS_HIST_BUCKETS - 1];
+
+    render_series(out, histogram->base.name, "_bucket", histogram->base.label, "le=\"+Inf\"");
+    render(out, "%llu\n", (unsigned long long) cumulative);
+    render_series(out, histogram->base.name, "_sum", histogram->base.label, NULL);
+    render(out, "%g\n", sum / 1e6);
+    render_series(out, histogram->base.name, "_count", histogram->base.label, NULL);
+    render(out, "%llu\n", (unsigned long long) cumulative);
+}
+
+char* metrics_render() {
+    static const char* type_names[] = { "counter", "gauge", "histogram" };
+    render_buff_t out = { malloc(16 * 1024), 0, 16 * 1024 };
+    if (!out.data) return NULL;
+    out.data[0] = '\0';
+
+    const char* prev_name = NULL;
+    for (int i = 0; i < registry_count; i++) {
+        metric_t* metric = registry[i];
+        // Series of one family are registered next to each other
+        if (!prev_name || strcmp(prev_name, metric->name) != 0) {
+            render(&out, "# HELP %s %s\n", metric->name, metric->help);
+            render(&out, "# TYPE %s %s\n", metric->name, type_names[metric->type]);
+            prev_name = metric->name;
+        }
+
+        if (metric->type == METRIC_COUNTER) {
+            render_series(&out, metric->name, "", metric->label, NULL);
+            render(&out, "%llu\n", (unsigned long long) counter_value((metric_counter_t*) metric));
+        } else if (metric->type == METRIC_GAUGE) {
+            metric_gauge_t* gauge = (metric_gauge_t*) metric;
+            render_series(&out, metric->name, "", metric->label, NULL);
+            render(&out, "%lld\n", (long long) atomic_load_explicit(&gauge->value, memory_order_relaxed));
+        } else {
+            render_histogram(&out, (metric_histogram_t*) metric);
+        }
+    }
+
+    return out.data;
+}
+
+void metrics_add_route(const char* path, metrics_route_t handler) {
+    if (route_count >= METRICS_MAX_ROUTES) return;
+    routes[route_count].path = path;
+    routes[route_count].handler = handler;
+    route_count++;
+}
+
+// "GET /path?query HTTP/1.0": runs the matching route, anything else gets the metrics
+static char* handle_request(char* request) {
+    char* path = strchr(request, ' ');
+    if (path) {
+        path++;
+        path[strcspn(path, " \r\n")] = '\0';
+        char* query = strchr(path, '?');
+        if (query) *query++ = '\0';
+
+        for (int i = 0; i < route_count; i++)
+            if (strcmp(routes[i].path, path) == 0)
+                return routes[i].handler(query ? query : "");
+    }
+    return metrics_render();
+}
+
+static void* metrics_thread(void* arg) {
+    int server_fd = *(int*) arg;
+    free(arg);
+    log_set_thread_name("metrics");
+
+    char request[1024];
+    char header[256];
+    while (true) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) continue;
+
+        // One request per connection
+        struct timeval timeout = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ssize_t request_len = recv(fd, request, sizeof(request) - 1, 0);
+        request[request_len > 0 ? request_len : 0] = '\0';
+
+        char* body = handle_request(request);
+        size_t body_len = body ? strlen(body) : 0;
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                                  body_len);
+        send(fd, header, header_len, MSG_NOSIGNAL);
+        for (size_t sent = 0; sent < body_len; ) {
+            ssize_t len = send(fd, body + sent, body_len - sent, MSG_NOSIGNAL);
+            if (len <= 0) break;
+            sent += len;
+        }
+
+        free(body);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void register_builtin() {
+    metrics_register(&metric_accepts.base);
+    metrics_register(&metric_connections.base);
+    for (int i = 0; i < COMMAND_TYPE_COUNT; i++)
+        metrics_register(&metric_commands[i].base);
+    for (int i = 0; i < COMMAND_TYPE_COUNT; i++)
+        metrics_register(&metric_command_latency[i].base);
+    metrics_register(&metric_broadcast_latency.base);
+    metrics_register(&metric_bytes_in.base);
+    metrics_register(&metric_bytes_out.base);
+    metrics_register(&metric_rooms.base);
+    metrics_register(&metric_games.base);
+    metrics_register(&metric_turns.base);
+    metrics_register(&metric_save_users_latency.base);
+    metrics_register(&metric_session_lock_wait.base);
+    metrics_register(&metric_users_lock_wait.base);
+}
+
+static int metrics_fd = -1;
+
+int metrics_listener() {
+    return metrics_fd;
+}
+
+static void serve(int server_fd) {
+    metrics_fd = server_fd;
+    int* arg = malloc(sizeof(int));
+    *arg = server_fd;
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, metrics_thread, arg);
+    pthread_detach(thread_id);
+}
+
+void metrics_start_inherited(int server_fd) {
+    register_builtin();
+    serve(server_fd);
+    LOG_INFO("[METRICS] Serving Prometheus metrics on the inherited socket");
+}
+
+void metrics_start(int port) {
+    register_builtin();
+
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    if (server_fd < 0 || bind(server_fd, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(server_fd, 16) < 0) {
+        LOG_ERROR("[METRICS] Error - cannot listen for scrapes: %s", strerror(errno));
+        if (server_fd >= 0) close(server_fd);
+        return;
+    }
+
+    serve(server_fd);
+    LOG_INFO("[METRICS] Serving Prometheus metrics on 127.0.0.1:%d/metrics", port);
+}
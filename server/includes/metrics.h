@@ -0,0 +1,116 @@
+#pragma once
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define METRICS_PORT 9180
+#define METRICS_SHARDS 16
+#define METRICS_MAX 128
+// Histograms count microseconds in half-octave buckets: [2^e, 1.5*2^e) and
+// [1.5*2^e, 2^(e+1)), up to METRICS_HIST_MAX_BITS.
+#define METRICS_HIST_MAX_BITS 27
+#define METRICS_HIST_BUCKETS (2 * METRICS_HIST_MAX_BITS + 2)
+#define METRICS_CACHE_LINE 64
+
+typedef enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM
+} metric_type_t;
+
+// Every metric starts with this header so the registry can hold them all.
+// 'label' is an optional preformatted label pair, e.g. "command=\"join\"".
+typedef struct {
+    const char* name;
+    const char* help;
+    const char* label;
+    metric_type_t type;
+} metric_t;
+
+typedef struct {
+    _Alignas(METRICS_CACHE_LINE) atomic_uint_fast64_t value;
+} metric_cell_t;
+
+// Counters and histograms are sharded per thread: writers only touch their
+// own cache line, and the exposition sums the shards.
+typedef struct {
+    metric_t base;
+    metric_cell_t shards[METRICS_SHARDS];
+} metric_counter_t;
+
+typedef struct {
+    metric_t base;
+    atomic_int_fast64_t value;
+} metric_gauge_t;
+
+typedef struct {
+    _Alignas(METRICS_CACHE_LINE) atomic_uint_fast64_t buckets[METRICS_HIST_BUCKETS];
+    atomic_uint_fast64_t sum;
+} metric_hist_shard_t;
+
+typedef struct {
+    metric_t base;
+    metric_hist_shard_t shards[METRICS_SHARDS];
+} metric_histogram_t;
+
+#define METRIC_COUNTER_INIT(name, help, label) { .base = { (name), (help), (label), METRIC_COUNTER } }
+#define METRIC_GAUGE_INIT(name, help, label) { .base = { (name), (help), (label), METRIC_GAUGE } }
+#define METRIC_HISTOGRAM_INIT(name, help, label) { .base = { (name), (help), (label), METRIC_HISTOGRAM } }
+
+typedef enum {
+    COMMAND_ANSWER,
+    COMMAND_HELP,
+    COMMAND_JOIN,
+    COMMAND_LOGIN,
+    COMMAND_LOGOUT,
+    COMMAND_MEOW,
+    COMMAND_REGISTER,
+    COMMAND_STATS,
+    COMMAND_START,
+    COMMAND_SPECTATE,
+    COMMAND_QUEUE,
+    COMMAND_RESUME,
+    COMMAND_QUIT,
+    COMMAND_UNKNOWN,
+    COMMAND_TYPE_COUNT
+} command_type_t;
+
+// What each command is called in logs, traces and QUIZ_RATE_COST
+extern const char* command_names[COMMAND_TYPE_COUNT];
+
+extern metric_counter_t metric_accepts;
+extern metric_gauge_t metric_connections;
+extern metric_counter_t metric_commands[COMMAND_TYPE_COUNT];
+extern metric_histogram_t metric_command_latency[COMMAND_TYPE_COUNT];
+extern metric_histogram_t metric_broadcast_latency;
+extern metric_counter_t metric_bytes_in;
+extern metric_counter_t metric_bytes_out;
+extern metric_gauge_t metric_rooms;
+extern metric_counter_t metric_games;
+extern metric_counter_t metric_turns;
+extern metric_histogram_t metric_save_users_latency;
+extern metric_histogram_t metric_session_lock_wait;
+extern metric_histogram_t metric_users_lock_wait;
+
+uint64_t metrics_now_us();
+void metrics_register(metric_t* metric);
+void counter_add(metric_counter_t* counter, uint64_t value);
+// Sum of the shards
+uint64_t counter_value(metric_counter_t* counter);
+void gauge_add(metric_gauge_t* gauge, int64_t delta);
+void gauge_set(metric_gauge_t* gauge, int64_t value);
+void histogram_observe(metric_histogram_t* histogram, uint64_t usec);
+// pthread_mutex_lock() that records how long it waited into 'wait', if given
+void metrics_lock(pthread_mutex_t* lock, metric_histogram_t* wait);
+// Writes every registered metric in Prometheus text format, returns a malloc'd string
+char* metrics_render();
+// Extra endpoints on the metrics listener: 'handler' gets the query string
+// ("" if none) and returns a malloc'd plain-text body. Add before metrics_start().
+typedef char* (*metrics_route_t)(const char* query);
+void metrics_add_route(const char* path, metrics_route_t handler);
+// Registers the built-in metrics and serves them over HTTP on 127.0.0.1:port
+void metrics_start(int port);
+// Same, on a socket that is already listening (handed over by upgrade.h)
+void metrics_start_inherited(int server_fd);
+// The socket metrics are served on, or -1
+int metrics_listener();
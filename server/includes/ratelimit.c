@@ -0,0 +1,275 @@
+#include "ratelimit.h"
+#include "logger.h"
+#include "lockprof.h"
+#include "memacct.h"
+#include <arpa/inet.h>
+
+#define RATE_LIMITED(cmd, label) \
+    [COMMAND_##cmd] = METRIC_COUNTER_INIT("quiz_rate_limited_total", "Commands dropped for going over a rate limit, by type", "command=\"" label "\"")
+
+metric_counter_t metric_rate_limited[COMMAND_TYPE_COUNT] = {
+    RATE_LIMITED(ANSWER, "answer"), RATE_LIMITED(HELP, "help"), RATE_LIMITED(JOIN, "join"), RATE_LIMITED(LOGIN, "login"),
+    RATE_LIMITED(LOGOUT, "logout"), RATE_LIMITED(MEOW, "meow"), RATE_LIMITED(REGISTER, "register"), RATE_LIMITED(STATS, "stats"),
+    RATE_LIMITED(START, "start"), RATE_LIMITED(SPECTATE, "spectate"), RATE_LIMITED(QUEUE, "queue"), RATE_LIMITED(RESUME, "resume"), RATE_LIMITED(QUIT, "quit"), RATE_LIMITED(UNKNOWN, "unknown")
+};
+metric_counter_t metric_rate_ip_limited = METRIC_COUNTER_INIT("quiz_rate_ip_limited_total", "Dropped commands whose address was over its limit", NULL);
+metric_counter_t metric_rate_delayed = METRIC_COUNTER_INIT("quiz_rate_delayed_total", "Commands held back until their tokens refilled", NULL);
+metric_counter_t metric_rate_disconnects = METRIC_COUNTER_INIT("quiz_rate_disconnects_total", "Connections closed for going over a rate limit", NULL);
+
+// login and register rewrite users.xml, resume tries a token
+static int command_costs[COMMAND_TYPE_COUNT] = {
+    [COMMAND_ANSWER] = 1, [COMMAND_HELP] = 1, [COMMAND_JOIN] = 2, [COMMAND_LOGIN] = 10,
+    [COMMAND_LOGOUT] = 2, [COMMAND_MEOW] = 1, [COMMAND_REGISTER] = 10, [COMMAND_STATS] = 1,
+    [COMMAND_START] = 2, [COMMAND_SPECTATE] = 2, [COMMAND_QUEUE] = 2, [COMMAND_RESUME] = 10,
+    [COMMAND_QUIT] = 0, [COMMAND_UNKNOWN] = 1
+};
+
+// Tokens are kept in thousandths
+typedef struct {
+    int64_t milli;
+    uint64_t at_us;
+} rate_bucket_t;
+
+typedef struct {
+    int rate;
+    int burst;
+} rate_config_t;
+
+static rate_config_t conn_config = { RATE_CONN_RATE, RATE_CONN_BURST };
+static rate_config_t ip_config = { RATE_IP_RATE, RATE_IP_BURST };
+
+typedef struct _rate_ip_t {
+    uint32_t addr;
+    int refs;                    // connections from it, under the table lock
+    rate_bucket_t bucket;
+    pthread_mutex_t lock;
+    struct _rate_ip_t* next;
+} rate_ip_t;
+
+typedef struct _rate_limit_t {
+    rate_bucket_t bucket;
+    rate_ip_t* ip;
+    int rejects;                 // in a row
+} rate_limit_t;
+
+static struct {
+    pthread_mutex_t lock;
+    rate_ip_t* buckets[RATE_IP_BUCKETS];
+} addresses = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+//
+//  Buckets
+//
+
+static void bucket_fill(rate_bucket_t* bucket, const rate_config_t* config, uint64_t now) {
+    bucket->milli += (int64_t) ((now - bucket->at_us) * config->rate / 1000);
+    if (bucket->milli > (int64_t) config->burst * 1000)
+        bucket->milli = (int64_t) config->burst * 1000;
+    bucket->at_us = now;
+}
+
+// Microseconds until 'cost' tokens are there
+static uint64_t bucket_wait(const rate_bucket_t* bucket, const rate_config_t* config, int cost) {
+    int64_t missing = (int64_t) cost * 1000 - bucket->milli;
+    if (missing <= 0) return 0;
+    return (uint64_t) missing * 1000 / config->rate;
+}
+
+static bool bucket_full(rate_bucket_t* bucket, const rate_config_t* config, uint64_t now) {
+    bucket_fill(bucket, config, now);
+    return bucket->milli >= (int64_t) config->burst * 1000;
+}
+
+//
+//  Addresses (table lock held)
+//
+
+// Also frees the unused entries it passes once they have refilled, so an
+// address can't reset its bucket by reconnecting
+static rate_ip_t* ip_take(uint32_t addr, uint64_t now) {
+    rate_ip_t** link = &addresses.buckets[addr % RATE_IP_BUCKETS];
+    rate_ip_t* found = NULL;
+    while (*link) {
+        rate_ip_t* entry = *link;
+        if (entry->addr == addr) {
+            found = entry;
+        } else if (entry->refs == 0) {
+            MUTEX_LOCK(&entry->lock);
+            bool idle = bucket_full(&entry->bucket, &ip_config, now);
+            MUTEX_UNLOCK(&entry->lock);
+            if (idle) {
+                *link = entry->next;
+                pthread_mutex_destroy(&entry->lock);
+                mem_free(MEM_NETWORK, entry);
+                continue;
+            }
+        }
+        link = &entry->next;
+    }
+    if (!found) {
+        found = mem_calloc(MEM_NETWORK, 1, sizeof(rate_ip_t));
+        if (!found) return NULL;
+        found->addr = addr;
+        found->bucket = (rate_bucket_t) { (int64_t) ip_config.burst * 1000, now };
+        pthread_mutex_init(&found->lock, NULL);
+        found->next = addresses.buckets[addr % RATE_IP_BUCKETS];
+        addresses.buckets[addr % RATE_IP_BUCKETS] = found;
+    }
+    found->refs++;
+    return found;
+}
+
+//
+//  API
+//
+
+void ratelimit_attach(client_t* client) {
+    client->rate = NULL;
+    if (conn_config.rate == 0 && ip_config.rate == 0)
+        return;
+    rate_limit_t* limit = mem_calloc(MEM_NETWORK, 1, sizeof(rate_limit_t));
+    if (!limit) return;
+    uint64_t now = metrics_now_us();
+    limit->bucket = (rate_bucket_t) { (int64_t) conn_config.burst * 1000, now };
+
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    if (ip_config.rate > 0 && getpeername(client->socket_fd, (struct sockaddr*) &peer, &len) == 0 &&
+        peer.sin_family == AF_INET) {
+        uint32_t addr = ntohl(peer.sin_addr.s_addr);
+        if ((addr >> 24) != 127) {
+            MUTEX_LOCK(&addresses.lock);
+            limit->ip = ip_take(addr, now);
+            MUTEX_UNLOCK(&addresses.lock);
+        }
+    }
+    client->rate = limit;
+}
+
+void ratelimit_release(client_t* client) {
+    rate_limit_t* limit = client->rate;
+    if (!limit) return;
+    client->rate = NULL;
+    if (limit->ip) {
+        MUTEX_LOCK(&addresses.lock);
+        limit->ip->refs--;
+        MUTEX_UNLOCK(&addresses.lock);
+    }
+    mem_free(MEM_NETWORK, limit);
+}
+
+void ratelimit_move(client_t* from, client_t* to) {
+    to->rate = from->rate;
+    from->rate = NULL;
+}
+
+rate_verdict_t ratelimit_take(client_t* client, command_type_t type) {
+    rate_limit_t* limit = client->rate;
+    int cost = command_costs[type];
+    if (!limit || cost == 0) return RATE_OK;
+
+    rate_ip_t* ip = limit->ip;
+    while (true) {
+        uint64_t now = metrics_now_us();
+        uint64_t conn_wait = 0, ip_wait = 0;
+        if (conn_config.rate > 0) {
+            bucket_fill(&limit->bucket, &conn_config, now);
+            conn_wait = bucket_wait(&limit->bucket, &conn_config, cost);
+        }
+        if (ip) {
+            MUTEX_LOCK(&ip->lock);
+            bucket_fill(&ip->bucket, &ip_config, now);
+            ip_wait = bucket_wait(&ip->bucket, &ip_config, cost);
+            if (conn_wait == 0 && ip_wait == 0)
+                ip->bucket.milli -= (int64_t) cost * 1000;
+            MUTEX_UNLOCK(&ip->lock);
+        }
+
+        uint64_t wait = conn_wait > ip_wait ? conn_wait : ip_wait;
+        if (wait == 0) {
+            limit->bucket.milli -= (int64_t) cost * 1000;
+            limit->rejects = 0;
+            return RATE_OK;
+        }
+        if (wait > RATE_MAX_DELAY_US) {
+            counter_add(&metric_rate_limited[type], 1);
+            if (ip_wait > conn_wait)
+                counter_add(&metric_rate_ip_limited, 1);
+            if (++limit->rejects < RATE_MAX_REJECTS)
+                return RATE_REJECTED;
+            counter_add(&metric_rate_disconnects, 1);
+            LOG_WARN("[RATE] Closing connection %u (%s): %d commands over the limit in a row",
+                     client->conn_id, client->username, limit->rejects);
+            return RATE_DISCONNECT;
+        }
+        // Another connection from the address may get there first; look again
+        counter_add(&metric_rate_delayed, 1);
+        usleep(wait);
+    }
+}
+
+//
+//  Settings
+//
+
+static void parse_config(const char* env, rate_config_t* config) {
+    const char* value = getenv(env);
+    if (!value) return;
+    int rate, burst;
+    int fields = sscanf(value, "%d:%d", &rate, &burst);
+    if (fields >= 1 && rate == 0) {
+        config->rate = 0;
+    } else if (fields == 2 && rate > 0 && burst > 0) {
+        config->rate = rate;
+        config->burst = burst;
+    } else {
+        LOG_WARN("[RATE] Ignoring %s=%s, expected rate:burst or 0", env, value);
+    }
+}
+
+static void parse_costs(const char* value) {
+    char copy[BUFF_SIZE];
+    snprintf(copy, sizeof(copy), "%s", value);
+    char* save = NULL;
+    for (char* item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char* equals = strchr(item, '=');
+        int type = 0;
+        if (equals) {
+            *equals = '\0';
+            while (type < COMMAND_TYPE_COUNT && strcmp(command_names[type], item) != 0)
+                type++;
+        }
+        if (!equals || type == COMMAND_TYPE_COUNT || atoi(equals + 1) < 0) {
+            LOG_WARN("[RATE] Ignoring '%s' in QUIZ_RATE_COST, expected command=cost", item);
+            continue;
+        }
+        command_costs[type] = atoi(equals + 1);
+    }
+}
+
+void ratelimit_start() {
+    for (int i = 0; i < COMMAND_TYPE_COUNT; i++)
+        metrics_register(&metric_rate_limited[i].base);
+    metrics_register(&metric_rate_ip_limited.base);
+    metrics_register(&metric_rate_delayed.base);
+    metrics_register(&metric_rate_disconnects.base);
+
+    parse_config("QUIZ_RATE_CONN", &conn_config);
+    parse_config("QUIZ_RATE_IP", &ip_config);
+    const char* costs = getenv("QUIZ_RATE_COST");
+    if (costs) parse_costs(costs);
+
+    if (conn_config.rate == 0 && ip_config.rate == 0) {
+        LOG_INFO("[RATE] Rate limiting is off");
+        return;
+    }
+    int largest = conn_config.rate ? conn_config.burst : ip_config.burst;
+    if (ip_config.rate && ip_config.burst < largest)
+        largest = ip_config.burst;
+    for (int i = 0; i < COMMAND_TYPE_COUNT; i++) {
+        if (command_costs[i] > largest) {
+            LOG_WARN("[RATE] '%s' costs more than a full bucket, capping it at %d", command_names[i], largest);
+            command_costs[i] = largest;
+        }
+    }
+}
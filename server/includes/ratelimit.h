@@ -0,0 +1,46 @@
+#pragma once
+#include "utils.h"
+#include "metrics.h"
+
+// Tokens per second and burst size of a connection's bucket, QUIZ_RATE_CONN="rate:burst"
+#define RATE_CONN_RATE 10
+#define RATE_CONN_BURST 40
+// Shared by every connection from one address, QUIZ_RATE_IP="rate:burst".
+// Either set to 0 turns that bucket off. Loopback has no address bucket, so
+// loadgen and local clients are only limited per connection.
+#define RATE_IP_RATE 50
+#define RATE_IP_BURST 200
+#define RATE_IP_BUCKETS 1024
+// A command short of tokens by no more than this much waits for them instead
+// of being dropped, which holds the connection's reads back
+#define RATE_MAX_DELAY_US 250000
+// Dropped commands in a row before the connection is closed
+#define RATE_MAX_REJECTS 20
+
+extern metric_counter_t metric_rate_limited[COMMAND_TYPE_COUNT];
+extern metric_counter_t metric_rate_ip_limited;
+extern metric_counter_t metric_rate_delayed;
+extern metric_counter_t metric_rate_disconnects;
+
+typedef enum {
+    RATE_OK,
+    RATE_REJECTED,      // drop the command
+    RATE_DISCONNECT     // and close the connection
+} rate_verdict_t;
+
+// Every command a socket client sends costs tokens from its connection's
+// bucket and its address's bucket; commands that rewrite users.xml or could
+// guess a token cost the most. QUIZ_RATE_COST overrides single costs, e.g.
+// "login=5,meow=0". In-process clients (simulate.c) aren't limited.
+
+// Reads the QUIZ_RATE_* settings and registers the quiz_rate* metrics. Call before metrics_start().
+void ratelimit_start();
+// Gives a new connection its buckets; the address comes from its socket
+void ratelimit_attach(client_t* client);
+// The connection is closing
+void ratelimit_release(client_t* client);
+// 'to' carries on with the connection 'from' was serving (a resume)
+void ratelimit_move(client_t* from, client_t* to);
+// Charges a command of 'type', waiting up to RATE_MAX_DELAY_US for tokens.
+// Always RATE_OK for clients without buckets.
+rate_verdict_t ratelimit_take(client_t* client, command_type_t type);
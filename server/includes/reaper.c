@@ -0,0 +1,234 @@
+#include "reaper.h"
+#include "logger.h"
+#include "lockprof.h"
+#include "memacct.h"
+#include "upgrade.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <netinet/tcp.h>
+
+metric_counter_t metric_reaped[REAP_KIND_COUNT] = {
+    [REAP_ANONYMOUS] = METRIC_COUNTER_INIT("quiz_reaper_closed_total", "Idle connections closed, by what they were doing", "state=\"anonymous\""),
+    [REAP_LOBBY] = METRIC_COUNTER_INIT("quiz_reaper_closed_total", "Idle connections closed, by what they were doing", "state=\"lobby\""),
+    [REAP_GAME] = METRIC_COUNTER_INIT("quiz_reaper_closed_total", "Idle connections closed, by what they were doing", "state=\"game\"")
+};
+metric_gauge_t metric_reaper_tracked = METRIC_GAUGE_INIT("quiz_reaper_connections", "Connections with an idle timer", NULL);
+
+static const char* kind_names[REAP_KIND_COUNT] = { "anonymous", "lobby", "game" };
+
+static uint64_t timeouts_us[REAP_KIND_COUNT] = {
+    (uint64_t) REAPER_ANONYMOUS_S * 1000000, (uint64_t) REAPER_LOBBY_S * 1000000, (uint64_t) REAPER_GAME_S * 1000000
+};
+static struct {
+    int idle;
+    int interval;
+    int count;
+} keepalive = { REAPER_KEEPALIVE_IDLE_S, REAPER_KEEPALIVE_INTERVAL_S, REAPER_KEEPALIVE_COUNT };
+
+typedef struct _reap_entry_t {
+    client_t* client;                // under the wheel lock
+    _Atomic uint64_t active_us;      // last command
+    uint64_t tick;                   // first one at or after its deadline
+    int slot;                        // -1 once reaped
+    struct _reap_entry_t* prev;
+    struct _reap_entry_t* next;
+} reap_entry_t;
+
+static struct {
+    pthread_mutex_t lock;
+    reap_entry_t* slots[REAPER_SLOTS];
+    uint64_t tick;                   // next one to run, or the one running
+} wheel = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+//
+//  Wheel (wheel lock held)
+//
+
+static void wheel_link(reap_entry_t* entry, uint64_t due_us) {
+    uint64_t tick = (due_us + REAPER_TICK_US - 1) / REAPER_TICK_US;
+    if (tick <= wheel.tick)
+        tick = wheel.tick + 1;
+    entry->tick = tick;
+    entry->slot = tick % REAPER_SLOTS;
+    entry->prev = NULL;
+    entry->next = wheel.slots[entry->slot];
+    if (entry->next) entry->next->prev = entry;
+    wheel.slots[entry->slot] = entry;
+}
+
+static void wheel_unlink(reap_entry_t* entry) {
+    if (entry->slot < 0) return;
+    if (entry->prev) entry->prev->next = entry->next;
+    else wheel.slots[entry->slot] = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    entry->slot = -1;
+}
+
+// Unlocked reads of the state, like the game thread's; a stale one only
+// moves the deadline to the next look
+static reap_kind_t kind_of(client_t* client) {
+    if (!client->user_data) return REAP_ANONYMOUS;
+    return client->state == CLIENT_IN_GAME ? REAP_GAME : REAP_LOBBY;
+}
+
+static uint64_t next_look(reap_entry_t* entry, uint64_t now) {
+    uint64_t timeout = timeouts_us[kind_of(entry->client)];
+    uint64_t recheck = now + REAPER_RECHECK_US;
+    if (timeout == 0) return recheck;
+    uint64_t deadline = atomic_load_explicit(&entry->active_us, memory_order_relaxed) + timeout;
+    return deadline < recheck ? deadline : recheck;
+}
+
+static void run_tick(uint64_t tick, uint64_t now) {
+    reap_entry_t* entry = wheel.slots[tick % REAPER_SLOTS];
+    while (entry) {
+        reap_entry_t* next = entry->next;
+        // Later turns of the wheel share the slot
+        if (entry->tick > tick) {
+            entry = next;
+            continue;
+        }
+        wheel_unlink(entry);
+        client_t* client = entry->client;
+        reap_kind_t kind = kind_of(client);
+        uint64_t idle = now - atomic_load_explicit(&entry->active_us, memory_order_relaxed);
+        if (timeouts_us[kind] == 0 || idle < timeouts_us[kind]) {
+            wheel_link(entry, next_look(entry, now));
+        } else {
+            // Left unlinked; the client thread frees it once recv() returns
+            counter_add(&metric_reaped[kind], 1);
+            LOG_INFO("[REAPER] Closing connection %u (%s, %s): idle for %llus",
+                     client->conn_id, client->username, kind_names[kind], (unsigned long long) (idle / 1000000));
+            shutdown(client->socket_fd, SHUT_RDWR);
+        }
+        entry = next;
+    }
+}
+
+//
+//  API
+//
+
+static void set_keepalive(int fd) {
+    if (keepalive.idle == 0) return;
+    int on = 1;
+    unsigned int user_timeout = (unsigned int) (keepalive.idle + keepalive.interval * keepalive.count) * 1000;
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive.idle, sizeof(int)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepalive.interval, sizeof(int)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &keepalive.count, sizeof(int)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout)) < 0)
+        LOG_WARN("[REAPER] Couldn't set keepalive on socket %d: %s", fd, strerror(errno));
+}
+
+void reaper_attach(client_t* client) {
+    client->reap = NULL;
+    set_keepalive(client->socket_fd);
+    reap_entry_t* entry = mem_calloc(MEM_NETWORK, 1, sizeof(reap_entry_t));
+    if (!entry) return;
+    uint64_t now = metrics_now_us();
+    entry->client = client;
+    atomic_init(&entry->active_us, now);
+
+    MUTEX_LOCK(&wheel.lock);
+    wheel_link(entry, next_look(entry, now));
+    MUTEX_UNLOCK(&wheel.lock);
+    client->reap = entry;
+    gauge_add(&metric_reaper_tracked, 1);
+}
+
+void reaper_touch(client_t* client) {
+    if (client->reap)
+        atomic_store_explicit(&client->reap->active_us, metrics_now_us(), memory_order_relaxed);
+}
+
+void reaper_release(client_t* client) {
+    reap_entry_t* entry = client->reap;
+    if (!entry) return;
+    client->reap = NULL;
+    MUTEX_LOCK(&wheel.lock);
+    wheel_unlink(entry);
+    MUTEX_UNLOCK(&wheel.lock);
+    mem_free(MEM_NETWORK, entry);
+    gauge_add(&metric_reaper_tracked, -1);
+}
+
+void reaper_move(client_t* from, client_t* to) {
+    reap_entry_t* entry = from->reap;
+    from->reap = NULL;
+    to->reap = entry;
+    if (!entry) return;
+    MUTEX_LOCK(&wheel.lock);
+    entry->client = to;
+    MUTEX_UNLOCK(&wheel.lock);
+}
+
+//
+//  Reaper thread
+//
+
+// Real time, like the other infrastructure threads
+static void* reaper_thread(void* arg) {
+    (void) arg;
+    log_set_thread_name("reaper");
+    while (true) {
+        uint64_t now = metrics_now_us();
+        uint64_t current = now / REAPER_TICK_US;
+        // Handed over sockets are the new process's to shut down
+        upgrade_step_begin();
+        MUTEX_LOCK(&wheel.lock);
+        // After a long stall one turn of the wheel visits every slot
+        if (current >= wheel.tick + REAPER_SLOTS)
+            wheel.tick = current - REAPER_SLOTS + 1;
+        for (; wheel.tick <= current; wheel.tick++)
+            run_tick(wheel.tick, now);
+        MUTEX_UNLOCK(&wheel.lock);
+        upgrade_step_end();
+
+        uint64_t wait = wheel.tick * REAPER_TICK_US - now;
+        struct timespec sleep = { wait / 1000000, (wait % 1000000) * 1000L };
+        nanosleep(&sleep, NULL);
+    }
+    return NULL;
+}
+
+static void parse_timeouts(const char* value) {
+    int seconds[REAP_KIND_COUNT];
+    if (sscanf(value, "%d:%d:%d", &seconds[REAP_ANONYMOUS], &seconds[REAP_LOBBY], &seconds[REAP_GAME]) != REAP_KIND_COUNT ||
+        seconds[REAP_ANONYMOUS] < 0 || seconds[REAP_LOBBY] < 0 || seconds[REAP_GAME] < 0) {
+        LOG_WARN("[REAPER] Ignoring QUIZ_IDLE_TIMEOUT=%s, expected anonymous:lobby:game seconds", value);
+        return;
+    }
+    for (int i = 0; i < REAP_KIND_COUNT; i++)
+        timeouts_us[i] = (uint64_t) seconds[i] * 1000000;
+}
+
+static void parse_keepalive(const char* value) {
+    int idle, interval, count;
+    int fields = sscanf(value, "%d:%d:%d", &idle, &interval, &count);
+    if (fields >= 1 && idle == 0) {
+        keepalive.idle = 0;
+    } else if (fields == 3 && idle > 0 && interval > 0 && count > 0) {
+        keepalive.idle = idle;
+        keepalive.interval = interval;
+        keepalive.count = count;
+    } else {
+        LOG_WARN("[REAPER] Ignoring QUIZ_KEEPALIVE=%s, expected idle:interval:count seconds or 0", value);
+    }
+}
+
+void reaper_start() {
+    for (int i = 0; i < REAP_KIND_COUNT; i++)
+        metrics_register(&metric_reaped[i].base);
+    metrics_register(&metric_reaper_tracked.base);
+
+    const char* env = getenv("QUIZ_IDLE_TIMEOUT");
+    if (env) parse_timeouts(env);
+    env = getenv("QUIZ_KEEPALIVE");
+    if (env) parse_keepalive(env);
+    wheel.tick = metrics_now_us() / REAPER_TICK_US;
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, reaper_thread, NULL);
+    pthread_detach(thread);
+}
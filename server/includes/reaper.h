@@ -0,0 +1,50 @@
+#pragma once
+#include "utils.h"
+#include "metrics.h"
+
+// Seconds without a command before a connection is closed, by what it is
+// doing, QUIZ_IDLE_TIMEOUT="anonymous:lobby:game". 0 never closes that kind.
+#define REAPER_ANONYMOUS_S 120
+#define REAPER_LOBBY_S 1800      // logged in but not playing: lobby, queue, spectating
+#define REAPER_GAME_S 900
+// TCP keepalive, QUIZ_KEEPALIVE="idle:interval:count" in seconds, or 0 to
+// leave the kernel's defaults. The same total bounds how long sent data may
+// go unacknowledged (TCP_USER_TIMEOUT).
+#define REAPER_KEEPALIVE_IDLE_S 60
+#define REAPER_KEEPALIVE_INTERVAL_S 10
+#define REAPER_KEEPALIVE_COUNT 6
+// Timer wheel: one slot per tick, a full turn covers REAPER_SLOTS seconds
+#define REAPER_TICK_US 1000000
+#define REAPER_SLOTS 512
+// A connection is looked at again at least this often, so a state change
+// to a shorter timeout takes effect
+#define REAPER_RECHECK_US 60000000
+
+typedef enum {
+    REAP_ANONYMOUS,
+    REAP_LOBBY,
+    REAP_GAME,
+    REAP_KIND_COUNT
+} reap_kind_t;
+
+extern metric_counter_t metric_reaped[REAP_KIND_COUNT];
+extern metric_gauge_t metric_reaper_tracked;
+
+// Every socket connection sits in a timer wheel under its next deadline.
+// Commands only stamp the connection's last activity; when its slot comes
+// round the reaper thread works out the real deadline and either moves it
+// on or shuts the socket down, so the client thread's recv() returns and
+// takes the normal drop path (a logged in player's seat is held, see
+// resume.h). Keepalive turns a peer that vanished without a FIN into a
+// recv() error the same way.
+
+// Reads the settings, registers the quiz_reaper* metrics and starts the reaper. Call before metrics_start().
+void reaper_start();
+// Sets keepalive on the connection's socket and starts its idle timer
+void reaper_attach(client_t* client);
+// A command arrived
+void reaper_touch(client_t* client);
+// The connection is going away; call before its socket is closed
+void reaper_release(client_t* client);
+// 'to' carries on with the connection 'from' was serving (a resume)
+void reaper_move(client_t* from, client_t* to);
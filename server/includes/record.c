@@ -0,0 +1,70 @@
+#include "record.h"
+#include "lockprof.h"
+#include "logger.h"
+#include "utils.h"
+#include <errno.h>
+
+extern question_t** questions;
+extern int question_count;
+
+atomic_bool record_on = false;
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* record_file = NULL;
+static uint64_t record_epoch;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Records are written in the order they're taken under the lock, so a reply
+// recorded before it's sent always precedes the command it prompted
+void record_event(record_type_t type, uint32_t conn, const void* data, size_t len) {
+    if (!record_enabled()) return;
+
+    MUTEX_LOCK(&record_lock);
+    if (record_file) {
+        record_header_t header = { now_us() - record_epoch, conn, (uint32_t) len, type, 0 };
+        fwrite(&header, sizeof(header), 1, record_file);
+        if (len > 0)
+            fwrite(data, 1, len, record_file);
+    }
+    MUTEX_UNLOCK(&record_lock);
+}
+
+static void record_stop() {
+    atomic_store(&record_on, false);
+    MUTEX_LOCK(&record_lock);
+    if (record_file) {
+        fclose(record_file);
+        record_file = NULL;
+    }
+    MUTEX_UNLOCK(&record_lock);
+}
+
+void record_start() {
+    const char* path = getenv("QUIZ_RECORD");
+    if (!path || !*path) return;
+
+    record_file = fopen(path, "wb");
+    if (!record_file) {
+        LOG_ERROR("[RECORD] Error - cannot write %s: %s", path, strerror(errno));
+        return;
+    }
+    setvbuf(record_file, NULL, _IOFBF, 1 << 20);
+    fwrite(RECORD_MAGIC, 1, strlen(RECORD_MAGIC), record_file);
+    record_epoch = now_us();
+    atomic_store(&record_on, true);
+    atexit(record_stop);
+
+    uint32_t* ids = malloc((question_count ? question_count : 1) * sizeof(uint32_t));
+    if (ids) {
+        for (int i = 0; i < question_count; i++)
+            ids[i] = questions[i]->id;
+        record_event(RECORD_QUESTIONS, 0, ids, question_count * sizeof(uint32_t));
+        free(ids);
+    }
+    LOG_INFO("[RECORD] Recording session to %s", path);
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Capture files start with RECORD_MAGIC followed by records: a header, then
+// 'len' bytes of payload. Fields are host byte order, times are microseconds
+// since recording started.
+#define RECORD_MAGIC "QREC1\n"
+
+typedef enum {
+    RECORD_QUESTIONS,    // payload: uint32_t question ids in the order they were loaded
+    RECORD_CONNECT,
+    RECORD_COMMAND,      // payload: bytes received from 'conn'
+    RECORD_SEND,         // payload: bytes sent to 'conn'
+    RECORD_DISCONNECT,
+    RECORD_QUESTION,     // 'conn' holds the index of the question being asked
+    RECORD_TYPE_COUNT
+} record_type_t;
+
+typedef struct {
+    uint64_t time_us;
+    uint32_t conn;
+    uint32_t len;
+    uint32_t type;
+    uint32_t reserved;
+} record_header_t;
+
+extern atomic_bool record_on;
+
+static inline bool record_enabled() {
+    return atomic_load_explicit(&record_on, memory_order_relaxed);
+}
+
+// QUIZ_RECORD=path captures every connection, command, reply and question
+// asked to 'path'. Call after the questions are loaded.
+void record_start();
+void record_event(record_type_t type, uint32_t conn, const void* data, size_t len);
@@ -0,0 +1,233 @@
+#include "resume.h"
+#include "logger.h"
+#include "clock.h"
+#include "memacct.h"
+#include "lockprof.h"
+#include "upgrade.h"
+#include <sys/random.h>
+
+// Defined in server.c
+void release_seat(client_t* client);
+
+typedef struct _resume_entry_t {
+    char token[RESUME_TOKEN_LEN + 1];
+    client_t* client;
+    uint64_t expires_us;               // 0 while the client is connected
+    struct _resume_entry_t* next;      // in its bucket
+    struct _resume_entry_t* older;     // detached entries, by expiry
+    struct _resume_entry_t* newer;
+} resume_entry_t;
+
+metric_gauge_t metric_resume_held = METRIC_GAUGE_INIT("quiz_resume_seats_held", "Dropped connections whose seat is kept for a resume", NULL);
+metric_counter_t metric_resumes = METRIC_COUNTER_INIT("quiz_resumes_total", "Connections that took over a held seat", NULL);
+metric_counter_t metric_resume_expired = METRIC_COUNTER_INIT("quiz_resume_expired_total", "Held seats released after the grace period", NULL);
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    resume_entry_t* buckets[RESUME_BUCKETS];
+    // The grace period is fixed, so detach order is expiry order
+    resume_entry_t* oldest;
+    resume_entry_t* newest;
+} table = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static uint32_t bucket_of(const char* token) {
+    uint32_t hash = 2166136261u;
+    for (const char* c = token; *c; c++)
+        hash = (hash ^ (uint8_t) *c) * 16777619u;
+    return hash % RESUME_BUCKETS;
+}
+
+//
+//  Table (table lock held)
+//
+
+static resume_entry_t* lookup(const char* token) {
+    for (resume_entry_t* entry = table.buckets[bucket_of(token)]; entry; entry = entry->next)
+        if (strcmp(entry->token, token) == 0)
+            return entry;
+    return NULL;
+}
+
+static void unlink_bucket(resume_entry_t* entry) {
+    resume_entry_t** link = &table.buckets[bucket_of(entry->token)];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+}
+
+static void unlink_detached(resume_entry_t* entry) {
+    if (entry->older) entry->older->newer = entry->newer;
+    else table.oldest = entry->newer;
+    if (entry->newer) entry->newer->older = entry->older;
+    else table.newest = entry->older;
+    entry->older = entry->newer = NULL;
+    entry->expires_us = 0;
+}
+
+static void link_bucket(resume_entry_t* entry) {
+    uint32_t bucket = bucket_of(entry->token);
+    entry->next = table.buckets[bucket];
+    table.buckets[bucket] = entry;
+    entry->client->resume = entry;
+}
+
+static void link_detached(resume_entry_t* entry) {
+    entry->expires_us = clock_now_us() + RESUME_GRACE_US;
+    entry->older = table.newest;
+    entry->newer = NULL;
+    if (table.newest) table.newest->newer = entry;
+    else table.oldest = entry;
+    table.newest = entry;
+    MUTEX_COND_BROADCAST(&table.wake);
+}
+
+//
+//  API
+//
+
+bool resume_issue(client_t* client, char token[RESUME_TOKEN_LEN + 1]) {
+    uint8_t bytes[RESUME_TOKEN_LEN / 2];
+    if (getrandom(bytes, sizeof(bytes), 0) != (ssize_t) sizeof(bytes)) {
+        LOG_WARN("[RESUME] No randomness for a token, %s can't resume", client->username);
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(bytes); i++)
+        snprintf(token + 2 * i, 3, "%02x", bytes[i]);
+
+    resume_entry_t* entry = mem_calloc(MEM_NETWORK, 1, sizeof(resume_entry_t));
+    if (!entry) return false;
+    memcpy(entry->token, token, RESUME_TOKEN_LEN + 1);
+    entry->client = client;
+
+    resume_revoke(client);
+    MUTEX_LOCK(&table.lock);
+    link_bucket(entry);
+    MUTEX_UNLOCK(&table.lock);
+    return true;
+}
+
+bool resume_adopt(client_t* client, const char* token) {
+    if (strspn(token, "0123456789abcdef") != RESUME_TOKEN_LEN || token[RESUME_TOKEN_LEN] != '\0')
+        return false;
+    resume_entry_t* entry = mem_calloc(MEM_NETWORK, 1, sizeof(resume_entry_t));
+    if (!entry) return false;
+    memcpy(entry->token, token, RESUME_TOKEN_LEN + 1);
+    entry->client = client;
+
+    MUTEX_LOCK(&table.lock);
+    bool taken = lookup(token) != NULL;
+    if (!taken) {
+        link_bucket(entry);
+        link_detached(entry);
+    }
+    MUTEX_UNLOCK(&table.lock);
+
+    if (taken) {
+        mem_free(MEM_NETWORK, entry);
+        return false;
+    }
+    gauge_add(&metric_resume_held, 1);
+    return true;
+}
+
+bool resume_token(client_t* client, char token[RESUME_TOKEN_LEN + 1]) {
+    MUTEX_LOCK(&table.lock);
+    resume_entry_t* entry = client->resume;
+    if (entry)
+        memcpy(token, entry->token, RESUME_TOKEN_LEN + 1);
+    MUTEX_UNLOCK(&table.lock);
+    return entry != NULL;
+}
+
+void resume_revoke(client_t* client) {
+    MUTEX_LOCK(&table.lock);
+    resume_entry_t* entry = client->resume;
+    if (entry) {
+        unlink_bucket(entry);
+        client->resume = NULL;
+    }
+    MUTEX_UNLOCK(&table.lock);
+    mem_free(MEM_NETWORK, entry);
+}
+
+void resume_detach(client_t* client) {
+    MUTEX_LOCK(&table.lock);
+    link_detached(client->resume);
+    MUTEX_UNLOCK(&table.lock);
+
+    gauge_add(&metric_resume_held, 1);
+}
+
+client_t* resume_claim(const char* token) {
+    if (strlen(token) != RESUME_TOKEN_LEN) return NULL;
+
+    MUTEX_LOCK(&table.lock);
+    resume_entry_t* entry = lookup(token);
+    client_t* client = NULL;
+    if (entry && entry->expires_us != 0) {
+        unlink_detached(entry);
+        client = entry->client;
+    }
+    MUTEX_UNLOCK(&table.lock);
+
+    if (!client) return NULL;
+    gauge_add(&metric_resume_held, -1);
+    counter_add(&metric_resumes, 1);
+    return client;
+}
+
+//
+//  Sweeper
+//
+
+// Attached to the game clock like the other timers; waits without a deadline
+// while no seat is held
+static void* sweeper_thread(void* arg) {
+    (void) arg;
+    log_set_thread_name("resume");
+    clock_attach();
+
+    MUTEX_LOCK(&table.lock);
+    while (true) {
+        while (!table.oldest)
+            MUTEX_COND_WAIT(&table.wake, &table.lock);
+
+        uint64_t now = clock_now_us();
+        resume_entry_t* entry = table.oldest;
+        if (entry->expires_us > now) {
+            // A claim may unlink it meanwhile; the next pass looks again
+            uint64_t wait = entry->expires_us - now;
+            MUTEX_UNLOCK(&table.lock);
+            clock_sleep_us(wait);
+            MUTEX_LOCK(&table.lock);
+            continue;
+        }
+
+        unlink_detached(entry);
+        unlink_bucket(entry);
+        client_t* client = entry->client;
+        client->resume = NULL;
+        MUTEX_UNLOCK(&table.lock);
+
+        gauge_add(&metric_resume_held, -1);
+        counter_add(&metric_resume_expired, 1);
+        LOG_INFO("[RESUME] %s didn't come back, releasing their seat", client->username);
+        mem_free(MEM_NETWORK, entry);
+        upgrade_step_begin();
+        release_seat(client);
+        upgrade_step_end();
+        MUTEX_LOCK(&table.lock);
+    }
+    return NULL;
+}
+
+void resume_start() {
+    metrics_register(&metric_resume_held.base);
+    metrics_register(&metric_resumes.base);
+    metrics_register(&metric_resume_expired.base);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, sweeper_thread, NULL);
+    pthread_detach(thread);
+}
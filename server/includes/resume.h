@@ -0,0 +1,38 @@
+#pragma once
+#include "utils.h"
+#include "metrics.h"
+
+// Hex characters in a token (128 random bits)
+#define RESUME_TOKEN_LEN 32
+#define RESUME_BUCKETS 4096
+// How long a dropped connection keeps its seat
+#define RESUME_GRACE_US 60000000
+
+extern metric_gauge_t metric_resume_held;
+extern metric_counter_t metric_resumes;
+extern metric_counter_t metric_resume_expired;
+
+// Every logged in socket client holds a token. When its connection drops the
+// client_t is kept, seat and score included, instead of being freed; a new
+// connection that sends 'resume : <token>' within RESUME_GRACE_US carries on
+// as that client without a login. Otherwise the sweeper hands it to
+// release_seat() (server.c).
+
+// Registers the quiz_resume* metrics and starts the sweeper. Call before metrics_start().
+void resume_start();
+// Issues a new token for 'client' (replacing any it had) and writes it to
+// 'token'. False if no randomness was available.
+bool resume_issue(client_t* client, char token[RESUME_TOKEN_LEN + 1]);
+// Takes 'token' (from a snapshot) for a client with no connection yet, and
+// detaches it right away. False if the token is malformed or already taken.
+bool resume_adopt(client_t* client, const char* token);
+// Copies the client's token to 'token'; false if it has none
+bool resume_token(client_t* client, char token[RESUME_TOKEN_LEN + 1]);
+// Forgets the client's token, e.g. on logout
+void resume_revoke(client_t* client);
+// The client's connection dropped; its grace period starts now. Only for
+// clients holding a token.
+void resume_detach(client_t* client);
+// The detached client holding 'token', taken off the sweeper's list, or NULL
+// if the token is unknown, expired, or still in use by a live connection
+client_t* resume_claim(const char* token);
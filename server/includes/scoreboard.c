@@ -0,0 +1,165 @@
+#include "scoreboard.h"
+#include "utils.h"
+#include "logger.h"
+#include "clock.h"
+#include "memacct.h"
+#include "lockprof.h"
+
+// Defined in server.c
+void broadcast_all(game_session_t* session, const char* message, client_t* exclude);
+
+typedef struct _scoreboard_entry_t {
+    char* name;
+    int score;
+    bool dirty;
+} scoreboard_entry_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    scoreboard_t* boards;
+    int active;
+} ticker = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static void release_entries(scoreboard_t* board) {
+    for (int i = 0; i < board->count; i++)
+        mem_free(MEM_GAME, board->entries[i].name);
+    mem_free(MEM_GAME, board->entries);
+    board->entries = NULL;
+    board->count = 0;
+}
+
+void scoreboard_init(scoreboard_t* board, game_session_t* session) {
+    memset(board, 0, sizeof(scoreboard_t));
+    pthread_mutex_init(&board->lock, NULL);
+    board->session = session;
+
+    MUTEX_LOCK(&ticker.lock);
+    board->next = ticker.boards;
+    ticker.boards = board;
+    MUTEX_UNLOCK(&ticker.lock);
+}
+
+void scoreboard_begin(scoreboard_t* board, client_t** players, int count) {
+    MUTEX_LOCK(&board->lock);
+    release_entries(board);
+    board->entries = mem_calloc(MEM_GAME, count ? count : 1, sizeof(scoreboard_entry_t));
+    for (int i = 0; board->entries && i < count; i++) {
+        board->entries[i].name = mem_strdup(MEM_GAME, players[i]->username);
+        board->entries[i].score = players[i]->score;
+        players[i]->board_slot = i;
+        board->count++;
+    }
+    board->changed = 0;
+    board->keyframe = true;
+    bool was_active = board->active;
+    board->active = true;
+    MUTEX_UNLOCK(&board->lock);
+
+    if (!was_active) {
+        MUTEX_LOCK(&ticker.lock);
+        ticker.active++;
+        MUTEX_COND_BROADCAST(&ticker.wake);
+        MUTEX_UNLOCK(&ticker.lock);
+    }
+}
+
+void scoreboard_update(scoreboard_t* board, client_t* player) {
+    MUTEX_LOCK(&board->lock);
+    int slot = player->board_slot;
+    if (slot >= 0 && slot < board->count) {
+        scoreboard_entry_t* entry = &board->entries[slot];
+        entry->score = player->score;
+        if (!entry->dirty) {
+            entry->dirty = true;
+            board->changed++;
+        }
+    }
+    MUTEX_UNLOCK(&board->lock);
+}
+
+void scoreboard_keyframe(scoreboard_t* board) {
+    MUTEX_LOCK(&board->lock);
+    board->keyframe = true;
+    MUTEX_UNLOCK(&board->lock);
+}
+
+// Builds the frame for this tick and clears the changes, NULL if there's nothing to send
+static char* take_frame(scoreboard_t* board) {
+    if (!board->active || (board->changed == 0 && !board->keyframe) || board->count == 0)
+        return NULL;
+
+    size_t cap = 48;
+    for (int i = 0; i < board->count; i++)
+        cap += strlen(board->entries[i].name) + 16;
+    char* frame = mem_malloc(MEM_GAME, cap);
+    if (!frame) return NULL;
+
+    size_t len = snprintf(frame, cap, "SCOR:%s #%u:", board->keyframe ? "Scores" : "Changes", ++board->tick);
+    for (int i = 0; i < board->count; i++) {
+        scoreboard_entry_t* entry = &board->entries[i];
+        if (entry->dirty || board->keyframe)
+            len += snprintf(frame + len, cap - len, " %s=%d", entry->name, entry->score);
+        entry->dirty = false;
+    }
+    snprintf(frame + len, cap - len, "\n");
+    board->changed = 0;
+    board->keyframe = false;
+    return frame;
+}
+
+static void tick(scoreboard_t* board) {
+    MUTEX_LOCK(&board->lock);
+    char* frame = take_frame(board);
+    MUTEX_UNLOCK(&board->lock);
+
+    if (frame) {
+        broadcast_all(board->session, frame, NULL);
+        mem_free(MEM_GAME, frame);
+    }
+}
+
+void scoreboard_end(scoreboard_t* board) {
+    tick(board);
+
+    MUTEX_LOCK(&board->lock);
+    bool was_active = board->active;
+    board->active = false;
+    release_entries(board);
+    MUTEX_UNLOCK(&board->lock);
+
+    if (was_active) {
+        MUTEX_LOCK(&ticker.lock);
+        ticker.active--;
+        MUTEX_UNLOCK(&ticker.lock);
+    }
+}
+
+// Attached to the game clock, so under a virtual clock the ticks follow game
+// time. With no game running it waits without a deadline and the clock isn't
+// held back by it.
+static void* ticker_thread(void* arg) {
+    (void) arg;
+    log_set_thread_name("scoreboard");
+    clock_attach();
+
+    while (true) {
+        MUTEX_LOCK(&ticker.lock);
+        while (ticker.active == 0)
+            MUTEX_COND_WAIT(&ticker.wake, &ticker.lock);
+        scoreboard_t* boards = ticker.boards;
+        MUTEX_UNLOCK(&ticker.lock);
+
+        // Boards are only ever added at the head, so this list stays valid
+        for (scoreboard_t* board = boards; board; board = board->next)
+            tick(board);
+        clock_sleep_us(SCOREBOARD_TICK_US);
+    }
+    return NULL;
+}
+
+void scoreboard_start() {
+    pthread_t thread;
+    pthread_create(&thread, NULL, ticker_thread, NULL);
+    pthread_detach(thread);
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// 4 Hz, on the game clock
+#define SCOREBOARD_TICK_US 250000
+
+struct _game_session_t;
+struct _client_t;
+struct _scoreboard_entry_t;
+
+// A room's live scores. Results only update it in memory; every tick the
+// entries that changed since the last one go to the whole room (players and
+// spectators) as a single frame, so fan-out follows the tick rate rather
+// than the answer rate:
+//   "SCOR:Scores #12: alice=30 bob=10\n"   every entry (game and question start)
+//   "SCOR:Changes #13: alice=40\n"         entries changed since #12
+// A client that sees a gap in the numbers waits for the next "Scores".
+typedef struct _scoreboard_t {
+    pthread_mutex_t lock;
+    struct _game_session_t* session;
+    struct _scoreboard_entry_t* entries;
+    int count;
+    int changed;
+    bool active;
+    bool keyframe;
+    uint32_t tick;
+    struct _scoreboard_t* next;   // every board, for the ticker
+} scoreboard_t;
+
+void scoreboard_init(scoreboard_t* board, struct _game_session_t* session);
+// Game thread, with the session lock held: one entry per player, and each
+// player's 'board_slot' pointing at it
+void scoreboard_begin(scoreboard_t* board, struct _client_t** players, int count);
+// Records 'player->score'; sent on the next tick
+void scoreboard_update(scoreboard_t* board, struct _client_t* player);
+// The next tick sends every entry
+void scoreboard_keyframe(scoreboard_t* board);
+// Sends what's pending right away and stops ticking the board
+void scoreboard_end(scoreboard_t* board);
+// Starts the ticker thread
+void scoreboard_start();
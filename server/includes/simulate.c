@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+#include "simulate.h"
+#include "utils.h"
+#include "data_loader.h"
+#include "metrics.h"
+#include "logger.h"
+#include "clock.h"
+#include "memacct.h"
+#include "lockprof.h"
+#include "spectate.h"
+#include <errno.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+// Defined in server.c
+extern question_t** questions;
+extern int question_count;
+void game_session_init(game_session_t* session, int id);
+void* game_loop(void* arg);
+bool handle_command(client_t* client, char* buff);
+
+// Messages are cut to SIM_SLOT_SIZE: bots only look at the start of them
+typedef struct {
+    client_t client;
+    char name[32];
+    bool host;
+    int room_size;
+    int games_left;
+    int accuracy;
+    unsigned int seed;
+    bool joining;
+    bool started;
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    char slots[SIM_QUEUE_SLOTS][SIM_SLOT_SIZE];
+    int head;
+    int count;
+    uint64_t dropped;
+} bot_t;
+
+// Spectators only count what the spectate workers hand them
+typedef struct {
+    client_t client;
+    atomic_uint_fast64_t frames;
+    atomic_uint_fast64_t bytes;
+} viewer_t;
+
+//
+//  Bots
+//
+
+// Only what bot_handle() acts on is queued, so large rooms don't fill the
+// queues with spectator traffic
+static bool bot_wants(bot_t* bot, const char* message, size_t len) {
+    static const char* prefixes[] = {
+        "QUES:It's ", "RESP:Joined game!", "INFO:Game ended", "ERR_:Game already in progress", "WARN:Already in game lobby"
+    };
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++)
+        if (len >= strlen(prefixes[i]) && strncmp(message, prefixes[i], strlen(prefixes[i])) == 0)
+            return true;
+    return bot->host && len > 5 && strncmp(message, "INFO:", 5) == 0 && memmem(message, len, " joined the game ", 17);
+}
+
+// client_t.deliver: runs on whichever thread sends, often with the session
+// lock held, so it never blocks; a full queue drops the message
+static void deliver(client_t* client, const char* message, size_t len) {
+    bot_t* bot = (bot_t*) client->deliver_ctx;
+    if (!bot_wants(bot, message, len))
+        return;
+    MUTEX_LOCK(&bot->lock);
+    if (bot->count == SIM_QUEUE_SLOTS) {
+        bot->dropped++;
+    } else {
+        char* slot = bot->slots[(bot->head + bot->count++) % SIM_QUEUE_SLOTS];
+        if (len >= SIM_SLOT_SIZE) len = SIM_SLOT_SIZE - 1;
+        memcpy(slot, message, len);
+        slot[len] = '\0';
+        MUTEX_COND_BROADCAST(&bot->ready);
+    }
+    MUTEX_UNLOCK(&bot->lock);
+}
+
+static void bot_send(bot_t* bot, const char* command) {
+    char buff[BUFF_SIZE];
+    snprintf(buff, sizeof(buff), "%s", command);
+    handle_command(&bot->client, buff);
+}
+
+static void bot_answer(bot_t* bot) {
+    char answer = questions[bot->client.session->curr_question_idx]->correct_answer;
+    if (rand_r(&bot->seed) % 100 >= bot->accuracy)
+        answer = 'A' + (answer - 'A' + 1 + rand_r(&bot->seed) % 3) % 4;
+
+    char command[16];
+    snprintf(command, sizeof(command), "answer : %c", answer);
+    bot_send(bot, command);
+}
+
+// Returns false once the bot has played all its games
+static bool bot_handle(bot_t* bot, const char* message) {
+    // "QUES:It's your turn!" in turn mode, "QUES:It's everyone's turn!" in rounds
+    if (strncmp(message, "QUES:It's ", 10) == 0) {
+        bot_answer(bot);
+    } else if (strncmp(message, "RESP:Joined game!", 17) == 0 ||
+               (strncmp(message, "INFO:", 5) == 0 && strstr(message, " joined the game "))) {
+        if (message[0] == 'R')
+            bot->joining = false;
+        // "... Players: N" or "... (Total: N players)"
+        const char* total = strrchr(message, ':');
+        if (bot->host && !bot->started && total && atoi(total + 1) >= bot->room_size) {
+            bot->started = true;
+            bot_send(bot, "start");
+        }
+    } else if (strncmp(message, "INFO:Game ended", 15) == 0) {
+        bot->started = false;
+        if (--bot->games_left == 0)
+            return false;
+        bot->joining = true;
+        bot_send(bot, "join");
+    } else if (bot->joining && (strncmp(message, "ERR_:Game already in progress", 29) == 0 ||
+                                strncmp(message, "WARN:Already in game lobby", 26) == 0)) {
+        // The game thread hasn't reset the room yet
+        clock_sleep_us(SIM_REJOIN_DELAY_US);
+        bot_send(bot, "join");
+    }
+    return true;
+}
+
+static void* bot_thread(void* arg) {
+    bot_t* bot = (bot_t*) arg;
+    log_set_thread_name(bot->name);
+    clock_attach();
+
+    bot->joining = true;
+    bot_send(bot, "join");
+
+    char message[SIM_SLOT_SIZE];
+    bool playing = true;
+    while (playing) {
+        MUTEX_LOCK(&bot->lock);
+        while (bot->count == 0)
+            MUTEX_COND_WAIT(&bot->ready, &bot->lock);
+        memcpy(message, bot->slots[bot->head], SIM_SLOT_SIZE);
+        bot->head = (bot->head + 1) % SIM_QUEUE_SLOTS;
+        bot->count--;
+        MUTEX_UNLOCK(&bot->lock);
+
+        playing = bot_handle(bot, message);
+    }
+
+    clock_detach();
+    return NULL;
+}
+
+static void bot_init(bot_t* bot, game_session_t* room, int room_idx, int idx, int room_size, int games, int accuracy, unsigned int seed) {
+    memset(bot, 0, sizeof(bot_t));
+    snprintf(bot->name, sizeof(bot->name), "sim-%d-%d", room_idx, idx);
+    bot->host = (idx == 0);
+    bot->room_size = room_size;
+    bot->games_left = games;
+    bot->accuracy = accuracy;
+    bot->seed = seed;
+    pthread_mutex_init(&bot->lock, NULL);
+    pthread_cond_init(&bot->ready, NULL);
+
+    client_t* client = &bot->client;
+    client->socket_fd = -1;
+    client->conn_id = (uint32_t) (room_idx * room_size + idx + 1);
+    strcpy(client->username, "__anon__");
+    client->state = CLIENT_CONNECTED;
+    client->session = room;
+    client->deliver = deliver;
+    client->deliver_ctx = bot;
+    pthread_mutex_init(&client->lock, NULL);
+}
+
+//
+//  Viewers
+//
+
+// client_t.deliver for viewers: called by a spectate worker, one at a time per viewer
+static void viewer_deliver(client_t* client, const char* message, size_t len) {
+    (void) message;
+    viewer_t* viewer = (viewer_t*) client->deliver_ctx;
+    atomic_fetch_add_explicit(&viewer->frames, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&viewer->bytes, len, memory_order_relaxed);
+}
+
+static void viewer_init(viewer_t* viewer, game_session_t* room, uint32_t conn_id) {
+    memset(viewer, 0, sizeof(viewer_t));
+    client_t* client = &viewer->client;
+    client->socket_fd = -1;
+    client->conn_id = conn_id;
+    strcpy(client->username, "__anon__");
+    client->state = CLIENT_CONNECTED;
+    client->session = room;
+    client->deliver = viewer_deliver;
+    client->deliver_ctx = viewer;
+    pthread_mutex_init(&client->lock, NULL);
+}
+
+//
+//  Main
+//
+
+static void usage() {
+    fprintf(stderr, "Usage: server simulate [options]\n\
+  -r, --rooms N           rooms played in parallel (default 4)\n\
+  -p, --players N         bots per room, at least 2 (default 4)\n\
+  -g, --games N           games each room plays (default 10)\n\
+  -q, --questions N       questions per game (default: all loaded)\n\
+  -m, --mode MODE         turns or rounds (default turns)\n\
+  -v, --viewers N         spectators per room (default 0)\n\
+  -a, --accuracy PCT      chance a bot answers correctly (default 70)\n\
+  -s, --seed N            seed for the bots' answers (default 1)\n");
+}
+
+int simulate_main(int argc, char* argv[]) {
+    static const struct option options[] = {
+        { "rooms", required_argument, NULL, 'r' },
+        { "players", required_argument, NULL, 'p' },
+        { "games", required_argument, NULL, 'g' },
+        { "questions", required_argument, NULL, 'q' },
+        { "mode", required_argument, NULL, 'm' },
+        { "viewers", required_argument, NULL, 'v' },
+        { "accuracy", required_argument, NULL, 'a' },
+        { "seed", required_argument, NULL, 's' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int room_count = 4, room_size = 4, games = 10, limit = 0, accuracy = 70, viewers_per_room = 0;
+    game_mode_t mode = GAME_MODE_TURNS;
+    unsigned int seed = 1;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:p:g:q:m:v:a:s:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'r': room_count = atoi(optarg); break;
+        case 'p': room_size = atoi(optarg); break;
+        case 'g': games = atoi(optarg); break;
+        case 'q': limit = atoi(optarg); break;
+        case 'm':
+            if (strcmp(optarg, "turns") != 0 && strcmp(optarg, "rounds") != 0) {
+                usage();
+                return 1;
+            }
+            mode = (strcmp(optarg, "rounds") == 0) ? GAME_MODE_ROUNDS : GAME_MODE_TURNS;
+            break;
+        case 'v': viewers_per_room = atoi(optarg); break;
+        case 'a': accuracy = atoi(optarg); break;
+        case 's': seed = (unsigned int) strtoul(optarg, NULL, 10); break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (room_count < 1 || room_size < 2 || games < 1 || viewers_per_room < 0 || accuracy < 0 || accuracy > 100) {
+        usage();
+        return 1;
+    }
+
+    if (clock_mode() != QUIZ_CLOCK_VIRTUAL) {
+        LOG_ERROR("[SIMULATE] Error - the simulation needs the virtual clock");
+        return 1;
+    }
+    if (!getenv("QUIZ_LOG_LEVEL"))
+        log_set_level(LOG_WARN);
+
+    load_questions();
+    if (question_count == 0) {
+        LOG_ERROR("[SIMULATE] No questions loaded! Cannot simulate.");
+        return 1;
+    }
+    if (limit > 0 && limit < question_count)
+        question_count = limit;
+
+    // Every bot registers and every game ends in save_users(), so keep the
+    // real data/users.xml out of it
+    char scratch[] = "/tmp/quizsim.XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) < 0 || mkdir("data", 0755) < 0) {
+        LOG_ERROR("[SIMULATE] Error - cannot create scratch directory: %s", strerror(errno));
+        return 1;
+    }
+
+    int bot_count = room_count * room_size;
+    game_session_t* rooms = mem_calloc(MEM_GAME, room_count, sizeof(game_session_t));
+    bot_t* bots = mem_calloc(MEM_GAME, bot_count, sizeof(bot_t));
+    int viewer_count = room_count * viewers_per_room;
+    viewer_t* viewers = mem_calloc(MEM_GAME, viewer_count ? viewer_count : 1, sizeof(viewer_t));
+    if (!rooms || !bots || !viewers) {
+        LOG_ERROR("[SIMULATE] Error - cannot allocate %d bots", bot_count);
+        return 1;
+    }
+
+    for (int r = 0; r < room_count; r++) {
+        game_session_init(&rooms[r], r + 1);
+        rooms[r].default_mode = mode;
+        pthread_t game_thread;
+        pthread_create(&game_thread, NULL, game_loop, &rooms[r]);
+        pthread_detach(game_thread);
+    }
+
+    // Registration is setup, not part of the measurement
+    for (int i = 0; i < bot_count; i++) {
+        bot_t* bot = &bots[i];
+        bot_init(bot, &rooms[i / room_size], i / room_size + 1, i % room_size, room_size, games, accuracy, seed + i);
+        char command[64];
+        snprintf(command, sizeof(command), "register : %s", bot->name);
+        bot_send(bot, command);
+        bot->count = 0;
+    }
+    for (int i = 0; i < viewer_count; i++) {
+        viewer_init(&viewers[i], &rooms[i / viewers_per_room], (uint32_t) (bot_count + i + 1));
+        char command[] = "spectate";
+        handle_command(&viewers[i].client, command);
+        atomic_store(&viewers[i].frames, 0);
+        atomic_store(&viewers[i].bytes, 0);
+    }
+
+    uint64_t coalesced_before = counter_value(&metric_spectate_coalesced);
+    uint64_t games_before = counter_value(&metric_games);
+    uint64_t turns_before = counter_value(&metric_turns);
+    uint64_t allocs_before, alloc_bytes_before;
+    mem_totals(&allocs_before, &alloc_bytes_before);
+    uint64_t start = metrics_now_us();
+    uint64_t virtual_start = clock_now_us();
+    for (int i = 0; i < bot_count; i++)
+        pthread_create(&bots[i].thread, NULL, bot_thread, &bots[i]);
+    for (int i = 0; i < bot_count; i++)
+        pthread_join(bots[i].thread, NULL);
+
+    uint64_t allocs, alloc_bytes;
+    mem_totals(&allocs, &alloc_bytes);
+    allocs -= allocs_before;
+    alloc_bytes -= alloc_bytes_before;
+    double elapsed = (metrics_now_us() - start) / 1e6;
+    double virtual_elapsed = (clock_now_us() - virtual_start) / 1e6;
+    uint64_t played = counter_value(&metric_games) - games_before;
+    uint64_t turns = counter_value(&metric_turns) - turns_before;
+
+    // Whatever the workers haven't delivered by now is not counted
+    uint64_t viewer_frames = 0, viewer_bytes = 0;
+    int silent = 0;
+    for (int i = 0; i < viewer_count; i++) {
+        uint64_t frames = atomic_load(&viewers[i].frames);
+        viewer_frames += frames;
+        viewer_bytes += atomic_load(&viewers[i].bytes);
+        if (frames == 0)
+            silent++;
+        char command[] = "spectate : stop";
+        handle_command(&viewers[i].client, command);
+    }
+
+    // announce_winner() must have counted every game for every bot
+    uint64_t dropped = 0;
+    int mismatched = 0;
+    for (int i = 0; i < bot_count; i++) {
+        dropped += bots[i].dropped;
+        if (!bots[i].client.user_data || bots[i].client.user_data->games_played != games)
+            mismatched++;
+    }
+
+    printf("[SIMULATE] %d rooms x %d bots, %d games per room, %d questions per game (%s)\n",
+           room_count, room_size, games, question_count, mode == GAME_MODE_ROUNDS ? "rounds" : "turns");
+    printf("[SIMULATE] %llu games, %llu turns in %.3fs (%.0fs of game time)\n",
+           (unsigned long long) played, (unsigned long long) turns, elapsed, virtual_elapsed);
+    printf("[SIMULATE] %.1f games/s, %.1f turns/s\n", played / elapsed, turns / elapsed);
+    // Only what goes through memacct.h; libc's own and the few plain malloc()
+    // calls outside the game path aren't seen
+    if (played > 0)
+        printf("[SIMULATE] %.1f tracked allocations (%.1f KB) per game\n",
+               (double) allocs / played, (double) alloc_bytes / played / 1024);
+    if (viewer_count > 0)
+        printf("[SIMULATE] %d spectators got %llu frames (%.1f KB each), %llu coalesced\n",
+               viewer_count, (unsigned long long) viewer_frames, (double) viewer_bytes / viewer_count / 1024,
+               (unsigned long long) (counter_value(&metric_spectate_coalesced) - coalesced_before));
+    printf("[SIMULATE] Users saved to %s/data/users.xml\n", scratch);
+
+    if (dropped > 0)
+        LOG_WARN("[SIMULATE] %llu messages dropped on full bot queues", (unsigned long long) dropped);
+    if (silent > 0) {
+        LOG_ERROR("[SIMULATE] Error - %d spectators received nothing", silent);
+        return 1;
+    }
+    if (played != (uint64_t) room_count * games || mismatched > 0) {
+        LOG_ERROR("[SIMULATE] Error - expected %d games, got %llu; %d bots have wrong stats",
+                  room_count * games, (unsigned long long) played, mismatched);
+        return 1;
+    }
+    return 0;
+}
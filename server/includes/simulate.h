@@ -0,0 +1,14 @@
+#pragma once
+
+#define SIM_QUEUE_SLOTS 256
+#define SIM_SLOT_SIZE 128
+#define SIM_REJOIN_DELAY_US 100000
+
+// './server simulate [options]': runs rooms of bot players entirely in
+// memory on the virtual clock and reports throughput. Bots are threads that
+// call handle_command() directly and read the server's replies from an
+// in-memory queue instead of a socket; everything behind handle_command()
+// (game loop, scoring, announce_winner(), save_users()) is the production
+// code. Runs in a scratch directory so data/users.xml is left alone.
+// 'argv[0]' is "simulate".
+int simulate_main(int argc, char* argv[]);
@@ -0,0 +1,329 @@
+#include "snapshot.h"
+#include "logger.h"
+#include "lockprof.h"
+#include "memacct.h"
+#include "data_loader.h"
+#include "matchmaking.h"
+#include "upgrade.h"
+#include <errno.h>
+#include <fcntl.h>
+
+extern question_t** questions;
+extern int question_count;
+
+// Defined in server.c
+void client_init(client_t* client, int socket_fd, uint32_t conn_id);
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} snapshot_buf_t;
+
+typedef struct {
+    const char* data;
+    size_t len;
+    size_t at;
+} snapshot_reader_t;
+
+metric_counter_t metric_snapshots = METRIC_COUNTER_INIT("quiz_snapshots_total", "Room snapshots written", NULL);
+metric_gauge_t metric_snapshot_bytes = METRIC_GAUGE_INIT("quiz_snapshot_bytes", "Size of the last room snapshot", NULL);
+metric_histogram_t metric_snapshot_latency = METRIC_HISTOGRAM_INIT("quiz_snapshot_duration_seconds", "Time to capture and write a room snapshot", NULL);
+
+static struct {
+    pthread_mutex_t lock;
+    game_session_t** rooms;
+    int count;
+} tracked = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void snapshot_track(game_session_t* session) {
+    MUTEX_LOCK(&tracked.lock);
+    game_session_t** grown = mem_realloc(MEM_GAME, tracked.rooms, (tracked.count + 1) * sizeof(game_session_t*));
+    if (grown) {
+        tracked.rooms = grown;
+        tracked.rooms[tracked.count++] = session;
+    }
+    MUTEX_UNLOCK(&tracked.lock);
+}
+
+//
+//  Writing
+//
+
+static bool buf_put(snapshot_buf_t* buf, const void* data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap ? buf->cap * 2 : 4096;
+        while (cap < buf->len + len)
+            cap *= 2;
+        char* grown = mem_realloc(MEM_GAME, buf->data, cap);
+        if (!grown) return false;
+        buf->data = grown;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+// Appends 'room' unless nobody in it could resume; true if it did
+static bool capture_room(snapshot_buf_t* buf, game_session_t* room) {
+    MUTEX_LOCK_WAIT(&room->lock, &metric_session_lock_wait);
+    if (room->player_count == 0 || room->state == GAME_FINISHED) {
+        MUTEX_UNLOCK(&room->lock);
+        return false;
+    }
+
+    size_t at = buf->len;
+    snapshot_room_t saved = {
+        .id = room->id, .question_idx = room->curr_question_idx, .player_turn = room->curr_player_turn + room->turn_scored,
+        .state = room->state, .mode = room->mode, .has_lobby = room->lobby != NULL
+    };
+    bool ok = buf_put(buf, &saved, sizeof(saved));
+    for (int i = 0; ok && i < room->player_count; i++) {
+        client_t* player = room->players[i];
+        snapshot_player_t record = { .score = player->score, .join_order = player->join_order };
+        // In-process and logged out clients have nothing to resume with
+        char token[RESUME_TOKEN_LEN + 1];
+        if (!resume_token(player, token))
+            continue;
+        memcpy(record.token, token, RESUME_TOKEN_LEN);
+        record.state = player->state == CLIENT_DISCONNECTED ? player->resume_state : player->state;
+        record.name_len = strlen(player->username);
+        ok = buf_put(buf, &record, sizeof(record)) && buf_put(buf, player->username, record.name_len);
+        saved.player_count++;
+    }
+    MUTEX_UNLOCK(&room->lock);
+
+    if (!ok || saved.player_count == 0) {
+        buf->len = at;
+        return false;
+    }
+    memcpy(buf->data + at, &saved, sizeof(saved));
+    return true;
+}
+
+// Renamed over the old file only once it's on disk, so a crash leaves one or the other
+static bool write_file(const char* path, const snapshot_buf_t* buf) {
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+
+    size_t written = 0;
+    while (written < buf->len) {
+        ssize_t n = write(fd, buf->data + written, buf->len - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        written += n;
+    }
+    bool ok = written == buf->len && fsync(fd) == 0;
+    if (close(fd) < 0) ok = false;
+    if (ok && rename(tmp_path, path) == 0)
+        return true;
+    unlink(tmp_path);
+    return false;
+}
+
+void snapshot_save() {
+    // The ticker and the signal thread would race on the same temporary file
+    static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+    MUTEX_LOCK(&save_lock);
+    uint64_t start = metrics_now_us();
+
+    snapshot_buf_t buf = { 0 };
+    snapshot_header_t header = { .taken_at = (uint64_t) time(NULL), .question_count = question_count };
+    bool ok = buf_put(&buf, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) && buf_put(&buf, &header, sizeof(header));
+    for (int i = 0; ok && i < question_count; i++) {
+        uint32_t id = questions[i]->id;
+        ok = buf_put(&buf, &id, sizeof(id));
+    }
+
+    MUTEX_LOCK(&tracked.lock);
+    for (int i = 0; ok && i < tracked.count; i++)
+        if (capture_room(&buf, tracked.rooms[i]))
+            header.room_count++;
+    MUTEX_UNLOCK(&tracked.lock);
+
+    if (ok) {
+        memcpy(buf.data + strlen(SNAPSHOT_MAGIC), &header, sizeof(header));
+        ok = write_file(SNAPSHOT_PATH, &buf);
+    }
+    if (ok) {
+        counter_add(&metric_snapshots, 1);
+        gauge_set(&metric_snapshot_bytes, buf.len);
+        histogram_observe(&metric_snapshot_latency, metrics_now_us() - start);
+        LOG_DEBUG("[SNAPSHOT] Wrote %u rooms (%zu bytes)", header.room_count, buf.len);
+    } else {
+        LOG_ERROR("[SNAPSHOT] Error - cannot write %s: %s", SNAPSHOT_PATH, strerror(errno));
+    }
+    mem_free(MEM_GAME, buf.data);
+    MUTEX_UNLOCK(&save_lock);
+}
+
+//
+//  Restoring
+//
+
+static const void* take(snapshot_reader_t* reader, size_t len) {
+    if (reader->len - reader->at < len) return NULL;
+    const void* data = reader->data + reader->at;
+    reader->at += len;
+    return data;
+}
+
+// A held seat in 'room' for a saved player, or NULL if they can't come back
+static client_t* restore_player(game_session_t* room, const snapshot_player_t* saved, const char* name) {
+    char username[MAX_NAME_LEN];
+    memcpy(username, name, saved->name_len);
+    username[saved->name_len] = '\0';
+    user_data_t* user = find_user(username);
+    if (!user) {
+        LOG_WARN("[SNAPSHOT] User %s is gone, not restoring their seat", username);
+        return NULL;
+    }
+
+    client_t* client = mem_malloc(MEM_NETWORK, sizeof(client_t));
+    if (!client) return NULL;
+    client_init(client, -1, 0);
+    strcpy(client->username, username);
+    client->user_data = user;
+    client->score = saved->score;
+    client->join_order = saved->join_order;
+    client->session = room;
+    client->state = CLIENT_DISCONNECTED;
+    client->resume_state = saved->state == CLIENT_IN_GAME || saved->state == CLIENT_LOBBY ? saved->state : CLIENT_CONNECTED;
+
+    char token[RESUME_TOKEN_LEN + 1];
+    memcpy(token, saved->token, RESUME_TOKEN_LEN);
+    token[RESUME_TOKEN_LEN] = '\0';
+    if (!resume_adopt(client, token)) {
+        pthread_mutex_destroy(&client->lock);
+        mem_free(MEM_NETWORK, client);
+        return NULL;
+    }
+    return client;
+}
+
+static bool restore_room(snapshot_reader_t* reader, game_session_t* lobby) {
+    snapshot_room_t saved;
+    const void* data = take(reader, sizeof(saved));
+    if (!data) return false;
+    memcpy(&saved, data, sizeof(saved));
+    if (saved.state > GAME_ACTIVE || saved.mode > GAME_MODE_ROUNDS ||
+        saved.question_idx < 0 || saved.question_idx >= question_count || saved.player_turn < 0)
+        return false;
+
+    game_session_t* room = saved.id == 0 ? lobby : matchmaking_room();
+    if (!room) return false;
+
+    // Under the room lock, so the sweeper can't release a seat before it's in the room
+    MUTEX_LOCK(&room->lock);
+    int restored = 0;
+    room->players = mem_realloc(MEM_GAME, room->players, (saved.player_count ? saved.player_count : 1) * sizeof(client_t*));
+    for (int i = 0; i < saved.player_count; i++) {
+        snapshot_player_t player;
+        const void* record = take(reader, sizeof(player));
+        if (!record) break;
+        memcpy(&player, record, sizeof(player));
+        const char* name = take(reader, player.name_len);
+        if (!name) break;
+
+        client_t* client = room->players ? restore_player(room, &player, name) : NULL;
+        if (client)
+            room->players[restored++] = client;
+    }
+    room->player_count = restored;
+
+    if (restored > 0 && saved.state == GAME_ACTIVE) {
+        room->state = GAME_ACTIVE;
+        room->mode = saved.mode;
+        room->curr_question_idx = saved.question_idx;
+        // One past the last player moves on to the next question
+        room->curr_player_turn = saved.player_turn <= restored ? saved.player_turn : 0;
+        room->restored = true;
+        if (room != lobby && saved.has_lobby)
+            room->lobby = lobby;
+        gauge_add(&metric_rooms, 1);
+        MUTEX_COND_BROADCAST(&room->game_start);
+    }
+    MUTEX_UNLOCK(&room->lock);
+
+    LOG_INFO("[SNAPSHOT] Restored room %d as room %d: %d/%d players, %s at question %d",
+             saved.id, room->id, restored, saved.player_count,
+             saved.state == GAME_ACTIVE ? "playing" : "waiting", saved.question_idx + 1);
+    return true;
+}
+
+void snapshot_restore(game_session_t* lobby) {
+    FILE* file = fopen(SNAPSHOT_PATH, "rb");
+    if (!file) return;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = size > 0 ? mem_malloc(MEM_GAME, size) : NULL;
+    snapshot_reader_t reader = { data, 0, 0 };
+    if (data && fread(data, 1, size, file) == (size_t) size)
+        reader.len = size;
+    fclose(file);
+
+    snapshot_header_t header;
+    const void* magic = take(&reader, strlen(SNAPSHOT_MAGIC));
+    const void* saved = take(&reader, sizeof(header));
+    if (!magic || memcmp(magic, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) != 0 || !saved) {
+        LOG_WARN("[SNAPSHOT] %s is not a snapshot, ignoring it", SNAPSHOT_PATH);
+        mem_free(MEM_GAME, data);
+        return;
+    }
+    memcpy(&header, saved, sizeof(header));
+
+    // Games ask the questions in load order, so they have to be the same ones
+    bool same_questions = header.question_count == (uint32_t) question_count;
+    for (int i = 0; same_questions && i < question_count; i++) {
+        const void* id = take(&reader, sizeof(uint32_t));
+        same_questions = id && memcmp(id, &questions[i]->id, sizeof(uint32_t)) == 0;
+    }
+    if (!same_questions) {
+        LOG_WARN("[SNAPSHOT] The questions changed since %s was taken, not restoring its games", SNAPSHOT_PATH);
+        mem_free(MEM_GAME, data);
+        return;
+    }
+
+    uint32_t rooms = 0;
+    while (rooms < header.room_count && restore_room(&reader, lobby))
+        rooms++;
+    if (rooms < header.room_count)
+        LOG_WARN("[SNAPSHOT] %s is cut short after %u of %u rooms", SNAPSHOT_PATH, rooms, header.room_count);
+    LOG_INFO("[SNAPSHOT] Restored %u rooms from a snapshot taken %llds ago", rooms,
+             (long long) (time(NULL) - (time_t) header.taken_at));
+    mem_free(MEM_GAME, data);
+}
+
+//
+//  Ticker
+//
+
+// Real time, like the other infrastructure threads: a snapshot is for when
+// the process dies, whatever the game clock says
+static void* snapshot_thread(void* arg) {
+    (void) arg;
+    log_set_thread_name("snapshot");
+    struct timespec interval = { SNAPSHOT_INTERVAL_US / 1000000, (SNAPSHOT_INTERVAL_US % 1000000) * 1000L };
+    while (true) {
+        nanosleep(&interval, NULL);
+        upgrade_step_begin();
+        snapshot_save();
+        upgrade_step_end();
+    }
+    return NULL;
+}
+
+void snapshot_start() {
+    metrics_register(&metric_snapshots.base);
+    metrics_register(&metric_snapshot_bytes.base);
+    metrics_register(&metric_snapshot_latency.base);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, snapshot_thread, NULL);
+    pthread_detach(thread);
+}
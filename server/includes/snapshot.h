@@ -0,0 +1,59 @@
+#pragma once
+#include "utils.h"
+#include "metrics.h"
+#include "resume.h"
+
+#define SNAPSHOT_PATH "data/rooms.snap"
+#define SNAPSHOT_INTERVAL_US 5000000
+// How long a restored game waits for its players to 'resume' before going on
+#define SNAPSHOT_RESUME_WAIT_US 30000000
+
+// Snapshot files start with SNAPSHOT_MAGIC, then a snapshot_header_t and
+// 'question_count' uint32_t question ids (the order games ask them in), then
+// 'room_count' rooms: a snapshot_room_t followed by 'player_count' players,
+// each a snapshot_player_t and 'name_len' bytes of username. Fields are host
+// byte order.
+#define SNAPSHOT_MAGIC "QSNP1\n"
+
+typedef struct {
+    uint64_t taken_at;        // unix time
+    uint32_t question_count;
+    uint32_t room_count;
+} snapshot_header_t;
+
+typedef struct {
+    int32_t id;
+    int32_t question_idx;
+    int32_t player_turn;
+    uint16_t player_count;
+    uint8_t state;            // game_state_t
+    uint8_t mode;             // game_mode_t
+    uint8_t has_lobby;        // formed by the matchmaker; players go back to room 0
+    uint8_t reserved[3];
+} snapshot_room_t;
+
+typedef struct {
+    char token[RESUME_TOKEN_LEN];
+    int32_t score;
+    uint16_t join_order;
+    uint8_t state;            // client_state_t the player resumes into
+    uint8_t name_len;
+} snapshot_player_t;
+
+extern metric_counter_t metric_snapshots;
+extern metric_gauge_t metric_snapshot_bytes;
+extern metric_histogram_t metric_snapshot_latency;
+
+// Rooms the snapshots cover; game_session_init() adds each one
+void snapshot_track(game_session_t* session);
+// Restores the rooms of the last snapshot, if any: each player comes back as a
+// held seat (see resume.h) that their old token resumes, and started games
+// carry on from the question and turn they were at. Room 0 goes to 'lobby',
+// the others to rooms from the matchmaker. Call after the users and
+// questions are loaded and before any game thread or client runs.
+void snapshot_restore(game_session_t* lobby);
+// Writes the rooms to SNAPSHOT_PATH now
+void snapshot_save();
+// Registers the quiz_snapshot* metrics and starts writing a snapshot every
+// SNAPSHOT_INTERVAL_US. Call before metrics_start().
+void snapshot_start();
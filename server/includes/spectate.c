@@ -0,0 +1,237 @@
+#include "spectate.h"
+#include "logger.h"
+#include "record.h"
+#include "memacct.h"
+#include "lockprof.h"
+#include <errno.h>
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    spectator_t** subscribers;
+    int subscriber_count;
+    int subscriber_cap;
+    spectate_frame_t* inbox[SPECTATE_INBOX];
+    int inbox_head;
+    int inbox_count;
+} spectate_worker_t;
+
+metric_gauge_t metric_spectators = METRIC_GAUGE_INIT("quiz_spectators_active", "Clients currently spectating", NULL);
+metric_counter_t metric_spectate_frames = METRIC_COUNTER_INIT("quiz_spectate_frames_total", "Messages published to spectators", NULL);
+metric_counter_t metric_spectate_coalesced = METRIC_COUNTER_INIT("quiz_spectate_coalesced_total", "Frames dropped so a slow spectator skips to newer ones", NULL);
+
+static spectate_worker_t workers[SPECTATE_WORKERS];
+static atomic_bool running = false;
+static atomic_uint next_worker = 0;
+
+static void frame_release(spectate_frame_t* frame) {
+    if (atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) == 1)
+        mem_free(MEM_SPECTATORS, frame);
+}
+
+//
+//  Backlogs (worker lock held)
+//
+
+static void backlog_push(spectator_t* spectator, spectate_frame_t* frame) {
+    if (spectator->count == SPECTATE_BACKLOG) {
+        // The head may be half written; it has to finish or the stream is cut
+        int drop = spectator->sent > 0 ? 1 : 0;
+        int at = (spectator->head + drop) % SPECTATE_BACKLOG;
+        frame_release(spectator->backlog[at]);
+        for (int i = drop; i < spectator->count - 1; i++) {
+            int next = (at + 1) % SPECTATE_BACKLOG;
+            spectator->backlog[at] = spectator->backlog[next];
+            at = next;
+        }
+        spectator->count--;
+        counter_add(&metric_spectate_coalesced, 1);
+    }
+
+    atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+    spectator->backlog[(spectator->head + spectator->count++) % SPECTATE_BACKLOG] = frame;
+}
+
+static void backlog_pop(spectator_t* spectator) {
+    frame_release(spectator->backlog[spectator->head]);
+    spectator->head = (spectator->head + 1) % SPECTATE_BACKLOG;
+    spectator->count--;
+    spectator->sent = 0;
+}
+
+// Writes as much of the backlog as the socket takes. Returns false if the
+// socket filled up before the backlog was empty.
+static bool backlog_flush(spectator_t* spectator) {
+    client_t* client = spectator->client;
+    while (spectator->count > 0) {
+        spectate_frame_t* frame = spectator->backlog[spectator->head];
+        if (spectator->sent == 0)
+            record_event(RECORD_SEND, client->conn_id, frame->data, frame->len);
+
+        if (client->deliver) {
+            client->deliver(client, frame->data, frame->len);
+            counter_add(&metric_bytes_out, frame->len);
+            backlog_pop(spectator);
+            continue;
+        }
+
+        ssize_t sent = send(client->socket_fd, frame->data + spectator->sent, frame->len - spectator->sent,
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return false;
+            if (errno == EINTR)
+                continue;
+            // Gone; its client thread notices on recv() and unsubscribes
+            while (spectator->count > 0)
+                backlog_pop(spectator);
+            return true;
+        }
+
+        counter_add(&metric_bytes_out, sent);
+        spectator->sent += sent;
+        if (spectator->sent < frame->len)
+            return false;
+        backlog_pop(spectator);
+    }
+    return true;
+}
+
+//
+//  Workers
+//
+
+static void* worker_thread(void* arg) {
+    spectate_worker_t* worker = (spectate_worker_t*) arg;
+    char name[LOG_THREAD_NAME_LEN];
+    snprintf(name, sizeof(name), "spectate-%d", (int) (worker - workers));
+    log_set_thread_name(name);
+
+    MUTEX_LOCK(&worker->lock);
+    while (true) {
+        while (worker->inbox_count > 0) {
+            spectate_frame_t* frame = worker->inbox[worker->inbox_head];
+            worker->inbox_head = (worker->inbox_head + 1) % SPECTATE_INBOX;
+            worker->inbox_count--;
+            for (int i = 0; i < worker->subscriber_count; i++)
+                if (worker->subscribers[i]->session == frame->session)
+                    backlog_push(worker->subscribers[i], frame);
+            frame_release(frame);
+        }
+
+        bool stalled = false;
+        for (int i = 0; i < worker->subscriber_count; i++)
+            if (!backlog_flush(worker->subscribers[i]))
+                stalled = true;
+
+        if (worker->inbox_count > 0)
+            continue;
+        if (!stalled) {
+            MUTEX_COND_TIMEDWAIT(&worker->wake, &worker->lock, NULL);
+            continue;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += SPECTATE_RETRY_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        MUTEX_COND_TIMEDWAIT(&worker->wake, &worker->lock, &deadline);
+    }
+    return NULL;
+}
+
+void spectate_publish(game_session_t* session, const char* message, size_t len) {
+    if (atomic_load_explicit(&session->spectators, memory_order_relaxed) == 0)
+        return;
+
+    spectate_frame_t* frame = mem_malloc(MEM_SPECTATORS, sizeof(spectate_frame_t) + len);
+    if (!frame) return;
+    atomic_init(&frame->refs, 1);
+    frame->session = session;
+    frame->len = len;
+    memcpy(frame->data, message, len);
+    counter_add(&metric_spectate_frames, 1);
+
+    for (int w = 0; w < SPECTATE_WORKERS; w++) {
+        spectate_worker_t* worker = &workers[w];
+        MUTEX_LOCK(&worker->lock);
+        if (worker->subscriber_count > 0) {
+            // A worker this far behind skips its oldest frame too
+            if (worker->inbox_count == SPECTATE_INBOX) {
+                frame_release(worker->inbox[worker->inbox_head]);
+                worker->inbox_head = (worker->inbox_head + 1) % SPECTATE_INBOX;
+                worker->inbox_count--;
+                counter_add(&metric_spectate_coalesced, 1);
+            }
+            atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+            worker->inbox[(worker->inbox_head + worker->inbox_count++) % SPECTATE_INBOX] = frame;
+            pthread_cond_signal(&worker->wake);
+        }
+        MUTEX_UNLOCK(&worker->lock);
+    }
+    frame_release(frame);
+}
+
+spectator_t* spectate_subscribe(game_session_t* session, client_t* client) {
+    if (!atomic_load(&running)) return NULL;
+
+    spectator_t* spectator = mem_calloc(MEM_SPECTATORS, 1, sizeof(spectator_t));
+    if (!spectator) return NULL;
+    spectator->client = client;
+    spectator->session = session;
+    spectator->worker = atomic_fetch_add_explicit(&next_worker, 1, memory_order_relaxed) % SPECTATE_WORKERS;
+
+    spectate_worker_t* worker = &workers[spectator->worker];
+    MUTEX_LOCK(&worker->lock);
+    if (worker->subscriber_count == worker->subscriber_cap) {
+        int cap = worker->subscriber_cap ? worker->subscriber_cap * 2 : 64;
+        spectator_t** grown = mem_realloc(MEM_SPECTATORS, worker->subscribers, cap * sizeof(spectator_t*));
+        if (!grown) {
+            MUTEX_UNLOCK(&worker->lock);
+            mem_free(MEM_SPECTATORS, spectator);
+            return NULL;
+        }
+        worker->subscribers = grown;
+        worker->subscriber_cap = cap;
+    }
+    spectator->index = worker->subscriber_count;
+    worker->subscribers[worker->subscriber_count++] = spectator;
+    atomic_fetch_add_explicit(&session->spectators, 1, memory_order_relaxed);
+    MUTEX_UNLOCK(&worker->lock);
+
+    gauge_add(&metric_spectators, 1);
+    return spectator;
+}
+
+void spectate_unsubscribe(spectator_t* spectator) {
+    spectate_worker_t* worker = &workers[spectator->worker];
+    MUTEX_LOCK(&worker->lock);
+    spectator_t* last = worker->subscribers[--worker->subscriber_count];
+    worker->subscribers[spectator->index] = last;
+    last->index = spectator->index;
+    while (spectator->count > 0)
+        backlog_pop(spectator);
+    atomic_fetch_sub_explicit(&spectator->session->spectators, 1, memory_order_relaxed);
+    MUTEX_UNLOCK(&worker->lock);
+
+    gauge_add(&metric_spectators, -1);
+    mem_free(MEM_SPECTATORS, spectator);
+}
+
+void spectate_start() {
+    metrics_register(&metric_spectators.base);
+    metrics_register(&metric_spectate_frames.base);
+    metrics_register(&metric_spectate_coalesced.base);
+
+    for (int w = 0; w < SPECTATE_WORKERS; w++) {
+        pthread_mutex_init(&workers[w].lock, NULL);
+        pthread_cond_init(&workers[w].wake, NULL);
+        pthread_create(&workers[w].thread, NULL, worker_thread, &workers[w]);
+        pthread_detach(workers[w].thread);
+    }
+    atomic_store(&running, true);
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include "utils.h"
+#include "metrics.h"
+
+#define SPECTATE_WORKERS 4
+// Frames a spectator can have waiting; past that the oldest unsent one is dropped
+#define SPECTATE_BACKLOG 8
+// Frames published but not yet fanned out by a worker
+#define SPECTATE_INBOX 64
+// How often a worker retries spectators whose sockets were full
+#define SPECTATE_RETRY_MS 10
+
+// One published message, shared read-only by every spectator it goes to and
+// freed by whoever drops the last reference
+typedef struct {
+    atomic_int refs;
+    struct _game_session_t* session;
+    size_t len;
+    char data[];
+} spectate_frame_t;
+
+// Owned by its worker: only touched with the worker's lock held
+typedef struct _spectator_t {
+    client_t* client;
+    struct _game_session_t* session;
+    int worker;
+    int index;                                   // in the worker's subscriber list
+    spectate_frame_t* backlog[SPECTATE_BACKLOG];
+    int head;
+    int count;
+    size_t sent;                                 // bytes of backlog[head] already written
+} spectator_t;
+
+extern metric_gauge_t metric_spectators;
+extern metric_counter_t metric_spectate_frames;
+extern metric_counter_t metric_spectate_coalesced;
+
+// Registers the quiz_spectate* metrics and starts the workers. Call before
+// metrics_start().
+void spectate_start();
+// Adds 'client' to the room's read-only audience. Returns NULL if the workers
+// aren't running.
+spectator_t* spectate_subscribe(struct _game_session_t* session, client_t* client);
+// Frees 'spectator'; once this returns no worker will write to its client
+void spectate_unsubscribe(spectator_t* spectator);
+// Copies 'message' into one frame and hands it to the workers. Never blocks on
+// a spectator's socket, and costs one atomic load when nobody is watching.
+void spectate_publish(struct _game_session_t* session, const char* message, size_t len);
@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include "metrics.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Per-thread event buffer. Only its owner appends; the lock is there for the
+// exporter and is uncontended otherwise.
+typedef struct _trace_buffer_t {
+    pthread_mutex_t lock;
+    trace_event_t* events;
+    size_t count;
+    size_t cap;
+    uint64_t dropped;
+    bool dead;
+    uint32_t tid;
+    char name[16];
+    struct _trace_buffer_t* next;
+} trace_buffer_t;
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} json_buff_t;
+
+atomic_int trace_captures = 0;
+
+// Guards the buffer list, the capture bookkeeping and exports
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer_t* buffers = NULL;
+static uint32_t next_tid = 1;
+static __thread trace_buffer_t* thread_buffer = NULL;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+
+static int sample_rate = 0;
+static uint64_t games_seen = 0;
+static uint64_t windows_seen = 0;
+
+uint64_t trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//
+//  Recording
+//
+
+static void release_buffer(void* arg) {
+    trace_buffer_t* buffer = (trace_buffer_t*) arg;
+    pthread_mutex_lock(&buffer->lock);
+    buffer->dead = true;
+    pthread_mutex_unlock(&buffer->lock);
+}
+
+static void create_key() {
+    pthread_key_create(&buffer_key, release_buffer);
+}
+
+static trace_buffer_t* get_buffer() {
+    if (thread_buffer) return thread_buffer;
+
+    trace_buffer_t* buffer = calloc(1, sizeof(trace_buffer_t));
+    if (!buffer) return NULL;
+    pthread_mutex_init(&buffer->lock, NULL);
+    if (pthread_getname_np(pthread_self(), buffer->name, sizeof(buffer->name)) != 0)
+        strcpy(buffer->name, "thread");
+
+    pthread_once(&buffer_key_once, create_key);
+    pthread_setspecific(buffer_key, buffer);
+
+    pthread_mutex_lock(&buffers_lock);
+    buffer->tid = next_tid++;
+    buffer->next = buffers;
+    buffers = buffer;
+    pthread_mutex_unlock(&buffers_lock);
+
+    thread_buffer = buffer;
+    return buffer;
+}
+
+void trace_end(uint64_t start_ns, const char* cat, const char* name, const char* detail, int64_t arg) {
+    if (!start_ns || !trace_enabled()) return;
+    uint64_t now = trace_now_ns();
+
+    trace_buffer_t* buffer = get_buffer();
+    if (!buffer) return;
+
+    pthread_mutex_lock(&buffer->lock);
+    if (buffer->count == buffer->cap && buffer->cap < TRACE_MAX_EVENTS) {
+        size_t cap = buffer->cap ? buffer->cap * 2 : 256;
+        trace_event_t* events = realloc(buffer->events, cap * sizeof(trace_event_t));
+        if (events) {
+            buffer->events = events;
+            buffer->cap = cap;
+        }
+    }
+    if (buffer->count < buffer->cap) {
+        trace_event_t* event = &buffer->events[buffer->count++];
+        event->cat = cat;
+        event->name = name;
+        event->detail = detail;
+        event->arg = arg;
+        event->start_ns = start_ns;
+        event->dur_ns = now - start_ns;
+    } else {
+        buffer->dropped++;
+    }
+    pthread_mutex_unlock(&buffer->lock);
+}
+
+//
+//  Export
+//
+
+static void json(json_buff_t* out, const char* fmt, ...) {
+    while (true) {
+        va_list args;
+        va_start(args, fmt);
+        int len = vsnprintf(out->data + out->len, out->cap - out->len, fmt, args);
+        va_end(args);
+
+        if (len >= 0 && out->len + len < out->cap) {
+            out->len += len;
+            return;
+        }
+
+        size_t cap = out->cap * 2 + (len > 0 ? len : 0);
+        char* data = realloc(out->data, cap);
+        if (!data) return;
+        out->data = data;
+        out->cap = cap;
+    }
+}
+
+static void json_string(json_buff_t* out, const char* str) {
+    json(out, "\"");
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            json(out, "\\%c", *str);
+        else if ((unsigned char) *str < 0x20)
+            json(out, "\\u%04x", *str);
+        else
+            json(out, "%c", *str);
+    }
+    json(out, "\"");
+}
+
+// Chrome trace-event format: complete ("X") events plus thread name metadata.
+// Loads in chrome://tracing and ui.perfetto.dev.
+static char* render_capture(const char* kind, trace_capture_t capture, uint64_t end_ns) {
+    json_buff_t out = { malloc(64 * 1024), 0, 64 * 1024 };
+    if (!out.data) return NULL;
+
+    json(&out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    size_t events = 0;
+    uint64_t dropped = 0;
+
+    for (trace_buffer_t* buffer = buffers; buffer; buffer = buffer->next) {
+        pthread_mutex_lock(&buffer->lock);
+        bool named = false;
+        for (size_t i = 0; i < buffer->count; i++) {
+            trace_event_t* event = &buffer->events[i];
+            if (event->start_ns + event->dur_ns < capture.start_ns || event->start_ns > end_ns)
+                continue;
+
+            if (!named) {
+                json(&out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+                     first ? "" : ",\n", buffer->tid);
+                json_string(&out, buffer->name);
+                json(&out, "}}");
+                named = true;
+                first = false;
+            }
+
+            json(&out, ",\n{\"name\":");
+            json_string(&out, event->name);
+            json(&out, ",\"cat\":");
+            json_string(&out, event->cat);
+            json(&out, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u",
+                 event->start_ns / 1000.0, event->dur_ns / 1000.0, buffer->tid);
+            if (event->detail || event->arg != TRACE_NO_ARG) {
+                json(&out, ",\"args\":{");
+                if (event->detail) {
+                    json(&out, "\"detail\":");
+                    json_string(&out, event->detail);
+                }
+                if (event->arg != TRACE_NO_ARG)
+                    json(&out, "%s\"arg\":%lld", event->detail ? "," : "", (long long) event->arg);
+                json(&out, "}");
+            }
+            json(&out, "}");
+            events++;
+        }
+        dropped += buffer->dropped;
+        pthread_mutex_unlock(&buffer->lock);
+    }
+
+    json(&out, "\n],\"otherData\":{\"capture\":\"%s\",\"id\":%llu,\"events\":%zu,\"dropped\":%llu}}\n",
+         kind, (unsigned long long) capture.id, events, (unsigned long long) dropped);
+    return out.data;
+}
+
+// Game captures pass 'sample' > 1 to skip all but every sample-th call
+static trace_capture_t begin_capture(uint64_t* seen, int sample) {
+    trace_capture_t capture = { 0, 0 };
+    pthread_mutex_lock(&buffers_lock);
+    uint64_t id = ++*seen;
+    if ((id - 1) % sample == 0) {
+        capture.id = id;
+        capture.start_ns = trace_now_ns();
+        atomic_fetch_add(&trace_captures, 1);
+    }
+    pthread_mutex_unlock(&buffers_lock);
+    return capture;
+}
+
+// Once nothing is being captured the buffers are emptied and the ones left
+// behind by exited threads are freed
+static char* end_capture(const char* kind, trace_capture_t capture) {
+    pthread_mutex_lock(&buffers_lock);
+    char* body = render_capture(kind, capture, trace_now_ns());
+
+    if (atomic_fetch_sub(&trace_captures, 1) == 1) {
+        trace_buffer_t** link = &buffers;
+        while (*link) {
+            trace_buffer_t* buffer = *link;
+            pthread_mutex_lock(&buffer->lock);
+            bool dead = buffer->dead;
+            buffer->count = 0;
+            buffer->dropped = 0;
+            pthread_mutex_unlock(&buffer->lock);
+
+            if (dead) {
+                *link = buffer->next;
+                pthread_mutex_destroy(&buffer->lock);
+                free(buffer->events);
+                free(buffer);
+            } else {
+                link = &buffer->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&buffers_lock);
+    return body;
+}
+
+trace_capture_t trace_game_begin() {
+    if (sample_rate <= 0) {
+        trace_capture_t none = { 0, 0 };
+        return none;
+    }
+    return begin_capture(&games_seen, sample_rate);
+}
+
+void trace_game_end(trace_capture_t capture) {
+    if (!capture.id) return;
+
+    char* body = end_capture("game", capture);
+    if (!body) return;
+
+    char path[256];
+    mkdir("build", 0755);
+    mkdir(TRACE_DIR, 0755);
+    snprintf(path, sizeof(path), "%s/game-%llu.json", TRACE_DIR, (unsigned long long) capture.id);
+
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        LOG_ERROR("[TRACE] Error - cannot write %s: %s", path, strerror(errno));
+    } else {
+        fputs(body, file);
+        fclose(file);
+        LOG_INFO("[TRACE] Game %llu trace written to %s", (unsigned long long) capture.id, path);
+    }
+    free(body);
+}
+
+// GET /trace?ms=N blocks the metrics listener for the window
+static char* trace_route(const char* query) {
+    int ms = 1000;
+    if (strncmp(query, "ms=", 3) == 0)
+        ms = atoi(query + 3);
+    if (ms <= 0) ms = 1;
+    if (ms > TRACE_MAX_WINDOW_MS) ms = TRACE_MAX_WINDOW_MS;
+
+    trace_capture_t capture = begin_capture(&windows_seen, 1);
+    usleep(ms * 1000);
+    return end_capture("window", capture);
+}
+
+void trace_start() {
+    const char* env = getenv("QUIZ_TRACE");
+    sample_rate = env ? atoi(env) : 0;
+    metrics_add_route("/trace", trace_route);
+    if (sample_rate > 0)
+        LOG_INFO("[TRACE] Tracing one game in %d to %s", sample_rate, TRACE_DIR);
+}
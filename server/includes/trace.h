@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define TRACE_DIR "build/traces"
+#define TRACE_MAX_EVENTS (64 * 1024)
+#define TRACE_MAX_WINDOW_MS 60000
+#define TRACE_NO_ARG -1
+
+// One completed span. 'cat', 'name' and 'detail' must be string literals or
+// otherwise outlive the trace.
+typedef struct {
+    const char* cat;
+    const char* name;
+    const char* detail;
+    int64_t arg;
+    uint64_t start_ns;   // CLOCK_MONOTONIC
+    uint64_t dur_ns;
+} trace_event_t;
+
+// A game or time window being recorded; 'id' is 0 when not sampled
+typedef struct {
+    uint64_t id;
+    uint64_t start_ns;
+} trace_capture_t;
+
+// Number of captures in progress; spans are only recorded while it's non-zero
+extern atomic_int trace_captures;
+
+static inline bool trace_enabled() {
+    return atomic_load_explicit(&trace_captures, memory_order_relaxed) > 0;
+}
+
+uint64_t trace_now_ns();
+
+// uint64_t span = TRACE_BEGIN(); ...; trace_end(span, "net", "broadcast", NULL, TRACE_NO_ARG);
+// Costs one atomic load when nothing is being captured.
+#define TRACE_BEGIN() (trace_enabled() ? trace_now_ns() : 0)
+void trace_end(uint64_t start_ns, const char* cat, const char* name, const char* detail, int64_t arg);
+
+// QUIZ_TRACE=N records one game in N (unset or 0: off) to TRACE_DIR/game-<id>.json.
+// Also adds GET /trace?ms=N to the metrics listener, which records the next
+// N milliseconds and returns them. Call before metrics_start().
+void trace_start();
+trace_capture_t trace_game_begin();
+void trace_game_end(trace_capture_t capture);
@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+#include "upgrade.h"
+#include "logger.h"
+#include "memacct.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+static int wake_pipe[2] = { -1, -1 };
+static int drain_pipe[2] = { -1, -1 };
+// Writers first, so a handover isn't starved by steps that keep starting
+static pthread_rwlock_t steps = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+static struct {
+    upgrade_record_t* records;
+    int count;
+    int listeners[UPGRADE_CLIENT];
+} received = { .listeners = { -1, -1 } };
+
+void upgrade_init() {
+    if (pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+        LOG_ERROR("[UPGRADE] Error - no wake pipe, SIGHUP won't upgrade: %s", strerror(errno));
+    if (pipe2(drain_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+        LOG_ERROR("[UPGRADE] Error - no drain pipe, an upgrade may lose commands: %s", strerror(errno));
+}
+
+void upgrade_request() {
+    if (wake_pipe[1] >= 0 && write(wake_pipe[1], "u", 1) < 0)
+        LOG_WARN("[UPGRADE] An upgrade is already pending");
+}
+
+int upgrade_wake_fd() {
+    return wake_pipe[0];
+}
+
+bool upgrade_requested() {
+    char byte;
+    bool requested = false;
+    while (read(wake_pipe[0], &byte, 1) == 1)
+        requested = true;
+    return requested;
+}
+
+void upgrade_step_begin() {
+    pthread_rwlock_rdlock(&steps);
+}
+
+void upgrade_step_end() {
+    pthread_rwlock_unlock(&steps);
+}
+
+int upgrade_drain_fd() {
+    return drain_pipe[0];
+}
+
+static void set_timeout(int fd) {
+    struct timeval timeout = { UPGRADE_TIMEOUT_S, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+//
+//  Old process
+//
+
+int upgrade_spawn(char* argv[]) {
+    // Not close-on-exec: the child's end has to survive into the new binary
+    int channel[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, channel) < 0) {
+        LOG_ERROR("[UPGRADE] Error - socketpair failed: %s", strerror(errno));
+        return -1;
+    }
+    // Built up front: setenv() isn't safe with other threads running
+    int env_count = 0;
+    while (environ[env_count])
+        env_count++;
+    char** envp = mem_calloc(MEM_NETWORK, env_count + 2, sizeof(char*));
+    char fd_env[64];
+    snprintf(fd_env, sizeof(fd_env), "%s=%d", UPGRADE_FD_ENV, UPGRADE_FD);
+    if (!envp) {
+        close(channel[0]);
+        close(channel[1]);
+        return -1;
+    }
+    envp[0] = fd_env;
+    for (int i = 0, j = 1; i < env_count; i++)
+        if (strncmp(environ[i], UPGRADE_FD_ENV "=", strlen(UPGRADE_FD_ENV) + 1) != 0)
+            envp[j++] = environ[i];
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Only async-signal-safe calls until exec. Every other descriptor is
+        // closed so the new process holds nothing it wasn't handed.
+        if (channel[1] != UPGRADE_FD && dup2(channel[1], UPGRADE_FD) < 0)
+            _exit(127);
+        close_range(UPGRADE_FD + 1, ~0U, 0);
+        execve("/proc/self/exe", argv, envp);
+        _exit(127);
+    }
+    mem_free(MEM_NETWORK, envp);
+    close(channel[1]);
+    if (pid < 0) {
+        LOG_ERROR("[UPGRADE] Error - fork failed: %s", strerror(errno));
+        close(channel[0]);
+        return -1;
+    }
+
+    set_timeout(channel[0]);
+    char ready;
+    if (recv(channel[0], &ready, 1, 0) != 1) {
+        LOG_ERROR("[UPGRADE] Error - new process %d didn't come up, still serving", (int) pid);
+        close(channel[0]);
+        waitpid(pid, NULL, WNOHANG);
+        return -1;
+    }
+    LOG_INFO("[UPGRADE] New process %d is ready, handing over", (int) pid);
+    return channel[0];
+}
+
+void upgrade_drain() {
+    // Never read, so it stays readable
+    if (drain_pipe[1] >= 0 && write(drain_pipe[1], "d", 1) < 0)
+        LOG_WARN("[UPGRADE] Couldn't stop the client threads: %s", strerror(errno));
+}
+
+void upgrade_freeze() {
+    pthread_rwlock_wrlock(&steps);
+}
+
+bool upgrade_send(int channel, upgrade_kind_t kind, int fd, const char* token, const char* username, client_state_t state) {
+    upgrade_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.kind = kind;
+    record.state = state;
+    record.fd = -1;
+    if (token) snprintf(record.token, sizeof(record.token), "%s", token);
+    if (username) snprintf(record.username, sizeof(record.username), "%s", username);
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { &record, sizeof(record) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    while (sendmsg(channel, &msg, MSG_NOSIGNAL) < 0) {
+        if (errno == EINTR) continue;
+        LOG_ERROR("[UPGRADE] Error - cannot hand over socket %d: %s", fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+//
+//  New process
+//
+
+// One record and its socket; false at the end of the handover
+static bool receive_one(int channel, upgrade_record_t* record) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { record, sizeof(*record) };
+
+    while (true) {
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+        ssize_t len = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+        if (len < 0 && errno == EINTR) continue;
+        if (len < 0)
+            LOG_WARN("[UPGRADE] Old process still hasn't exited: %s", strerror(errno));
+        if (len <= 0) return false;
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (len != sizeof(*record) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+            LOG_WARN("[UPGRADE] Skipping a malformed handover record");
+            continue;
+        }
+        memcpy(&record->fd, CMSG_DATA(cmsg), sizeof(int));
+        record->token[RESUME_TOKEN_LEN] = '\0';
+        record->username[MAX_NAME_LEN - 1] = '\0';
+        return true;
+    }
+}
+
+bool upgrade_receive() {
+    const char* env = getenv(UPGRADE_FD_ENV);
+    if (!env) return false;
+    int channel = atoi(env);
+    unsetenv(UPGRADE_FD_ENV);
+    fcntl(channel, F_SETFD, FD_CLOEXEC);
+
+    if (send(channel, "R", 1, MSG_NOSIGNAL) != 1) {
+        LOG_ERROR("[UPGRADE] Error - the old process is gone, starting fresh");
+        close(channel);
+        return false;
+    }
+
+    // Until the old process exits and its end closes
+    set_timeout(channel);
+    upgrade_record_t record;
+    while (receive_one(channel, &record)) {
+        if (record.kind < UPGRADE_CLIENT) {
+            received.listeners[record.kind] = record.fd;
+            continue;
+        }
+        upgrade_record_t* grown = mem_realloc(MEM_NETWORK, received.records, (received.count + 1) * sizeof(upgrade_record_t));
+        if (!grown) {
+            close(record.fd);
+            continue;
+        }
+        received.records = grown;
+        received.records[received.count++] = record;
+    }
+    close(channel);
+
+    LOG_INFO("[UPGRADE] Took over %d connections%s", received.count,
+             received.listeners[UPGRADE_LISTENER] >= 0 ? " and the listening socket" : ", but no listening socket");
+    return true;
+}
+
+int upgrade_listener(upgrade_kind_t kind) {
+    return kind < UPGRADE_CLIENT ? received.listeners[kind] : -1;
+}
+
+upgrade_record_t* upgrade_clients(int* count) {
+    *count = received.count;
+    return received.records;
+}
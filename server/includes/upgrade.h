@@ -0,0 +1,70 @@
+#pragma once
+#include "utils.h"
+#include "resume.h"
+
+// The new process finds its end of the channel here
+#define UPGRADE_FD_ENV "QUIZ_UPGRADE_FD"
+#define UPGRADE_FD 3
+// How long the old process waits for the new one to come up, and the new
+// one for the old one to hand over and exit
+#define UPGRADE_TIMEOUT_S 30
+
+// SIGHUP upgrades the binary in place. The main thread stops accepting and
+// execs /proc/self/exe with a SOCK_SEQPACKET channel on UPGRADE_FD. Once the
+// new process has loaded its questions it says so, and the old one drains:
+// client threads finish the command they are on and stop reading, leaving
+// the rest in the socket, and game and infrastructure threads stop at their
+// next step. Only then does it write a room snapshot (snapshot.h) and send
+// one upgrade_record_t per socket, the socket itself riding along as
+// SCM_RIGHTS: the listeners first, then every live client with its resume
+// token. Then the old process exits; the new one waits for that before
+// restoring the rooms, so the two never play at once. Connections that
+// arrive meanwhile wait in the listen backlog.
+typedef enum {
+    UPGRADE_LISTENER,
+    UPGRADE_METRICS,
+    UPGRADE_CLIENT
+} upgrade_kind_t;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t state;                          // client_state_t
+    char token[RESUME_TOKEN_LEN + 1];        // empty if it holds none
+    char username[MAX_NAME_LEN];             // empty if not logged in
+    int fd;                                  // in the receiving process
+} upgrade_record_t;
+
+// Creates the pipe the signal thread wakes the main thread through
+void upgrade_init();
+// Signal thread: asks the main thread to upgrade
+void upgrade_request();
+// Readable once an upgrade was requested; read it with upgrade_requested()
+int upgrade_wake_fd();
+bool upgrade_requested();
+
+// Threads that change what a snapshot captures (scoring, seating, releasing
+// seats) or touch client sockets wrap each step in these; a handover waits
+// for the steps in progress and blocks new ones for good. Don't nest them.
+void upgrade_step_begin();
+void upgrade_step_end();
+// Client threads wait for their socket together with this; readable once
+// they should stop reading
+int upgrade_drain_fd();
+
+// Old process: starts the new binary and waits until it's ready for the
+// handover. Returns the channel, or -1 if the new process didn't come up.
+int upgrade_spawn(char* argv[]);
+// Old process: tells client threads to stop reading (see upgrade_drain_fd())
+void upgrade_drain();
+// Old process: waits for the steps in progress and blocks new ones; never undone
+void upgrade_freeze();
+// Old process: sends one socket and what the new process needs to know about it
+bool upgrade_send(int channel, upgrade_kind_t kind, int fd, const char* token, const char* username, client_state_t state);
+
+// New process: if it was started by upgrade_spawn(), takes everything the
+// old process sends and waits for it to exit. False when not upgrading.
+bool upgrade_receive();
+// The received socket of 'kind' (not UPGRADE_CLIENT), or -1
+int upgrade_listener(upgrade_kind_t kind);
+// The received client connections
+upgrade_record_t* upgrade_clients(int* count);
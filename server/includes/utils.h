@@ -5,9 +5,12 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <time.h>
+#include "answers.h"
+#include "scoreboard.h"
 
 #define BUFF_SIZE 4096
 #define MAX_NAME_LEN 256
@@ -21,6 +24,7 @@ typedef struct {
     int games_won;
     int max_streak;
     int curr_streak;
+    int rating;
     char last_login[64];
 } user_data_t;
 
@@ -28,20 +32,44 @@ typedef enum {
     CLIENT_CONNECTED,
     CLIENT_LOBBY,
     CLIENT_IN_GAME,
+    CLIENT_SPECTATING,
+    CLIENT_QUEUED,
     CLIENT_DISCONNECTED
 } client_state_t;
 
-typedef struct {
+struct _game_session_t;
+struct _spectator_t;
+struct _match_entry_t;
+struct _resume_entry_t;
+struct _rate_limit_t;
+struct _reap_entry_t;
+
+typedef struct _client_t {
     int socket_fd;
+    uint32_t conn_id;
     int score;
     char username[MAX_NAME_LEN];
     user_data_t* user_data;
     client_state_t state;
     int join_order;
+    int board_slot;                        // entry in the room's scoreboard
     bool has_answered;
     char answer;
     time_t answer_time;
+    atomic_uint_fast32_t answered_round;   // see answer_board_t
     pthread_mutex_t lock;
+    struct _game_session_t* session;
+    struct _spectator_t* spectator;   // set while CLIENT_SPECTATING
+    struct _match_entry_t* match_entry;   // set while CLIENT_QUEUED, under the matcher's lock
+    struct _resume_entry_t* resume;       // token issued at login (see resume.h)
+    client_state_t resume_state;          // what to go back to once a dropped connection resumes
+    struct _client_t* takeover;           // set by 'resume': the held client this connection continues as
+    int conn_slot;                        // in server.c's list of live connections, -1 if none
+    struct _rate_limit_t* rate;           // command budget of a socket connection (see ratelimit.h)
+    struct _reap_entry_t* reap;           // idle timer of a socket connection (see reaper.h)
+    // Set for in-process clients (see simulate.c); used instead of socket_fd
+    void (*deliver)(struct _client_t* client, const char* message, size_t len);
+    void* deliver_ctx;
 } client_t;
 
 typedef struct {
@@ -64,13 +92,30 @@ typedef enum {
     GAME_FINISHED
 } game_state_t;
 
-typedef struct {
+typedef enum {
+    GAME_MODE_TURNS,    // one player answers at a time, the others spectate
+    GAME_MODE_ROUNDS    // everyone answers each question at once
+} game_mode_t;
+
+typedef struct _game_session_t {
+    int id;
     client_t** players;
     int player_count;
     int max_players;
     int curr_question_idx;
     int curr_player_turn;
+    bool turn_scored;           // the current player's turn is over; a snapshot resumes with the next
     game_state_t state;
+    game_mode_t mode;
+    game_mode_t default_mode;   // used by a plain 'start'
+    answer_board_t answers;     // round mode: open while the current question takes answers
+    atomic_int connected;       // players not in a held seat, under the lock; read without it
+    bool sending_results;       // play_round() is sending results outside the lock; leaving players wait
+    pthread_cond_t results_sent;
+    atomic_int spectators;      // subscribed through spectate.h, not in 'players'
+    scoreboard_t scoreboard;
+    struct _game_session_t* lobby;   // rooms formed by the matchmaker: where players go back to afterwards
+    bool restored;              // from a snapshot: waits for its players to resume before going on
     pthread_mutex_t lock;
     pthread_cond_t game_start;
     time_t question_start_time;
@@ -1,56 +1,233 @@
 #include "includes/utils.h"
 #include "includes/data_loader.h"
+#include "includes/metrics.h"
+#include "includes/lockprof.h"
+#include "includes/logger.h"
+#include "includes/trace.h"
+#include "includes/record.h"
+#include "includes/clock.h"
+#include "includes/simulate.h"
+#include "includes/memacct.h"
+#include "includes/spectate.h"
+#include "includes/matchmaking.h"
+#include "includes/resume.h"
+#include "includes/snapshot.h"
+#include "includes/upgrade.h"
+#include "includes/ratelimit.h"
+#include "includes/reaper.h"
 #include <time.h>
-
-#define Clear   "\033[3;0;0m"
-#define Black   "\033[0;30m"
-#define Red     "\033[0;31m"
-#define Green   "\033[0;32m"
-#define Yellow  "\033[0;33m"
-#define Blue    "\033[0;34m"
-#define Purple  "\033[0;35m"
-#define Cyan    "\033[0;36m"
-#define White   "\033[0;37m"
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
 
 user_data_t** users = NULL;
 int user_count = 0;
 question_t** questions = NULL;
 int question_count = 0;
 game_session_t game_session;
+static size_t client_stack_size = 0;
+
+// Every connection a client thread is serving, for upgrade handovers
+static struct {
+    pthread_mutex_t lock;
+    client_t** clients;
+    int count;
+    int parked;                 // client threads stopped for a handover
+} connections = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#define SESSION_LOCK(session)   MUTEX_LOCK_WAIT(&(session)->lock, &metric_session_lock_wait)
+#define SESSION_UNLOCK(session) MUTEX_UNLOCK(&(session)->lock)
+
+static void send_message(client_t* client, const char* message, size_t len) {
+    record_event(RECORD_SEND, client->conn_id, message, len);
+    if (client->deliver) {
+        client->deliver(client, message, len);
+        counter_add(&metric_bytes_out, len);
+        return;
+    }
+    ssize_t sent = send(client->socket_fd, message, len, MSG_NOSIGNAL);
+    if (sent > 0)
+        counter_add(&metric_bytes_out, sent);
+}
 
-void broadcast_all(const char* message, client_t* exclude) {
-    pthread_mutex_lock(&game_session.lock);
-    for (int i = 0; i < game_session.player_count; i++) {
-        if (game_session.players[i] && 
-            game_session.players[i]->state != CLIENT_DISCONNECTED &&
-            game_session.players[i] != exclude) {
-                send(game_session.players[i]->socket_fd, message, strlen(message), 0);
+void game_session_init(game_session_t* session, int id) {
+    memset(session, 0, sizeof(game_session_t));
+    session->id = id;
+    session->state = GAME_WAITING;
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_cond_init(&session->game_start, NULL);
+    pthread_cond_init(&session->results_sent, NULL);
+    scoreboard_init(&session->scoreboard, session);
+    snapshot_track(session);
+}
+
+void client_init(client_t* client, int socket_fd, uint32_t conn_id) {
+    client->socket_fd = socket_fd;
+    client->conn_id = conn_id;
+    client->score = 0;
+    strcpy(client->username, "__anon__");
+    client->user_data = NULL;
+    client->state = CLIENT_CONNECTED;
+    client->has_answered = false;
+    client->answer = '\0';
+    atomic_init(&client->answered_round, 0);
+    client->session = &game_session;
+    client->board_slot = -1;
+    client->spectator = NULL;
+    client->match_entry = NULL;
+    client->resume = NULL;
+    client->resume_state = CLIENT_CONNECTED;
+    client->takeover = NULL;
+    client->conn_slot = -1;
+    client->rate = NULL;
+    client->reap = NULL;
+    client->deliver = NULL;
+    pthread_mutex_init(&client->lock, NULL);
+}
+
+void broadcast_all(game_session_t* session, const char* message, client_t* exclude) {
+    uint64_t span = TRACE_BEGIN();
+    uint64_t start = metrics_now_us();
+    size_t len = strlen(message);
+    SESSION_LOCK(session);
+    for (int i = 0; i < session->player_count; i++) {
+        if (session->players[i] && 
+            session->players[i]->state != CLIENT_DISCONNECTED &&
+            session->players[i] != exclude) {
+                send_message(session->players[i], message, len);
             }
     }
-    pthread_mutex_unlock(&game_session.lock);
+    SESSION_UNLOCK(session);
+    spectate_publish(session, message, len);
+    histogram_observe(&metric_broadcast_latency, metrics_now_us() - start);
+    trace_end(span, "net", "broadcast", NULL, TRACE_NO_ARG);
 }
 
 void send_to_client(client_t* client, const char* message) {
     if (client && client->state != CLIENT_DISCONNECTED)
-        send(client->socket_fd, message, strlen(message), 0);
+        send_message(client, message, strlen(message));
 }
 
-void remove_player(client_t* client) {
-    pthread_mutex_lock(&game_session.lock);
+// Session lock held: play_round() may be sending to any player
+static void wait_results_sent(game_session_t* session) {
+    while (session->sending_results)
+        MUTEX_COND_WAIT(&session->results_sent, &session->lock);
+}
 
-    for (int i = 0; i < game_session.player_count; i++) {
-        if (game_session.players[i] == client) {
-            for (int j = i; j < game_session.player_count - 1; j++) 
-                game_session.players[j] = game_session.players[j+1];
-            game_session.player_count--;
+void remove_player(client_t* client) {
+    game_session_t* session = client->session;
+    SESSION_LOCK(session);
+    wait_results_sent(session);
+
+    for (int i = 0; i < session->player_count; i++) {
+        if (session->players[i] == client) {
+            // A held seat was taken off when its connection dropped
+            if (client->state != CLIENT_DISCONNECTED) {
+                answers_player_left(&session->answers, &client->answered_round);
+                atomic_fetch_sub(&session->connected, 1);
+            }
+            for (int j = i; j < session->player_count - 1; j++) 
+                session->players[j] = session->players[j+1];
+            session->player_count--;
 
-            if (game_session.curr_player_turn >= game_session.player_count && game_session.player_count > 0)
-                game_session.curr_player_turn = 0;
+            if (session->curr_player_turn >= session->player_count && session->player_count > 0)
+                session->curr_player_turn = 0;
             break;
         }
     }
 
-    pthread_mutex_unlock(&game_session.lock);
+    SESSION_UNLOCK(session);
+}
+
+static void stop_spectating(client_t* client) {
+    spectate_unsubscribe(client->spectator);
+    client->spectator = NULL;
+    client->state = CLIENT_CONNECTED;
+}
+
+//
+//  Resume (see resume.h)
+//
+
+// Sends the client a new resume token; socket clients only
+static void issue_token(client_t* client) {
+    char token[RESUME_TOKEN_LEN + 1];
+    if (client->deliver || !resume_issue(client, token))
+        return;
+    char buff[BUFF_SIZE];
+    snprintf(buff, sizeof(buff), "INFO:Resume token: %s (if your connection drops, 'resume : %s' within %d seconds keeps your seat)\n",
+             token, token, RESUME_GRACE_US / 1000000);
+    send_to_client(client, buff);
+}
+
+// The connection dropped: closes it, and the client stays seated,
+// CLIENT_DISCONNECTED, until it resumes or the sweeper releases it
+static void hold_seat(client_t* client) {
+    game_session_t* session = client->session;
+    SESSION_LOCK(session);
+    wait_results_sent(session);
+    client_state_t state = client->state;
+    int socket_fd = client->socket_fd;
+    if (state == CLIENT_IN_GAME || state == CLIENT_LOBBY) {
+        answers_player_left(&session->answers, &client->answered_round);
+        atomic_fetch_sub(&session->connected, 1);
+    }
+    client->resume_state = state;
+    client->state = CLIENT_DISCONNECTED;
+    client->socket_fd = -1;
+    SESSION_UNLOCK(session);
+
+    char buff[BUFF_SIZE];
+    snprintf(buff, sizeof(buff), "INFO:%s lost connection, holding their seat for %d seconds\n",
+             client->username, RESUME_GRACE_US / 1000000);
+    record_event(RECORD_DISCONNECT, client->conn_id, NULL, 0);
+    close(socket_fd);
+    if (state == CLIENT_IN_GAME || state == CLIENT_LOBBY)
+        broadcast_all(session, buff, NULL);
+    // From here on a 'resume' may take the client over
+    resume_detach(client);
+}
+
+// The grace period ran out: what a dropped connection used to do right away
+void release_seat(client_t* client) {
+    game_session_t* session = client->session;
+    SESSION_LOCK(session);
+    client_state_t state = client->resume_state;
+    SESSION_UNLOCK(session);
+
+    if (state == CLIENT_IN_GAME || state == CLIENT_LOBBY) {
+        char buff[BUFF_SIZE];
+        snprintf(buff, sizeof(buff), "INFO:%s left the game", client->username);
+        broadcast_all(session, buff, client);
+        remove_player(client);
+    }
+    pthread_mutex_destroy(&client->lock);
+    mem_free(MEM_NETWORK, client);
+}
+
+// 'seat' continues on the connection 'client' came in on
+static void rebind_seat(client_t* seat, client_t* client) {
+    game_session_t* session = seat->session;
+    SESSION_LOCK(session);
+    seat->socket_fd = client->socket_fd;
+    seat->conn_id = client->conn_id;
+    seat->state = seat->resume_state;
+    client_state_t state = seat->state;
+    if (state == CLIENT_IN_GAME || state == CLIENT_LOBBY) {
+        answers_player_back(&session->answers, &seat->answered_round);
+        atomic_fetch_add(&session->connected, 1);
+    }
+    SESSION_UNLOCK(session);
+    client->takeover = seat;
+
+    char buff[BUFF_SIZE];
+    snprintf(buff, sizeof(buff), "RESP:Welcome back %s! Resumed with %d points this game\n", seat->username, seat->score);
+    send_to_client(seat, buff);
+    if (state == CLIENT_IN_GAME || state == CLIENT_LOBBY) {
+        snprintf(buff, sizeof(buff), "INFO:%s is back\n", seat->username);
+        broadcast_all(session, buff, seat);
+    }
+    LOG_INFO("[RESUME] %s resumed on connection %u", seat->username, seat->conn_id);
 }
 
 void send_question(client_t* player, question_t* question) {
@@ -61,14 +238,14 @@ void send_question(client_t* player, question_t* question) {
     send_to_client(player, buff);
 }
 
-void broadcast_question(question_t* question, const char* current_player_name) {
+void broadcast_question(game_session_t* session, question_t* question, const char* current_player_name) {
     char buff[BUFF_SIZE];
     snprintf(buff, sizeof(buff),
              "QUES:Spectating player %s:\n%s\nA:%s\nB:%s\nC:%s\nD:%s\n",
              current_player_name, question->text,
              question->option_a, question->option_b, question->option_c, question->option_d);
 
-    broadcast_all(buff, game_session.players[game_session.curr_player_turn]);
+    broadcast_all(session, buff, session->players[session->curr_player_turn]);
 }
 
 void announce_result(client_t* player, bool correct, int points_earned, char correct_ans) {
@@ -84,8 +261,8 @@ void announce_result(client_t* player, bool correct, int points_earned, char cor
                  correct_ans, player->score);
     }
     send_to_client(player, buff);
-    broadcast_all("INFO:Player responded, moving on to the next contestant!\n", player);
-    sleep(2);
+    broadcast_all(player->session, "INFO:Player responded, moving on to the next contestant!\n", player);
+    clock_sleep(2);
 }
 
 void announce_timeout(client_t* player) {
@@ -94,51 +271,52 @@ void announce_timeout(client_t* player) {
              "LRES:Oops, you ran out of time! No points awarded. (Total: %d points)",
              player->score);
     send_to_client(player, buff);
-    broadcast_all("INFO:Player ran out of time...I wonder what happened. Anyways, moving on to the next contestant!\n", player);
-    sleep(2);
+    broadcast_all(player->session, "INFO:Player ran out of time...I wonder what happened. Anyways, moving on to the next contestant!\n", player);
+    clock_sleep(2);
 }
 
-void announce_winner() {
-    pthread_mutex_lock(&game_session.lock);
+void announce_winner(game_session_t* session) {
+    SESSION_LOCK(session);
 
-    if (game_session.player_count == 0) {
-        pthread_mutex_unlock(&game_session.lock);
+    if (session->player_count == 0) {
+        SESSION_UNLOCK(session);
         return;
     }
 
     int max_score = -1;
-    for (int i = 0; i < game_session.player_count; i++) {
-        if (game_session.players[i]->score > max_score)
-            max_score = game_session.players[i]->score;
+    for (int i = 0; i < session->player_count; i++) {
+        if (session->players[i]->score > max_score)
+            max_score = session->players[i]->score;
     }
 
     char winners[BUFF_SIZE / 4] = "";
     int winner_count = 0;
 
-    for (int i = 0; i < game_session.player_count; i++) {
-        if (game_session.players[i]->score == max_score) {
+    for (int i = 0; i < session->player_count; i++) {
+        if (session->players[i]->score == max_score) {
             if (winner_count > 0) strcat(winners, ", ");
-            strcat(winners, game_session.players[i]->username);
+            strcat(winners, session->players[i]->username);
             winner_count++;
-            if (game_session.players[i]->user_data) {
-                game_session.players[i]->user_data->games_won++;
-                game_session.players[i]->user_data->curr_streak++;
-                if (game_session.players[i]->user_data->max_streak < game_session.players[i]->user_data->curr_streak)
-                    game_session.players[i]->user_data->max_streak = game_session.players[i]->user_data->curr_streak;
+            if (session->players[i]->user_data) {
+                session->players[i]->user_data->games_won++;
+                session->players[i]->user_data->curr_streak++;
+                if (session->players[i]->user_data->max_streak < session->players[i]->user_data->curr_streak)
+                    session->players[i]->user_data->max_streak = session->players[i]->user_data->curr_streak;
             }
         } else {
-            if (game_session.players[i]->user_data) {
-                game_session.players[i]->user_data->curr_streak = 0;
+            if (session->players[i]->user_data) {
+                session->players[i]->user_data->curr_streak = 0;
             }
         }
 
-        if (game_session.players[i]->user_data) {
-            game_session.players[i]->user_data->total_points += game_session.players[i]->score;
-            game_session.players[i]->user_data->games_played++;
+        if (session->players[i]->user_data) {
+            session->players[i]->user_data->total_points += session->players[i]->score;
+            session->players[i]->user_data->games_played++;
         }
     }
 
-    pthread_mutex_unlock(&game_session.lock);
+    matchmaking_rate(session->players, session->player_count);
+    SESSION_UNLOCK(session);
     
     save_users();
 
@@ -148,211 +326,472 @@ void announce_winner() {
     else
         snprintf(buff, sizeof(buff), "END_:Tie! Winners: %s with %d points each!\n", winners, max_score);
 
-    broadcast_all(buff, NULL);
+    broadcast_all(session, buff, NULL);
 }
 
-void reset_game_session() {
-    pthread_mutex_lock(&game_session.lock);
-
-    for (int i = 0; i < game_session.player_count; i++) {
-        if (game_session.players[i] && game_session.players[i]->state != CLIENT_DISCONNECTED) {
-            game_session.players[i]->state = CLIENT_CONNECTED;
-            game_session.players[i]->score = 0;
-            game_session.players[i]->has_answered = false;
+void reset_game_session(game_session_t* session) {
+    SESSION_LOCK(session);
+
+    for (int i = 0; i < session->player_count; i++) {
+        if (session->players[i] && session->players[i]->state != CLIENT_DISCONNECTED) {
+            session->players[i]->state = CLIENT_CONNECTED;
+            session->players[i]->score = 0;
+            session->players[i]->has_answered = false;
+        } else if (session->players[i]) {
+            // A held seat resumes into the lobby
+            session->players[i]->resume_state = CLIENT_CONNECTED;
         }
+        if (session->lobby)
+            session->players[i]->session = session->lobby;
     }
 
-    free(game_session.players);
-    game_session.players = NULL;
-    game_session.player_count = 0;
-    game_session.curr_question_idx = 0;
-    game_session.curr_player_turn = 0;
-    game_session.state = GAME_WAITING;
+    mem_free(MEM_GAME, session->players);
+    session->players = NULL;
+    session->player_count = 0;
+    atomic_store(&session->connected, 0);
+    session->curr_question_idx = 0;
+    session->curr_player_turn = 0;
+    session->turn_scored = false;
+    session->state = GAME_WAITING;
+    gauge_add(&metric_rooms, -1);
+
+    SESSION_UNLOCK(session);
+    LOG_INFO("[GAME] Game session reset, ready for new players");
+}
 
-    pthread_mutex_unlock(&game_session.lock);
-    printf(Yellow"[GAME] Game session reset, ready for new players\n"Clear);
+// A held seat (see resume.h) stays disconnected until its player resumes,
+// straight into the game
+static void enter_game(client_t* player) {
+    if (player->state == CLIENT_DISCONNECTED)
+        player->resume_state = CLIENT_IN_GAME;
+    else
+        player->state = CLIENT_IN_GAME;
 }
 
-void* game_loop(void* arg) {
-    while (true) {
-        printf(Green"[GAME] Game loop started, waiting for start signal...\n"Clear);
+// Seats players formed into a room by the matchmaker and starts the game, as
+// if they had all typed 'join' and one of them 'start'. The room must be idle.
+void start_match(game_session_t* session, client_t** players, int count, game_mode_t mode) {
+    SESSION_LOCK(session);
+    session->players = mem_realloc(MEM_GAME, session->players, count * sizeof(client_t*));
+    session->lobby = players[0]->session;
+    for (int i = 0; i < count; i++) {
+        players[i]->session = session;
+        if (players[i]->state != CLIENT_DISCONNECTED)
+            atomic_fetch_add(&session->connected, 1);
+        enter_game(players[i]);
+        players[i]->score = 0;
+        players[i]->join_order = i;
+        session->players[i] = players[i];
+    }
+    session->player_count = count;
+    session->state = GAME_ACTIVE;
+    session->mode = mode;
+    gauge_add(&metric_rooms, 1);
 
-        pthread_mutex_lock(&game_session.lock);
-        while (game_session.state == GAME_WAITING)
-            pthread_cond_wait(&game_session.game_start, &game_session.lock);
-        pthread_mutex_unlock(&game_session.lock);
-        
-        broadcast_all("GAME:Ladies and gentlemen, the game is starting! Get ready!", NULL);
-        sleep(2);
+    MUTEX_COND_BROADCAST(&session->game_start);
+    SESSION_UNLOCK(session);
+}
 
-        for (int q_idx = 0; q_idx < question_count; q_idx++) {
-            pthread_mutex_lock(&game_session.lock);
+// Turn mode: each player gets the question in turn while the others spectate
+static void play_turns(game_session_t* session, int q_idx, question_t* curr_question, int players_in_round, int first_player) {
+    for (int player_idx = first_player; player_idx < players_in_round; player_idx++) {
+        SESSION_LOCK(session);
+        if (session->player_count == 0) {
+            SESSION_UNLOCK(session);
+            break;
+        }
+        if (player_idx >= session->player_count) {
+            SESSION_UNLOCK(session);
+            break;
+        }
 
-            if (game_session.player_count == 0) {
-                printf(Yellow"[GAME] No players left! Ending game.\n"Clear);
-                pthread_mutex_unlock(&game_session.lock);
+        session->curr_player_turn = player_idx;
+        session->turn_scored = false;
+        client_t* curr_player = session->players[player_idx];
+        char curr_player_name[MAX_NAME_LEN];
+        strcpy(curr_player_name, curr_player->username);
+        if (curr_player->state == CLIENT_DISCONNECTED) {
+            SESSION_UNLOCK(session);
+            continue;
+        }
+        LOG_INFO("[GAME] Player %d/%d: %s's turn", player_idx + 1, players_in_round, curr_player->username);
+    
+        SESSION_UNLOCK(session);
+
+        // Cleared before the question goes out, so a quick answer isn't lost
+        MUTEX_LOCK(&curr_player->lock);
+        curr_player->has_answered = false;
+        MUTEX_UNLOCK(&curr_player->lock);
+
+        uint64_t turn_span = TRACE_BEGIN();
+        uint64_t send_span = TRACE_BEGIN();
+        send_question(curr_player, curr_question);
+        broadcast_question(session, curr_question, curr_player->username);
+        trace_end(send_span, "net", "question sent", NULL, q_idx);
+        time_t start_time = clock_time();
+        session->question_start_time = start_time;
+        uint64_t deadline = clock_now_us() + (uint64_t) curr_question->time_limit * 1000000;
+
+        bool answer_time = false;
+        uint64_t wait_span = TRACE_BEGIN();
+        while (clock_now_us() < deadline) {
+            MUTEX_LOCK(&curr_player->lock);
+            bool answered = curr_player->has_answered;
+            bool disconnected = (curr_player->state == CLIENT_DISCONNECTED);
+            MUTEX_UNLOCK(&curr_player->lock);
+
+            if (answered || disconnected) {
+                answer_time = answered;
                 break;
             }
 
-            game_session.curr_question_idx = q_idx;
-            question_t* curr_question = questions[q_idx];
-            int players_in_round = game_session.player_count;
-
-            pthread_mutex_unlock(&game_session.lock);
-            printf(Cyan"[GAME] Question %d/%d: %s\n"Clear, q_idx + 1, question_count, curr_question->text);
-
-            for (int player_idx = 0; player_idx < players_in_round; player_idx++) {
-                pthread_mutex_lock(&game_session.lock);
-                if (game_session.player_count == 0) {
-                    pthread_mutex_unlock(&game_session.lock);
-                    break;
-                }
-                if (player_idx >= game_session.player_count) {
-                    pthread_mutex_unlock(&game_session.lock);
-                    break;
-                }
-
-                game_session.curr_player_turn = player_idx;
-                client_t* curr_player = game_session.players[player_idx];
-                char curr_player_name[MAX_NAME_LEN];
-                strcpy(curr_player_name, curr_player->username);
-                if (curr_player->state == CLIENT_DISCONNECTED) {
-                    pthread_mutex_unlock(&game_session.lock);
-                    continue;
-                }
-                printf(Blue"[GAME] Player %d/%d: %s's turn\n"Clear, player_idx + 1, players_in_round, curr_player->username);
-            
-                pthread_mutex_unlock(&game_session.lock);
-
-                send_question(curr_player, curr_question);
-                broadcast_question(curr_question, curr_player->username);
-                time_t start_time = time(NULL);
-                game_session.question_start_time = start_time;
-
-                pthread_mutex_lock(&curr_player->lock);
-                curr_player->has_answered = false;
-                pthread_mutex_unlock(&curr_player->lock);
-
-                bool answer_time = false;
-                while (difftime(time(NULL), start_time) < curr_question->time_limit) {
-                    pthread_mutex_lock(&curr_player->lock);
-                    bool answered = curr_player->has_answered;
-                    bool disconnected = (curr_player->state == CLIENT_DISCONNECTED);
-                    pthread_mutex_unlock(&curr_player->lock);
-
-                    if (answered || disconnected) {
-                        answer_time = answered;
-                        break;
-                    }
-
-                    usleep(100000);
-                }
-
-                if (curr_player->state == CLIENT_DISCONNECTED) {
-                    printf(Yellow"[GAME] Player %s disconnected during their turn\n"Clear, curr_player_name);
-                    char buff[BUFF_SIZE];
-                    snprintf(buff, sizeof(buff), "INFO:%s disconnected\n", curr_player_name);
-                    broadcast_all(buff, curr_player);
-                    continue;
-                }
-
-                if (answer_time) {
-                    pthread_mutex_lock(&curr_player->lock);
-                    char answer = curr_player->answer;
-                    pthread_mutex_unlock(&curr_player->lock);
-
-                    bool correct = (answer == curr_question->correct_answer);
-                    if (correct) {
-                        curr_player->score += curr_question->points;
-                        printf(Green"[GAME] %s answered correctly! +%d points\n"Clear,
-                            curr_player->username, curr_question->points);
-                    } else {
-                        printf(Blue"[GAME] %s answered incorrectly (answered %c, correct was %c)\n"Clear,
-                            curr_player->username, answer, curr_question->correct_answer);
-                    }
-
-                    announce_result(curr_player, correct, curr_question->points, curr_question->correct_answer);
-                } else {
-                    printf(Blue"[GAME] %s timed out\n"Clear, curr_player->username);
-                    announce_timeout(curr_player);
-                }
-            }
-
-            if (q_idx < question_count - 1) {
-                char buff[BUFF_SIZE];
-                snprintf(buff, sizeof(buff), "INFO:Next question in 3 seconds... (%d/%d)", q_idx + 2, question_count);
-                broadcast_all(buff, NULL);
-                sleep(3);
-            }
+            clock_sleep_us(100000);
         }
+        trace_end(wait_span, "wait", "answer wait", NULL, player_idx);
 
-        printf(Green"[GAME] All questions completed!\n"Clear);
+        upgrade_step_begin();
+        SESSION_LOCK(session);
+        session->turn_scored = true;
+        SESSION_UNLOCK(session);
+
+        if (curr_player->state == CLIENT_DISCONNECTED) {
+            LOG_WARN("[GAME] Player %s disconnected during their turn", curr_player_name);
+            char buff[BUFF_SIZE];
+            snprintf(buff, sizeof(buff), "INFO:%s disconnected\n", curr_player_name);
+            broadcast_all(session, buff, curr_player);
+            upgrade_step_end();
+            trace_end(turn_span, "game", "turn", "disconnected", player_idx);
+            continue;
+        }
 
-        pthread_mutex_lock(&game_session.lock);
-        game_session.state = GAME_FINISHED;
-        pthread_mutex_unlock(&game_session.lock);
+        uint64_t result_span = TRACE_BEGIN();
+        if (answer_time) {
+            MUTEX_LOCK(&curr_player->lock);
+            char answer = curr_player->answer;
+            MUTEX_UNLOCK(&curr_player->lock);
+
+            bool correct = (answer == curr_question->correct_answer);
+            if (correct) {
+                curr_player->score += curr_question->points;
+                scoreboard_update(&session->scoreboard, curr_player);
+                LOG_INFO("[GAME] %s answered correctly! +%d points",
+                    curr_player->username, curr_question->points);
+            } else {
+                LOG_INFO("[GAME] %s answered incorrectly (answered %c, correct was %c)",
+                    curr_player->username, answer, curr_question->correct_answer);
+            }
 
-        announce_winner();
-        sleep(5);
-        broadcast_all("INFO:Game ended. You can type 'join' to play again!\n", NULL);
-        reset_game_session();
+            upgrade_step_end();
+            announce_result(curr_player, correct, curr_question->points, curr_question->correct_answer);
+        } else {
+            LOG_INFO("[GAME] %s timed out", curr_player->username);
+            upgrade_step_end();
+            announce_timeout(curr_player);
+        }
+        counter_add(&metric_turns, 1);
+        trace_end(result_span, "net", "result broadcast", NULL, player_idx);
+        trace_end(turn_span, "game", "turn", NULL, player_idx);
     }
-    return NULL;
 }
 
-void* handle_client(void* arg) {
-    client_t* client = (client_t*) arg;
+typedef enum {
+    ROUND_TIMEOUT,
+    ROUND_CORRECT,
+    ROUND_WRONG
+} round_outcome_t;
+
+typedef struct {
+    client_t* player;
+    round_outcome_t outcome;
+    int score;
+} round_result_t;
+
+// Round mode: everyone gets the question at once. Answers go to the session's
+// answer board without taking the session lock (see answers.h) until the
+// deadline or until all players have answered, then the shards are merged
+// and every player is scored in one pass.
+static void play_round(game_session_t* session, int q_idx, question_t* curr_question) {
+    uint64_t round_span = TRACE_BEGIN();
+    answers_open(&session->answers, curr_question->correct_answer, clock_now_us());
+
     char buff[BUFF_SIZE];
-    while (true) {
-        memset(buff, 0, sizeof(buff));
-        int len = recv(client->socket_fd, buff, sizeof(buff), 0);
-        if (len <= 0) {
-            printf(Cyan"[SERVER_CHANDLER] Client %s disconnected successfully\n"Clear, client->username);
+    snprintf(buff, sizeof(buff),
+             "QUES:It's everyone's turn! Read the question and choose wisely:\n%s\nA:%s\nB:%s\nC:%s\nD:%s\n",
+             curr_question->text, curr_question->option_a, curr_question->option_b,
+             curr_question->option_c, curr_question->option_d);
+    uint64_t send_span = TRACE_BEGIN();
+    broadcast_all(session, buff, NULL);
+    trace_end(send_span, "net", "question sent", NULL, q_idx);
+    session->question_start_time = clock_time();
+    uint64_t deadline = clock_now_us() + (uint64_t) curr_question->time_limit * 1000000;
+
+    uint64_t wait_span = TRACE_BEGIN();
+    while (clock_now_us() < deadline) {
+        // Held seats can't answer until they resume, and their answers don't count meanwhile
+        int players = atomic_load(&session->connected);
+        if (answers_count(&session->answers) >= (uint64_t) (players > 0 ? players : 0))
+            break;
+        clock_sleep_us(100000);
+    }
+    trace_end(wait_span, "wait", "answer wait", NULL, q_idx);
+
+    uint64_t result_span = TRACE_BEGIN();
+    answer_totals_t totals;
+    upgrade_step_begin();
+    answers_close(&session->answers, &totals);
+
+    // Scored under the lock, sent after it, so a slow socket doesn't hold up
+    // answers and joins. Players who left during the round are already out of
+    // the list; those leaving now wait for the sends.
+    int players = 0;
+    SESSION_LOCK(session);
+    session->turn_scored = true;
+    round_result_t* results = mem_malloc(MEM_GAME, (session->player_count ? session->player_count : 1) * sizeof(round_result_t));
+    for (int i = 0; i < session->player_count; i++) {
+        client_t* player = session->players[i];
+        if (player->state == CLIENT_DISCONNECTED)
+            continue;
 
-            if (client->state == CLIENT_IN_GAME) {
-                char buff[BUFF_SIZE];
-                snprintf(buff, sizeof(buff), "INFO:%s left the game", client->username);
-                broadcast_all(buff, client);
-                remove_player(client);
+        round_outcome_t outcome = ROUND_TIMEOUT;
+        if (answers_player_answered(&session->answers, &player->answered_round)) {
+            outcome = player->answer == curr_question->correct_answer ? ROUND_CORRECT : ROUND_WRONG;
+            if (outcome == ROUND_CORRECT) {
+                player->score += curr_question->points;
+                scoreboard_update(&session->scoreboard, player);
             }
-            client->state = CLIENT_DISCONNECTED;
+        }
+        if (results)
+            results[players] = (round_result_t) { player, outcome, player->score };
+        players++;
+    }
+    session->sending_results = results != NULL;
+    SESSION_UNLOCK(session);
+
+    for (int i = 0; results && i < players; i++) {
+        if (results[i].outcome == ROUND_TIMEOUT) {
+            snprintf(buff, sizeof(buff),
+                     "LRES:Oops, you ran out of time! No points awarded. (Total: %d points)",
+                     results[i].score);
+        } else if (results[i].outcome == ROUND_CORRECT) {
+            snprintf(buff, sizeof(buff),
+                     "WRES:You answered correctly! +%d points (Total: %d)\n",
+                     curr_question->points, results[i].score);
+        } else {
+            snprintf(buff, sizeof(buff),
+                     "LRES:Oops! You answered incorrectly. Correct answer was: %c. (Total: %d points)",
+                     curr_question->correct_answer, results[i].score);
+        }
+        send_to_client(results[i].player, buff);
+    }
+    if (results) {
+        SESSION_LOCK(session);
+        session->sending_results = false;
+        MUTEX_COND_BROADCAST(&session->results_sent);
+        SESSION_UNLOCK(session);
+        mem_free(MEM_GAME, results);
+    } else {
+        LOG_WARN("[GAME] Round %d: out of memory, results not sent", q_idx + 1);
+    }
+    upgrade_step_end();
+    counter_add(&metric_turns, players);
 
-            break;
+    int median = 0;
+    for (uint64_t seen = 0; median < ANSWER_TIME_BUCKETS - 1; median++) {
+        seen += totals.time_buckets[median];
+        if (seen * 2 >= totals.answered) break;
+    }
+    LOG_INFO("[GAME] Round %d: %llu/%d answered, %llu correct, median answer within %ds",
+             q_idx + 1, (unsigned long long) totals.answered, players, (unsigned long long) totals.correct, median + 1);
+    snprintf(buff, sizeof(buff), "INFO:Round over! %llu of %d players answered correctly. Answers: A:%llu B:%llu C:%llu D:%llu\n",
+             (unsigned long long) totals.correct, players,
+             (unsigned long long) totals.options[0], (unsigned long long) totals.options[1],
+             (unsigned long long) totals.options[2], (unsigned long long) totals.options[3]);
+    broadcast_all(session, buff, NULL);
+    trace_end(result_span, "net", "result broadcast", NULL, q_idx);
+    trace_end(round_span, "game", "round", NULL, q_idx);
+    clock_sleep(2);
+}
+
+// A game restored from a snapshot: its players come back through 'resume'
+static void wait_for_resumes(game_session_t* session) {
+    uint64_t deadline = clock_now_us() + SNAPSHOT_RESUME_WAIT_US;
+    while (clock_now_us() < deadline) {
+        int away = 0;
+        SESSION_LOCK(session);
+        for (int i = 0; i < session->player_count; i++)
+            if (session->players[i]->state == CLIENT_DISCONNECTED)
+                away++;
+        SESSION_UNLOCK(session);
+
+        if (away == 0) break;
+        clock_sleep_us(100000);
+    }
+}
+
+// One thread per room; 'arg' is its game_session_t
+void* game_loop(void* arg) {
+    game_session_t* session = (game_session_t*) arg;
+    char name[LOG_THREAD_NAME_LEN];
+    snprintf(name, sizeof(name), "game-%d", session->id);
+    log_set_thread_name(name);
+    clock_attach();
+    while (true) {
+        LOG_INFO("[GAME] Game loop started, waiting for start signal...");
+
+        SESSION_LOCK(session);
+        while (session->state == GAME_WAITING)
+            MUTEX_COND_WAIT(&session->game_start, &session->lock);
+        game_mode_t mode = session->mode;
+        bool restored = session->restored;
+        int first_question = restored ? session->curr_question_idx : 0;
+        int first_turn = restored ? session->curr_player_turn : 0;
+        // A round is scored all at once: if it was, go on with the next question
+        if (restored && mode == GAME_MODE_ROUNDS && first_turn > 0)
+            first_question++;
+        session->restored = false;
+        scoreboard_begin(&session->scoreboard, session->players, session->player_count);
+        SESSION_UNLOCK(session);
+        trace_capture_t trace = trace_game_begin();
+        uint64_t game_span = TRACE_BEGIN();
+
+        if (restored) {
+            LOG_INFO("[GAME] Restored game, waiting for players to resume before question %d", first_question + 1);
+            wait_for_resumes(session);
+            broadcast_all(session, "GAME:The server restarted! Picking the game up where it left off.", NULL);
+        } else {
+            broadcast_all(session, "GAME:Ladies and gentlemen, the game is starting! Get ready!", NULL);
         }
+        uint64_t sleep_span = TRACE_BEGIN();
+        clock_sleep(2);
+        trace_end(sleep_span, "sleep", "start delay", NULL, TRACE_NO_ARG);
+
+        for (int q_idx = first_question; q_idx < question_count; q_idx++) {
+            uint64_t question_span = TRACE_BEGIN();
+            SESSION_LOCK(session);
 
-        printf(Blue"[SERVER_CHANDLER] Command received: '%s'\n"Clear, buff);
-        if (strncmp(buff, "answer : ", 9) == 0) {
-            if (client->state != CLIENT_IN_GAME) {
-                send_to_client(client, "ERR_:Not in game\n");
-                continue;
+            if (session->player_count == 0) {
+                LOG_WARN("[GAME] No players left! Ending game.");
+                SESSION_UNLOCK(session);
+                break;
             }
 
-            pthread_mutex_lock(&game_session.lock);
-            bool is_curr_turn = (game_session.curr_player_turn < game_session.player_count &&
-                                 game_session.players[game_session.curr_player_turn] == client);
-            pthread_mutex_unlock(&game_session.lock);
+            session->curr_question_idx = q_idx;
+            session->turn_scored = false;
+            question_t* curr_question = questions[q_idx];
+            int players_in_round = session->player_count;
+
+            SESSION_UNLOCK(session);
+            scoreboard_keyframe(&session->scoreboard);
+            LOG_INFO("[GAME] Question %d/%d: %s", q_idx + 1, question_count, curr_question->text);
+            record_event(RECORD_QUESTION, q_idx, NULL, 0);
 
-            if (!is_curr_turn) {
-                send_to_client(client, "WARN:Not your turn!\n");
-                continue;
+            if (mode == GAME_MODE_ROUNDS)
+                play_round(session, q_idx, curr_question);
+            else
+                play_turns(session, q_idx, curr_question, players_in_round, q_idx == first_question ? first_turn : 0);
+
+            if (q_idx < question_count - 1) {
+                char buff[BUFF_SIZE];
+                snprintf(buff, sizeof(buff), "INFO:Next question in 3 seconds... (%d/%d)", q_idx + 2, question_count);
+                broadcast_all(session, buff, NULL);
+                trace_end(question_span, "game", "question", NULL, q_idx);
+                sleep_span = TRACE_BEGIN();
+                clock_sleep(3);
+                trace_end(sleep_span, "sleep", "next question delay", NULL, q_idx);
+            } else {
+                trace_end(question_span, "game", "question", NULL, q_idx);
             }
+        }
+
+        LOG_INFO("[GAME] All questions completed!");
+        scoreboard_end(&session->scoreboard);
+
+        upgrade_step_begin();
+        SESSION_LOCK(session);
+        session->state = GAME_FINISHED;
+        SESSION_UNLOCK(session);
+
+        announce_winner(session);
+        upgrade_step_end();
+        counter_add(&metric_games, 1);
+        sleep_span = TRACE_BEGIN();
+        clock_sleep(5);
+        trace_end(sleep_span, "sleep", "end delay", NULL, TRACE_NO_ARG);
+        broadcast_all(session, "INFO:Game ended. You can type 'join' to play again!\n", NULL);
+        reset_game_session(session);
+        trace_end(game_span, "game", "game", NULL, trace.id);
+        trace_game_end(trace);
+    }
+    return NULL;
+}
+
+static command_type_t command_type(const char* buff) {
+    static const struct { const char* prefix; command_type_t type; } commands[] = {
+        { "answer : ", COMMAND_ANSWER }, { "help", COMMAND_HELP }, { "join", COMMAND_JOIN },
+        { "login : ", COMMAND_LOGIN }, { "logout", COMMAND_LOGOUT }, { "meow", COMMAND_MEOW },
+        { "register : ", COMMAND_REGISTER }, { "stats", COMMAND_STATS }, { "start", COMMAND_START },
+        { "spectate", COMMAND_SPECTATE }, { "queue", COMMAND_QUEUE },
+        { "resume : ", COMMAND_RESUME }, { "quit", COMMAND_QUIT }
+    };
+
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+        if (strncmp(buff, commands[i].prefix, strlen(commands[i].prefix)) == 0)
+            return commands[i].type;
+    return COMMAND_UNKNOWN;
+}
+
+static bool dispatch_command(client_t* client, char* buff) {
+    game_session_t* session = client->session;
+    if (strncmp(buff, "answer : ", 9) == 0) {
+        if (client->state != CLIENT_IN_GAME) {
+            send_to_client(client, "ERR_:Not in game\n");
+            return true;
+        }
 
-            char answer = buff[9] & 0x5F;
+        char answer = buff[9] & 0x5F;
+        if (atomic_load(&session->answers.open)) {
             if (answer < 'A' || answer > 'D') {
                 send_to_client(client, "ERR_:Invalid answer. Use A, B, C or D.\n");
-                continue;
+                return true;
             }
-
-            pthread_mutex_lock(&client->lock);
-            if (!client->has_answered) {
-                client->answer = answer;
-                client->has_answered = true;
-                client->answer_time = time(NULL);
+            answer_result_t result = answers_submit(&session->answers, &client->answered_round,
+                                                    &client->answer, answer, clock_now_us());
+            if (result == ANSWER_ACCEPTED)
                 send_to_client(client, "RESP:Answer received!\n");
-            }
-            pthread_mutex_unlock(&client->lock);
-        } else if (strncmp(buff, "help", 4) == 0) {
-            send(client->socket_fd, "RESP:// ===== Server Specific Commands =====//\n\
+            else if (result == ANSWER_DUPLICATE)
+                send_to_client(client, "WARN:You already answered this question!\n");
+            else
+                send_to_client(client, "WARN:Answers are closed for this question!\n");
+            return true;
+        }
+
+        SESSION_LOCK(session);
+        bool rounds = (session->mode == GAME_MODE_ROUNDS);
+        bool is_curr_turn = !rounds &&
+                            session->curr_player_turn < session->player_count &&
+                            session->players[session->curr_player_turn] == client;
+        SESSION_UNLOCK(session);
+
+        if (!is_curr_turn) {
+            send_to_client(client, rounds ? "WARN:Answers are closed for this question!\n" : "WARN:Not your turn!\n");
+            return true;
+        }
+
+        if (answer < 'A' || answer > 'D') {
+            send_to_client(client, "ERR_:Invalid answer. Use A, B, C or D.\n");
+            return true;
+        }
+
+        MUTEX_LOCK(&client->lock);
+        if (!client->has_answered) {
+            client->answer = answer;
+            client->has_answered = true;
+            client->answer_time = clock_time();
+            send_to_client(client, "RESP:Answer received!\n");
+        }
+        MUTEX_UNLOCK(&client->lock);
+    } else if (strncmp(buff, "help", 4) == 0) {
+        send_to_client(client, "RESP:// ===== Server Specific Commands =====//\n\
 answer : abcd...      => Answer to current question\n\
 help                  => Display command list\n\
 login : username      => Login into user with name 'username'\n\
@@ -360,214 +799,661 @@ logout                => Log out of the current user\n\
 meow                  => 'meow :3' back\n\
 register : username   => Register new user with name 'username'\n\
 stats                 => Show stats of current user\n\
+start : mode          => Start the game, mode is turns or rounds (optional)\n\
+spectate              => Watch the game without playing ('spectate : stop' to leave)\n\
+queue                 => Wait for a room with players of your rating ('queue : stop' to leave)\n\
+resume : token        => Take back your seat after a dropped connection\n\
 quit/exit             => Quit cleanly from the server and close client\n\
 // ===== Client Specific Commands =====//\n\
-clear                 => Clear terminal\n", 569, 0);
-        } else if (strncmp(buff, "join", 4) == 0) {
-            if (client->user_data == NULL) {
-                send_to_client(client, "ERR_:Please login first to join the game!\n");
-                continue;
-            }
+clear                 => Clear terminal\n");
+    } else if (strncmp(buff, "join", 4) == 0) {
+        if (client->user_data == NULL) {
+            send_to_client(client, "ERR_:Please login first to join the game!\n");
+            return true;
+        }
 
-            pthread_mutex_lock(&game_session.lock);
+        SESSION_LOCK(session);
 
-            if (game_session.state != GAME_WAITING) {
-                send_to_client(client, "ERR_:Game already in progress.\n");
-                pthread_mutex_unlock(&game_session.lock);
-                continue;
-            }
+        if (session->state != GAME_WAITING) {
+            send_to_client(client, "ERR_:Game already in progress.\n");
+            SESSION_UNLOCK(session);
+            return true;
+        }
 
-            if (client->state == CLIENT_IN_GAME || client->state == CLIENT_LOBBY) {
-                send_to_client(client, "WARN:Already in game lobby\n");
-                pthread_mutex_unlock(&game_session.lock);
-                continue;
+        if (client->state == CLIENT_IN_GAME || client->state == CLIENT_LOBBY) {
+            send_to_client(client, "WARN:Already in game lobby\n");
+            SESSION_UNLOCK(session);
+            return true;
+        }
+        if (client->state == CLIENT_QUEUED) {
+            send_to_client(client, "WARN:You are in the matchmaking queue ('queue : stop' to leave)\n");
+            SESSION_UNLOCK(session);
+            return true;
+        }
+
+        if (client->state == CLIENT_SPECTATING)
+            stop_spectating(client);
+        client->state = CLIENT_LOBBY;
+        client->score = 0;
+        client->join_order = session->player_count;
+
+        session->players = mem_realloc(MEM_GAME, session->players,
+                                       (session->player_count + 1) * sizeof(client_t*));
+        session->players[session->player_count] = client;
+        session->player_count++;
+        atomic_fetch_add(&session->connected, 1);
+
+        char buff[BUFF_SIZE];
+        snprintf(buff, sizeof(buff), "RESP:Joined game! Players: %d\n", session->player_count);
+        send_to_client(client, buff);
+
+        int players = session->player_count;
+        snprintf(buff, sizeof(buff), "INFO:%s joined the game (Total: %d players)\n", client->username, players);
+        SESSION_UNLOCK(session);
+        broadcast_all(session, buff, client);
+
+        LOG_INFO("[GAME] %s joined the party! (Total players: %d)", client->username, players);
+    } else if (strncmp(buff, "login : ", 8) == 0) {
+        if (client->user_data != NULL) {
+            send_to_client(client, "WARN:You are already logged in. Maybe you meant 'logout'?");
+            return true;
+        }
+        char username[MAX_NAME_LEN];
+        sscanf(buff, "login : %s", username);
+        user_data_t* user = find_user(username);
+
+        if (user == NULL) {
+            send_to_client(client, "ERR_:User not found. Please register first.");
+        } else {
+            strcpy(client->username, username);
+            client->user_data = user;
+            time_t now = clock_time();
+            strftime(user->last_login, sizeof(user->last_login), "%Y-%m-%d %H:%M:%S", localtime(&now));
+            save_users();
+            char resp[BUFF_SIZE];
+            snprintf(resp, sizeof(resp), "RESP:Welcome back %s! Points: %d, Games: %d, Wins: %d", 
+                     username, user->total_points, user->games_played, user->games_won);
+            send_to_client(client, resp);
+            issue_token(client);
+        }
+    } else if (strncmp(buff, "logout", 6) == 0) {
+        if (client->user_data == NULL) {
+            send_to_client(client, "WARN:You are already logged out. Maybe you meant 'quit'?");
+            return true;
+        }
+        client->user_data = NULL;
+        resume_revoke(client);
+        send_to_client(client, "RESP:Logged Out");
+    } else if (strncmp(buff, "meow", 4) == 0) {
+        send_to_client(client, "RESP:meow :3");
+    } else if (strncmp(buff, "register : ", 11) == 0) {
+        if (client->user_data != NULL) {
+            send_to_client(client, "WARN:You are already logged in.");
+            return true;
+        }
+        char username[MAX_NAME_LEN];
+        sscanf(buff, "register : %255s", username);
+        user_data_t* existing_user = find_user(username);
+
+        if (existing_user)
+            send_to_client(client, "ERR_:Username already exists!");
+        else {
+            client->user_data = create_user(username);
+            strcpy(client->username, username);
+            char resp[BUFF_SIZE];
+            snprintf(resp, sizeof(resp), "RESP:Registered new user '%s'", username);
+            send_to_client(client, resp);
+            issue_token(client);
+        }
+    } else if (strncmp(buff, "stats", 5) == 0) {
+        if (client->user_data == NULL)
+            send_to_client(client, "ERR_:Please login first to view stats");
+        else {
+            char resp[BUFF_SIZE];
+            snprintf(resp, sizeof(resp),
+                     "RESP:Stats: %s | Points: %d | Games: %d | Wins: %d | Win Rate: %.1f | Max Streak: %d | Rating: %d",
+                     client->username, client->user_data->total_points, client->user_data->games_played, client->user_data->games_won, 
+                     (client->user_data->games_played > 0) ? (100.0 * client->user_data->games_won / client->user_data->games_played) : 0.0,
+                     client->user_data->max_streak, client->user_data->rating);
+            send_to_client(client, resp);
+        } 
+    } else if (strncmp(buff, "start", 5) == 0) {
+        game_mode_t mode = session->default_mode;
+        if (strncmp(buff, "start : ", 8) == 0) {
+            if (strncmp(buff + 8, "rounds", 6) == 0)
+                mode = GAME_MODE_ROUNDS;
+            else if (strncmp(buff + 8, "turns", 5) == 0)
+                mode = GAME_MODE_TURNS;
+            else {
+                send_to_client(client, "ERR_:Unknown game mode. Use 'turns' or 'rounds'.\n");
+                return true;
             }
+        }
 
-            client->state = CLIENT_LOBBY;
-            client->score = 0;
-            client->join_order = game_session.player_count;
+        SESSION_LOCK(session);
 
-            game_session.players = realloc(game_session.players,
-                                          (game_session.player_count + 1) * sizeof(client_t*));
-            game_session.players[game_session.player_count] = client;
-            game_session.player_count++;
+        if (session->state != GAME_WAITING) {
+            send_to_client(client, "ERR_:Game already started!\n");
+            SESSION_UNLOCK(session);
+            return true;
+        }
 
-            char buff[BUFF_SIZE];
-            snprintf(buff, sizeof(buff), "RESP:Joined game! Players: %d\n", game_session.player_count);
-            send_to_client(client, buff);
-
-            snprintf(buff, sizeof(buff), "INFO:%s joined the game (Total: %d players)\n", client->username, game_session.player_count);
-            pthread_mutex_unlock(&game_session.lock);
-            broadcast_all(buff, client);
-
-            printf(Green"[GAME] %s joined the party! (Total players: %d)\n"Clear, client->username, game_session.player_count);
-        } else if (strncmp(buff, "login : ", 8) == 0) {
-            if (client->user_data != NULL) {
-                send(client->socket_fd, "WARN:You are already logged in. Maybe you meant 'logout'?", 57, 0);
-                continue;
-            }
-            char username[MAX_NAME_LEN];
-            sscanf(buff, "login : %s", username);
-            user_data_t* user = find_user(username);
+        if (session->player_count < 2) {
+            send_to_client(client, "ERR_:Need at least 2 players to start!\n");
+            SESSION_UNLOCK(session);
+            return true;
+        }
 
-            if (user == NULL) {
-                send(client->socket_fd, "ERR_:User not found. Please register first.", 43, 0);
-            } else {
-                strcpy(client->username, username);
-                client->user_data = user;
-                time_t now = time(NULL);
-                strftime(user->last_login, sizeof(user->last_login), "%Y-%m-%d %H:%M:%S", localtime(&now));
-                save_users();
-                char resp[BUFF_SIZE];
-                snprintf(resp, sizeof(resp), "RESP:Welcome back %s! Points: %d, Games: %d, Wins: %d", 
-                         username, user->total_points, user->games_played, user->games_won);
-                send(client->socket_fd, resp, strlen(resp), 0);
-            }
-        } else if (strncmp(buff, "logout", 6) == 0) {
-            if (client->user_data == NULL) {
-                send(client->socket_fd, "WARN:You are already logged out. Maybe you meant 'quit'?", 56, 0);
-                continue;
-            }
-            client->user_data = NULL;
-            send(client->socket_fd, "RESP:Logged Out", 15, 0);
-        } else if (strncmp(buff, "meow", 4) == 0) {
-            send(client->socket_fd, "RESP:meow :3", 12, 0);
-        } else if (strncmp(buff, "register : ", 11) == 0) {
-            if (client->user_data != NULL) {
-                send(client->socket_fd, "WARN:You are already logged in.", 31, 0);
-                continue;
+        session->state = GAME_ACTIVE;
+        session->mode = mode;
+        gauge_add(&metric_rooms, 1);
+        for (int i = 0; i < session->player_count; i++)
+            enter_game(session->players[i]);
+        
+        MUTEX_COND_BROADCAST(&session->game_start);
+        SESSION_UNLOCK(session);
+
+        LOG_INFO("[GAME] Game started by %s with %d players (%s)", client->username, session->player_count,
+                 mode == GAME_MODE_ROUNDS ? "rounds" : "turns");
+    } else if (strncmp(buff, "spectate", 8) == 0) {
+        if (strncmp(buff, "spectate : stop", 15) == 0) {
+            if (client->state != CLIENT_SPECTATING) {
+                send_to_client(client, "WARN:You are not spectating\n");
+                return true;
             }
-            char username[MAX_NAME_LEN];
-            sscanf(buff, "register : %255s", username);
-            user_data_t* existing_user = find_user(username);
+            stop_spectating(client);
+            send_to_client(client, "RESP:Stopped spectating\n");
+            return true;
+        }
 
-            if (existing_user)
-                send(client->socket_fd, "ERR_:Username already exists!", 29, 0);
-            else {
-                client->user_data = create_user(username);
-                strcpy(client->username, username);
-                char resp[BUFF_SIZE];
-                snprintf(resp, sizeof(resp), "RESP:Registered new user '%s'", username);
-                send(client->socket_fd, resp, strlen(resp), 0);
-            }
-        } else if (strncmp(buff, "stats", 5) == 0) {
-            if (client->user_data == NULL)
-                send(client->socket_fd, "ERR_:Please login first to view stats", 37, 0);
-            else {
-                char resp[BUFF_SIZE];
-                snprintf(resp, sizeof(resp),
-                         "RESP:Stats: %s | Points: %d | Games: %d | Wins: %d | Win Rate: %.1f | Max Streak: %d",
-                         client->username, client->user_data->total_points, client->user_data->games_played, client->user_data->games_won, 
-                         (client->user_data->games_played > 0) ? (100.0 * client->user_data->games_won / client->user_data->games_played) : 0.0,
-                         client->user_data->max_streak);
-                send(client->socket_fd, resp, strlen(resp), 0);
-            } 
-        } else if (strncmp(buff, "start", 5) == 0) {
-            pthread_mutex_lock(&game_session.lock);
-
-            if (game_session.state != GAME_WAITING) {
-                send_to_client(client, "ERR_:Game already started!\n");
-                pthread_mutex_unlock(&game_session.lock);
-                continue;
-            }
+        if (client->state == CLIENT_SPECTATING) {
+            send_to_client(client, "WARN:Already spectating\n");
+            return true;
+        }
+        if (client->state == CLIENT_IN_GAME || client->state == CLIENT_LOBBY) {
+            send_to_client(client, "ERR_:Players can't spectate their own game\n");
+            return true;
+        }
+        if (client->state == CLIENT_QUEUED) {
+            send_to_client(client, "WARN:You are in the matchmaking queue ('queue : stop' to leave)\n");
+            return true;
+        }
 
-            if (game_session.player_count < 2) {
-                send_to_client(client, "ERR_:Need at least 2 players to start!\n");
-                pthread_mutex_unlock(&game_session.lock);
-                continue;
-            }
+        send_to_client(client, "RESP:Spectating! Type 'spectate : stop' to leave.\n");
+        client->spectator = spectate_subscribe(session, client);
+        if (!client->spectator) {
+            send_to_client(client, "ERR_:Spectating is not available right now\n");
+            return true;
+        }
+        client->state = CLIENT_SPECTATING;
+        LOG_DEBUG("[GAME] %s is spectating", client->username);
+    } else if (strncmp(buff, "queue", 5) == 0) {
+        if (strncmp(buff, "queue : stop", 12) == 0) {
+            if (client->state == CLIENT_QUEUED && matchmaking_leave(client))
+                send_to_client(client, "RESP:Left the matchmaking queue\n");
+            else
+                send_to_client(client, "WARN:You are not in the matchmaking queue\n");
+            return true;
+        }
+
+        if (client->user_data == NULL) {
+            send_to_client(client, "ERR_:Please login first to join the queue!\n");
+            return true;
+        }
+        if (client->state == CLIENT_QUEUED) {
+            send_to_client(client, "WARN:Already in the matchmaking queue\n");
+            return true;
+        }
+        if (client->state != CLIENT_CONNECTED) {
+            send_to_client(client, "ERR_:Leave your current game or 'spectate : stop' first\n");
+            return true;
+        }
+
+        char resp[BUFF_SIZE];
+        snprintf(resp, sizeof(resp), "RESP:Looking for a match! Your rating: %d. Type 'queue : stop' to leave.\n",
+                 client->user_data->rating);
+        send_to_client(client, resp);
+        if (!matchmaking_join(client))
+            send_to_client(client, "ERR_:Matchmaking is not available right now\n");
+    } else if (strncmp(buff, "resume : ", 9) == 0) {
+        if (client->user_data != NULL) {
+            send_to_client(client, "WARN:You are already logged in.");
+            return true;
+        }
+        // The takeover frees this client, so nothing else may still point at it
+        if (client->state != CLIENT_CONNECTED) {
+            send_to_client(client, "ERR_:Leave your current game or 'spectate : stop' first\n");
+            return true;
+        }
+        char token[RESUME_TOKEN_LEN + 2] = "";
+        sscanf(buff, "resume : %33s", token);
+        client_t* seat = resume_claim(token);
+        if (!seat) {
+            send_to_client(client, "ERR_:Unknown or expired resume token. Please login again.\n");
+            return true;
+        }
+        rebind_seat(seat, client);
+    } else if (strncmp(buff, "quit", 4) == 0) {
+        send_to_client(client, "RESP:bye-bye!");
+        resume_revoke(client);
+        
+        // Fails if the matcher seated it first, which leaves it CLIENT_IN_GAME
+        if (client->state == CLIENT_QUEUED)
+            matchmaking_leave(client);
+        if (client->state == CLIENT_IN_GAME || client->state == CLIENT_LOBBY) {
+            remove_player(client);
+        } else if (client->state == CLIENT_SPECTATING) {
+            stop_spectating(client);
+        }
+        client->state = CLIENT_DISCONNECTED;
+        return false;
+    } else {
+        send_to_client(client, "ERR_:Unrecognized Command");
+    }
+
+    return true;
+}
+
+// Runs one command from 'client', returns false once the client asked to quit
+bool handle_command(client_t* client, char* buff) {
+    command_type_t type = command_type(buff);
+    LOG_DEBUG("[SERVER_CHANDLER] Command '%s' from %s", command_names[type], client->username);
+    switch (ratelimit_take(client, type)) {
+    case RATE_OK:
+        break;
+    case RATE_REJECTED:
+        send_to_client(client, "WARN:Slow down! You are sending commands too fast, that one was dropped.\n");
+        return true;
+    case RATE_DISCONNECT:
+        // The read that follows sees the connection drop like any other
+        send_to_client(client, "ERR_:Too many commands, closing the connection.\n");
+        shutdown(client->socket_fd, SHUT_RDWR);
+        return true;
+    }
+    uint64_t span = TRACE_BEGIN();
+    uint64_t start = metrics_now_us();
+    bool keep_going = dispatch_command(client, buff);
+    trace_end(span, "command", command_names[type], NULL, TRACE_NO_ARG);
+    counter_add(&metric_commands[type], 1);
+    histogram_observe(&metric_command_latency[type], metrics_now_us() - start);
+    return keep_going;
+}
+
+// A handover is under way: whatever the client sends next is for the new
+// process to read. Blocks until the process exits.
+static void park_connection() {
+    MUTEX_LOCK(&connections.lock);
+    connections.parked++;
+    MUTEX_UNLOCK(&connections.lock);
+    while (true)
+        pause();
+}
 
-            game_session.state = GAME_ACTIVE;
-            for (int i = 0; i < game_session.player_count; i++)
-                game_session.players[i]->state = CLIENT_IN_GAME;
-            
-            pthread_cond_signal(&game_session.game_start);
-            pthread_mutex_unlock(&game_session.lock);
-
-            printf(Green"[GAME] Game started by %s with %d players\n"Clear, client->username, game_session.player_count);
-        } else if (strncmp(buff, "quit", 4) == 0) {
-            send(client->socket_fd, "RESP:bye-bye!", 13, 0);
-            
-            if (client->state == CLIENT_IN_GAME || client->state == CLIENT_LOBBY) {
+// Takes a connection's bookkeeping off its client
+static void end_connection(client_t* client) {
+    MUTEX_LOCK(&connections.lock);
+    client_t* last = connections.clients[--connections.count];
+    connections.clients[client->conn_slot] = last;
+    last->conn_slot = client->conn_slot;
+    client->conn_slot = -1;
+    MUTEX_UNLOCK(&connections.lock);
+    ratelimit_release(client);
+    reaper_release(client);
+}
+
+void* handle_client(void* arg) {
+    client_t* client = (client_t*) arg;
+    char buff[BUFF_SIZE];
+    snprintf(buff, sizeof(buff), "client-%d", client->socket_fd);
+    log_set_thread_name(buff);
+    bool held = false;
+    while (true) {
+        struct pollfd wait_fds[2] = { { client->socket_fd, POLLIN, 0 }, { upgrade_drain_fd(), POLLIN, 0 } };
+        if (poll(wait_fds, 2, -1) < 0)
+            continue;
+        if (wait_fds[1].revents)
+            park_connection();
+
+        memset(buff, 0, sizeof(buff));
+        int len = recv(client->socket_fd, buff, sizeof(buff), 0);
+        if (len <= 0) {
+            LOG_INFO("[SERVER_CHANDLER] Client %s disconnected successfully", client->username);
+            // Before hold_seat(): once it returns a resume may take the client over
+            end_connection(client);
+
+            if (client->state == CLIENT_QUEUED)
+                matchmaking_leave(client);
+            if (client->state == CLIENT_SPECTATING)
+                stop_spectating(client);
+            if (client->resume) {
+                hold_seat(client);
+                held = true;
+                break;
+            }
+            if (client->state == CLIENT_IN_GAME) {
+                char buff[BUFF_SIZE];
+                snprintf(buff, sizeof(buff), "INFO:%s left the game", client->username);
+                broadcast_all(client->session, buff, client);
                 remove_player(client);
             }
             client->state = CLIENT_DISCONNECTED;
+
             break;
-        } else {
-            send(client->socket_fd, "ERR_:Unrecognized Command", 25, 0);
+        }
+
+        counter_add(&metric_bytes_in, len);
+        reaper_touch(client);
+        record_event(RECORD_COMMAND, client->conn_id, buff, len);
+        if (!handle_command(client, buff))
+            break;
+
+        if (client->takeover) {
+            client_t* seat = client->takeover;
+            MUTEX_LOCK(&connections.lock);
+            seat->conn_slot = client->conn_slot;
+            connections.clients[seat->conn_slot] = seat;
+            MUTEX_UNLOCK(&connections.lock);
+            ratelimit_move(client, seat);
+            reaper_move(client, seat);
+            pthread_mutex_destroy(&client->lock);
+            mem_free(MEM_NETWORK, client);
+            client = seat;
         }
     }
 
-    close(client->socket_fd);
-    pthread_mutex_destroy(&client->lock);
-    free(client);
+    if (!held) {
+        if (client->conn_slot >= 0)
+            end_connection(client);
+        record_event(RECORD_DISCONNECT, client->conn_id, NULL, 0);
+        close(client->socket_fd);
+        pthread_mutex_destroy(&client->lock);
+        mem_free(MEM_NETWORK, client);
+    }
+    mem_track(MEM_STACKS, -(int64_t) client_stack_size);
+    gauge_add(&metric_connections, -1);
     return NULL;
 }
 
-int main() {
-    load_users();
-    load_questions();
+#ifndef QUIZ_NO_MAIN
+static uint32_t conn_count = 0;
+
+// Starts the thread serving 'client'
+static void start_client(client_t* client) {
+    MUTEX_LOCK(&connections.lock);
+    client_t** grown = mem_realloc(MEM_NETWORK, connections.clients, (connections.count + 1) * sizeof(client_t*));
+    if (grown) {
+        connections.clients = grown;
+        client->conn_slot = connections.count;
+        connections.clients[connections.count++] = client;
+    }
+    MUTEX_UNLOCK(&connections.lock);
+    if (!grown) {
+        close(client->socket_fd);
+        pthread_mutex_destroy(&client->lock);
+        mem_free(MEM_NETWORK, client);
+        gauge_add(&metric_connections, -1);
+        return;
+    }
+
+    ratelimit_attach(client);
+    reaper_attach(client);
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, handle_client, client);
+    pthread_detach(thread_id);
+    mem_track(MEM_STACKS, client_stack_size);
+}
+
+//
+//  Upgrades (see upgrade.h)
+//
+
+// Old process: hands the listeners and every live connection to a new one
+// and exits. Returns only if the new process didn't come up.
+static void hand_over(int server_fd, char* argv[]) {
+    LOG_INFO("[UPGRADE] Upgrade requested, starting the new binary");
+    int channel = upgrade_spawn(argv);
+    if (channel < 0) return;
 
+    // Lets every client thread finish the command it is on
+    upgrade_drain();
+    uint64_t deadline = metrics_now_us() + (uint64_t) UPGRADE_TIMEOUT_S * 1000000;
+    while (true) {
+        MUTEX_LOCK(&connections.lock);
+        int busy = connections.count - connections.parked;
+        MUTEX_UNLOCK(&connections.lock);
+        if (busy <= 0) break;
+        if (metrics_now_us() > deadline) {
+            LOG_WARN("[UPGRADE] %d client threads are still busy, handing over anyway", busy);
+            break;
+        }
+        struct timespec pause = { 0, 10000000 };
+        nanosleep(&pause, NULL);
+    }
+    upgrade_freeze();
+    snapshot_save();
+    upgrade_send(channel, UPGRADE_LISTENER, server_fd, NULL, NULL, CLIENT_CONNECTED);
+    if (metrics_listener() >= 0)
+        upgrade_send(channel, UPGRADE_METRICS, metrics_listener(), NULL, NULL, CLIENT_CONNECTED);
+
+    MUTEX_LOCK(&connections.lock);
+    int count = connections.count;
+    for (int i = 0; i < connections.count; i++) {
+        client_t* client = connections.clients[i];
+        char token[RESUME_TOKEN_LEN + 1] = "";
+        resume_token(client, token);
+        upgrade_send(channel, UPGRADE_CLIENT, client->socket_fd, token,
+                     client->user_data ? client->username : NULL, client->state);
+    }
+    MUTEX_UNLOCK(&connections.lock);
+
+    LOG_INFO("[UPGRADE] Handed over %d connections, exiting", count);
+    exit(0);
+}
+
+// New process: a connection the old one was serving. Players in a restored
+// room take back their seat; anyone else logged in stays logged in.
+static void adopt_connection(upgrade_record_t* record) {
+    gauge_add(&metric_connections, 1);
+    client_t* client = mem_malloc(MEM_NETWORK, sizeof(client_t));
+    if (!client) {
+        close(record->fd);
+        gauge_add(&metric_connections, -1);
+        return;
+    }
+    client_init(client, record->fd, ++conn_count);
+    record_event(RECORD_CONNECT, client->conn_id, NULL, 0);
+
+    client_t* seat = record->token[0] ? resume_claim(record->token) : NULL;
+    if (seat) {
+        rebind_seat(seat, client);
+        pthread_mutex_destroy(&client->lock);
+        mem_free(MEM_NETWORK, client);
+        client = seat;
+    } else if (record->username[0] && (client->user_data = find_user(record->username))) {
+        strcpy(client->username, record->username);
+        // Keeps the token the player was given at login
+        if (resume_adopt(client, record->token))
+            resume_claim(record->token);
+        if (record->state == CLIENT_SPECTATING || record->state == CLIENT_QUEUED)
+            send_to_client(client, "INFO:The server was upgraded. Type 'spectate' or 'queue' again to carry on.\n");
+    }
+    start_client(client);
+}
+
+// SIGUSR1 dumps the lock profile, SIGUSR2 the memory accounting, SIGHUP hands
+// over to a new binary (see upgrade.h); SIGINT/SIGTERM write a room snapshot
+// and exit through atexit so the logger and profiler get to flush
+static void* signal_thread(void* arg) {
+    sigset_t* set = (sigset_t*) arg;
+    log_set_thread_name("signal");
+    while (true) {
+        int sig;
+        if (sigwait(set, &sig) != 0) continue;
+
+        if (sig == SIGUSR1) {
+            lockprof_dump(LOCKPROF_DUMP_PATH);
+            continue;
+        }
+        if (sig == SIGUSR2) {
+            mem_dump(MEM_DUMP_PATH);
+            continue;
+        }
+        if (sig == SIGHUP) {
+            upgrade_request();
+            continue;
+        }
+        LOG_INFO("[SERVER] Caught %s, shutting down", strsignal(sig));
+        snapshot_save();
+        exit(0);
+    }
+    return NULL;
+}
+
+// GET /loglevel shows the current level, /loglevel?level=debug changes it
+static char* loglevel_route(const char* query) {
+    char* body = malloc(64);
+    if (!body) return NULL;
+
+    if (strncmp(query, "level=", 6) == 0) {
+        log_level_t level;
+        if (!log_parse_level(query + 6, &level)) {
+            snprintf(body, 64, "unknown level '%.32s'\n", query + 6);
+            return body;
+        }
+        log_set_level(level);
+        LOG_WARN("[SERVER] Log level set to %s", log_level_name(level));
+    }
+    snprintf(body, 64, "level: %s\n", log_level_name(log_get_level()));
+    return body;
+}
+
+int main(int argc, char* argv[]) {
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    // Threads created afterwards inherit the mask, so only signal_thread sees these
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    log_start();
+    log_set_thread_name("main");
+    bool simulating = argc > 1 && strcmp(argv[1], "simulate") == 0;
+    const char* clock_env = getenv("QUIZ_CLOCK");
+    clock_init(simulating || (clock_env && strcmp(clock_env, "virtual") == 0) ? QUIZ_CLOCK_VIRTUAL : QUIZ_CLOCK_REAL);
+    if (clock_mode() == QUIZ_CLOCK_VIRTUAL && !simulating)
+        LOG_WARN("[SERVER] Running on a virtual clock: pauses and turn limits elapse as soon as the game thread is idle");
+    lockprof_start();
+
+    upgrade_init();
+    pthread_t signal_id;
+    pthread_create(&signal_id, NULL, signal_thread, &signals);
+    pthread_detach(signal_id);
+    // Before anything is loaded, so libxml's allocations are all charged to MEM_XML
+    mem_start();
+    spectate_start();
+    scoreboard_start();
+    resume_start();
+    ratelimit_start();
+    reaper_start();
+
+    if (simulating)
+        return simulate_main(argc - 1, argv + 1);
+
+    load_questions();
     if (question_count == 0) {
-        printf(Red"[SERVER] No questions loaded! Cannot start server.\n"Clear);
+        LOG_ERROR("[SERVER] No questions loaded! Cannot start server.");
         return 1;
     }
+    // After the questions, so a binary that can't start doesn't take over; before
+    // the users, which the old process may still be saving
+    bool upgraded = upgrade_receive();
+    load_users();
 
-    memset(&game_session, 0, sizeof(game_session_t));
-    game_session.state = GAME_WAITING;
-    game_session.players = NULL;
-    game_session.player_count = 0;
-    game_session.curr_question_idx = 0;
-    game_session.curr_player_turn = 0;
-    pthread_mutex_init(&game_session.lock, NULL);
-    pthread_cond_init(&game_session.game_start, NULL);
+    game_session_init(&game_session, 0);
+    const char* mode_env = getenv("QUIZ_GAME_MODE");
+    if (mode_env && strcmp(mode_env, "rounds") == 0)
+        game_session.default_mode = GAME_MODE_ROUNDS;
+    matchmaking_start(game_session.default_mode);
+    snapshot_restore(&game_session);
+    snapshot_start();
+
+    record_start();
+    metrics_add_route("/loglevel", loglevel_route);
+    trace_start();
+    if (upgrade_listener(UPGRADE_METRICS) >= 0)
+        metrics_start_inherited(upgrade_listener(UPGRADE_METRICS));
+    else
+        metrics_start(METRICS_PORT);
 
     pthread_t game_thread;
-    pthread_create(&game_thread, NULL, game_loop, NULL);
+    pthread_create(&game_thread, NULL, game_loop, &game_session);
     pthread_detach(game_thread);
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror(Red"[SERVER] Error - SO_REUSEADDR failed\n"Clear);
+    int server_fd = upgrade_listener(UPGRADE_LISTENER);
+    if (server_fd < 0) {
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        int opt = 1;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+            LOG_ERROR("[SERVER] Error - SO_REUSEADDR failed: %s", strerror(errno));
+        }
+        struct sockaddr_in address;
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(8080);
+
+        bind(server_fd, (struct sockaddr*)&address, sizeof(address));
+        listen(server_fd, SOMAXCONN);
     }
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(8080);
+    LOG_INFO("[SERVER] Quiz Game Server %s on port 8080", upgraded ? "upgraded" : "started");
+    LOG_INFO("[SERVER] Loaded %d questions, ready for players!", question_count);
 
-    bind(server_fd, (struct sockaddr*)&address, sizeof(address));
-    listen(server_fd, 10);
-    printf(Green"[SERVER] Quiz Game Server started on port 8080\n"Clear);
-    printf(Green"[SERVER] Loaded %d questions, ready for players!\n"Clear, question_count);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr, &client_stack_size);
+    pthread_attr_destroy(&attr);
 
+    int adopted_count;
+    upgrade_record_t* adopted = upgrade_clients(&adopted_count);
+    for (int i = 0; i < adopted_count; i++)
+        adopt_connection(&adopted[i]);
+
+    struct pollfd wait_fds[2] = { { server_fd, POLLIN, 0 }, { upgrade_wake_fd(), POLLIN, 0 } };
     while(1) {
+        if (poll(wait_fds, 2, -1) < 0)
+            continue;
+        if (wait_fds[1].revents && upgrade_requested())
+            hand_over(server_fd, argv);
+        if (!(wait_fds[0].revents & POLLIN))
+            continue;
+
         int client_socket = accept(server_fd, NULL, NULL);
-        printf(Blue"[SERVER] New client connected! Socket: %d\n"Clear, client_socket);
+        if (client_socket < 0) {
+            LOG_ERROR("[SERVER] Error - accept failed: %s", strerror(errno));
+            usleep(10000);
+            continue;
+        }
+        LOG_DEBUG("[SERVER] New client connected! Socket: %d", client_socket);
+        counter_add(&metric_accepts, 1);
+        gauge_add(&metric_connections, 1);
 
-        client_t* client = malloc(sizeof(client_t));
+        client_t* client = mem_malloc(MEM_NETWORK, sizeof(client_t));
         if (!client) {
             close(client_socket);
+            gauge_add(&metric_connections, -1);
             continue;
         }
 
-        client->socket_fd = client_socket;
-        client->score = 0;
-        strcpy(client->username, "__anon__");
-        client->user_data = NULL;
-        client->state = CLIENT_CONNECTED;
-        client->has_answered = false;
-        client->answer = '\0';
-        pthread_mutex_init(&client->lock, NULL);
-
-        pthread_t thread_id;
-        pthread_create(&thread_id, NULL, handle_client, client);
-        pthread_detach(thread_id);
-        printf(Blue"[SERVER] Created new thread for new client.\nWaiting new connections...\n"Clear);
+        client_init(client, client_socket, ++conn_count);
+        record_event(RECORD_CONNECT, client->conn_id, NULL, 0);
+        start_client(client);
     }
 
     pthread_mutex_destroy(&game_session.lock);
     pthread_cond_destroy(&game_session.game_start);
     return 0;
-}
\ No newline at end of file
+}
+#endif